@@ -0,0 +1,172 @@
+/* -------------------------------------------------------------------------- */
+/*                             Binary access log                              */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include "logging.h"
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * One fixed-size record per request, instead of formatted log lines: the
+ * records are copied into a buffer and appended to ACCESS_LOG in batches,
+ * with a single write() per batch. A batch is written when the buffer is full,
+ * when it is a second old, and when its connection goes idle or ends (an idle
+ * connection may be killed by its timeout, losing what it buffered).
+ *
+ * Paths are logged as the 64-bit hash of their name. The first time a process
+ * sees a path whose hash isn't in the shared table of written paths, it
+ * writes a path record with the name before the request record, so each
+ * name is usually written once per file. Readers collect the path records
+ * first: a name may be written after a record of another process using it.
+ *
+ * tools/access_read turns the log into text, JSON or CSV, or aggregates it.
+ */
+
+/** @brief First bytes of an access log. */
+#define ACCESS_MAGIC "CSACCES1"
+
+/** @brief Size of a request record, and the unit path records are padded to. */
+#define ACCESS_RECORD_SIZE 64
+
+/** @brief Kinds of records, the first byte of each one. */
+typedef enum AccessKindEnum
+{
+    ACCESS_KIND_REQUEST = 1, /**< An AccessRecord. */
+    ACCESS_KIND_PATH    = 2  /**< An AccessPath. */
+} AccessKind;
+
+/** @brief Request methods, with anything else as ACCESS_OTHER. */
+typedef enum AccessMethodEnum
+{
+    ACCESS_OTHER,
+    ACCESS_GET,
+    ACCESS_HEAD,
+    ACCESS_POST,
+    ACCESS_PUT,
+    ACCESS_DELETE,
+    ACCESS_OPTIONS,
+    ACCESS_PATCH,
+    ACCESS_CONNECT,
+    ACCESS_TRACE,
+    ACCESS_METHODS
+} AccessMethod;
+
+/** @brief Names of the methods, in AccessMethod order. */
+#define ACCESS_METHOD_NAMES                                                                    \
+    {"OTHER", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "CONNECT", "TRACE"}
+
+/** @brief Durations of a request, from one phase to the next. */
+typedef enum AccessSpanEnum
+{
+    ACCESS_WAIT,    /**< Accepted to first byte received, first request of a connection. */
+    ACCESS_READ,    /**< First byte to header parsed. */
+    ACCESS_HANDLE,  /**< Header parsed to response header sent. */
+    ACCESS_SEND,    /**< Response header to last byte sent. */
+    ACCESS_SPANS
+} AccessSpan;
+
+/**
+ * @brief Start of an access log, written when the file is created.
+ * Records are in the byte order of the server that wrote them, endian tells
+ * readers whether it's theirs. */
+typedef struct AccessFileHeaderStruct
+{
+    /** @brief ACCESS_MAGIC, without the null terminator. */
+    char magic[8];
+    /** @brief 0x01020304 in the writer's byte order. */
+    uint32_t endian;
+    /** @brief ACCESS_RECORD_SIZE. */
+    uint32_t record_size;
+} AccessFileHeader;
+
+/** @brief A request, ACCESS_RECORD_SIZE bytes. */
+typedef struct AccessRecordStruct
+{
+    /** @brief ACCESS_KIND_REQUEST. */
+    uint8_t kind;
+    /** @brief An AccessMethod. */
+    uint8_t method;
+    /** @brief Response status, 0 if none was sent. */
+    uint16_t status;
+    /** @brief Peer port, 0 for Unix sockets. */
+    uint16_t port;
+    /** @brief Request header bytes. */
+    uint16_t bytes_in;
+    /** @brief Wall clock time when the request started, in microseconds since the epoch. */
+    uint64_t time_us;
+    /** @brief Hash of the path, named by an AccessPath record. 0 if unknown. */
+    uint64_t path_id;
+    /** @brief Response bytes sent, header included. */
+    uint64_t bytes_out;
+    /** @brief Peer address, IPv4 mapped into IPv6. All zero for Unix sockets. */
+    uint8_t addr[16];
+    /** @brief Duration of each AccessSpan, in microseconds. 0 if not reached. */
+    uint32_t span_us[ACCESS_SPANS];
+} AccessRecord;
+
+/**
+ * @brief Name of a path. Followed by the rest of the name if it doesn't fit,
+ * padded to a multiple of ACCESS_RECORD_SIZE. */
+typedef struct AccessPathStruct
+{
+    /** @brief ACCESS_KIND_PATH. */
+    uint8_t kind;
+    /** @brief Unused, 0. */
+    uint8_t reserved;
+    /** @brief Length of the name. */
+    uint16_t length;
+    /** @brief Unused, 0. */
+    uint32_t reserved2;
+    /** @brief Hash of the name, as in AccessRecord.path_id. */
+    uint64_t id;
+    /** @brief Start of the name, not null terminated. */
+    char name[48];
+} AccessPath;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Open ACCESS_LOG and allocate the shared table of written paths.
+ * Does nothing if ACCESS_LOG is empty. Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int access_log_startup();
+
+/**
+ * @brief Close ACCESS_LOG. */
+void access_log_shutdown();
+
+/**
+ * @brief Whether requests are logged.
+ * @return 1 if ACCESS_LOG is open, else 0. */
+int access_log_enabled();
+
+/**
+ * @brief Level of the messages logged for each request: DEBUG when the access
+ * log has them or the connection isn't one of the LOG_SAMPLE sampled, else INFO.
+ * @return The log level. */
+LogLevel access_log_level();
+
+/**
+ * @brief Record the peer of a newly accepted connection, before forking.
+ * Also decides if its messages are sampled, see access_log_level().
+ * @param addr The peer address. */
+void access_log_peer(const struct sockaddr_storage* addr);
+
+/**
+ * @brief Describe the current request, from its request line.
+ * @param line The request line, "METHOD PATH" with or without the version.
+ * @param len Length of the line. */
+void access_log_request(const char* line, size_t len);
+
+/**
+ * @brief Buffer the record of a finished request.
+ * @param r Its trace record, with phase offsets filled in. */
+void access_log_write(const TraceRecord* r);
+
+/**
+ * @brief Write the buffered records. */
+void access_log_flush();
@@ -0,0 +1,54 @@
+/* -------------------------------------------------------------------------- */
+/*                               Request arena                                */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+
+/*
+ * Memory that lives as long as a request. Strings built while handling it
+ * (the target, the decoded path, the file path) are bump allocated, with no
+ * length limit and no free(), then released all at once by arena_reset()
+ * after the request, or after the stream on HTTP/2.
+ *
+ * The block of ARENA_SIZE bytes is allocated once by the main process before
+ * the first fork(): every child starts with it and reuses it for each
+ * request of its connection. A request that needs more gets extra blocks
+ * from malloc(), freed by the reset and counted in arena_overflows. The
+ * arena_* statistics give the peak and the average use (arena_bytes /
+ * arena_requests), to size ARENA_SIZE.
+ */
+
+/**
+ * @brief Allocate the arena block. Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (logged). */
+int arena_startup();
+
+/**
+ * @brief Free the arena block, and any overflow block. */
+void arena_shutdown();
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Allocate memory until the next arena_reset().
+ * @param size Bytes needed, aligned for any type.
+ * @return The memory, NULL if an overflow block couldn't be allocated (logged). */
+void* arena_alloc(size_t size);
+
+/**
+ * @brief Copy a string into the arena.
+ * @param s The string, not necessarily null terminated.
+ * @param len Bytes to copy, a null terminator is added.
+ * @return The copy, NULL on failure. */
+char* arena_strndup(const char* s, size_t len);
+
+/**
+ * @brief Format a string into the arena, as long as it needs to be.
+ * @return The string, NULL on failure. */
+char* arena_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief Release everything allocated since the last reset, and count its use
+ * in the statistics. Called after each request. */
+void arena_reset();
@@ -0,0 +1,45 @@
+/* -------------------------------------------------------------------------- */
+/*                               I/O buffer pool                              */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+
+/*
+ * Buffers for bulk data, the bodies copied through user space: files sent over
+ * TLS without kTLS, and proxied responses. They come in three size classes, a
+ * request takes the smallest one that fits what it expects to move, up to the
+ * class of BUFFER_SIZE, and gives it back when done.
+ *
+ * Given back buffers are kept on a free list per class, for the next request
+ * of the connection to reuse. Each process serves one connection, so its
+ * lists are its own: no locking, and the memory stays on the CPU that last
+ * used it. Statistics: buffer_gets, buffer_allocs (the free list was empty)
+ * and buffer_peak (most bytes a process held at once, in use or kept).
+ */
+
+/** @brief Smallest size class: bodies of a few pages. */
+#define BUFPOOL_SMALL (4 * 1024)
+
+/** @brief Middle size class: streams of unknown length. */
+#define BUFPOOL_MEDIUM (64 * 1024)
+
+/** @brief Largest size class: large files and bodies. */
+#define BUFPOOL_LARGE (1024 * 1024)
+
+/**
+ * @brief Take a buffer from the pool.
+ * @param want Bytes the caller expects to move at a time. Gets the smallest
+ *             class that holds them, but no larger than the class of BUFFER_SIZE.
+ * @param[out] size Size of the buffer, which may be less or more than want.
+ * @return The buffer, NULL if it couldn't be allocated (logged). */
+void* bufpool_get(size_t want, size_t* size);
+
+/**
+ * @brief Give a buffer back to the pool.
+ * @param buff A buffer from bufpool_get(), or NULL. */
+void bufpool_put(void* buff);
+
+/**
+ * @brief Free the buffers kept on the free lists. */
+void bufpool_shutdown();
@@ -0,0 +1,69 @@
+/* -------------------------------------------------------------------------- */
+/*                              Traffic capture                               */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Records the raw header of incoming requests, with their arrival time, to
+ * CAPTURE_FILE: one in CAPTURE_SAMPLE requests, each appended with a single
+ * writev(). tools/replay sends them back to a server, at their original pace,
+ * faster or as fast as possible, and measures the responses.
+ *
+ * HTTP/2 requests are captured as the HTTP/1.1 header they are handled as.
+ */
+
+/** @brief First bytes of a capture file. */
+#define CAPTURE_MAGIC "CSCAPT01"
+
+/**
+ * @brief Start of a capture file, written when the file is created.
+ * Records are in the byte order of the server that wrote them, endian tells
+ * readers whether it's theirs. */
+typedef struct CaptureFileHeaderStruct
+{
+    /** @brief CAPTURE_MAGIC, without the null terminator. */
+    char magic[8];
+    /** @brief 0x01020304 in the writer's byte order. */
+    uint32_t endian;
+    /** @brief sizeof(CaptureRecord). */
+    uint32_t record_size;
+} CaptureFileHeader;
+
+/**
+ * @brief A captured request, followed by its header, padded with zeros to a
+ * multiple of 8 bytes. */
+typedef struct CaptureRecordStruct
+{
+    /** @brief Wall clock time when its header was complete, in microseconds since the epoch. */
+    uint64_t time_us;
+    /** @brief Connection it came on (the pid of its child): requests of a connection share it. */
+    uint32_t connection;
+    /** @brief Length of the header, final empty line included. */
+    uint16_t length;
+    /** @brief HTTP major version it came with: 1 or 2. */
+    uint8_t protocol;
+    /** @brief Unused, 0. */
+    uint8_t reserved;
+} CaptureRecord;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Open CAPTURE_FILE and allocate the sampling counter.
+ * Does nothing if CAPTURE_FILE is empty. Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int capture_startup();
+
+/**
+ * @brief Close CAPTURE_FILE. */
+void capture_shutdown();
+
+/**
+ * @brief Capture a request, if sampled.
+ * @param head The request header.
+ * @param len Length of the header.
+ * @param protocol HTTP major version. */
+void capture_request(const char* head, size_t len, int protocol);
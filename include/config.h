@@ -11,7 +11,7 @@
 /** @brief Expand a macro argument and convert to a string literal. */
 #define STR(X) _STR(X)
 
-/** @brief Buffer size for network communication. */
+/** @brief Largest I/O buffer taken from the pool, in bytes. */
 extern int BUFFER_SIZE;
 /** @brief Maximum length of the client connection queue. */
 extern int BACKLOG;
@@ -27,6 +27,121 @@ extern char* LOG_FILE_NAME;
 extern char* ROOT_DIR;
 /** @brief Favicon file name. File to be served when receiving a request for /favicon.ico. */
 extern char* FAVICON_FILE;
+/** @brief Whether to keep an in-memory index of ROOT_DIR to answer lookups without syscalls. */
+extern int PATH_INDEX;
+/** @brief Response bytes in flight above which new connections are shed (0 = unlimited). */
+extern int MAX_INFLIGHT;
+/** @brief What to do with new connections when overloaded: 0 = leave queued, 1 = answer 503. */
+extern int SHED_MODE;
+/** @brief Seconds sent in the Retry-After header of shed connections. */
+extern int RETRY_AFTER;
+/** @brief Request path where statistics are exported (empty = disabled). */
+extern char* STATS_PATH;
+/** @brief Milliseconds a client has to send a complete request header. */
+extern int HEADER_TIMEOUT;
+/** @brief Milliseconds a response may go without any progress before the connection is closed. */
+extern int SEND_TIMEOUT;
+/** @brief Milliseconds a kept-alive connection may wait for its next request. */
+extern int KEEPALIVE_TIMEOUT;
+/** @brief Milliseconds open connections have to finish on shutdown or upgrade (0 = no wait). */
+extern int DRAIN_TIMEOUT;
+/** @brief Requests per second allowed per client address (0 = unlimited). */
+extern int RATE_LIMIT;
+/** @brief Requests a client may make in a burst above RATE_LIMIT. */
+extern int RATE_BURST;
+/** @brief Response bytes per second allowed per client address (0 = unlimited). */
+extern int RATE_LIMIT_BYTES;
+/** @brief Seconds the kernel waits for request data before waking us for a connection (0 = off). */
+extern int DEFER_ACCEPT;
+/** @brief Length of the TCP Fast Open queue of the server socket (0 = off). */
+extern int FASTOPEN;
+/** @brief Whether to disable Nagle's algorithm on client sockets. */
+extern int NODELAY;
+/** @brief Send buffer size of client sockets, in bytes (0 = kernel default). */
+extern int SNDBUF;
+/** @brief Receive buffer size of client sockets, in bytes (0 = kernel default). */
+extern int RCVBUF;
+/** @brief URL of the server requests are forwarded to (empty = serve ROOT_DIR). */
+extern char* PROXY_UPSTREAM;
+/** @brief Persistent connections kept open to the upstream server. */
+extern int PROXY_POOL;
+/** @brief Memory for cached upstream responses, in megabytes (0 = no cache). */
+extern int PROXY_CACHE_MB;
+/** @brief Directory where responses too large for memory are cached (empty = don't). */
+extern char* PROXY_CACHE_DIR;
+/** @brief Disk space for cached responses in PROXY_CACHE_DIR, in megabytes. */
+extern int PROXY_DISK_MB;
+/** @brief Seconds an expired response may still be served while it is refreshed, or on errors. */
+extern int PROXY_STALE;
+/** @brief Whether links to the upstream server in proxied HTML pages are pointed at us (0|1). */
+extern int PROXY_REWRITE;
+/** @brief Whether cleartext HTTP/2 is accepted, with prior knowledge or Upgrade: h2c (0|1). */
+extern int HTTP2;
+/** @brief Streams a client may have open at once on one HTTP/2 connection. */
+extern int HTTP2_STREAMS;
+/** @brief Port of the HTTPS listener (0 = none). */
+extern int TLS_PORT;
+/** @brief PEM file with the certificate chain of the HTTPS listener. */
+extern char* TLS_CERT;
+/** @brief PEM file with its private key (empty = in TLS_CERT). */
+extern char* TLS_KEY;
+/** @brief Seconds between session ticket key rotations. */
+extern int TLS_TICKET_ROTATE;
+/** @brief Whether TLS records are handed to the kernel after the handshake (0|1). */
+extern int KTLS;
+/** @brief Bytes a connection may send per scheduling round. */
+extern int SCHED_QUANTUM;
+/** @brief Response bytes per second sent by all connections together (0 = unlimited). */
+extern int BANDWIDTH;
+/** @brief Response bytes per second sent on each connection (0 = unlimited). */
+extern int BANDWIDTH_CONN;
+/** @brief Milliseconds past which a request is written to SLOW_LOG (0 = off). */
+extern int SLOW_MS;
+/** @brief Path to the slow request log. */
+extern char* SLOW_LOG;
+/** @brief Path to the binary request trace (empty = off). */
+extern char* TRACE_FILE;
+/** @brief One in this many requests is written to TRACE_FILE. */
+extern int TRACE_SAMPLE;
+/** @brief Path to the binary access log (empty = off). */
+extern char* ACCESS_LOG;
+/** @brief Path to the capture of incoming requests (empty = off). */
+extern char* CAPTURE_FILE;
+/** @brief One in this many requests is written to CAPTURE_FILE. */
+extern int CAPTURE_SAMPLE;
+/** @brief Megabytes past which the log file is rotated (0 = off). */
+extern int LOG_MAX_MB;
+/** @brief Seconds past which the log file is rotated (0 = off). */
+extern int LOG_ROTATE;
+/** @brief Whether rotated log files are compressed with gzip. */
+extern int LOG_COMPRESS;
+/** @brief Messages per second per call site and process (0 = unlimited). */
+extern int LOG_RATE;
+/** @brief One in this many connections logs its per-request messages as INFO. */
+extern int LOG_SAMPLE;
+/** @brief Microseconds per write past which messages below WARNING are dropped (0 = off). */
+extern int LOG_DEGRADE_US;
+/** @brief Threads walking ROOT_DIR before the listeners are opened (0 = no warm-up). */
+extern int WARMUP_THREADS;
+/** @brief List of files read into the page cache during the warm-up (empty = none). */
+extern char* WARMUP_PRELOAD;
+/** @brief Milliseconds after which the warm-up is cut short. */
+extern int WARMUP_DEADLINE;
+/** @brief Bytes of the request arena, for the strings built while handling a request. */
+extern int ARENA_SIZE;
+
+/** @brief Config file read before the command line, and again on SIGHUP (empty = none). */
+extern char* CONFIG_FILE;
+/** @brief Times the config was reloaded. */
+extern int CONFIG_VERSION;
+
+/** @brief Most --listen options. */
+#define LISTEN_MAX 16
+
+/** @brief Listener specs given with --listen, see listener_startup(). */
+extern char* LISTEN[LISTEN_MAX];
+/** @brief Number of LISTEN specs. */
+extern int LISTEN_COUNT;
 
 /**
  * @brief Parses an argument and assigns the value to the target integer.
@@ -45,6 +160,15 @@ int parse_arg(const char* arg, const char* value, int* target);
  * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
 int config_server(int argc, char const* argv[]);
 
+/**
+ * @brief Read the config file and the command line again, and apply the new
+ * settings that don't need a restart.
+ * Called by the main loop on SIGHUP. Nothing changes if the new config is
+ * invalid. Changes that need a restart are logged and left out. Children
+ * keep the config they were forked with.
+ * @return EXIT_SUCCESS if the config was reloaded, EXIT_FAILURE if it's invalid. */
+int config_reload();
+
 /**
  * @brief Displays the current server configuration settings.
  * This function prints the current values of the server configuration
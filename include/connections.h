@@ -0,0 +1,143 @@
+/* -------------------------------------------------------------------------- */
+/*                        Connection tracking/admission                       */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** @brief What to do with the next connection waiting on the listening socket. */
+typedef enum AdmissionEnum
+{
+    /** @brief Accept it and fork a child to handle it. */
+    ADM_ACCEPT,
+    /** @brief Accept it and answer with the pre-rendered 503 page, without forking. */
+    ADM_SHED,
+    /** @brief Leave it in the kernel queue until a child exits. */
+    ADM_PAUSE
+} Admission;
+
+/** @brief What a connection is currently waiting for, each with its own timeout. */
+typedef enum ConnPhaseEnum
+{
+    /** @brief Reading the request header (HEADER_TIMEOUT, from the first byte). */
+    PHASE_HEADER,
+    /** @brief Sending the response (SEND_TIMEOUT, renewed on every progress). */
+    PHASE_SEND,
+    /** @brief Kept alive, waiting for the next request (KEEPALIVE_TIMEOUT). */
+    PHASE_IDLE
+} ConnPhase;
+
+/**
+ * @brief A connection currently handled by a child.
+ * Slots live in shared memory: the main loop owns the pid, the child updates
+ * its own counters. */
+typedef struct ConnSlotStruct
+{
+    /** @brief Process handling the connection, 0 if the slot is free. */
+    pid_t pid;
+    /** @brief Response bytes the child has queued but not yet sent. */
+    atomic_ulong inflight;
+    /** @brief Current ConnPhase, written by the child. */
+    atomic_int phase;
+    /** @brief Monotonic time (ms) when the current phase expires, written by the child. */
+    atomic_ulong deadline;
+} ConnSlot;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Allocate the connection table with MAX_CLIENTS slots.
+ * Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int conn_table_startup();
+
+/**
+ * @brief Follow new HEADER_TIMEOUT, SEND_TIMEOUT and KEEPALIVE_TIMEOUT values.
+ * Deadlines already set are kept, later ones use the new timeouts. */
+void conn_timeouts_update();
+
+/**
+ * @brief Release the connection table. */
+void conn_table_shutdown();
+
+/**
+ * @brief Decide whether the main loop can take another connection.
+ * Compares the active connections and in-flight bytes against MAX_CLIENTS and
+ * MAX_INFLIGHT. Already accepted connections always win: once a watermark is
+ * reached, new connections are shed or left queued according to SHED_MODE.
+ * @return The admission decision. */
+Admission conn_admission();
+
+/**
+ * @brief Reserve a slot for a connection about to be forked.
+ * @return The slot index, or -1 if the table is full. */
+int conn_claim();
+
+/**
+ * @brief Record the child handling a claimed slot. Called in the parent.
+ * @param slot Slot returned by conn_claim().
+ * @param pid Process ID returned by fork(). */
+void conn_bind(int slot, pid_t pid);
+
+/**
+ * @brief Give back a claimed slot that was never bound (fork failed).
+ * @param slot Slot returned by conn_claim(). */
+void conn_release(int slot);
+
+/**
+ * @brief Tell the connection table which slot this child owns.
+ * Called in the child right after fork().
+ * @param slot Slot returned by conn_claim(), or -1 in a helper process that
+ *             must not touch its parent's slot. */
+void conn_enter(int slot);
+
+/**
+ * @brief Reap exited children and free their slots. Never blocks.
+ * @return The number of children reaped. */
+int conn_reap();
+
+/**
+ * @brief Close connections whose phase deadline passed.
+ * Advances the timer wheel, then handles every expired timer in one batch:
+ * connections that made progress in the meantime are re-armed, the others
+ * have their child killed. Called by the main loop on every wakeup.
+ * @return The number of connections closed. */
+int conn_expire();
+
+/**
+ * @brief Time until conn_expire() has work to do.
+ * @return Milliseconds, suitable as a poll() timeout, or -1 if no timer is armed. */
+int conn_timeout();
+
+/**
+ * @brief Enter a new phase and set its deadline. Called in the child.
+ * @param phase The phase the connection is entering. */
+void conn_phase(ConnPhase phase);
+
+/**
+ * @brief Renew the deadline of the current phase after making progress.
+ * Only the send phase is renewed: a header dribbled one byte at a time must
+ * still arrive within HEADER_TIMEOUT. Called in the child. */
+void conn_progress();
+
+/**
+ * @brief Close the connections, gracefully unless forced. Called by the main
+ * loop once it stopped accepting, until no connection is left.
+ * The first call sends SIGTERM to every child: it finishes the response it is
+ * sending, then closes instead of waiting for another request (HTTP/2
+ * connections get a GOAWAY). Children idle between two requests are killed.
+ * @param force Non-zero to kill every child, at the drain deadline.
+ * @return The number of connections still open, they are freed when reaped. */
+size_t conn_drain(int force);
+
+/**
+ * @brief Number of connections currently handled by children. */
+size_t conn_active();
+
+/**
+ * @brief Account for response bytes queued (positive) or sent (negative).
+ * Does nothing outside of a child.
+ * @param delta Change in in-flight bytes. */
+void conn_inflight_add(long delta);
@@ -0,0 +1,94 @@
+/* -------------------------------------------------------------------------- */
+/*                           Cleartext HTTP/2 (h2c)                           */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+/** @brief The start of the HTTP/2 connection preface, up to its first blank line. */
+#define H2_PREFACE_START "PRI * HTTP/2.0\r\n\r\n"
+
+/** @brief A stream of the HTTP/2 connection handled by this process. */
+typedef struct H2StreamStruct H2Stream;
+
+/**
+ * @brief Stream whose request is being handled, NULL outside of HTTP/2.
+ * Responses started while it is set are sent on it as HTTP/2 frames instead
+ * of being written to the socket (see response.h). */
+extern H2Stream* h2_current;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Whether a request asks to upgrade its connection to h2c.
+ * Requests with a body are left on HTTP/1.1, their body would have to be read
+ * before switching.
+ * @param req The raw request header, null terminated.
+ * @return Non-zero if the connection can be upgraded. */
+int h2_upgrade_requested(const char* req);
+
+/**
+ * @brief Serve an HTTP/2 connection until either side closes it.
+ * Requests of the streams are handled one at a time with handle_user_request(),
+ * in the order they complete, while the responses already started are sent
+ * interleaved, a frame of each in turn, as flow control allows.
+ * @param client_socket The client socket.
+ * @param data Bytes already read from the connection: the preface, or the
+ *             request that asked for h2c followed by what came after it.
+ * @param len Length of data.
+ * @param upgrade_len Length of the request at the start of data that asked
+ *                    for h2c, answered with 101 Switching Protocols and then
+ *                    on stream 1. 0 for connections that started with the
+ *                    preface (prior knowledge).
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on a protocol error. */
+int h2_serve(int client_socket, const char* data, size_t len, size_t upgrade_len);
+
+/* -------------------------------------------------------------------------- */
+/* Used by the response functions, when h2_current is set.                    */
+
+/**
+ * @brief Send the response header of a stream as a HEADERS frame.
+ * @param s The stream.
+ * @param head Status line and header lines, as for HTTP/1.1. Connection
+ *             specific headers and the framing are left out.
+ * @param head_len Length of head.
+ * @param content_length Length of the body, negative if unknown or none.
+ * @param end Whether no body follows (HEAD, 204, 304, empty bodies).
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the header doesn't fit or
+ *         the stream is gone. */
+int h2_stream_begin(
+    H2Stream* s, const char* head, size_t head_len, long long content_length, int end);
+
+/**
+ * @brief Queue body bytes on a stream.
+ * Returns once they are queued, sending what the connection allows (this
+ * stream's and the others') while too many of the stream's bytes wait.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the stream was reset or
+ *         the connection failed. */
+int h2_stream_write(H2Stream* s, const void* data, size_t len);
+
+/**
+ * @brief Queue body bytes from a file on a stream.
+ * The stream keeps its own descriptor of the file and reads it as it is
+ * scheduled, after the request handler returned, so a large file doesn't
+ * hold up the requests multiplexed with it.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the stream was reset or
+ *         the connection failed. */
+int h2_stream_sendfile(H2Stream* s, int fd, off_t offset, size_t len);
+
+/**
+ * @brief Send what the stream has queued now, as flow control allows.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the stream was reset or
+ *         the connection failed. */
+int h2_stream_flush(H2Stream* s);
+
+/**
+ * @brief Mark the body complete, the stream ends once its queue drains.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the stream was reset. */
+int h2_stream_end(H2Stream* s);
+
+/**
+ * @brief Reset a stream whose response can't be completed (RST_STREAM).
+ * @param s The stream. */
+void h2_stream_abort(H2Stream* s);
@@ -0,0 +1,99 @@
+/* -------------------------------------------------------------------------- */
+/*                         HPACK header compression                           */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Dynamic table size we announce, the HTTP/2 default. */
+#define HPACK_TABLE_SIZE 4096
+
+/** @brief Most entries the dynamic table can hold: each one costs at least 32 bytes. */
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+/** @brief An entry of the dynamic table. Name and value share one allocation. */
+typedef struct HpackEntryStruct
+{
+    /** @brief Name, followed by the value. */
+    char* name;
+    /** @brief Length of the name. */
+    size_t name_len;
+    /** @brief Length of the value. */
+    size_t value_len;
+} HpackEntry;
+
+/**
+ * @brief State of the HPACK decoder of one connection.
+ * Every header block the peer sends must go through it, in order, even those
+ * of requests that are refused, or its dynamic table drifts from the peer's. */
+typedef struct HpackDecoderStruct
+{
+    /** @brief Dynamic table, a ring with the newest entry at first. */
+    HpackEntry entries[HPACK_MAX_ENTRIES];
+    /** @brief Index of the newest entry. */
+    size_t first;
+    /** @brief Number of entries. */
+    size_t count;
+    /** @brief Size of the entries, as HPACK counts it. */
+    size_t size;
+    /** @brief Current size limit, set by the peer with size updates. */
+    size_t limit;
+} HpackDecoder;
+
+/**
+ * @brief Called for each decoded header field.
+ * The name and value are not null terminated and only valid during the call. */
+typedef void (*HpackHeaderFn)(
+    void* ctx, const char* name, size_t name_len, const char* value, size_t value_len);
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Start a decoder with an empty dynamic table.
+ * @param d The decoder. */
+void hpack_decoder_init(HpackDecoder* d);
+
+/**
+ * @brief Free the entries of a decoder's dynamic table.
+ * @param d The decoder. */
+void hpack_decoder_free(HpackDecoder* d);
+
+/**
+ * @brief Decode a complete header block.
+ * @param d The decoder.
+ * @param block The header block, from a HEADERS frame and its CONTINUATIONs.
+ * @param len Length of the block.
+ * @param emit Called for each header field, in order.
+ * @param ctx Passed to emit.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on a malformed block, after
+ *         which the connection can't be used (COMPRESSION_ERROR). */
+int hpack_decode(
+    HpackDecoder* d, const uint8_t* block, size_t len, HpackHeaderFn emit, void* ctx);
+
+/**
+ * @brief Encode a response status.
+ * Common ones are a single byte from the static table.
+ * @param out Where to write.
+ * @param size Room in out.
+ * @param status The status code.
+ * @return Bytes written, 0 if they did not fit. */
+size_t hpack_encode_status(uint8_t* out, size_t size, int status);
+
+/**
+ * @brief Encode a header field, without adding it to the peer's dynamic table.
+ * The name is lower-cased, as HTTP/2 requires, and taken from the static
+ * table when it is there.
+ * @param out Where to write.
+ * @param size Room in out.
+ * @param name The header name.
+ * @param name_len Its length.
+ * @param value The header value.
+ * @param value_len Its length.
+ * @return Bytes written, 0 if they did not fit. */
+size_t hpack_encode_header(uint8_t*    out,
+                           size_t      size,
+                           const char* name,
+                           size_t      name_len,
+                           const char* value,
+                           size_t      value_len);
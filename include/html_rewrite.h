@@ -0,0 +1,71 @@
+/* -------------------------------------------------------------------------- */
+/*                            Streaming HTML rewriter                         */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+
+/** @brief Longest attribute value rewritten; longer ones are passed on as is. */
+#define HTML_URL_MAX 4096
+
+/**
+ * @brief Rewrites the src, href and srcset attributes of an HTML document as
+ * it streams through, so links to the upstream server point at the proxy.
+ * Works a chunk at a time with a fixed amount of memory: only the value of
+ * the attribute being read is held back, everything else is passed on right
+ * away, and tags or values split across chunks are handled. Script and style
+ * contents and comments are passed on untouched. */
+typedef struct HtmlRewriterStruct
+{
+    /** @brief Parser state. */
+    int state;
+    /** @brief Upstream authority (host[:port]) whose absolute URLs are made local. */
+    const char* host;
+    /** @brief Upstream path prefix stripped from URLs, "" if none. */
+    const char* prefix;
+    /** @brief Tag or attribute name being read, lower case, truncated. */
+    char name[16];
+    /** @brief Length of name. */
+    size_t name_len;
+    /** @brief Whether the tag being read is a closing one. */
+    int closing;
+    /** @brief End tag of the raw text element (script, style) being read, NULL if none. */
+    const char* raw_end;
+    /** @brief Characters of the raw text end tag or comment end matched so far. */
+    size_t match;
+    /** @brief Quote around the attribute value being read, 0 if unquoted. */
+    char quote;
+    /** @brief How the attribute value being read is rewritten (HtmlValueKind). */
+    int kind;
+    /** @brief Attribute value held back until it is complete. */
+    char value[HTML_URL_MAX];
+    /** @brief Length of value. */
+    size_t value_len;
+} HtmlRewriter;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Start rewriting a document.
+ * @param rw The rewriter.
+ * @param host Upstream authority, as in the Host header. Must outlive rw.
+ * @param prefix Upstream path prefix, without a trailing slash. Must outlive rw. */
+void html_rewrite_init(HtmlRewriter* rw, const char* host, const char* prefix);
+
+/**
+ * @brief Rewrite the next piece of a document.
+ * Rewritten URLs are never longer than the original ones, so the output is at
+ * most what was held back (HTML_URL_MAX) plus the input.
+ * @param rw The rewriter.
+ * @param in The next bytes of the document.
+ * @param len Number of bytes.
+ * @param out Where to write the output, with room for len + HTML_URL_MAX bytes.
+ * @return Number of bytes written to out. */
+size_t html_rewrite(HtmlRewriter* rw, const char* in, size_t len, char* out);
+
+/**
+ * @brief End the document, writing out anything still held back.
+ * @param rw The rewriter.
+ * @param out Where to write the output, with room for HTML_URL_MAX bytes.
+ * @return Number of bytes written to out. */
+size_t html_rewrite_finish(HtmlRewriter* rw, char* out);
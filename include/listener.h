@@ -0,0 +1,117 @@
+/* -------------------------------------------------------------------------- */
+/*                             Listening sockets                              */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include "config.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+/** @brief Most listening sockets: the --listen ones, plus --port and --tls-port. */
+#define LISTENERS_MAX (LISTEN_MAX + 2)
+
+/** @brief A socket the main loop accepts connections on. */
+typedef struct ListenerStruct
+{
+    /** @brief The listening socket. */
+    int fd;
+    /** @brief Address family: AF_INET, AF_INET6 or AF_UNIX. */
+    int family;
+    /** @brief Whether its connections start with a TLS handshake. */
+    int tls;
+    /** @brief Label in logs and statistics, the bound address unless named. */
+    char name[128];
+    /** @brief The spec it was opened from, to find it again after an upgrade. */
+    char spec[512];
+    /** @brief Socket file to remove on shutdown, empty for TCP and abstract sockets. */
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+} Listener;
+
+/**
+ * @brief Counters of a listener, in shared memory.
+ * Lets the latency of clients on a Unix socket be compared with loopback TCP. */
+typedef struct ListenerStatsStruct
+{
+    /** @brief Connections accepted. */
+    atomic_ulong accepted;
+    /** @brief Requests handled. */
+    atomic_ulong requests;
+    /** @brief Total time from complete request header to response handed to the socket. */
+    atomic_ulong request_us;
+    /** @brief Response bytes sent. */
+    atomic_ulong sent;
+} ListenerStats;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Open every configured listener: SERVER_PORT, TLS_PORT and each LISTEN spec.
+ * A spec is an address followed by comma separated options:
+ * - "PORT": every IPv4 and IPv6 address (dual-stack).
+ * - "HOST:PORT", "[IPV6]:PORT": one address, "[::]:PORT" for dual-stack.
+ * - "unix:PATH", "unix:@NAME": a Unix stream socket, @ for an abstract name.
+ * - Options: "tls", "v6only", "mode=OCTAL" (permissions of a socket file),
+ *   "name=LABEL" (label in logs and statistics).
+ * A socket handed down by an upgrade for the same spec is used instead of a new one.
+ * Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if any of them failed. */
+int listener_startup();
+
+/**
+ * @brief Close the listeners and remove their socket files.
+ * A server started by an upgrade that isn't ready leaves the files to the old one. */
+void listener_shutdown();
+
+/**
+ * @brief Close the listening sockets in a child, which only handles its own connection,
+ * or in a server that handed them down to a new one.
+ * The listeners stay known, for the statistics, their socket files are left alone. */
+void listener_close_all();
+
+/**
+ * @brief Stop listening when the server starts draining: close the listening sockets and
+ * remove their socket files, so new clients are refused instead of queued.
+ * The listeners stay known, for the statistics. */
+void listener_stop();
+
+/**
+ * @brief Number of open listeners. */
+size_t listener_count();
+
+/**
+ * @brief Get a listener.
+ * @param index Index of the listener, below listener_count().
+ * @return The listener. */
+const Listener* listener_get(size_t index);
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Count a connection accepted on a listener. Called by the main loop.
+ * @param index Index of the listener. */
+void listener_accepted(size_t index);
+
+/**
+ * @brief Remember which listener this child's connection came from.
+ * @param index Index of the listener. */
+void listener_enter(size_t index);
+
+/**
+ * @brief Count a request handled on this child's listener.
+ * @param start_us When its header was complete, from now_us(). */
+void listener_request_done(uint64_t start_us);
+
+/**
+ * @brief Count response bytes sent on this child's listener.
+ * @param n Bytes sent. */
+void listener_sent(size_t n);
+
+/**
+ * @brief Render the counters of every listener as "name{listener="label"} value" lines.
+ * @param[out] buff The buffer to write to.
+ * @param[in] buff_size The size of the buffer.
+ * @return Number of bytes written, excluding the null terminator. */
+size_t listener_stats_render(char* buff, size_t buff_size);
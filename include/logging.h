@@ -47,11 +47,30 @@ typedef enum FileLogStatusEnum
 /**
  * @brief Set up logging to a file.
  * This function is used to start logging to a file. It opens the file specified
- * by the LOG_FILE_NAME variable and stores a pointer to the file stream in the
- * lfs variable.
+ * by the LOG_FILE_NAME variable and stores its descriptor in the lfd variable.
+ * Must be called before the first fork(), for children to follow rotations.
  * @return EXIT_SUCCESS on success, EXIT_FAILURE on error. */
 int wlog_startup();
 
+/**
+ * @brief Rotate the log file if it's past LOG_MAX_MB or LOG_ROTATE.
+ * Called by the main loop only. The old file is renamed, a new one is opened
+ * and the other processes switch to it before their next message. */
+void wlog_maintain();
+
+/**
+ * @brief Milliseconds until wlog_maintain() has work, for the main loop's poll().
+ * Rate limit summaries, the end of degraded logging, age rotation, and the
+ * size limit while the file grows.
+ * @return The delay, 0 if it is due, -1 if there is none. */
+int wlog_timeout();
+
+/**
+ * @brief Reopen LOG_FILE_NAME, after it was moved by another program.
+ * Called by the main loop when SIGUSR1 is received; the other processes
+ * switch to the new file before their next message. */
+void wlog_reopen();
+
 /**
  * @brief Closes the log file stream if it is open.
  *
@@ -3,9 +3,27 @@
 /* -------------------------------------------------------------------------- */
 
 #pragma once
+#include "logging.h"
+
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
+/**
+ * @brief Whether responses built in this process keep the connection open.
+ * Selects the Connection header written by build_response_header(). Set for
+ * each request by server_client_handler(); pre-rendered pages are built in the
+ * main loop, where it is 0, and always close the connection. */
+extern int http_keep_alive;
+
+/**
+ * @brief Whether the client of the current request can read chunked bodies.
+ * Set for each request by server_client_handler() from its HTTP version.
+ * Responses of unknown length to clients that can't are delimited by closing
+ * the connection instead. */
+extern int http_chunked;
+
 /**
  * @brief Extracts the file extension from a given path and returns the corresponding mime type.
  *
@@ -32,6 +50,110 @@ void build_html_header(char*       header,
                        const char* content_type,
                        size_t      content_length);
 
+/**
+ * @brief Write HTML header with additional header lines to provided buffer.
+ * Same as build_html_header(), with extra header lines inserted before the
+ * blank line that ends the header.
+ * @param header The buffer to write the header to.
+ * @param header_size The maximum size of the header buffer.
+ * @param status The HTTP status code to include in the header.
+ * @param content_type The mime type of the content.
+ * @param content_length The length of the content to be sent.
+ * @param extra_headers Header lines, each ending in "\r\n". May be NULL. */
+void build_response_header(char*       header,
+                           size_t      header_size,
+                           const char* status,
+                           const char* content_type,
+                           size_t      content_length,
+                           const char* extra_headers);
+
+/**
+ * @brief Render the HTML body of an error page to a buffer.
+ * @param buff The buffer to write the body to.
+ * @param buff_size The maximum size of the buffer.
+ * @param title The title of the error page.
+ * @param message The message to be displayed on the error page.
+ * @return The length of the body, or 0 if it did not fit in the buffer. */
+size_t render_error_body(char* buff, size_t buff_size, const char* title, const char* message);
+
+/**
+ * @brief Render a complete error response (header and HTML body) to a buffer.
+ * Used both for error pages built on demand and for pages pre-rendered at
+ * startup, which can then be sent with a single call.
+ * @param buff The buffer to write the response to.
+ * @param buff_size The maximum size of the buffer.
+ * @param status The HTTP status code to include in the header.
+ * @param title The title of the error page.
+ * @param message The message to be displayed on the error page.
+ * @param extra_headers Additional header lines, each ending in "\r\n". May be NULL.
+ * @return The length of the response, or 0 if it did not fit in the buffer. */
+size_t render_error_page(char*       buff,
+                         size_t      buff_size,
+                         const char* status,
+                         const char* title,
+                         const char* message,
+                         const char* extra_headers);
+
+/**
+ * @brief Find the value of a header in a raw HTTP request or response header.
+ * The name is matched case-insensitively at the start of a line. The value is
+ * not null terminated: it ends before the "\r\n" of its line.
+ * @param[in] head The raw header, null terminated.
+ * @param[in] name The header name, without the colon.
+ * @param[out] len Where to store the length of the value.
+ * @return Pointer to the value, with leading spaces skipped, or NULL if absent. */
+const char* http_header_value(const char* head, const char* name, size_t* len);
+
+/**
+ * @brief Whether a request line ends with HTTP/1.1.
+ * @param[in] req The raw request header, null terminated.
+ * @return Non-zero for HTTP/1.1 requests. */
+int http_request_11(const char* req);
+
+/**
+ * @brief Decide whether the connection can be reused after answering a request.
+ * HTTP/1.1 requests are persistent unless they send "Connection: close";
+ * HTTP/1.0 requests only if they send "Connection: keep-alive". Requests with
+ * a body are never kept alive, since the body is not read.
+ * @param[in] req The raw request header, null terminated.
+ * @return Non-zero if the connection can be kept alive. */
+int http_wants_keep_alive(const char* req);
+
+/**
+ * @brief Milliseconds elapsed on the monotonic clock.
+ * Only meaningful relative to other values returned by this function.
+ * @return The current monotonic time, in milliseconds. */
+uint64_t now_ms();
+
+/**
+ * @brief Microseconds elapsed on the monotonic clock, for timing requests.
+ * @return The current monotonic time, in microseconds. */
+uint64_t now_us();
+
+/**
+ * @brief Build the word of a token bucket.
+ * A bucket packs its token count (signed, high 32 bits) and the time of its
+ * last refill (now_ms(), wrapping, low 32 bits) so both change in one
+ * compare-and-swap, and processes sharing it need no lock.
+ * @param tokens Tokens in the bucket.
+ * @param time Time of the last refill.
+ * @return The bucket word. */
+uint64_t bucket_pack(int32_t tokens, uint32_t time);
+
+/**
+ * @brief Refill a bucket, then take cost tokens from it.
+ * @param bucket The bucket.
+ * @param rate Tokens gained per second.
+ * @param burst Most tokens the bucket can hold.
+ * @param cost Tokens to take. 0 only refills.
+ * @param allow_debt Take the tokens even if there are not enough.
+ * @return The tokens left, negative if there were not enough. */
+int64_t bucket_take(atomic_uint_fast64_t* bucket,
+                    int64_t               rate,
+                    int64_t               burst,
+                    int64_t               cost,
+                    int                   allow_debt);
+
 /**
  * @brief Center a string in a buffer by padding with spaces.
  * @param[in] text The string to be centered.
@@ -72,13 +194,14 @@ void human_readable_size(long bytes, char buffer[], size_t buff_len);
 
 /**
  * @brief Format a log message with transfer data.
+ * @param lvl      The log level of the message.
  * @param read     The total number of bytes read from the client.
  * @param sent     The total number of bytes sent to the client.
  * @param transfers The number of transfers done.
  * This function formats a log message with the total number of bytes read and
  * sent, as well as the number of transfers done. It also logs the transfer data
  * in a human-readable format. */
-void log_transfer_data(long read, long sent, long unsigned transfers);
+void log_transfer_data(LogLevel lvl, long read, long sent, long unsigned transfers);
 
 /**
  * @brief Decodes a URL-encoded string.
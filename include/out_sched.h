@@ -0,0 +1,62 @@
+/* -------------------------------------------------------------------------- */
+/*                              Output scheduling                             */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+
+/*
+ * Every connection is sent by its own child, so there is no single queue to
+ * pick the next write from. Instead, children ask for a grant before each
+ * write, and the grants follow deficit round robin across connections: in
+ * every round, a connection may send one quantum (SCHED_QUANTUM). A connection
+ * that used its quantum waits for the next round, which starts as soon as the
+ * bandwidth is left unused, so a lone transfer is never held back. Rounds are
+ * measured against BANDWIDTH: without it nothing is ever left unused, so
+ * there are no rounds and each socket sends as fast as it drains.
+ *
+ * Responses with little left to send (shortest remaining first) get all they
+ * need in a single turn, and go first: while a short response waits for
+ * bandwidth or for room in its socket, long ones hold their next quantum for a
+ * few milliseconds. That keeps small pages from queueing behind large files.
+ *
+ * BANDWIDTH caps the bytes per second sent by all connections together, with
+ * a bucket in shared memory that rounds are measured against, and
+ * BANDWIDTH_CONN caps each connection.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Allocate the shared scheduler state.
+ * Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int sched_startup();
+
+/**
+ * @brief Release the shared scheduler state. */
+void sched_shutdown();
+
+/**
+ * @brief Start the scheduling state of a new connection.
+ * Called in the child right after fork(), before its first grant. */
+void sched_conn_start();
+
+/**
+ * @brief Wait for this connection's turn to send, then get how much it may send.
+ * Called in the child before every write of response data.
+ * @param want Bytes ready to be sent.
+ * @param remaining Bytes of the response left to send, want included. Responses
+ *                  whose length is unknown pass what they have queued.
+ * @return Bytes that may be sent now, between 1 and want (0 if want is 0). */
+size_t sched_grant(size_t want, size_t remaining);
+
+/**
+ * @brief Charge bytes that reached the socket to this connection's turn and the caps.
+ * @param n Bytes sent. */
+void sched_charge(size_t n);
+
+/**
+ * @brief Tell the scheduler this connection is waiting for room in its socket.
+ * A short response waiting there makes long ones hold back for a while. */
+void sched_waiting();
@@ -0,0 +1,62 @@
+/* -------------------------------------------------------------------------- */
+/*                                 Path index                                 */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Metadata about an entry of the served tree.
+ * Filled by path_index_lookup() without touching the filesystem, but below
+ * symlinked directories: they aren't followed, so they can't loop. */
+typedef struct PathInfoStruct
+{
+    /** @brief Non-zero if the entry is a directory. */
+    int is_dir;
+    /** @brief Size of the entry in bytes. */
+    uint64_t size;
+    /** @brief Last modification time of the entry. */
+    time_t mtime;
+} PathInfo;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Build the in-memory index of ROOT_DIR and start watching it.
+ * Walks the whole served tree once, storing every file and directory in an
+ * open-addressing hash table, then registers an inotify watch on every
+ * directory so the index can be kept current by path_index_update().
+ * Does nothing if PATH_INDEX is disabled.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (the index is then
+ *         disabled and lookups fall back to the filesystem). */
+int path_index_startup();
+
+/**
+ * @brief Release the index and stop watching the served tree. */
+void path_index_shutdown();
+
+/**
+ * @brief Check whether the index is built and can answer lookups.
+ * @return Non-zero if lookups are authoritative, 0 otherwise. */
+int path_index_ready();
+
+/**
+ * @brief Look up a path in the index.
+ * @param[in] path A filesystem path inside ROOT_DIR, as built by
+ *                 handle_user_request() (e.g. "data/cat.gif").
+ * @param[out] info Where to store the entry's metadata. May be NULL.
+ * @return EXIT_SUCCESS if the path exists, EXIT_FAILURE if it does not. */
+int path_index_lookup(const char path[], PathInfo* info);
+
+/**
+ * @brief File descriptor to poll for changes in the served tree.
+ * @return The inotify file descriptor, or -1 if there is none. */
+int path_index_fd();
+
+/**
+ * @brief Apply pending inotify events to the index.
+ * Should be called when path_index_fd() is readable. Never blocks.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int path_index_update();
@@ -0,0 +1,42 @@
+/* -------------------------------------------------------------------------- */
+/*                             Reverse proxy mode                             */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+
+/**
+ * @brief Set up proxy mode: upstream connection pool and shared cache.
+ * Does nothing when PROXY_UPSTREAM is empty. Must be called before the first
+ * fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int proxy_startup();
+
+/**
+ * @brief Release the upstream connection pool and the cache. */
+void proxy_shutdown();
+
+/**
+ * @brief Periodic work of the main loop (upstream connection pool upkeep). */
+void proxy_maintain();
+
+/**
+ * @brief Milliseconds until proxy_maintain() has work.
+ * @return The delay, 0 if it is due, -1 if there is none (no proxy). */
+int proxy_timeout();
+
+/**
+ * @brief Whether requests are forwarded to an upstream server.
+ * @return Non-zero in proxy mode. */
+int proxy_enabled();
+
+/**
+ * @brief Answer a request from the cache or by forwarding it upstream.
+ * Responses are streamed to the client as they arrive from the upstream
+ * server, and stored in the cache on the way when their Cache-Control or
+ * Expires headers allow it.
+ * @param client_socket The socket associated with the client.
+ * @param req The raw request header, null terminated.
+ * @param method The request method.
+ * @param target The request target (path and query), as sent by the client.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error. */
+int proxy_handle(int client_socket, const char* req, const char* method, const char* target);
@@ -0,0 +1,189 @@
+/* -------------------------------------------------------------------------- */
+/*                                 Proxy cache                                */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/** @brief Longest cache key (request target) stored, including the terminator. */
+#define CACHE_KEY_MAX 256
+
+/** @brief Result of a cache lookup. */
+typedef enum CacheLookupEnum
+{
+    CACHE_MISS,     /**< Nothing stored for the key. */
+    CACHE_FRESH,    /**< Stored and fresh, can be served as is. */
+    CACHE_STALE,    /**< Expired, but can be served while it is refreshed. */
+    CACHE_EXPIRED,  /**< Expired for good, only usable if the upstream fails. */
+    CACHE_FILLING,  /**< Being fetched by another process, can be followed. */
+} CacheLookup;
+
+/** @brief Freshness of a stored response. */
+typedef struct CacheTimesStruct
+{
+    /** @brief When the response was generated upstream, for the Age header. */
+    time_t stored;
+    /** @brief When the response stops being fresh. */
+    time_t expires;
+    /** @brief Until when it may be served stale while it is refreshed. */
+    time_t stale_until;
+    /** @brief Until when it may be served stale if the upstream fails. */
+    time_t error_until;
+} CacheTimes;
+
+/**
+ * @brief A stored response, found by proxy_cache_lookup().
+ * The entry is not locked while it's being read: if it's evicted in the
+ * meantime, proxy_cache_read() notices and fails. An entry found while still
+ * filling is read with proxy_cache_follow() instead, which waits for the
+ * process fetching it. */
+typedef struct CacheHitStruct
+{
+    /** @brief Index of the entry. */
+    int entry;
+    /** @brief Generation of the entry when it was found. */
+    unsigned gen;
+    /** @brief HTTP status code of the response. */
+    int status;
+    /** @brief Length of the stored header, which comes before the body. */
+    size_t header_len;
+    /** @brief Length of the stored header and body (so far, while filling). */
+    size_t size;
+    /** @brief Freshness of the response. */
+    CacheTimes times;
+    /** @brief Spill file of the entry, -1 if it is in memory. */
+    int fd;
+    /** @brief Read cursor: block holding the next byte, -1 if not known yet. */
+    int block;
+    /** @brief Read cursor: block holding the previous byte, -1 at the start. */
+    int prev_block;
+    /** @brief Read cursor: bytes already read. */
+    size_t pos;
+    /** @brief Whether the entry was still being stored when last looked at. */
+    int filling;
+} CacheHit;
+
+/**
+ * @brief A response being stored by the process that fetches it.
+ * Responses are written to shared memory as they stream in, and moved to a
+ * spill file in PROXY_CACHE_DIR if they outgrow the in-memory object limit. */
+typedef struct CacheWriterStruct
+{
+    /** @brief Index of the entry being filled, -1 when not storing. */
+    int entry;
+    /** @brief Generation of the entry. */
+    unsigned gen;
+    /** @brief Spill file, -1 while the entry is in memory. */
+    int fd;
+} CacheWriter;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Allocate the shared cache. Does nothing when proxy mode or the
+ * cache is disabled. Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int proxy_cache_startup();
+
+/**
+ * @brief Release the shared cache. */
+void proxy_cache_shutdown();
+
+/**
+ * @brief Find the stored response for a key.
+ * Unless a fresh or servable stale response is stored, a response another
+ * process is fetching is returned instead, so concurrent misses share one
+ * upstream request. Finished with proxy_cache_done().
+ * @param[in] key The cache key.
+ * @param[out] hit Where to store the entry found.
+ * @param[out] w If not NULL, and there's neither a servable response nor one
+ *               being fetched, an entry is reserved here for the caller to
+ *               fill: later lookups follow it instead of missing too.
+ * @return Whether an entry was found, and its freshness. */
+CacheLookup proxy_cache_lookup(const char* key, CacheHit* hit, CacheWriter* w);
+
+/**
+ * @brief Copy the next bytes of a stored response (header, then body).
+ * @param[in,out] hit The entry, its read cursor is advanced.
+ * @param[out] buff Where to copy the bytes.
+ * @param[in] len Most bytes to copy.
+ * @return Bytes copied, 0 at the end, -1 if the entry was evicted meanwhile. */
+ssize_t proxy_cache_read(CacheHit* hit, char* buff, size_t len);
+
+/**
+ * @brief Wait until the process filling an entry found with CACHE_FILLING has
+ * stored the response header, and fill in status, header_len and times.
+ * @param[in,out] hit The entry.
+ * @return EXIT_SUCCESS once the header is there, EXIT_FAILURE if the entry was
+ *         dropped (response not cacheable, upstream failure...). */
+int proxy_cache_wait_header(CacheHit* hit);
+
+/**
+ * @brief Copy the next bytes of a response that may still be filling, waiting
+ * for the process fetching it when the reader has caught up.
+ * @param[in,out] hit The entry, its read cursor is advanced.
+ * @param[out] buff Where to copy the bytes.
+ * @param[in] len Most bytes to copy.
+ * @return Bytes copied, 0 at the end of the complete response, -1 if the entry
+ *         was dropped meanwhile. */
+ssize_t proxy_cache_follow(CacheHit* hit, char* buff, size_t len);
+
+/**
+ * @brief Give a stored response new freshness times, after the upstream
+ * confirmed it is still valid (304 Not Modified).
+ * @param[in] hit The entry, found with proxy_cache_lookup().
+ * @param[in] times The new times.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the entry was evicted meanwhile. */
+int proxy_cache_refresh(const CacheHit* hit, const CacheTimes* times);
+
+/**
+ * @brief Release what a lookup holds (the spill file). */
+void proxy_cache_done(CacheHit* hit);
+
+/**
+ * @brief Start storing a response for a key.
+ * Fails if the cache is disabled or if another process is already storing a
+ * response for the same key.
+ * @param[out] w The writer.
+ * @param[in] key The cache key.
+ * @return EXIT_SUCCESS if the response should be stored, EXIT_FAILURE otherwise. */
+int proxy_cache_begin(CacheWriter* w, const char* key);
+
+/**
+ * @brief Append bytes to a response being stored.
+ * On failure (cache full, response too large) the entry is dropped and the
+ * writer stops storing; the caller just keeps forwarding.
+ * @param[in,out] w The writer. Does nothing if it is not storing.
+ * @param[in] data The bytes.
+ * @param[in] len Number of bytes. */
+void proxy_cache_append(CacheWriter* w, const void* data, size_t len);
+
+/**
+ * @brief Store the response header, which lets processes following the entry
+ * start answering their clients.
+ * The entry is dropped right away if the announced body can't be stored, so
+ * followers fall back to fetching it themselves before sending anything.
+ * @param[in,out] w The writer. Does nothing if it is not storing.
+ * @param[in] header The header to store, sent before the body on hits.
+ * @param[in] header_len Its length.
+ * @param[in] body_len Length of the body, -1 if unknown.
+ * @param[in] status HTTP status code of the response.
+ * @param[in] times Freshness of the response. */
+void proxy_cache_header(CacheWriter*      w,
+                        const char*       header,
+                        size_t            header_len,
+                        long long         body_len,
+                        int               status,
+                        const CacheTimes* times);
+
+/**
+ * @brief Publish a completely stored response, replacing any older one.
+ * @param[in,out] w The writer. Does nothing if it is not storing. */
+void proxy_cache_commit(CacheWriter* w);
+
+/**
+ * @brief Drop a response that could not be stored completely.
+ * @param[in,out] w The writer. Does nothing if it is not storing. */
+void proxy_cache_abort(CacheWriter* w);
@@ -0,0 +1,42 @@
+/* -------------------------------------------------------------------------- */
+/*                           Per-client rate limiting                         */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Allocate the shared rate limiting table.
+ * Does nothing if both RATE_LIMIT and RATE_LIMIT_BYTES are 0. Must be called
+ * before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int ratelimit_startup();
+
+/**
+ * @brief Release the rate limiting table. */
+void ratelimit_shutdown();
+
+/**
+ * @brief Check a new connection against the limits of its source address.
+ * Takes one token from the client's request bucket, and refuses the
+ * connection if there is none left or if the client's byte bucket is in debt.
+ * The client's entry is remembered so children forked afterwards charge
+ * their requests and bytes to it. Called by the main loop after accept().
+ * @param[in] addr The peer address returned by accept().
+ * @return EXIT_SUCCESS if the connection is allowed, EXIT_FAILURE if the
+ *         client is over its limit. */
+int ratelimit_admit(const struct sockaddr_storage* addr);
+
+/**
+ * @brief Check another request on the current connection.
+ * The first request of a connection is charged by ratelimit_admit(); kept
+ * alive connections call this for every following one. Called in the child.
+ * @return EXIT_SUCCESS if the request is allowed, EXIT_FAILURE otherwise. */
+int ratelimit_request();
+
+/**
+ * @brief Charge bytes sent on the current connection to its client.
+ * Called in the child after sending response data.
+ * @param bytes Number of bytes sent. */
+void ratelimit_charge(size_t bytes);
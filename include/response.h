@@ -0,0 +1,137 @@
+/* -------------------------------------------------------------------------- */
+/*                              Streaming responses                           */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+/** @brief Size of the output buffer small writes are gathered in. */
+#define RESPONSE_BUFFER (16 * 1024)
+
+/** @brief Content length of a response whose length isn't known yet. */
+#define RESPONSE_CHUNKED (-1)
+
+/** @brief Content length of a response without a body (204, 304), and no framing headers. */
+#define RESPONSE_NO_BODY (-2)
+
+/**
+ * @brief A response being sent to a client.
+ * The header is sent along with the first body bytes, and small writes are
+ * gathered in an output buffer so they leave in as few send() calls as
+ * possible. When the length is known up front it is sent as Content-Length;
+ * otherwise the body is sent with Transfer-Encoding: chunked, one chunk per
+ * flushed buffer, or delimited by closing the connection for HTTP/1.0
+ * clients. A write returns once its bytes are buffered or sent, waiting for
+ * the socket to drain when it is full, so producers never run ahead of the
+ * client. Responses to requests made on an HTTP/2 stream (h2_current) are
+ * sent on it instead, the stream doing the framing. */
+typedef struct ResponseStruct
+{
+    /** @brief Client socket. */
+    int socket;
+    /** @brief Whether the body is sent with the chunked transfer coding. */
+    int chunked;
+    /** @brief Whether only the header is sent (HEAD), body writes are discarded. */
+    int head_only;
+    /** @brief Whether sending failed; later calls do nothing. */
+    int failed;
+    /** @brief Content length sent in the header, or RESPONSE_CHUNKED, or RESPONSE_NO_BODY. */
+    long long length;
+    /** @brief Body bytes written so far. */
+    long long written;
+    /** @brief Declared body bytes still counted against MAX_INFLIGHT. */
+    long inflight;
+    /** @brief Bytes sent to the socket, header and framing included. */
+    size_t sent;
+    /** @brief Number of send calls made. */
+    unsigned long sends;
+    /** @brief Where the data of the open chunk starts in buff, when chunked. */
+    size_t chunk;
+    /** @brief Bytes in buff. */
+    size_t used;
+    /** @brief HTTP/2 stream the response is sent on, NULL for HTTP/1.x. */
+    struct H2StreamStruct* stream;
+    /** @brief Output buffer. When chunked, room for the size line is kept before the open chunk. */
+    char buff[RESPONSE_BUFFER];
+} Response;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Start a response built from a status and content type.
+ * Nothing is sent yet, the header waits in the buffer for the first body bytes.
+ * @param res The response.
+ * @param client_socket The client socket.
+ * @param status The HTTP status, e.g. "200 OK".
+ * @param content_type The mime type of the body.
+ * @param content_length Length of the body, or RESPONSE_CHUNKED if unknown.
+ * @param extra_headers Header lines, each ending in "\r\n". May be NULL.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the header could not be sent. */
+int response_begin(Response*   res,
+                   int         client_socket,
+                   const char* status,
+                   const char* content_type,
+                   long long   content_length,
+                   const char* extra_headers);
+
+/**
+ * @brief Start a response from a ready status line and header lines.
+ * The framing (Content-Length or Transfer-Encoding) and Connection headers
+ * and the blank line ending the header are added here.
+ * @param res The response.
+ * @param client_socket The client socket.
+ * @param head Status line and header lines, each ending in "\r\n".
+ * @param head_len Length of head.
+ * @param content_length Length of the body, RESPONSE_CHUNKED or RESPONSE_NO_BODY.
+ * @param head_only Send the header as if the body followed, but not the body.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the header could not be sent. */
+int response_begin_head(Response*   res,
+                        int         client_socket,
+                        const char* head,
+                        size_t      head_len,
+                        long long   content_length,
+                        int         head_only);
+
+/**
+ * @brief Write body bytes.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the client went away. */
+int response_write(Response* res, const void* data, size_t len);
+
+/**
+ * @brief Write formatted body text.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the client went away or
+ *         the text is larger than the output buffer. */
+int response_printf(Response* res, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Write body bytes straight from a file with sendfile().
+ * @param res The response.
+ * @param fd The file.
+ * @param offset Where to start in the file.
+ * @param len Number of bytes.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the client went away or
+ *         the file ended early. */
+int response_sendfile(Response* res, int fd, off_t offset, size_t len);
+
+/**
+ * @brief Send what is buffered now.
+ * For producers about to wait for more data (a slow upstream), so the client
+ * isn't kept waiting for bytes we already have.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the client went away. */
+int response_flush(Response* res);
+
+/**
+ * @brief Finish the response, sending what is left in the buffer and the
+ * last chunk. A response whose body didn't match its Content-Length leaves
+ * the client unable to tell where it ends, so the connection is not kept.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the response is incomplete. */
+int response_end(Response* res);
+
+/**
+ * @brief Give up on a response that can't be completed (its source failed).
+ * What is buffered is still sent, but not the end of the body, and the
+ * connection is not kept, so the client can tell the response is incomplete.
+ * @param res The response. */
+void response_abort(Response* res);
@@ -4,6 +4,12 @@
 
 #pragma once
 
+/**
+ * @brief Largest request header we accept, in bytes.
+ * Bigger headers are answered with 431 Request Header Fields Too Large. Also
+ * bounds the response headers read from the upstream server in proxy mode. */
+#define HEADER_MAX 8192
+
 /** @brief The current status of the server. */
 typedef enum ServerStatusEnum
 {
@@ -61,6 +67,8 @@ int handle_user_request(int client_socket, char* req);
 
 /**
  * @brief Sends a file to a client.
+ * The body is sent straight from the file with sendfile(), or, on an HTTP/2
+ * stream, read by the stream as its turn to send comes.
  * @param client_socket The socket where the file should be sent.
  * @param path The path to the file to be sent.
  * @return 0 on success, -1 on failure.
@@ -77,6 +85,14 @@ int send_file(int client_socket, const char path[]);
  */
 int send_error_page(int client_socket, const char* code, const char* title, const char* message);
 
+/**
+ * @brief Send the server statistics as a plain text page.
+ * Served for requests to STATS_PATH.
+ * @param client_socket The socket where the statistics should be sent.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int send_stats(int client_socket);
+
 /**
  * @brief Handle a single client request.
  * @param[in] client_socket File descriptor of the socket to read from.
@@ -86,8 +102,9 @@ int server_client_handler(int client_socket);
 
 /**
  * @brief Serves a directory listing as a web page to the client.
- * This function utilizes the 'tree' command to generate a directory listing
- * of the 'data' directory to a .HTML file and then send it to the client.
+ * The 'data' directory is walked as the page is sent, with nested lists for
+ * subdirectories, so the listing is never written to disk or held in memory
+ * whole. It is sent chunked, since its length is only known at the end.
  * @param client_socket The socket associated with the client.
  * @return EXIT_SUCCESS on successfully sending the directory listing, EXIT_FAILURE on error.*/
 int serve_data_tree(int client_socket);
@@ -0,0 +1,22 @@
+/* -------------------------------------------------------------------------- */
+/*                                Shared memory                               */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+
+/**
+ * @brief Allocate a zeroed memory region shared with forked children.
+ * Children handle clients in their own process, so any state that has to be
+ * seen by both the main loop and the children (counters, connection table)
+ * must live in one of these regions. They must be allocated before forking.
+ * @param[in] name Short name of the region, used in log messages.
+ * @param[in] size Size of the region in bytes.
+ * @return Pointer to the region, or NULL on failure. */
+void* shm_alloc(const char* name, size_t size);
+
+/**
+ * @brief Release a region allocated with shm_alloc().
+ * @param[in] ptr Pointer returned by shm_alloc(). May be NULL.
+ * @param[in] size Size that was passed to shm_alloc(). */
+void shm_free(void* ptr, size_t size);
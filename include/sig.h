@@ -8,22 +8,91 @@
 /**
  * @brief A flag to request the server to shut down.
  * This variable is declared volatile and accessed atomically because it is
- * accessed from both the main thread and the signal handler.
+ * accessed from both the main thread and the signal handler. The main loop
+ * clears it when it starts draining, so a second signal stops waiting.
  * @see sigh_startup()
  * @see sigh() */
 extern volatile sig_atomic_t shut_req;
 
+/**
+ * @brief The signal that last set shut_req, for the main loop to log.
+ * @see sigh() */
+extern volatile sig_atomic_t shut_signal;
+
+/**
+ * @brief A flag set when a child process exits.
+ * The main loop clears it and reaps the children.
+ * @see sigh_child() */
+extern volatile sig_atomic_t child_req;
+
+/**
+ * @brief A flag set when SIGUSR1 is received.
+ * The main loop clears it and reopens the log file.
+ * @see sigh_reopen() */
+extern volatile sig_atomic_t reopen_req;
+
+/**
+ * @brief A flag set when SIGHUP is received.
+ * The main loop clears it and reloads the config.
+ * @see sigh_reload() */
+extern volatile sig_atomic_t reload_req;
+
+/**
+ * @brief A flag set when SIGUSR2 is received.
+ * The main loop clears it and starts the new binary.
+ * @see sigh_upgrade() */
+extern volatile sig_atomic_t upgrade_req;
+
 /**
  * @brief Signal handler function.
- * This function is triggered when a signal is received. It logs the signal and
- * sets the shutdown request flag to indicate that a shutdown is needed.
+ * This function is triggered when a signal is received. It records the signal
+ * and sets the shutdown request flag to indicate that a shutdown is needed.
+ * Like the other handlers, it only sets flags and wakes the main loop up:
+ * nothing that isn't async-signal-safe is called from a handler.
  * @param signal The signal number that was received. (An ISO C99 / POSIX signal) */
 void sigh(int signal);
 
+/**
+ * @brief SIGCHLD handler.
+ * Sets the child_req flag. Also interrupts poll() in the main loop, so a
+ * paused listener can resume as soon as a slot frees up.
+ * @param signal The signal number that was received. */
+void sigh_child(int signal);
+
+/**
+ * @brief SIGUSR1 handler.
+ * Sets the reopen_req flag, for log rotation by other programs.
+ * @param signal The signal number that was received. */
+void sigh_reopen(int signal);
+
+/**
+ * @brief SIGHUP handler.
+ * Sets the reload_req flag, to read the config file again.
+ * @param signal The signal number that was received. */
+void sigh_reload(int signal);
+
+/**
+ * @brief SIGUSR2 handler.
+ * Sets the upgrade_req flag, to hand the listeners down to a new binary.
+ * @param signal The signal number that was received. */
+void sigh_upgrade(int signal);
+
 /**
  * @brief Signal handling startup function.
  * This function should be called once and only once.  It sets up signal
  * handling by registering the sigh() function to be called when SIGINT or
- * SIGTERM is received.
+ * SIGTERM is received, sigh_child() for SIGCHLD, sigh_reopen() for SIGUSR1,
+ * sigh_reload() for SIGHUP and sigh_upgrade() for SIGUSR2.
  * @returns 0 on success, -1 on failure. */
 int sigh_startup();
+
+/**
+ * @brief Read end of the self-pipe the handlers write to.
+ * Polled by the main loop, so it can block in poll() with no timeout and
+ * still see every signal, even one that arrives just before it polls.
+ * @return The descriptor, -1 before sigh_startup(). */
+int sigh_wake_fd();
+
+/**
+ * @brief Empty the self-pipe, once its POLLIN was seen. The flags say what happened. */
+void sigh_woken();
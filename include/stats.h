@@ -0,0 +1,138 @@
+/* -------------------------------------------------------------------------- */
+/*                                 Statistics                                 */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * @brief Server-wide counters.
+ * Lives in shared memory so the main loop and every forked child update the
+ * same values. Counters only go up; gauges go up and down. */
+typedef struct ServerStatsStruct
+{
+    /** @brief Connections accepted from the listening socket. */
+    atomic_ulong accepted;
+    /** @brief Gauge: connections currently handled by a child. */
+    atomic_ulong active;
+    /** @brief Gauge: response bytes queued by children but not yet sent. */
+    atomic_ulong inflight_bytes;
+    /** @brief Connections answered with the pre-rendered 503 page. */
+    atomic_ulong shed_503;
+    /** @brief Times the main loop stopped accepting because of overload. */
+    atomic_ulong accept_pauses;
+    /** @brief Connections closed because a header, send or keep-alive deadline passed. */
+    atomic_ulong timed_out;
+    /** @brief Connections and requests refused with 429 because their client was over its limit. */
+    atomic_ulong rate_limited;
+    /** @brief Rate limiting entries taken over by a new client. */
+    atomic_ulong rate_evictions;
+    /** @brief Proxied requests answered from the cache. */
+    atomic_ulong cache_hits;
+    /** @brief Proxied requests forwarded upstream. */
+    atomic_ulong cache_misses;
+    /** @brief Responses stored in the cache. */
+    atomic_ulong cache_stores;
+    /** @brief Cache entries evicted to make room. */
+    atomic_ulong cache_evictions;
+    /** @brief Proxied requests that streamed a response another request was fetching. */
+    atomic_ulong cache_coalesced;
+    /** @brief Expired responses served while being refreshed, or because the upstream failed. */
+    atomic_ulong cache_stale;
+    /** @brief Expired responses the upstream confirmed with 304 Not Modified. */
+    atomic_ulong cache_revalidations;
+    /** @brief Times a response waited for a full client socket to drain. */
+    atomic_ulong send_waits;
+    /** @brief Connections served with HTTP/2. */
+    atomic_ulong h2_connections;
+    /** @brief Requests handled on HTTP/2 streams. */
+    atomic_ulong h2_streams;
+    /** @brief TLS handshakes completed. */
+    atomic_ulong tls_handshakes;
+    /** @brief Handshakes that resumed a session from a ticket. */
+    atomic_ulong tls_resumed;
+    /** @brief Handshakes that failed. */
+    atomic_ulong tls_failed;
+    /** @brief TLS connections whose records are encrypted by the kernel. */
+    atomic_ulong tls_ktls;
+    /** @brief Total time spent in handshakes, in microseconds, network round trips included. */
+    atomic_ulong tls_handshake_us;
+    /** @brief Total CPU time spent in handshakes, in microseconds. */
+    atomic_ulong tls_handshake_cpu_us;
+    /** @brief Connections opened to the upstream server. */
+    atomic_ulong upstream_connects;
+    /** @brief Requests sent over a pooled upstream connection. */
+    atomic_ulong upstream_reuses;
+    /** @brief Requests the upstream failed to answer (with 502, or a stale copy). */
+    atomic_ulong upstream_errors;
+    /** @brief Writes that waited for their turn or for bandwidth. */
+    atomic_ulong sched_waits;
+    /** @brief Total time writes waited for their turn or for bandwidth, in microseconds. */
+    atomic_ulong sched_wait_us;
+    /** @brief Writes of long responses held back while short ones were waiting. */
+    atomic_ulong sched_yields;
+    /** @brief Requests written to the slow log. */
+    atomic_ulong slow_requests;
+    /** @brief Requests written to the trace file. */
+    atomic_ulong traced_requests;
+    /** @brief Requests written to the access log. */
+    atomic_ulong access_records;
+    /** @brief Batches written to the access log. */
+    atomic_ulong access_writes;
+    /** @brief Requests written to the capture file. */
+    atomic_ulong captured_requests;
+    /** @brief Times the log file was rotated or reopened. */
+    atomic_ulong log_rotations;
+    /** @brief Messages dropped by LOG_RATE. */
+    atomic_ulong log_suppressed;
+    /** @brief Times log writes got slower than LOG_DEGRADE_US. */
+    atomic_ulong log_degraded;
+    /** @brief Requests that used the request arena. */
+    atomic_ulong arena_requests;
+    /** @brief Arena bytes they used in total, arena_bytes / arena_requests is the average. */
+    atomic_ulong arena_bytes;
+    /** @brief Gauge: most arena bytes used by a request. */
+    atomic_ulong arena_peak;
+    /** @brief Blocks allocated for requests that outgrew ARENA_SIZE. */
+    atomic_ulong arena_overflows;
+    /** @brief I/O buffers taken from the pool. */
+    atomic_ulong buffer_gets;
+    /** @brief Those that had to be allocated, none of their class being kept. */
+    atomic_ulong buffer_allocs;
+    /** @brief Gauge: most I/O buffer bytes a process held at once, in use or kept. */
+    atomic_ulong buffer_peak;
+} ServerStats;
+
+/**
+ * @brief Shared server statistics.
+ * NULL until stats_startup() succeeds. */
+extern ServerStats* stats;
+
+/** @brief Add to a statistics field. */
+#define STAT_ADD(field, n) atomic_fetch_add_explicit(&stats->field, (n), memory_order_relaxed)
+
+/** @brief Subtract from a statistics gauge. */
+#define STAT_SUB(field, n) atomic_fetch_sub_explicit(&stats->field, (n), memory_order_relaxed)
+
+/** @brief Read a statistics field. */
+#define STAT_GET(field) atomic_load_explicit(&stats->field, memory_order_relaxed)
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Allocate the shared statistics block.
+ * Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int stats_startup();
+
+/**
+ * @brief Log the final values of all statistics and release them. */
+void stats_shutdown();
+
+/**
+ * @brief Render all statistics as "name value" lines.
+ * @param[out] buff The buffer to write to.
+ * @param[in] buff_size The size of the buffer.
+ * @return Number of bytes written, excluding the null terminator. */
+size_t stats_render(char* buff, size_t buff_size);
@@ -0,0 +1,94 @@
+/* -------------------------------------------------------------------------- */
+/*                                 Timer wheel                                */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Number of levels in the wheel. */
+#define TW_LEVELS 4
+/** @brief log2 of the number of slots per level. */
+#define TW_BITS 6
+/** @brief Number of slots per level. */
+#define TW_SLOTS (1 << TW_BITS)
+
+/**
+ * @brief A timer, meant to be embedded in the structure it times out.
+ * Timers are intrusive list nodes, so arming and cancelling never allocate
+ * and take O(1). */
+typedef struct TimerStruct
+{
+    /** @brief Next timer in the same slot, or in the expired list. */
+    struct TimerStruct* next;
+    /** @brief Pointer to the pointer to this timer, NULL when not armed. */
+    struct TimerStruct** pprev;
+    /** @brief Tick at which the timer expires. */
+    uint64_t expires;
+} Timer;
+
+/**
+ * @brief Hierarchical timer wheel.
+ * Level 0 has one slot per tick, every level above covers TW_SLOTS times the
+ * range of the one below. Timers are moved down a level (cascaded) when the
+ * wheel reaches their slot, so each timer is touched at most TW_LEVELS times
+ * and there is never a scan over all armed timers. */
+typedef struct TimerWheelStruct
+{
+    /** @brief Slot lists, per level. */
+    Timer* slots[TW_LEVELS][TW_SLOTS];
+    /** @brief Current tick. */
+    uint64_t now;
+    /** @brief Milliseconds per tick. */
+    unsigned tick_ms;
+    /** @brief Number of armed timers. */
+    size_t count;
+} TimerWheel;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Initialize an empty wheel.
+ * @param w The wheel.
+ * @param now_ms Current time, in milliseconds.
+ * @param tick_ms Resolution of the wheel, in milliseconds. */
+void timer_wheel_init(TimerWheel* w, uint64_t now_ms, unsigned tick_ms);
+
+/**
+ * @brief Arm a timer, or move it if it is already armed.
+ * Deadlines further than the wheel can represent are clamped; the timer will
+ * fire early and is expected to be re-armed by its owner.
+ * @param w The wheel.
+ * @param t The timer.
+ * @param expires_ms Deadline, in milliseconds. */
+void timer_arm(TimerWheel* w, Timer* t, uint64_t expires_ms);
+
+/**
+ * @brief Disarm a timer. Does nothing if it is not armed.
+ * @param w The wheel.
+ * @param t The timer. */
+void timer_cancel(TimerWheel* w, Timer* t);
+
+/**
+ * @brief Check whether a timer is armed.
+ * @param t The timer.
+ * @return Non-zero if armed. */
+int timer_armed(const Timer* t);
+
+/**
+ * @brief Advance the wheel and collect every timer that expired.
+ * Expired timers are disarmed and returned as a list linked through their
+ * next field, so the caller can handle them in one batch.
+ * @param w The wheel.
+ * @param now_ms Current time, in milliseconds.
+ * @return The first expired timer, or NULL if none expired. */
+Timer* timer_wheel_advance(TimerWheel* w, uint64_t now_ms);
+
+/**
+ * @brief Time until the wheel needs to be advanced again.
+ * Suitable as a poll() timeout. May be earlier than the next expiry when a
+ * higher level has to be cascaded first.
+ * @param w The wheel.
+ * @param now_ms Current time, in milliseconds.
+ * @return Milliseconds to wait, or -1 if no timer is armed. */
+int timer_wheel_timeout(const TimerWheel* w, uint64_t now_ms);
@@ -0,0 +1,91 @@
+/* -------------------------------------------------------------------------- */
+/*                         TLS termination (OpenSSL)                          */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Connections accepted on the TLS listener are handshaken by their child
+ * before the first request is read. Once the handshake completes, OpenSSL
+ * hands the session keys to the kernel (kTLS) when it supports them: records
+ * are then encrypted by the kernel, and send(), sendmsg() and sendfile() on
+ * the plain socket keep working, zero-copy included. Otherwise every byte
+ * goes through OpenSSL in user space.
+ *
+ * The tls_send(), tls_recv()... functions below are used for all client
+ * socket I/O. On connections that aren't TLS, or where the kernel encrypts,
+ * they are the plain system calls.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Load the certificate and key and set up session tickets.
+ * Does nothing without TLS_CERT. Must be called before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int tls_startup();
+
+/**
+ * @brief Release the TLS context. */
+void tls_shutdown();
+
+/**
+ * @brief Rotate the session ticket key when it is due. Called by the main loop.
+ * Children forked after a rotation encrypt tickets with the new key and still
+ * accept tickets from the previous one, so sessions can be resumed across a
+ * rotation. */
+void tls_maintain();
+
+/**
+ * @brief Milliseconds until the session ticket key is due, for the main loop's poll().
+ * @return The delay, 0 if it is due, -1 without TLS. */
+int tls_timeout();
+
+/**
+ * @brief Perform the server side of the handshake on a freshly accepted connection.
+ * Called by the child, before any other I/O on the socket. Takes the socket
+ * out of blocking mode, the functions below wait as needed.
+ * @param client_socket The client socket.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the handshake failed. */
+int tls_accept(int client_socket);
+
+/**
+ * @brief Send the closing alert and release the connection's session. */
+void tls_close();
+
+/**
+ * @brief Whether this process' connection is TLS.
+ * @return Non-zero after a successful tls_accept(). */
+int tls_active();
+
+/**
+ * @brief Whether decrypted bytes are waiting in OpenSSL.
+ * poll() can't see them, so callers check this before waiting for input.
+ * @return Non-zero if tls_recv() would return data right away. */
+int tls_pending();
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief recv() on a client socket.
+ * Only MSG_DONTWAIT is honored in flags when the connection is TLS. */
+ssize_t tls_recv(int socket, void* buff, size_t len, int flags);
+
+/**
+ * @brief send() on a client socket.
+ * Only MSG_DONTWAIT is honored in flags when the connection is TLS. */
+ssize_t tls_send(int socket, const void* buff, size_t len, int flags);
+
+/**
+ * @brief sendmsg() on a client socket. Only the iovecs of msg are used.
+ * In user space, the first buffers are gathered into a single record. */
+ssize_t tls_sendmsg(int socket, const struct msghdr* msg, int flags);
+
+/**
+ * @brief sendfile() to a client socket. Never blocks when the connection is TLS.
+ * In user space, the file is read in a pooled buffer as large as the room in the
+ * socket's send buffer, then encrypted a record at a time. */
+ssize_t tls_sendfile(int socket, int fd, off_t* offset, size_t count);
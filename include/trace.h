@@ -0,0 +1,131 @@
+/* -------------------------------------------------------------------------- */
+/*                              Request tracing                               */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each request records when it reached every phase, on the monotonic clock,
+ * along with its send and receive calls and bytes. When it is done, requests
+ * slower than SLOW_MS get a line in the slow log, and one in TRACE_SAMPLE
+ * requests is appended to TRACE_FILE as a fixed-size binary record, read with
+ * tools/trace_read. Every request also goes to the access log, if any.
+ *
+ * The first request of a connection starts when it was accepted, the next
+ * ones when their first byte arrives. HTTP/2 streams start when they are
+ * handled, and their responses are done once queued on the stream, which
+ * sends them along with the others: their bytes and calls aren't counted.
+ */
+
+/** @brief Phases of a request, in the order they are reached. */
+typedef enum TracePhaseEnum
+{
+    TRACE_ACCEPT,      /**< Connection accepted, first request only. */
+    TRACE_FIRST_BYTE,  /**< First byte of the request received. */
+    TRACE_PARSED,      /**< Request header complete. */
+    TRACE_OPENED,      /**< File to send opened. */
+    TRACE_HEADERS,     /**< Response header sent, with the first body bytes. */
+    TRACE_LAST_BYTE,   /**< Last response byte sent. */
+    TRACE_PHASES
+} TracePhase;
+
+/** @brief First bytes of a trace file. */
+#define TRACE_MAGIC "CSTRACE1"
+
+/** @brief Phase offset of a phase the request never reached. */
+#define TRACE_NONE UINT32_MAX
+
+/**
+ * @brief Start of a trace file, written when the file is created.
+ * Records are in the byte order of the server that wrote them, endian tells
+ * readers whether it's theirs. */
+typedef struct TraceFileHeaderStruct
+{
+    /** @brief TRACE_MAGIC, without the null terminator. */
+    char magic[8];
+    /** @brief 0x01020304 in the writer's byte order. */
+    uint32_t endian;
+    /** @brief Size of each record that follows. */
+    uint32_t record_size;
+} TraceFileHeader;
+
+/** @brief A traced request, 128 bytes. */
+typedef struct TraceRecordStruct
+{
+    /** @brief Wall clock time when the request started, in microseconds since the epoch. */
+    uint64_t time_us;
+    /** @brief Time from the start to each phase in microseconds, TRACE_NONE if not reached. */
+    uint32_t phase_us[TRACE_PHASES];
+    /** @brief Receive calls that returned data. */
+    uint32_t recvs;
+    /** @brief Send calls that sent data. */
+    uint32_t sends;
+    /** @brief Request header bytes. */
+    uint64_t bytes_in;
+    /** @brief Response bytes sent, header included. */
+    uint64_t bytes_out;
+    /** @brief Response status, 0 if none was sent. */
+    uint16_t status;
+    /** @brief HTTP major version: 1 or 2. */
+    uint8_t protocol;
+    /** @brief Unused, 0. */
+    uint8_t reserved;
+    /** @brief Method and path of the request, null padded, truncated if needed. */
+    char request[68];
+} TraceRecord;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Open the slow log and the trace file, and allocate the sampling counter.
+ * Does nothing if both SLOW_MS and TRACE_FILE are unset. Must be called
+ * before the first fork().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int trace_startup();
+
+/**
+ * @brief Close the slow log and the trace file. */
+void trace_shutdown();
+
+/**
+ * @brief Record that a connection was just accepted. Called by the main loop
+ * before forking, its child's first request starts then. */
+void trace_accept();
+
+/**
+ * @brief Record that the current request reached a phase.
+ * Only the first time counts. Reaching TRACE_FIRST_BYTE starts a request. */
+void trace_mark(TracePhase phase);
+
+/**
+ * @brief Describe the current request, once its header is complete.
+ * @param req The request header, its first line is kept.
+ * @param len Length of the header.
+ * @param protocol HTTP major version. */
+void trace_request(const char* req, size_t len, int protocol);
+
+/**
+ * @brief Record the status of the response to the current request.
+ * @param status The HTTP status code. */
+void trace_status(int status);
+
+/**
+ * @brief Count a receive call that returned data. The first one starts a request. */
+void trace_recv();
+
+/**
+ * @brief Count a send call that sent data. The first one sends the response header.
+ * @param n Bytes sent. */
+void trace_send(size_t n);
+
+/**
+ * @brief Count response bytes handed on to be sent later, without a send call of their own.
+ * The body of an HTTP/2 stream goes out in DATA frames after its request is finished.
+ * @param n Bytes. */
+void trace_queued(size_t n);
+
+/**
+ * @brief Finish the current request: log it if slow, record it if sampled. */
+void trace_end();
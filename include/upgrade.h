@@ -0,0 +1,88 @@
+/* -------------------------------------------------------------------------- */
+/*                               Binary upgrade                               */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+
+/*
+ * On SIGUSR2 the server starts its binary again, with the same command line,
+ * and hands the listening sockets down to it:
+ *
+ * 1. The main loop forks, the child execs the binary. The listeners are
+ *    inherited (they are not close-on-exec), UPGRADE_ENV_LISTENERS names them
+ *    with "FD SPEC" lines, SPEC being what listener_startup() opened.
+ * 2. The new server starts as usual, but adopts the inherited socket of a
+ *    listener with the same spec instead of binding a new one. Connections
+ *    waiting in the kernel queue are accepted by whichever server gets to them
+ *    first: none are refused.
+ * 3. Once in its main loop, the new server writes a byte to the pipe in
+ *    UPGRADE_ENV_READY. The old one closes its listeners, lets its children
+ *    finish their connections, and exits.
+ *
+ * If the new server fails to start, the pipe is closed without a byte and the
+ * old one keeps serving. Shared memory (statistics, connection table, rate
+ * limits, caches) is not handed down: the regions are anonymous mappings laid
+ * out by the old binary, the new one starts with its own.
+ */
+
+/** @brief Environment variable with the inherited listeners, "FD SPEC" lines. */
+#define UPGRADE_ENV_LISTENERS "CSERVER_LISTENERS"
+
+/** @brief Environment variable with the write end of the readiness pipe. */
+#define UPGRADE_ENV_READY "CSERVER_UPGRADE_FD"
+
+/** @brief Where an upgrade stands, in the old server. */
+typedef enum UpgradeStateEnum
+{
+    UPGRADE_NONE,     // No upgrade started, or the last one failed
+    UPGRADE_PENDING,  // New server started, not ready yet
+    UPGRADE_READY,    // New server in its main loop: stop accepting and drain
+} UpgradeState;
+
+/**
+ * @brief Remember the command line, to start the new binary with.
+ * Called once from main(), before anything else.
+ * @param argv The arguments of main(), argv[0] is the binary. */
+void upgrade_startup(char const* argv[]);
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Start the new binary with the listeners. Called by the main loop on SIGUSR2.
+ * @return EXIT_SUCCESS if it was started, EXIT_FAILURE if not (logged). */
+int upgrade_start();
+
+/**
+ * @brief Check on a started upgrade, without blocking. Called by the main loop.
+ * Logs when the new server is ready or failed to start.
+ * @return Where the upgrade stands. */
+UpgradeState upgrade_check();
+
+/**
+ * @brief The readiness pipe, for the main loop to poll: readable once upgrade_check() has news.
+ * @return The descriptor, -1 unless an upgrade is pending. */
+int upgrade_fd();
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Take the socket the old server had open for a listener spec.
+ * @param spec The listener spec, as given to listener_startup().
+ * @return The listening socket, -1 if none was inherited for that spec. */
+int upgrade_inherit(const char* spec);
+
+/**
+ * @brief Close the inherited sockets no listener took, they are no longer configured.
+ * Called by listener_startup() once every listener is open. */
+void upgrade_inherit_done();
+
+/**
+ * @brief Whether this server was started by an upgrade and isn't ready yet.
+ * Its socket files still belong to the old server until then.
+ * @return Non-zero while upgrade_ready() hasn't been called. */
+int upgrade_inheriting();
+
+/**
+ * @brief Tell the old server this one is ready, if it was started by an upgrade.
+ * Called by the main loop before its first poll(). */
+void upgrade_ready();
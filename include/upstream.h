@@ -0,0 +1,74 @@
+/* -------------------------------------------------------------------------- */
+/*                          Upstream connection pool                          */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+
+/**
+ * @brief A connection to the upstream server, as used by a child.
+ * Pooled connections are opened by the main loop and inherited by every
+ * child forked after them; a child borrows one by claiming its slot in
+ * shared memory. When the pool is empty the child opens a private
+ * connection, closed after a single exchange. */
+typedef struct UpstreamConnStruct
+{
+    /** @brief Socket connected to the upstream server. */
+    int fd;
+    /** @brief Pool slot borrowed, -1 for a private connection. */
+    int slot;
+} UpstreamConn;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Parse PROXY_UPSTREAM, resolve it and set up the connection pool.
+ * Does nothing when proxy mode is disabled. Must be called before the first
+ * fork(). Pool connections are opened by upstream_maintain().
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+int upstream_startup();
+
+/**
+ * @brief Close the pool and release its shared memory. */
+void upstream_shutdown();
+
+/**
+ * @brief Keep the pool healthy. Called by the main loop on every iteration.
+ * Reclaims slots of children that died while borrowing them, closes idle
+ * connections the upstream has hung up on, and reopens closed ones. Never
+ * blocks: connections are opened without waiting and picked up on a later
+ * call once established. */
+void upstream_maintain();
+
+/**
+ * @brief Milliseconds until upstream_maintain() has work, for the main loop's poll().
+ * @return The delay, 0 if it is due, -1 without a pool. */
+int upstream_timeout();
+
+/**
+ * @brief Get a connection to the upstream server.
+ * Borrows an idle pooled connection if there is one this process can use,
+ * otherwise opens a private one.
+ * @param[out] conn Where to store the connection.
+ * @param[in] fresh Skip the pool and always open a new connection, to retry a
+ *                  request a reused connection failed to deliver.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the upstream is unreachable. */
+int upstream_acquire(UpstreamConn* conn, int fresh);
+
+/**
+ * @brief Give back a connection obtained with upstream_acquire().
+ * @param[in] conn The connection.
+ * @param[in] reusable Whether the last response was read completely and the
+ *                     upstream did not ask to close the connection. Pooled
+ *                     connections that are not reusable are closed by the
+ *                     main loop. */
+void upstream_release(UpstreamConn* conn, int reusable);
+
+/**
+ * @brief Value of the Host header to send upstream ("host" or "host:port").
+ * @return The host, or an empty string when proxy mode is disabled. */
+const char* upstream_host();
+
+/**
+ * @brief Path prefix of the upstream URL, prepended to proxied request paths.
+ * @return The prefix, without a trailing slash. Empty if none. */
+const char* upstream_prefix();
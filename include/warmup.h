@@ -0,0 +1,24 @@
+/* -------------------------------------------------------------------------- */
+/*                                  Warm-up                                   */
+/* -------------------------------------------------------------------------- */
+
+#pragma once
+
+/*
+ * Before the listeners are opened, WARMUP_THREADS threads walk ROOT_DIR and
+ * stat every entry, so the kernel's directory and inode caches are filled
+ * before the path index is built and the first requests come in. Files named
+ * in WARMUP_PRELOAD are also read ahead into the page cache.
+ *
+ * The walk stops at WARMUP_DEADLINE, whatever is left is served cold. All
+ * threads are joined before returning: the server forks its children from a
+ * single-threaded process.
+ */
+
+/**
+ * @brief Warm the caches up, if WARMUP_THREADS is set.
+ * Must be called before listener_startup(). Logs how long it took and how
+ * much was warmed.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if it couldn't start (the
+ *         server can still run, cold). */
+int warmup_run();
@@ -0,0 +1,308 @@
+#include "access_log.h"
+#include "config.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "server.h"
+#include "shm.h"
+#include "stats.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+_Static_assert(sizeof(AccessRecord) == ACCESS_RECORD_SIZE, "access records are 64 bytes");
+_Static_assert(sizeof(AccessPath) == ACCESS_RECORD_SIZE, "path records are 64 bytes");
+
+/** @brief Size of the batch buffer of each process. */
+#define ACCESS_BUFFER_SIZE 65536
+
+/** @brief Age past which a batch is written, in milliseconds. */
+#define ACCESS_FLUSH_MS 1000
+
+/** @brief Slots in the shared table of written paths. */
+#define ACCESS_PATHS 4096
+
+/** @brief Slots looked at for a path before giving up and writing its name again. */
+#define ACCESS_PROBES 8
+
+/** @brief The access log, -1 if ACCESS_LOG is empty. Appended to by every child. */
+static int log_fd = -1;
+
+/** @brief Hashes of the paths written to the log, 0 for free slots, in shared memory. */
+static atomic_uint_fast64_t* paths = NULL;
+
+/** @brief Records waiting to be written by this process. */
+static char buffer[ACCESS_BUFFER_SIZE];
+
+/** @brief Bytes in buffer. */
+static size_t buffered = 0;
+
+/** @brief When the first record in buffer was added (now_ms()). */
+static uint64_t buffered_since = 0;
+
+/** @brief Peer of this process' connection, set before forking. */
+static AccessRecord peer;
+
+/** @brief Whether this process' connection logs its requests at INFO, see LOG_SAMPLE. */
+static int sampled = 1;
+
+/** @brief Method and path of the current request. */
+static struct
+{
+    uint8_t  method;
+    uint64_t path_id;
+} cur;
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief FNV-1a hash of a path, never 0. */
+static uint64_t path_hash(const char* path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+    return hash ? hash : 1;
+}
+
+/** @brief Method of a request line's first word. */
+static uint8_t parse_method(const char* method, size_t len)
+{
+    static const char* const names[ACCESS_METHODS] = ACCESS_METHOD_NAMES;
+
+    for (int m = ACCESS_OTHER + 1; m < ACCESS_METHODS; m++)
+        if (strlen(names[m]) == len && memcmp(names[m], method, len) == 0)
+            return m;
+    return ACCESS_OTHER;
+}
+
+/**
+ * @brief Claim a path in the shared table.
+ * @return 1 if its name must be written (first time seen, or table full), else 0. */
+static int path_claim(uint64_t id)
+{
+    for (size_t i = 0; i < ACCESS_PROBES; i++)
+    {
+        atomic_uint_fast64_t* slot = &paths[(id + i) % ACCESS_PATHS];
+        uint_fast64_t         seen = atomic_load_explicit(slot, memory_order_relaxed);
+
+        if (seen == 0 && atomic_compare_exchange_strong_explicit(
+                             slot, &seen, id, memory_order_relaxed, memory_order_relaxed))
+            return 1;
+
+        if (seen == id)
+            return 0;
+    }
+
+    return 1;
+}
+
+/** @brief Add bytes to the batch, writing it first if they don't fit. */
+static void buffer_add(const void* data, size_t len)
+{
+    if (buffered + len > sizeof buffer)
+        access_log_flush();
+
+    if (buffered == 0)
+        buffered_since = now_ms();
+
+    memcpy(buffer + buffered, data, len);
+    buffered += len;
+}
+
+/** @brief Add the record naming a path, padded to whole records. */
+static void write_path(uint64_t id, const char* name, size_t len)
+{
+    char        record[ACCESS_RECORD_SIZE + HEADER_MAX] = {0};
+    AccessPath* p                                       = (AccessPath*) record;
+
+    p->kind   = ACCESS_KIND_PATH;
+    p->length = len;
+    p->id     = id;
+    memcpy(p->name, name, len);
+
+    size_t size = offsetof(AccessPath, name) + len;
+    buffer_add(record, (size + ACCESS_RECORD_SIZE - 1) / ACCESS_RECORD_SIZE * ACCESS_RECORD_SIZE);
+}
+
+/** @brief Time between two phase offsets, 0 if either wasn't reached. */
+static uint32_t span(const TraceRecord* r, TracePhase from, TracePhase to)
+{
+    if (r->phase_us[from] == TRACE_NONE || r->phase_us[to] == TRACE_NONE)
+        return 0;
+    return r->phase_us[to] - r->phase_us[from];
+}
+
+/* -------------------------------------------------------------------------- */
+
+int access_log_startup()
+{
+    if (ACCESS_LOG[0] == '\0')
+    {
+        wlog(DEBUG, "Access log disabled.");
+        return EXIT_SUCCESS;
+    }
+
+    paths = shm_alloc("access log paths", ACCESS_PATHS * sizeof *paths);
+    if (!paths)
+        return EXIT_FAILURE;
+
+    log_fd = open(ACCESS_LOG, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1)
+    {
+        wlog(ERROR, "Failed to open %s: %s.", ACCESS_LOG, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    if (fstat(log_fd, &st) == 0 && st.st_size == 0)  // New file, starts with its header
+    {
+        AccessFileHeader header = {.endian = 0x01020304, .record_size = ACCESS_RECORD_SIZE};
+        memcpy(header.magic, ACCESS_MAGIC, sizeof header.magic);
+        if (write(log_fd, &header, sizeof header) != sizeof header)
+            wlog(WARNING, "Failed to write access log header: %s.", strerror(errno));
+    }
+
+    wlog(INFO, "Logging requests to %s.", ACCESS_LOG);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void access_log_shutdown()
+{
+    if (log_fd != -1)
+    {
+        access_log_flush();
+        close(log_fd);
+    }
+
+    shm_free(paths, ACCESS_PATHS * sizeof *paths);
+    log_fd = -1;
+    paths  = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int access_log_enabled()
+{
+    return log_fd != -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+LogLevel access_log_level()
+{
+    return log_fd != -1 || !sampled ? DEBUG : INFO;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void access_log_peer(const struct sockaddr_storage* addr)
+{
+    static unsigned long connections = 0;
+    sampled = connections++ % LOG_SAMPLE == 0;  // Inherited by the child
+
+    if (log_fd == -1)
+        return;
+
+    memset(&peer, 0, sizeof peer);
+
+    if (addr->ss_family == AF_INET)  // Stored as ::ffff:a.b.c.d
+    {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*) addr;
+        peer.addr[10]                 = 0xff;
+        peer.addr[11]                 = 0xff;
+        memcpy(peer.addr + 12, &sin->sin_addr, 4);
+        peer.port = ntohs(sin->sin_port);
+    }
+    else if (addr->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6* sin = (const struct sockaddr_in6*) addr;
+        memcpy(peer.addr, &sin->sin6_addr, 16);
+        peer.port = ntohs(sin->sin6_port);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+void access_log_request(const char* line, size_t len)
+{
+    if (log_fd == -1)
+        return;
+
+    const char* sp   = memchr(line, ' ', len);
+    size_t      mlen = sp ? (size_t) (sp - line) : len;
+    const char* path = sp ? sp + 1 : line + len;
+    const char* end  = memchr(path, ' ', line + len - path);
+    size_t      plen = (end ? end : line + len) - path;
+
+    if (plen > HEADER_MAX)
+        plen = HEADER_MAX;
+
+    cur.method  = parse_method(line, mlen);
+    cur.path_id = plen ? path_hash(path, plen) : 0;
+
+    if (cur.path_id && path_claim(cur.path_id))
+        write_path(cur.path_id, path, plen);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void access_log_write(const TraceRecord* r)
+{
+    if (log_fd == -1)
+        return;
+
+    AccessRecord a = peer;  // Address and port
+
+    a.kind      = ACCESS_KIND_REQUEST;
+    a.method    = cur.method;
+    a.status    = r->status;
+    a.bytes_in  = r->bytes_in < UINT16_MAX ? r->bytes_in : UINT16_MAX;
+    a.time_us   = r->time_us;
+    a.path_id   = cur.path_id;
+    a.bytes_out = r->bytes_out;
+
+    a.span_us[ACCESS_WAIT] = span(r, TRACE_ACCEPT, TRACE_FIRST_BYTE);
+    a.span_us[ACCESS_READ] = span(r, TRACE_FIRST_BYTE, TRACE_PARSED);
+
+    if (r->phase_us[TRACE_HEADERS] != TRACE_NONE)
+    {
+        a.span_us[ACCESS_HANDLE] = span(r, TRACE_PARSED, TRACE_HEADERS);
+        a.span_us[ACCESS_SEND]   = span(r, TRACE_HEADERS, TRACE_LAST_BYTE);
+    }
+    else  // Nothing sent by us (HTTP/2): all handling
+        a.span_us[ACCESS_HANDLE] = span(r, TRACE_PARSED, TRACE_LAST_BYTE);
+
+    buffer_add(&a, sizeof a);
+    STAT_ADD(access_records, 1);
+    memset(&cur, 0, sizeof cur);
+
+    if (now_ms() - buffered_since >= ACCESS_FLUSH_MS)
+        access_log_flush();
+}
+
+/* -------------------------------------------------------------------------- */
+
+void access_log_flush()
+{
+    if (log_fd == -1 || buffered == 0)
+        return;
+
+    ssize_t sent = write(log_fd, buffer, buffered);  // One write, so batches don't mix
+    if (sent != (ssize_t) buffered)
+        wlog(WARNING,
+             "Failed to write the access log: %s.",
+             sent == -1 ? strerror(errno) : "short write");
+
+    STAT_ADD(access_writes, 1);
+    buffered = 0;
+}
@@ -0,0 +1,172 @@
+#include "arena.h"
+#include "config.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Alignment of every allocation. */
+#define ARENA_ALIGN 16
+
+/** @brief An extra block, for a request that outgrew the arena. */
+typedef struct ArenaOverflowStruct
+{
+    /** @brief The block allocated before it, NULL for the first one. */
+    struct ArenaOverflowStruct* next;
+    /** @brief Bytes in data. */
+    size_t size;
+    /** @brief Bytes of data handed out. */
+    size_t used;
+    /** @brief The memory handed out. */
+    _Alignas(ARENA_ALIGN) char data[];
+} ArenaOverflow;
+
+/** @brief The arena block, allocated before the first fork(). */
+static char* block = NULL;
+
+/** @brief Size of the block, ARENA_SIZE when it was allocated. */
+static size_t block_size = 0;
+
+/** @brief Bytes of the block handed out since the last reset. */
+static size_t used = 0;
+
+/** @brief Overflow blocks of the current request, the newest first. */
+static ArenaOverflow* overflow = NULL;
+
+/** @brief Bytes handed out from overflow blocks since the last reset. */
+static size_t spilled = 0;
+
+/* -------------------------------------------------------------------------- */
+
+int arena_startup()
+{
+    block_size = ARENA_SIZE & ~(ARENA_ALIGN - 1);  // So what is left is always whole units
+    block      = malloc(block_size);
+
+    if (!block)
+    {
+        wlog(FATAL, "Failed to allocate the %zu byte request arena.", block_size);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void arena_shutdown()
+{
+    arena_reset();
+    free(block);
+    block      = NULL;
+    block_size = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void* arena_alloc(size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (size <= block_size - used)
+    {
+        void* p = block + used;
+        used += size;
+        return p;
+    }
+
+    if (overflow && size <= overflow->size - overflow->used)
+    {
+        void* p = overflow->data + overflow->used;
+        overflow->used += size;
+        spilled += size;
+        return p;
+    }
+
+    size_t         cap = size > block_size ? size : block_size;
+    ArenaOverflow* o   = malloc(sizeof *o + cap);
+    if (!o)
+    {
+        wlog(ERROR, "Failed to grow the request arena by %zu bytes.", cap);
+        return NULL;
+    }
+
+    o->next  = overflow;
+    o->size  = cap;
+    o->used  = size;
+    overflow = o;
+    spilled += size;
+    STAT_ADD(arena_overflows, 1);
+    return o->data;
+}
+
+/* -------------------------------------------------------------------------- */
+
+char* arena_strndup(const char* s, size_t len)
+{
+    char* copy = arena_alloc(len + 1);
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/* -------------------------------------------------------------------------- */
+
+char* arena_printf(const char* format, ...)
+{
+    va_list args, retry;
+    va_start(args, format);
+    va_copy(retry, args);
+
+    // Straight into the block when it fits, formatted again once the length is known if not.
+    // The room is a multiple of ARENA_ALIGN, so what fits is handed out from the same place
+    size_t room = block_size - used;
+    int    len  = vsnprintf(block + used, room, format, args);
+    char*  s    = NULL;
+
+    if (len >= 0 && (size_t) len < room)
+        s = arena_alloc(len + 1);
+    else if (len >= 0 && (s = arena_alloc(len + 1)))
+        vsnprintf(s, len + 1, format, retry);
+
+    va_end(retry);
+    va_end(args);
+    return s;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void arena_reset()
+{
+    unsigned long total = used + spilled;
+    if (total == 0)
+        return;
+
+    STAT_ADD(arena_requests, 1);
+    STAT_ADD(arena_bytes, total);
+
+    unsigned long peak = STAT_GET(arena_peak);  // Gauge of the largest request so far
+    while (total > peak &&
+           !atomic_compare_exchange_weak_explicit(
+               &stats->arena_peak, &peak, total, memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    while (overflow)
+    {
+        ArenaOverflow* next = overflow->next;
+        free(overflow);
+        overflow = next;
+    }
+
+    used    = 0;
+    spilled = 0;
+}
@@ -0,0 +1,121 @@
+#include "bufpool.h"
+#include "config.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Number of size classes. */
+#define BUFPOOL_CLASSES 3
+
+/** @brief Bytes in front of each buffer, a cache line: buffers start on one too. */
+#define BUFPOOL_HEADER 64
+
+/** @brief What the pool knows of a buffer, kept in front of it. */
+typedef struct BufHeaderStruct
+{
+    /** @brief Next buffer on the free list. */
+    struct BufHeaderStruct* next;
+    /** @brief Size class of the buffer. */
+    int cls;
+} BufHeader;
+
+/** @brief Bytes of each size class. */
+static const size_t class_size[BUFPOOL_CLASSES] = {BUFPOOL_SMALL, BUFPOOL_MEDIUM, BUFPOOL_LARGE};
+
+/** @brief Most buffers kept on the free list of each class, fewer for the larger ones. */
+static const size_t class_keep[BUFPOOL_CLASSES] = {4, 2, 1};
+
+/** @brief Buffers given back, by class. */
+static BufHeader* free_list[BUFPOOL_CLASSES];
+
+/** @brief Number of buffers on each free list. */
+static size_t kept[BUFPOOL_CLASSES];
+
+/** @brief Bytes of the buffers this process holds, in use or kept. */
+static size_t held = 0;
+
+/* -------------------------------------------------------------------------- */
+
+void* bufpool_get(size_t want, size_t* size)
+{
+    int top = 0;  // Class of BUFFER_SIZE, the smallest one if it is below it
+    while (top + 1 < BUFPOOL_CLASSES && class_size[top + 1] <= (size_t) BUFFER_SIZE)
+        top++;
+
+    int cls = 0;
+    while (cls < top && class_size[cls] < want)
+        cls++;
+
+    STAT_ADD(buffer_gets, 1);
+
+    BufHeader* h = free_list[cls];
+    if (h)
+    {
+        free_list[cls] = h->next;
+        kept[cls]--;
+    }
+    else
+    {
+        h = aligned_alloc(BUFPOOL_HEADER, BUFPOOL_HEADER + class_size[cls]);
+        if (!h)
+        {
+            wlog(ERROR, "Failed to allocate a %zu byte I/O buffer.", class_size[cls]);
+            return NULL;
+        }
+
+        h->cls = cls;
+        held += class_size[cls];
+        STAT_ADD(buffer_allocs, 1);
+
+        unsigned long peak = STAT_GET(buffer_peak);  // Gauge of the most any process held
+        while (held > peak &&
+               !atomic_compare_exchange_weak_explicit(
+                   &stats->buffer_peak, &peak, held, memory_order_relaxed, memory_order_relaxed))
+            ;
+    }
+
+    *size = class_size[cls];
+    return (char*) h + BUFPOOL_HEADER;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void bufpool_put(void* buff)
+{
+    if (!buff)
+        return;
+
+    BufHeader* h = (BufHeader*) ((char*) buff - BUFPOOL_HEADER);
+    if (kept[h->cls] == class_keep[h->cls])
+    {
+        held -= class_size[h->cls];
+        free(h);
+        return;
+    }
+
+    h->next           = free_list[h->cls];
+    free_list[h->cls] = h;
+    kept[h->cls]++;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void bufpool_shutdown()
+{
+    for (int cls = 0; cls < BUFPOOL_CLASSES; cls++)
+    {
+        while (free_list[cls])
+        {
+            BufHeader* next = free_list[cls]->next;
+            free(free_list[cls]);
+            free_list[cls] = next;
+        }
+
+        held -= kept[cls] * class_size[cls];
+        kept[cls] = 0;
+    }
+}
@@ -0,0 +1,107 @@
+#include "capture.h"
+#include "config.h"
+#include "logging.h"
+#include "shm.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+_Static_assert(sizeof(CaptureRecord) == 16, "capture records are 16 bytes");
+
+/** @brief Capture file, -1 if CAPTURE_FILE is empty. Appended to by every child. */
+static int capture_fd = -1;
+
+/** @brief Requests seen by every process, in shared memory: one in CAPTURE_SAMPLE is captured. */
+static atomic_ulong* seen = NULL;
+
+/* -------------------------------------------------------------------------- */
+
+int capture_startup()
+{
+    if (CAPTURE_FILE[0] == '\0')
+    {
+        wlog(DEBUG, "Traffic capture disabled.");
+        return EXIT_SUCCESS;
+    }
+
+    seen = shm_alloc("capture sampling counter", sizeof *seen);
+    if (!seen)
+        return EXIT_FAILURE;
+
+    capture_fd = open(CAPTURE_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (capture_fd == -1)
+    {
+        wlog(ERROR, "Failed to open %s: %s.", CAPTURE_FILE, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    if (fstat(capture_fd, &st) == 0 && st.st_size == 0)  // New file, starts with its header
+    {
+        CaptureFileHeader header = {.endian = 0x01020304, .record_size = sizeof(CaptureRecord)};
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof header.magic);
+        if (write(capture_fd, &header, sizeof header) != sizeof header)
+            wlog(WARNING, "Failed to write capture header: %s.", strerror(errno));
+    }
+
+    wlog(INFO, "Capturing one in %d requests to %s.", CAPTURE_SAMPLE, CAPTURE_FILE);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void capture_shutdown()
+{
+    if (capture_fd != -1)
+        close(capture_fd);
+
+    shm_free(seen, sizeof *seen);
+    capture_fd = -1;
+    seen       = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void capture_request(const char* head, size_t len, int protocol)
+{
+    if (capture_fd == -1 ||
+        atomic_fetch_add_explicit(seen, 1, memory_order_relaxed) % CAPTURE_SAMPLE != 0)
+        return;
+
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    CaptureRecord record = {
+        .time_us    = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+        .connection = getpid(),
+        .length     = len,
+        .protocol   = protocol,
+    };
+
+    static const char padding[8] = {0};
+    struct iovec      iov[3]     = {
+        {.iov_base = &record, .iov_len = sizeof record},
+        {.iov_base = (void*) head, .iov_len = len},
+        {.iov_base = (void*) padding, .iov_len = (8 - len % 8) % 8},
+    };
+
+    // One call, so records of different children don't mix
+    ssize_t total = sizeof record + len + iov[2].iov_len;
+    if (writev(capture_fd, iov, 3) != total)
+        wlog(WARNING, "Failed to write captured request: %s.", strerror(errno));
+    else
+        STAT_ADD(captured_requests, 1);
+}
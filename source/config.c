@@ -16,168 +16,1133 @@ int      MAX_CLIENTS   = -1;
 char*    LOG_FILE_NAME = "";
 char*    ROOT_DIR      = "";
 char*    FAVICON_FILE  = "";
+int      PATH_INDEX    = -1;
+int      MAX_INFLIGHT  = -1;
+int      SHED_MODE     = -1;
+int      RETRY_AFTER   = -1;
+char*    STATS_PATH    = "";
+int      HEADER_TIMEOUT    = -1;
+int      SEND_TIMEOUT      = -1;
+int      KEEPALIVE_TIMEOUT = -1;
+int      DRAIN_TIMEOUT     = -1;
+int      RATE_LIMIT        = -1;
+int      RATE_BURST        = -1;
+int      RATE_LIMIT_BYTES  = -1;
+int      DEFER_ACCEPT      = -1;
+int      FASTOPEN          = -1;
+int      NODELAY           = -1;
+int      SNDBUF            = -1;
+int      RCVBUF            = -1;
+char*    PROXY_UPSTREAM    = "";
+int      PROXY_POOL        = -1;
+int      PROXY_CACHE_MB    = -1;
+char*    PROXY_CACHE_DIR   = "";
+int      PROXY_DISK_MB     = -1;
+int      PROXY_STALE       = -1;
+int      PROXY_REWRITE     = -1;
+int      HTTP2             = -1;
+int      HTTP2_STREAMS     = -1;
+int      TLS_PORT          = -1;
+char*    TLS_CERT          = "";
+char*    TLS_KEY           = "";
+int      TLS_TICKET_ROTATE = -1;
+int      KTLS              = -1;
+int      SCHED_QUANTUM     = -1;
+int      BANDWIDTH         = -1;
+int      BANDWIDTH_CONN    = -1;
+int      SLOW_MS           = -1;
+char*    SLOW_LOG          = "";
+char*    TRACE_FILE        = "";
+int      TRACE_SAMPLE      = -1;
+char*    ACCESS_LOG        = "";
+char*    CAPTURE_FILE      = "";
+int      CAPTURE_SAMPLE    = -1;
+int      LOG_MAX_MB        = -1;
+int      LOG_ROTATE        = -1;
+int      LOG_COMPRESS      = -1;
+int      LOG_RATE          = -1;
+int      LOG_SAMPLE        = -1;
+int      LOG_DEGRADE_US    = -1;
+int      WARMUP_THREADS    = -1;
+char*    WARMUP_PRELOAD    = "";
+int      WARMUP_DEADLINE   = -1;
+int      ARENA_SIZE        = -1;
+char*    CONFIG_FILE       = "";
+int      CONFIG_VERSION    = 0;
+char*    LISTEN[LISTEN_MAX];
+int      LISTEN_COUNT      = 0;
+
+/** @brief Command line of the server, kept to read the config file again on reload. */
+static int          cmd_argc = 0;
+static char const** cmd_argv = NULL;
+
+/** @brief A setting, so config_reload() can compare and restore its value. */
+typedef struct ConfigVarStruct
+{
+    /** @brief Option that sets it, without the leading dashes. */
+    const char* name;
+    /** @brief The setting, if it's a number. */
+    int* number;
+    /** @brief The setting, if it's a string. */
+    char** string;
+    /** @brief Non-zero if a new value applies without restarting. */
+    int reload;
+} ConfigVar;
+
+#define CFG_INT(name, var, reload) {name, (int*) &var, NULL, reload}
+#define CFG_STR(name, var, reload) {name, NULL, &var, reload}
+
+/**
+ * @brief Every setting but LISTEN.
+ * Reloadable settings are read when they're used, by the main process or by
+ * children forked after the reload. The others were used to set something up
+ * at startup: sockets, shared memory, pre-rendered pages, open files. */
+static const ConfigVar vars[] = {
+    CFG_INT("port", SERVER_PORT, 0),
+    CFG_INT("buffer-size", BUFFER_SIZE, 1),
+    CFG_INT("log-level", LOG_LEVEL, 1),
+    CFG_INT("backlog", BACKLOG, 0),
+    CFG_INT("max-clients", MAX_CLIENTS, 0),
+    CFG_STR("favicon", FAVICON_FILE, 0),
+    CFG_STR("root", ROOT_DIR, 0),
+    CFG_STR("log-file", LOG_FILE_NAME, 0),
+    CFG_INT("path-index", PATH_INDEX, 0),
+    CFG_INT("max-inflight", MAX_INFLIGHT, 1),
+    CFG_INT("shed-mode", SHED_MODE, 1),
+    CFG_INT("retry-after", RETRY_AFTER, 0),
+    CFG_STR("stats-path", STATS_PATH, 1),
+    CFG_INT("header-timeout", HEADER_TIMEOUT, 1),
+    CFG_INT("send-timeout", SEND_TIMEOUT, 1),
+    CFG_INT("keepalive-timeout", KEEPALIVE_TIMEOUT, 1),
+    CFG_INT("drain-timeout", DRAIN_TIMEOUT, 1),
+    CFG_INT("rate-limit", RATE_LIMIT, 1),
+    CFG_INT("rate-burst", RATE_BURST, 1),
+    CFG_INT("rate-limit-bytes", RATE_LIMIT_BYTES, 1),
+    CFG_INT("defer-accept", DEFER_ACCEPT, 0),
+    CFG_INT("fastopen", FASTOPEN, 0),
+    CFG_INT("nodelay", NODELAY, 1),
+    CFG_INT("sndbuf", SNDBUF, 0),
+    CFG_INT("rcvbuf", RCVBUF, 0),
+    CFG_STR("proxy", PROXY_UPSTREAM, 0),
+    CFG_INT("proxy-pool", PROXY_POOL, 0),
+    CFG_INT("proxy-cache", PROXY_CACHE_MB, 0),
+    CFG_STR("proxy-cache-dir", PROXY_CACHE_DIR, 0),
+    CFG_INT("proxy-disk", PROXY_DISK_MB, 1),
+    CFG_INT("proxy-stale", PROXY_STALE, 1),
+    CFG_INT("proxy-rewrite", PROXY_REWRITE, 1),
+    CFG_INT("http2", HTTP2, 1),
+    CFG_INT("http2-streams", HTTP2_STREAMS, 1),
+    CFG_INT("tls-port", TLS_PORT, 0),
+    CFG_STR("tls-cert", TLS_CERT, 0),
+    CFG_STR("tls-key", TLS_KEY, 0),
+    CFG_INT("tls-ticket-rotate", TLS_TICKET_ROTATE, 0),
+    CFG_INT("ktls", KTLS, 0),
+    CFG_INT("sched-quantum", SCHED_QUANTUM, 1),
+    CFG_INT("bandwidth", BANDWIDTH, 1),
+    CFG_INT("bandwidth-conn", BANDWIDTH_CONN, 1),
+    CFG_INT("slow-ms", SLOW_MS, 0),
+    CFG_STR("slow-log", SLOW_LOG, 0),
+    CFG_STR("trace-file", TRACE_FILE, 0),
+    CFG_INT("trace-sample", TRACE_SAMPLE, 1),
+    CFG_STR("access-log", ACCESS_LOG, 0),
+    CFG_STR("capture", CAPTURE_FILE, 0),
+    CFG_INT("capture-sample", CAPTURE_SAMPLE, 1),
+    CFG_INT("log-max-size", LOG_MAX_MB, 1),
+    CFG_INT("log-rotate", LOG_ROTATE, 1),
+    CFG_INT("log-compress", LOG_COMPRESS, 1),
+    CFG_INT("log-rate", LOG_RATE, 1),
+    CFG_INT("log-sample", LOG_SAMPLE, 1),
+    CFG_INT("log-degrade-us", LOG_DEGRADE_US, 1),
+    CFG_INT("warmup-threads", WARMUP_THREADS, 0),
+    CFG_STR("warmup-preload", WARMUP_PRELOAD, 0),
+    CFG_INT("warmup-deadline", WARMUP_DEADLINE, 0),
+    CFG_INT("arena-size", ARENA_SIZE, 0),
+    CFG_STR("config", CONFIG_FILE, 0),
+};
+
+/** @brief Number of entries in vars. */
+#define VAR_COUNT (sizeof vars / sizeof *vars)
+
+/** @brief A saved value of a setting of vars. */
+typedef union ConfigValueUnion
+{
+    int   number;
+    char* string;
+} ConfigValue;
+
+/* -------------------------------------------------------------------------- */
+
+int parse_arg(const char* arg, const char* value, int* target)
+{
+    if (!value)
+    {
+        fprintf(stderr, "Expected value after %s.\n", arg);
+        return EXIT_FAILURE;
+    }
+
+    errno   = 0;  // strtol doesn't set errno to 0 on success because it sucks
+    *target = strtol(value, NULL, 10);
+
+    if (errno != 0)
+    {
+        fprintf(stderr, "Invalid number! (%s) errno: %d %s.\n", value, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Keep a string read from the config file for the life of the process.
+ * Settings point to it, also after a reload: each distinct string is kept once.
+ * @param s The string.
+ * @return The kept copy, NULL if out of memory. */
+static const char* config_string(const char* s)
+{
+    static char** strings = NULL;
+    static size_t count   = 0;
+
+    for (size_t i = 0; i < count; i++)
+        if (strcmp(strings[i], s) == 0)
+            return strings[i];
+
+    char** grown = realloc(strings, (count + 1) * sizeof *strings);
+    if (!grown)
+        return NULL;
+    strings = grown;
+
+    if (!(strings[count] = strdup(s)))
+        return NULL;
+    return strings[count++];
+}
+
+/**
+ * @brief Put the options of the config file given with --config in front of
+ * the command line, which overrides them.
+ * The file has an option per line: its long name without the dashes, then its
+ * value, e.g. "log-level 1". Empty lines and lines starting with '#' are
+ * skipped.
+ * @param[in,out] argc The number of command line arguments.
+ * @param[in,out] argv The command line arguments.
+ * @return EXIT_SUCCESS on success (or without --config), EXIT_FAILURE on failure. */
+static int config_file_args(int* argc, char const** argv[])
+{
+    static char const** args = NULL;  // Replaced on each call, the strings are kept
+    static size_t       cap  = 0;
+
+    const char* path = NULL;
+    for (int i = 1; i + 1 < *argc; i++)
+        if (strcmp((*argv)[i], "--config") == 0)
+            path = (*argv)[i + 1];
+
+    if (!path)
+        return EXIT_SUCCESS;
+
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open config file %s: %s.\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int  count = 1;
+    char line[1024];
+    int  lineno = 0;
+    int  status = EXIT_SUCCESS;
+
+    while (status == EXIT_SUCCESS && fgets(line, sizeof line, f))
+    {
+        lineno++;
+        char* name = line + strspn(line, " \t");
+        name[strcspn(name, "\r\n")] = '\0';
+        if (name[0] == '\0' || name[0] == '#')
+            continue;
+
+        char* value = name + strcspn(name, " \t");
+        if (*value)
+            *value++ = '\0';
+        value += strspn(value, " \t");
+        char* end = value + strlen(value);
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
+
+        if (value[0] == '\0')
+        {
+            fprintf(stderr, "Expected value after %s in %s:%d.\n", name, path, lineno);
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if ((size_t) (count + 2 + *argc) > cap)  // Room for this line and the command line
+        {
+            size_t       grown_cap = 2 * (count + 2 + *argc);
+            char const** grown     = realloc(args, grown_cap * sizeof *args);
+            if (!grown)
+            {
+                status = EXIT_FAILURE;
+                break;
+            }
+            args = grown;
+            cap  = grown_cap;
+        }
+
+        char option[128];
+        snprintf(option, sizeof option, "%s%s", name[0] == '-' ? "" : "--", name);
+        args[count]     = config_string(option);
+        args[count + 1] = config_string(value);
+        if (!args[count] || !args[count + 1])
+            status = EXIT_FAILURE;
+        count += 2;
+    }
+    fclose(f);
+
+    if (status == EXIT_FAILURE)
+    {
+        fprintf(stderr, "Failed to read config file %s.\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if ((size_t) (count + *argc) > cap)  // An empty file
+    {
+        char const** grown = realloc(args, (count + *argc) * sizeof *args);
+        if (!grown)
+            return EXIT_FAILURE;
+        args = grown;
+        cap  = count + *argc;
+    }
+
+    args[0] = (*argv)[0];
+    for (int i = 1; i < *argc; i++)  // Then the command line
+        args[count++] = (*argv)[i];
+
+    *argc = count;
+    *argv = args;
+    return EXIT_SUCCESS;
+}
 
 /* -------------------------------------------------------------------------- */
 
-int parse_arg(const char* arg, const char* value, int* target)
-{
-    if (!value)
+int config_server(int argc, char const* argv[])
+{
+    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    {
+        config_help();
+        return EXIT_FAILURE;
+    }
+
+    if (!cmd_argv)  // First call, from main()
+    {
+        cmd_argc = argc;
+        cmd_argv = argv;
+    }
+
+    if (config_file_args(&argc, &argv))
+        return EXIT_FAILURE;
+
+    // Default values:
+    SERVER_PORT       = 0;     // Passing port 0 to socket() gives a random port
+    BUFFER_SIZE       = 1048576;  // In bytes, the largest I/O buffer
+    LOG_LEVEL         = INFO;  // Messages of this level and above will be shown
+    int log_level_int = 2;
+    int port_given    = 0;  // Without it, only the --listen listeners are opened
+    BACKLOG           = 511;   // Connection queue size, capped by net.core.somaxconn
+    MAX_CLIENTS       = 256;   // Connections handled at once, past this we shed load
+    LOG_FILE_NAME     = "server.log";
+    ROOT_DIR          = "data";
+    FAVICON_FILE      = "favicon.png";
+    PATH_INDEX        = 1;
+    MAX_INFLIGHT      = 0;     // Bytes, 0 = unlimited
+    SHED_MODE         = 0;     // Leave new connections queued when overloaded
+    RETRY_AFTER       = 1;     // Seconds
+    STATS_PATH        = "";     // Counters aren't for every client, opt in
+    HEADER_TIMEOUT    = 10000;  // Milliseconds
+    SEND_TIMEOUT      = 30000;
+    KEEPALIVE_TIMEOUT = 5000;
+    DRAIN_TIMEOUT     = 10000;
+    RATE_LIMIT        = 0;      // Requests per second per client, 0 = unlimited
+    RATE_BURST        = 0;      // 0 = same as RATE_LIMIT
+    RATE_LIMIT_BYTES  = 0;      // Bytes per second per client, 0 = unlimited
+    DEFER_ACCEPT      = 0;      // Seconds, 0 = off
+    FASTOPEN          = 0;      // Queue length, 0 = off
+    NODELAY           = 0;
+    SNDBUF            = 0;      // Bytes, 0 = kernel default
+    RCVBUF            = 0;
+    PROXY_UPSTREAM    = "";     // Empty = serve files from ROOT_DIR
+    PROXY_POOL        = 8;      // Upstream connections
+    PROXY_CACHE_MB    = 64;
+    PROXY_CACHE_DIR   = "";     // Empty = large responses are not cached
+    PROXY_DISK_MB     = 1024;
+    PROXY_STALE       = 60;     // Unless the upstream says otherwise
+    PROXY_REWRITE     = 1;
+    HTTP2             = 1;
+    HTTP2_STREAMS     = 100;    // Streams a client may open at once on one connection
+    TLS_PORT          = 0;      // 0 = no TLS listener
+    TLS_CERT          = "";
+    TLS_KEY           = "";     // Empty = in the certificate file
+    TLS_TICKET_ROTATE = 3600;   // Seconds
+    KTLS              = 1;
+    SCHED_QUANTUM     = 65536;  // Bytes per connection per round
+    BANDWIDTH         = 0;      // Bytes per second, 0 = unlimited
+    BANDWIDTH_CONN    = 0;
+    SLOW_MS           = 0;      // Milliseconds, 0 = no slow log
+    SLOW_LOG          = "slow.log";
+    TRACE_FILE        = "";     // Empty = no trace
+    TRACE_SAMPLE      = 100;    // One in 100 requests
+    ACCESS_LOG        = "";     // Empty = no access log
+    CAPTURE_FILE      = "";     // Empty = no capture
+    CAPTURE_SAMPLE    = 1;      // Every request
+    LOG_MAX_MB        = 0;      // 0 = no size limit
+    LOG_ROTATE        = 0;      // Seconds, 0 = no age limit
+    LOG_COMPRESS      = 0;
+    LOG_RATE          = 0;      // Messages per second per call site, 0 = unlimited
+    LOG_SAMPLE        = 1;      // Every connection
+    LOG_DEGRADE_US    = 0;      // Microseconds, 0 = off
+    WARMUP_THREADS    = 0;      // 0 = no warm-up
+    WARMUP_PRELOAD    = "";     // Empty = nothing read ahead
+    WARMUP_DEADLINE   = 10000;  // Milliseconds
+    ARENA_SIZE        = 16384;  // Bytes
+    CONFIG_FILE       = "";     // Empty = command line only
+    LISTEN_COUNT      = 0;
+
+    if (argc == 1)
+    {
+        fprintf(stderr, "Using default arguments: ");
+        server_config_show();
+        return EXIT_SUCCESS;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)  // Check if there's a next argument
+        {
+            fprintf(stderr, "Expected value after %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        // ( ¬A or ¬B ) === ¬( A and B )
+        if ((strcmp("-p", argv[i]) && strcmp("--port", argv[i])) == 0)
+        {
+            i++;
+            port_given = 1;
+            if (parse_arg(argv[i - 1], argv[i], &SERVER_PORT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((strcmp("-b", argv[i]) && strcmp("--buffer-size", argv[i])) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &BUFFER_SIZE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((strcmp("-l", argv[i]) && strcmp("--log-level", argv[i])) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &log_level_int))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((strcmp("-c", argv[i]) && strcmp("--backlog", argv[i])) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &BACKLOG))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((strcmp("-m", argv[i]) && strcmp("--max-clients", argv[i])) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &MAX_CLIENTS))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((strcmp("-i", argv[i]) && strcmp("--favicon", argv[i])) == 0)
+        {
+            FAVICON_FILE = (char*) argv[++i];
+        }
+        else if ((strcmp("-r", argv[i]) && strcmp("--root", argv[i])) == 0)
+        {
+            ROOT_DIR = (char*) argv[++i];
+        }
+        else if ((strcmp("-f", argv[i]) && strcmp("--log-file", argv[i])) == 0)
+        {
+            LOG_FILE_NAME = (char*) argv[++i];
+        }
+        else if (strcmp("--path-index", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &PATH_INDEX))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--max-inflight", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &MAX_INFLIGHT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--shed-mode", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &SHED_MODE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--retry-after", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &RETRY_AFTER))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--stats-path", argv[i]) == 0)
+        {
+            STATS_PATH = (char*) argv[++i];
+        }
+        else if (strcmp("--header-timeout", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &HEADER_TIMEOUT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--send-timeout", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &SEND_TIMEOUT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--keepalive-timeout", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &KEEPALIVE_TIMEOUT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--drain-timeout", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &DRAIN_TIMEOUT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--rate-limit", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &RATE_LIMIT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--rate-burst", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &RATE_BURST))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--rate-limit-bytes", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &RATE_LIMIT_BYTES))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--defer-accept", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &DEFER_ACCEPT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--fastopen", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &FASTOPEN))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--nodelay", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &NODELAY))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--sndbuf", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &SNDBUF))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--rcvbuf", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &RCVBUF))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--proxy", argv[i]) == 0)
+        {
+            PROXY_UPSTREAM = (char*) argv[++i];
+        }
+        else if (strcmp("--proxy-pool", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &PROXY_POOL))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--proxy-cache", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &PROXY_CACHE_MB))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--proxy-cache-dir", argv[i]) == 0)
+        {
+            PROXY_CACHE_DIR = (char*) argv[++i];
+        }
+        else if (strcmp("--proxy-disk", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &PROXY_DISK_MB))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--proxy-stale", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &PROXY_STALE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--proxy-rewrite", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &PROXY_REWRITE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--http2", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &HTTP2))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--http2-streams", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &HTTP2_STREAMS))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--tls-port", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &TLS_PORT))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--tls-cert", argv[i]) == 0)
+        {
+            TLS_CERT = (char*) argv[++i];
+        }
+        else if (strcmp("--tls-key", argv[i]) == 0)
+        {
+            TLS_KEY = (char*) argv[++i];
+        }
+        else if (strcmp("--tls-ticket-rotate", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &TLS_TICKET_ROTATE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--listen", argv[i]) == 0)
+        {
+            if (LISTEN_COUNT == LISTEN_MAX)
+            {
+                fprintf(stderr, "At most %d --listen options are allowed.\n", LISTEN_MAX);
+                return EXIT_FAILURE;
+            }
+            LISTEN[LISTEN_COUNT++] = (char*) argv[++i];
+        }
+        else if (strcmp("--ktls", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &KTLS))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--sched-quantum", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &SCHED_QUANTUM))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--bandwidth", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &BANDWIDTH))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--bandwidth-conn", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &BANDWIDTH_CONN))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--slow-ms", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &SLOW_MS))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--slow-log", argv[i]) == 0)
+        {
+            SLOW_LOG = (char*) argv[++i];
+        }
+        else if (strcmp("--trace-file", argv[i]) == 0)
+        {
+            TRACE_FILE = (char*) argv[++i];
+        }
+        else if (strcmp("--trace-sample", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &TRACE_SAMPLE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--access-log", argv[i]) == 0)
+        {
+            ACCESS_LOG = (char*) argv[++i];
+        }
+        else if (strcmp("--capture", argv[i]) == 0)
+        {
+            CAPTURE_FILE = (char*) argv[++i];
+        }
+        else if (strcmp("--capture-sample", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &CAPTURE_SAMPLE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--log-max-size", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &LOG_MAX_MB))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--log-rotate", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &LOG_ROTATE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--log-compress", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &LOG_COMPRESS))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--log-rate", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &LOG_RATE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--log-sample", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &LOG_SAMPLE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--log-degrade-us", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &LOG_DEGRADE_US))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--warmup-threads", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &WARMUP_THREADS))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--warmup-preload", argv[i]) == 0)
+        {
+            WARMUP_PRELOAD = (char*) argv[++i];
+        }
+        else if (strcmp("--warmup-deadline", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &WARMUP_DEADLINE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--arena-size", argv[i]) == 0)
+        {
+            i++;
+            if (parse_arg(argv[i - 1], argv[i], &ARENA_SIZE))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp("--config", argv[i]) == 0)
+        {
+            CONFIG_FILE = (char*) argv[++i];  // Already read by config_file_args()
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* --------------------- Check validity of user args -------------------- */
+
+    if (BUFFER_SIZE <= 0)
+    {
+        fprintf(stderr, "Buffer size must be greater than 0.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (LISTEN_COUNT > 0 && !port_given)
+        SERVER_PORT = -1;  // No listener on --port
+
+    if (SERVER_PORT > 0 && (SERVER_PORT < 1024 || SERVER_PORT > 65535))
+    {
+        fprintf(stderr,
+                "Server port not allowed: %d. "
+                "Port must be in range [1024, 65535]\n",
+                SERVER_PORT);
+        return EXIT_FAILURE;
+    }
+
+    if (log_level_int < 0 || log_level_int > 5)
+    {
+        fprintf(stderr,
+                "Unknown / invalid log level: %d. "
+                "Known log levels in range [0, 5] (0=TRACE, 5=FATAL)\n",
+                log_level_int);
+        return EXIT_FAILURE;
+    }
+
+    if (BACKLOG < 1 || BACKLOG > 65535)
+    {
+        fprintf(stderr,
+                "Backlog size out of allowed range: %d. "
+                "Valid values in range [1, 65535]\n",
+                BACKLOG);
+        return EXIT_FAILURE;
+    }
+
+    if (PATH_INDEX != 0 && PATH_INDEX != 1)
+    {
+        fprintf(stderr, "Path index must be either 0 (disabled) or 1 (enabled).\n");
+        return EXIT_FAILURE;
+    }
+
+    if (MAX_CLIENTS < 1)
+    {
+        fprintf(stderr, "Max clients must be a positive number.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (MAX_INFLIGHT < 0)
+    {
+        fprintf(stderr, "Max in-flight bytes must be 0 (unlimited) or a positive number.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (SHED_MODE != 0 && SHED_MODE != 1)
+    {
+        fprintf(stderr, "Shed mode must be either 0 (leave queued) or 1 (answer 503).\n");
+        return EXIT_FAILURE;
+    }
+
+    if (RETRY_AFTER < 0)
+    {
+        fprintf(stderr, "Retry-After seconds cannot be negative.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (STATS_PATH[0] != '\0' && STATS_PATH[0] != '/')
+    {
+        fprintf(stderr, "Stats path must be empty or start with '/'.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (HEADER_TIMEOUT <= 0 || SEND_TIMEOUT <= 0 || KEEPALIVE_TIMEOUT <= 0)
+    {
+        fprintf(stderr, "Timeouts must be positive numbers of milliseconds.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (DRAIN_TIMEOUT < 0)
+    {
+        fprintf(stderr, "Drain timeout must be 0 (don't wait) or a number of milliseconds.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (RATE_LIMIT < 0 || RATE_BURST < 0 || RATE_LIMIT_BYTES < 0)
+    {
+        fprintf(stderr, "Rate limits must be 0 (unlimited) or positive numbers.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (RATE_BURST == 0)
+        RATE_BURST = RATE_LIMIT;
+
+    if (RATE_LIMIT > 1000000 || RATE_BURST > 1000000)  // Tokens are kept in thousandths
+    {
+        fprintf(stderr, "Request rate and burst cannot exceed 1000000.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (DEFER_ACCEPT < 0 || FASTOPEN < 0 || SNDBUF < 0 || RCVBUF < 0)
+    {
+        fprintf(stderr, "Socket tuning values must be 0 (off / default) or positive numbers.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (NODELAY != 0 && NODELAY != 1)
+    {
+        fprintf(stderr, "Nodelay must be either 0 (disabled) or 1 (enabled).\n");
+        return EXIT_FAILURE;
+    }
+
+    if (PROXY_POOL < 0 || PROXY_POOL > 1024)
+    {
+        fprintf(stderr, "Upstream pool size must be in range [0, 1024].\n");
+        return EXIT_FAILURE;
+    }
+
+    if (PROXY_CACHE_MB < 0 || PROXY_CACHE_MB > 65536 || PROXY_DISK_MB < 0)
+    {
+        fprintf(stderr, "Proxy cache sizes must be 0 or positive (memory at most 65536 MB).\n");
+        return EXIT_FAILURE;
+    }
+
+    if (PROXY_STALE < 0)
+    {
+        fprintf(stderr, "Proxy stale time must be 0 or positive.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (PROXY_REWRITE != 0 && PROXY_REWRITE != 1)
+    {
+        fprintf(stderr, "Proxy rewrite must be either 0 (disabled) or 1 (enabled).\n");
+        return EXIT_FAILURE;
+    }
+
+    if (HTTP2 != 0 && HTTP2 != 1)
+    {
+        fprintf(stderr, "HTTP/2 must be either 0 (disabled) or 1 (enabled).\n");
+        return EXIT_FAILURE;
+    }
+
+    if (HTTP2_STREAMS < 1 || HTTP2_STREAMS > 1024)
+    {
+        fprintf(stderr, "HTTP/2 streams must be in range [1, 1024].\n");
+        return EXIT_FAILURE;
+    }
+
+    if (TLS_PORT != 0 && (TLS_PORT < 1024 || TLS_PORT > 65535 || TLS_PORT == SERVER_PORT))
     {
-        fprintf(stderr, "Expected value after %s.\n", arg);
+        fprintf(stderr,
+                "TLS port not allowed: %d. "
+                "Port must be in range [1024, 65535] and differ from the server port\n",
+                TLS_PORT);
         return EXIT_FAILURE;
     }
 
-    errno   = 0;  // strtol doesn't set errno to 0 on success because it sucks
-    *target = strtol(value, NULL, 10);
+    if (SERVER_PORT < 0 && TLS_PORT == 0 && LISTEN_COUNT == 0)
+    {
+        fprintf(stderr, "No listener: set --port, --tls-port or --listen.\n");
+        return EXIT_FAILURE;
+    }
 
-    if (errno != 0)
+    if (TLS_PORT != 0 && strcmp(TLS_CERT, "") == 0)
     {
-        fprintf(stderr, "Invalid number! (%s) errno: %d %s.\n", value, errno, strerror(errno));
+        fprintf(stderr, "A TLS certificate (--tls-cert) is required with --tls-port.\n");
         return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
-}
+    if (TLS_TICKET_ROTATE <= 0)
+    {
+        fprintf(stderr, "Ticket key rotation must be a positive number of seconds.\n");
+        return EXIT_FAILURE;
+    }
 
-/* -------------------------------------------------------------------------- */
+    if (KTLS != 0 && KTLS != 1)
+    {
+        fprintf(stderr, "kTLS must be either 0 (disabled) or 1 (enabled).\n");
+        return EXIT_FAILURE;
+    }
 
-int config_server(int argc, char const* argv[])
-{
-    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    if (SCHED_QUANTUM < 1024 || SCHED_QUANTUM > 16777216)
     {
-        config_help();
+        fprintf(stderr, "Scheduling quantum must be in range [1024, 16777216] bytes.\n");
         return EXIT_FAILURE;
     }
 
-    // Default values:
-    SERVER_PORT       = 0;     // Passing port 0 to socket() gives a random port
-    BUFFER_SIZE       = 1024;  // In bytes
-    LOG_LEVEL         = INFO;  // Messages of this level and above will be shown
-    int log_level_int = 2;
-    BACKLOG           = 5;     // Connection queue size
-    MAX_CLIENTS       = 10;
-    LOG_FILE_NAME     = "server.log";
-    ROOT_DIR          = "data";
-    FAVICON_FILE      = "favicon.png";
+    if (BANDWIDTH < 0 || BANDWIDTH_CONN < 0)
+    {
+        fprintf(stderr, "Bandwidth caps must be 0 (unlimited) or positive numbers.\n");
+        return EXIT_FAILURE;
+    }
 
-    if (argc == 1)
+    if (SLOW_MS < 0)
     {
-        fprintf(stderr, "Using default arguments: ");
-        server_config_show();
-        return EXIT_SUCCESS;
+        fprintf(stderr, "Slow request threshold must be 0 (off) or a positive number.\n");
+        return EXIT_FAILURE;
     }
 
-    for (int i = 1; i < argc; i++)
+    if (SLOW_MS > 0 && strcmp(SLOW_LOG, "") == 0)
     {
-        if (i + 1 >= argc)  // Check if there's a next argument
-        {
-            fprintf(stderr, "Expected value after %s.\n", argv[i]);
-            return EXIT_FAILURE;
-        }
-        // ( ¬A or ¬B ) === ¬( A and B )
-        if ((strcmp("-p", argv[i]) && strcmp("--port", argv[i])) == 0)
-        {
-            i++;
-            if (parse_arg(argv[i - 1], argv[i], &SERVER_PORT))
-            {
-                return EXIT_FAILURE;
-            }
-        }
-        else if ((strcmp("-b", argv[i]) && strcmp("--buffer-size", argv[i])) == 0)
-        {
-            i++;
-            if (parse_arg(argv[i - 1], argv[i], &BUFFER_SIZE))
-            {
-                return EXIT_FAILURE;
-            }
-        }
-        else if ((strcmp("-l", argv[i]) && strcmp("--log-level", argv[i])) == 0)
-        {
-            i++;
-            if (parse_arg(argv[i - 1], argv[i], &log_level_int))
-            {
-                return EXIT_FAILURE;
-            }
-        }
-        else if ((strcmp("-c", argv[i]) && strcmp("--backlog", argv[i])) == 0)
-        {
-            i++;
-            if (parse_arg(argv[i - 1], argv[i], &BACKLOG))
-            {
-                return EXIT_FAILURE;
-            }
-        }
-        else if ((strcmp(argv[1], "-m") && strcmp(argv[1], "--max-clients")) == 0)
-        {
-            i++;
-            if (parse_arg(argv[i - 1], argv[i], &MAX_CLIENTS))
-            {
-                return EXIT_FAILURE;
-            }
-        }
-        else if ((strcmp("-i", argv[i]) && strcmp("--favicon", argv[i])) == 0)
-        {
-            FAVICON_FILE = strdup(argv[++i]);
-        }
-        else if ((strcmp("-r", argv[i]) && strcmp("--root", argv[i])) == 0)
-        {
-            ROOT_DIR = strdup(argv[++i]);
-        }
-        else if ((strcmp("-f", argv[i]) && strcmp("--log-file", argv[i])) == 0)
-        {
-            LOG_FILE_NAME = strdup(argv[++i]);
-        }
-        else
-        {
-            fprintf(stderr, "Unknown option: %s.\n", argv[i]);
-            return EXIT_FAILURE;
-        }
+        fprintf(stderr, "Slow log file name cannot be empty.\n");
+        return EXIT_FAILURE;
     }
 
-    /* --------------------- Check validity of user args -------------------- */
+    if (TRACE_SAMPLE < 1)
+    {
+        fprintf(stderr, "Trace sampling must be a positive number.\n");
+        return EXIT_FAILURE;
+    }
 
-    if (BUFFER_SIZE <= 0)
+    if (CAPTURE_SAMPLE < 1)
     {
-        fprintf(stderr, "Buffer size must be greater than 0.\n");
+        fprintf(stderr, "Capture sampling must be a positive number.\n");
         return EXIT_FAILURE;
     }
 
-    if (SERVER_PORT != 0 && (SERVER_PORT < 1024 || SERVER_PORT > 65535))
+    if (strcmp(LOG_FILE_NAME, "") == 0)
     {
-        fprintf(stderr,
-                "Server port not allowed: %d. "
-                "Port must be in range [1024, 65535]\n",
-                SERVER_PORT);
+        fprintf(stderr, "Log file name cannot be empty.\n");
         return EXIT_FAILURE;
     }
 
-    if (log_level_int < 0 || log_level_int > 5)
+    if (LOG_MAX_MB < 0 || LOG_MAX_MB > 1 << 20)
     {
-        fprintf(stderr,
-                "Unknown / invalid log level: %d. "
-                "Known log levels in range [0, 5] (0=TRACE, 5=FATAL)\n",
-                log_level_int);
+        fprintf(stderr, "Log size limit must be in range [0, 1048576] MB.\n");
         return EXIT_FAILURE;
     }
 
-    if (BACKLOG < 1 || BACKLOG > 1024)
+    if (LOG_ROTATE < 0)
     {
-        fprintf(stderr,
-                "Backlog size out of allowed range: %d."
-                "Valid values in range [1, 1024]\n",
-                BACKLOG);
+        fprintf(stderr, "Log rotation interval must be 0 (off) or a positive number.\n");
         return EXIT_FAILURE;
     }
 
-    if (MAX_CLIENTS < 1)
+    if (LOG_COMPRESS != 0 && LOG_COMPRESS != 1)
     {
-        fprintf(stderr, "Max clients must be a positive number.\n");
+        fprintf(stderr, "Log compression must be either 0 (disabled) or 1 (enabled).\n");
         return EXIT_FAILURE;
     }
 
-    if (strcmp(LOG_FILE_NAME, "") == 0)
+    if (LOG_RATE < 0)
     {
-        fprintf(stderr, "Log file name cannot be empty.\n");
+        fprintf(stderr, "Log rate limit must be 0 (off) or a positive number.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (LOG_SAMPLE < 1)
+    {
+        fprintf(stderr, "Log sampling must be a positive number.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (LOG_DEGRADE_US < 0)
+    {
+        fprintf(stderr, "Log degrade threshold must be 0 (off) or a positive number.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (WARMUP_THREADS < 0 || WARMUP_THREADS > 64)
+    {
+        fprintf(stderr, "Warm-up threads must be in range [0, 64].\n");
+        return EXIT_FAILURE;
+    }
+
+    if (WARMUP_DEADLINE < 1)
+    {
+        fprintf(stderr, "Warm-up deadline must be a positive number.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (ARENA_SIZE < 1024 || ARENA_SIZE > 16777216)
+    {
+        fprintf(stderr, "Arena size must be in range [1024, 16777216].\n");
+        return EXIT_FAILURE;
+    }
+
+    if (WARMUP_PRELOAD[0] != '\0' && access(WARMUP_PRELOAD, R_OK) != 0)
+    {
+        fprintf(stderr, "Preload list does not exist (%s).\n", WARMUP_PRELOAD);
         return EXIT_FAILURE;
     }
 
@@ -217,17 +1182,201 @@ int config_server(int argc, char const* argv[])
 
 /* -------------------------------------------------------------------------- */
 
+/**
+ * @brief Write a setting of vars as text.
+ * @param[out] buf Where to write it.
+ * @param size Size of buf.
+ * @param var The setting.
+ * @param value Its value.
+ * @return buf. */
+static const char* var_text(char* buf, size_t size, const ConfigVar* var, ConfigValue value)
+{
+    if (var->string)
+        snprintf(buf, size, "\"%s\"", value.string);
+    else
+        snprintf(buf, size, "%d", value.number);
+    return buf;
+}
+
+/** @brief Read a setting of vars. */
+static ConfigValue var_get(const ConfigVar* var)
+{
+    return var->string ? (ConfigValue) {.string = *var->string}
+                       : (ConfigValue) {.number = *var->number};
+}
+
+/** @brief Set a setting of vars. */
+static void var_set(const ConfigVar* var, ConfigValue value)
+{
+    if (var->string)
+        *var->string = value.string;
+    else
+        *var->number = value.number;
+}
+
+/** @brief Whether two values of a setting of vars differ. */
+static int var_changed(const ConfigVar* var, ConfigValue a, ConfigValue b)
+{
+    return var->string ? strcmp(a.string, b.string) != 0 : a.number != b.number;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int config_reload()
+{
+    ConfigValue old[VAR_COUNT];
+    char*       old_listen[LISTEN_MAX];
+    int         old_listen_count = LISTEN_COUNT;
+    int         rate_was         = RATE_LIMIT || RATE_LIMIT_BYTES;
+    char        from[128], to[128];
+
+    for (size_t i = 0; i < VAR_COUNT; i++)
+        old[i] = var_get(&vars[i]);
+    memcpy(old_listen, LISTEN, sizeof LISTEN);
+
+    wlog(INFO, "Reloading config...");
+    if (config_server(cmd_argc, cmd_argv) == EXIT_FAILURE)  // Read the file again, validate
+    {
+        for (size_t i = 0; i < VAR_COUNT; i++)
+            var_set(&vars[i], old[i]);
+        memcpy(LISTEN, old_listen, sizeof LISTEN);
+        LISTEN_COUNT = old_listen_count;
+
+        wlog(ERROR, "Invalid config, keeping version %d.", CONFIG_VERSION);
+        return EXIT_FAILURE;
+    }
+
+    // Rate limiting keeps no table when it's off, it can't be turned on or off
+    int rate_now = RATE_LIMIT || RATE_LIMIT_BYTES;
+
+    int applied = 0, pending = 0;
+    for (size_t i = 0; i < VAR_COUNT; i++)
+    {
+        const ConfigVar* var = &vars[i];
+        if (!var_changed(var, old[i], var_get(var)))
+            continue;
+
+        int is_rate = var->number == &RATE_LIMIT || var->number == &RATE_BURST ||
+                      var->number == &RATE_LIMIT_BYTES;
+        int reload  = var->reload && !(is_rate && rate_was != rate_now);
+
+        if (!reload)
+        {
+            wlog(WARNING,
+                 "Restart to change %s from %s to %s.",
+                 var->name,
+                 var_text(from, sizeof from, var, old[i]),
+                 var_text(to, sizeof to, var, var_get(var)));
+            var_set(var, old[i]);
+            pending++;
+            continue;
+        }
+
+        wlog(INFO,
+             "Changed %s from %s to %s.",
+             var->name,
+             var_text(from, sizeof from, var, old[i]),
+             var_text(to, sizeof to, var, var_get(var)));
+        applied++;
+    }
+
+    int listen_changed = LISTEN_COUNT != old_listen_count;
+    for (int i = 0; i < LISTEN_COUNT && !listen_changed; i++)
+        listen_changed = strcmp(LISTEN[i], old_listen[i]) != 0;
+
+    if (listen_changed)
+    {
+        wlog(WARNING, "Restart to change the listen options.");
+        memcpy(LISTEN, old_listen, sizeof LISTEN);
+        LISTEN_COUNT = old_listen_count;
+        pending++;
+    }
+
+    CONFIG_VERSION++;
+    wlog(INFO,
+         "Config version %d: %d settings changed, %d need a restart.",
+         CONFIG_VERSION,
+         applied,
+         pending);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
 void server_config_show()
 {
     fprintf(stderr,
-            "PORT=%d, BUFFER=%d, LOGLEVEL=%d, BACKLOG=%d, LOGFILE=%s, FAVICON=%s, ROOT=%s\n",
+            "PORT=%d, BUFFER=%d, LOGLEVEL=%d, BACKLOG=%d, LOGFILE=%s, FAVICON=%s, ROOT=%s, "
+            "PATHINDEX=%d, MAXCLIENTS=%d, MAXINFLIGHT=%d, SHEDMODE=%d, STATS=%s, "
+            "TIMEOUTS=%d/%d/%d/%d, RATELIMIT=%d/%d/%d, DEFERACCEPT=%d, FASTOPEN=%d, NODELAY=%d, "
+            "SNDBUF=%d, RCVBUF=%d, PROXY=%s, PROXYPOOL=%d, PROXYCACHE=%d/%s/%d, PROXYSTALE=%d, "
+            "PROXYREWRITE=%d, HTTP2=%d/%d, TLS=%d/%s/%s/%d/%d, SCHED=%d/%d/%d, "
+            "SLOW=%d/%s, TRACE=%s/%d, ACCESSLOG=%s, CAPTURE=%s/%d, LOGROTATE=%d/%d/%d, "
+            "LOGRATE=%d/%d/%d, WARMUP=%d/%s/%d, ARENA=%d, CONFIG=%s",
             SERVER_PORT,
             BUFFER_SIZE,
             LOG_LEVEL,
             BACKLOG,
             LOG_FILE_NAME,
             FAVICON_FILE,
-            ROOT_DIR);
+            ROOT_DIR,
+            PATH_INDEX,
+            MAX_CLIENTS,
+            MAX_INFLIGHT,
+            SHED_MODE,
+            STATS_PATH,
+            HEADER_TIMEOUT,
+            SEND_TIMEOUT,
+            KEEPALIVE_TIMEOUT,
+            DRAIN_TIMEOUT,
+            RATE_LIMIT,
+            RATE_BURST,
+            RATE_LIMIT_BYTES,
+            DEFER_ACCEPT,
+            FASTOPEN,
+            NODELAY,
+            SNDBUF,
+            RCVBUF,
+            PROXY_UPSTREAM,
+            PROXY_POOL,
+            PROXY_CACHE_MB,
+            PROXY_CACHE_DIR,
+            PROXY_DISK_MB,
+            PROXY_STALE,
+            PROXY_REWRITE,
+            HTTP2,
+            HTTP2_STREAMS,
+            TLS_PORT,
+            TLS_CERT,
+            TLS_KEY,
+            TLS_TICKET_ROTATE,
+            KTLS,
+            SCHED_QUANTUM,
+            BANDWIDTH,
+            BANDWIDTH_CONN,
+            SLOW_MS,
+            SLOW_LOG,
+            TRACE_FILE,
+            TRACE_SAMPLE,
+            ACCESS_LOG,
+            CAPTURE_FILE,
+            CAPTURE_SAMPLE,
+            LOG_MAX_MB,
+            LOG_ROTATE,
+            LOG_COMPRESS,
+            LOG_RATE,
+            LOG_SAMPLE,
+            LOG_DEGRADE_US,
+            WARMUP_THREADS,
+            WARMUP_PRELOAD,
+            WARMUP_DEADLINE,
+            ARENA_SIZE,
+            CONFIG_FILE);
+
+    for (int i = 0; i < LISTEN_COUNT; i++)
+        fprintf(stderr, ", LISTEN=%s", LISTEN[i]);
+
+    fprintf(stderr, "\n");
     return;
 }
 
@@ -237,15 +1386,23 @@ void config_help()
 {
     fprintf(stderr,
             "Usage: server [OPTIONS]...\n"
+            "--config FILE\n"
+            "Read options from FILE, one per line: the long option name without\n"
+            "the dashes, then its value. Options given on the command line take\n"
+            "precedence. On SIGHUP, FILE is read again and the settings that\n"
+            "don't need a restart are applied.\n"
+            "Defaults to \"\" (none).\n\n"
+
             "-p, --port PORT\n"
             "Choose specific port to bind to.\n"
             "Must be in range [1024, 65535] or 0, for a random port.\n"
             "Defaults to 0.\n\n"
 
             "-b, --buffer BUFF_SIZE\n"
-            "Buffer size for file transfer, in bytes.\n"
-            "Must be a positive value.\n"
-            "Defaults to 1024.\n\n"
+            "Largest I/O buffer a request takes from the pool, in bytes. Buffers come\n"
+            "in classes of 4 KiB, 64 KiB and 1 MiB, sized for the body being moved.\n"
+            "Must be a positive value, below 4096 gives the 4 KiB class.\n"
+            "Defaults to 1048576.\n\n"
 
             "-l, --log-level LOGLEVEL\n"
             "Only messages with this level, or higher, will be shown.\n"
@@ -255,8 +1412,8 @@ void config_help()
 
             "-c, --backlog MAXCONNECT\n"
             "Maximum number of connections in queue.\n"
-            "Must be a positive value.\n"
-            "Defaults to 5.\n\n"
+            "Must be in range [1, 65535], the kernel caps it at net.core.somaxconn.\n"
+            "Defaults to 511.\n\n"
 
             "-f, --log-file LOGFILE\n"
             "Name of file to write log to.\n"
@@ -264,6 +1421,57 @@ void config_help()
             "If specified, file name must not be empty.\n"
             "Defaults to server.log.\n\n"
 
+            "--log-max-size MB\n"
+            "Rotate the log file once it reaches MB megabytes, 0 for no limit.\n"
+            "Defaults to 0.\n\n"
+
+            "--log-rotate SECONDS\n"
+            "Rotate the log file once it is SECONDS old, 0 for no limit.\n"
+            "Rotated files are renamed LOGFILE.YYYYmmdd-HHMMSS. SIGUSR1 reopens\n"
+            "LOGFILE, for rotation by other programs.\n"
+            "Defaults to 0.\n\n"
+
+            "--log-compress 0|1\n"
+            "Compress rotated log files with gzip, in the background.\n"
+            "Defaults to 0.\n\n"
+
+            "--log-rate N\n"
+            "Write at most N messages per second from each place in the code,\n"
+            "in each process, 0 for no limit. The dropped ones are counted and\n"
+            "summarized later. FATAL messages are never dropped.\n"
+            "Defaults to 0.\n\n"
+
+            "--log-sample N\n"
+            "Only one in N connections logs its per-request INFO messages, the\n"
+            "others log them as DEBUG.\n"
+            "Defaults to 1.\n\n"
+
+            "--log-degrade-us US\n"
+            "When writing a message takes more than US microseconds on average,\n"
+            "drop messages below WARNING for 10 seconds, 0 to never drop them.\n"
+            "Defaults to 0.\n\n"
+
+            "--warmup-threads N\n"
+            "Before accepting connections, walk ROOT_DIR with N threads to warm\n"
+            "the filesystem caches up, 0 to start cold. Must be in range [0, 64].\n"
+            "Defaults to 0.\n\n"
+
+            "--warmup-preload FILE\n"
+            "During the warm-up, read the files listed in FILE into the page\n"
+            "cache, one path relative to ROOT_DIR per line.\n"
+            "Defaults to \"\" (none).\n\n"
+
+            "--warmup-deadline MS\n"
+            "Start accepting connections after MS milliseconds of warm-up, even\n"
+            "if it isn't done.\n"
+            "Defaults to 10000.\n\n"
+
+            "--arena-size BYTES\n"
+            "Memory for the strings built while handling a request, reused by\n"
+            "every request. Larger requests allocate more, see the arena_* stats.\n"
+            "Must be in range [1024, 16777216].\n"
+            "Defaults to 16384.\n\n"
+
             "-r, --root ROOTDIR\n"
             "Set the root directory for serving files.\n"
             "Defaults to 'data'.\n\n"
@@ -271,13 +1479,205 @@ void config_help()
             "-i, --favicon FAVICONFILE\n"
             "Set the name of the favicon file.\n"
             "Must be a valid file in the root directory.\n"
-            "Defaults to 'favicon32.png'.\n"
+            "Defaults to 'favicon32.png'.\n\n"
+
+            "--path-index ENABLED\n"
+            "Keep an in-memory index of the root directory, updated with inotify.\n"
+            "Requests for missing paths are answered without touching the disk.\n"
+            "Must be 0 (disabled) or 1 (enabled).\n"
+            "Defaults to 1.\n\n"
+
+            "-m, --max-clients MAXCLIENTS\n"
+            "Maximum number of client connections the server can handle simultaneously.\n"
+            "Past this, new connections are shed according to --shed-mode.\n"
+            "Must be a positive, non-zero value.\n"
+            "Defaults to 256.\n\n"
+
+            "--max-inflight BYTES\n"
+            "Response bytes queued but not yet sent past which new connections are shed.\n"
+            "Must be 0 (unlimited) or a positive value.\n"
+            "Defaults to 0.\n\n"
+
+            "--shed-mode MODE\n"
+            "What to do with new connections when overloaded.\n"
+            "0 leaves them queued in the kernel until a connection finishes,\n"
+            "1 answers them right away with 503 Service Unavailable.\n"
+            "Defaults to 0.\n\n"
+
+            "--retry-after SECONDS\n"
+            "Value of the Retry-After header sent with 503 responses.\n"
+            "Defaults to 1.\n\n"
+
+            "--stats-path PATH\n"
+            "Request path where server statistics are exported as plain text.\n"
+            "Anyone who can connect can read them: keep it to trusted listeners.\n"
+            "Must start with '/', or be empty to disable.\n"
+            "Defaults to empty (disabled).\n\n"
+
+            "--header-timeout MILLISECONDS\n"
+            "Time a client has to send a complete request header.\n"
+            "Defaults to 10000.\n\n"
+
+            "--send-timeout MILLISECONDS\n"
+            "Time a response may go without any progress before the connection is closed.\n"
+            "Defaults to 30000.\n\n"
+
+            "--keepalive-timeout MILLISECONDS\n"
+            "Time a kept-alive connection may wait for its next request.\n"
+            "All timeouts must be positive values.\n"
+            "Defaults to 5000.\n\n"
+
+            "--drain-timeout MILLISECONDS\n"
+            "On SIGINT or SIGTERM, time open connections have to finish before they\n"
+            "are closed. A second signal closes them right away. 0 doesn't wait.\n"
+            "Defaults to 10000.\n\n"
+
+            "--rate-limit REQUESTS\n"
+            "Requests per second allowed per client address (per /64 for IPv6).\n"
+            "Clients over the limit are answered with 429 Too Many Requests.\n"
+            "Must be 0 (unlimited) or a positive value.\n"
+            "Defaults to 0.\n\n"
+
+            "--rate-burst REQUESTS\n"
+            "Requests a client may make at once before --rate-limit applies.\n"
+            "Defaults to the value of --rate-limit.\n\n"
+
+            "--rate-limit-bytes BYTES\n"
+            "Response bytes per second allowed per client address.\n"
+            "Must be 0 (unlimited) or a positive value.\n"
+            "Defaults to 0.\n\n"
+
+            "--defer-accept SECONDS\n"
+            "Only wake the server for a connection once its request arrives, waiting\n"
+            "up to SECONDS (TCP_DEFER_ACCEPT).\n"
+            "Defaults to 0 (disabled).\n\n"
+
+            "--fastopen QUEUE_LENGTH\n"
+            "Accept TCP Fast Open connections, with up to QUEUE_LENGTH pending.\n"
+            "Defaults to 0 (disabled).\n\n"
+
+            "--nodelay 0|1\n"
+            "Disable Nagle's algorithm on client sockets (TCP_NODELAY).\n"
+            "Defaults to 0.\n\n"
+
+            "--sndbuf BYTES, --rcvbuf BYTES\n"
+            "Send and receive buffer sizes of client sockets.\n"
+            "Defaults to 0 (kernel default).\n\n"
+
+            "--proxy UPSTREAM\n"
+            "Forward GET and HEAD requests to UPSTREAM (http://host[:port][/prefix])\n"
+            "instead of serving files, caching responses that allow it.\n"
+            "Defaults to \"\" (disabled).\n\n"
+
+            "--proxy-pool CONNECTIONS\n"
+            "Persistent connections kept open to the upstream server.\n"
+            "Defaults to 8.\n\n"
+
+            "--proxy-cache MEGABYTES\n"
+            "Memory for cached responses, 0 disables the cache.\n"
+            "Defaults to 64.\n\n"
+
+            "--proxy-cache-dir DIR\n"
+            "Directory where responses too large to cache in memory are stored.\n"
+            "Defaults to \"\" (not stored).\n\n"
+
+            "--proxy-disk MEGABYTES\n"
+            "Disk space for responses stored in --proxy-cache-dir.\n"
+            "Defaults to 1024.\n\n"
+
+            "--proxy-stale SECONDS\n"
+            "How long after expiring a cached response is still served, right away\n"
+            "while it is refreshed in the background, or when the upstream fails.\n"
+            "The upstream's stale-while-revalidate and stale-if-error take precedence.\n"
+            "Defaults to 60.\n\n"
+
+            "--proxy-rewrite 0|1\n"
+            "Point src, href and srcset links to the upstream server in HTML pages at\n"
+            "the proxy, rewriting them as they stream through.\n"
+            "Defaults to 1.\n\n"
+
+            "--http2 0|1\n"
+            "Accept cleartext HTTP/2 (h2c), from clients that start with its preface\n"
+            "or ask to upgrade an HTTP/1.1 connection.\n"
+            "Defaults to 1.\n\n"
+
+            "--http2-streams STREAMS\n"
+            "Requests a client may have open at once on one HTTP/2 connection.\n"
+            "Must be in range [1, 1024].\n"
+            "Defaults to 100.\n\n"
+
+            "--tls-port PORT\n"
+            "Also accept HTTPS connections on PORT, in range [1024, 65535].\n"
+            "HTTP/2 is offered with ALPN when --http2 is enabled.\n"
+            "Defaults to 0 (disabled).\n\n"
+
+            "--tls-cert FILE, --tls-key FILE\n"
+            "PEM certificate chain and private key, required with --tls-port.\n"
+            "The key defaults to being read from the certificate file.\n\n"
+
+            "--tls-ticket-rotate SECONDS\n"
+            "How often the session ticket key is replaced. Tickets of the previous\n"
+            "key are still accepted, and renewed.\n"
+            "Defaults to 3600.\n\n"
+
+            "--listen ADDRESS[,OPTION]...\n"
+            "Also accept connections on ADDRESS, may be given up to " STR(LISTEN_MAX) " times.\n"
+            "PORT listens on every IPv4 and IPv6 address, HOST:PORT or [IPV6]:PORT on\n"
+            "one, unix:PATH on a Unix socket and unix:@NAME on an abstract one.\n"
+            "Options: tls, v6only, mode=OCTAL (of the socket file), name=LABEL (in logs\n"
+            "and statistics). With --listen, --port is only opened if given.\n\n"
+
+            "--ktls 0|1\n"
+            "Hand TLS records to the kernel (kTLS) after the handshake, so sendfile()\n"
+            "keeps working. Falls back to OpenSSL when the kernel can't.\n"
+            "Defaults to 1.\n\n"
+
+            "--sched-quantum BYTES\n"
+            "Bytes a connection may send before the others get their turn, out of\n"
+            "--bandwidth (no effect without it). Responses with less than 4 quanta\n"
+            "left are sent in one turn, ahead of larger ones.\n"
+            "Must be in range [1024, 16777216].\n"
+            "Defaults to 65536.\n\n"
+
+            "--bandwidth BYTES\n"
+            "Response bytes per second sent by all connections together.\n"
+            "Defaults to 0 (unlimited).\n\n"
+
+            "--bandwidth-conn BYTES\n"
+            "Response bytes per second sent on each connection.\n"
+            "Defaults to 0 (unlimited).\n\n"
+
+            "--slow-ms MILLISECONDS\n"
+            "Write requests slower than this to the slow log, with the time they\n"
+            "reached each phase, their send and receive calls and bytes.\n"
+            "Defaults to 0 (disabled).\n\n"
+
+            "--slow-log FILE\n"
+            "Name of the slow request log.\n"
+            "Defaults to slow.log.\n\n"
+
+            "--trace-file FILE\n"
+            "Append sampled requests to FILE as binary records, read with\n"
+            "tools/trace_read.\n"
+            "Defaults to \"\" (disabled).\n\n"
+
+            "--trace-sample N\n"
+            "Trace one in N requests.\n"
+            "Defaults to 100.\n\n"
+
+            "--access-log FILE\n"
+            "Append a 64-byte binary record per request to FILE, written in\n"
+            "batches, read with tools/access_read. Per-request INFO messages\n"
+            "become DEBUG ones.\n"
+            "Defaults to \"\" (disabled).\n\n"
 
-            // "-m, --max-clients MAXCLIENTS\n"
-            // "Maximum number of client connections the server can handle simultaneously. "
-            // "Must be a positive, non-zero value.\n"
-            // "Currently unused! /shrug.\n"
-            // "Defaults to 10.\n\n"
+            "--capture FILE\n"
+            "Append the header of incoming requests to FILE, with their arrival\n"
+            "time, to be sent again with tools/replay.\n"
+            "Defaults to \"\" (disabled).\n\n"
 
+            "--capture-sample N\n"
+            "Capture one in N requests.\n"
+            "Defaults to 1.\n"
     );
 }
\ No newline at end of file
@@ -0,0 +1,386 @@
+#include "connections.h"
+#include "config.h"
+#include "logging.h"
+#include "shm.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "net_utils.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Connection table.
+ * MAX_CLIENTS slots in shared memory, one per connection handled by a child. */
+static ConnSlot* slots = NULL;
+
+/** @brief Size of the connection table, in slots. */
+static size_t slot_count = 0;
+
+/**
+ * @brief Stack of free slot indices.
+ * Only used by the main loop, gives O(1) claims and releases. */
+static int* free_slots = NULL;
+
+/** @brief Number of indices in the free slot stack. */
+static size_t free_count = 0;
+
+/**
+ * @brief Map from child pid to slot index.
+ * Open addressing with linear probing, only used by the main loop to find the
+ * slot of a reaped child in O(1). A pid of 0 marks an empty entry. */
+static struct
+{
+    pid_t pid;
+    int   slot;
+} * pid_map = NULL;
+
+/** @brief Number of entries in the pid map. Always a power of two. */
+static size_t pid_map_size = 0;
+
+/** @brief Slot owned by this process, -1 in the main loop. */
+static int self = -1;
+
+/**
+ * @brief Deadline timer of each slot.
+ * Only used by the main loop. A timer is armed for the deadline the slot had
+ * when it was last checked; children move their deadline freely, and the
+ * timer is re-armed lazily when it fires. */
+static Timer* timers = NULL;
+
+/** @brief Timer wheel holding the deadline timers. */
+static TimerWheel wheel;
+
+/**
+ * @brief Longest time a slot goes without being checked, in milliseconds.
+ * A child entering a phase with a shorter deadline than the one armed (e.g.
+ * going idle after a long send) is noticed within this interval. */
+static unsigned long check_interval = 0;
+
+/** @brief Whether the children were asked to finish, by conn_drain(). */
+static int drain_asked = 0;
+
+/* -------------------------------------------------------------------------- */
+
+static size_t pid_map_home(pid_t pid)
+{
+    return ((size_t) pid * 2654435761u) & (pid_map_size - 1);
+}
+
+static void pid_map_put(pid_t pid, int slot)
+{
+    size_t i = pid_map_home(pid);
+    while (pid_map[i].pid != 0)
+        i = (i + 1) & (pid_map_size - 1);
+    pid_map[i].pid  = pid;
+    pid_map[i].slot = slot;
+}
+
+/**
+ * @brief Remove a pid from the map.
+ * Uses backward shift deletion so the map never accumulates tombstones.
+ * @return The slot of the pid, or -1 if it was not in the map. */
+static int pid_map_take(pid_t pid)
+{
+    size_t mask = pid_map_size - 1;
+    size_t i    = pid_map_home(pid);
+
+    while (pid_map[i].pid != pid)
+    {
+        if (pid_map[i].pid == 0)
+            return -1;
+        i = (i + 1) & mask;
+    }
+
+    int slot = pid_map[i].slot;
+
+    for (size_t j = (i + 1) & mask; pid_map[j].pid != 0; j = (j + 1) & mask)
+    {
+        size_t home = pid_map_home(pid_map[j].pid);
+        // Move entry j into the hole unless its home lies cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+            pid_map[i] = pid_map[j];
+            i          = j;
+        }
+    }
+
+    pid_map[i].pid = 0;
+    return slot;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int conn_table_startup()
+{
+    slot_count = MAX_CLIENTS;
+    slots      = shm_alloc("connection table", slot_count * sizeof *slots);
+
+    pid_map_size = 16;
+    while (pid_map_size < slot_count * 2)
+        pid_map_size *= 2;
+
+    free_slots = malloc(slot_count * sizeof *free_slots);
+    pid_map    = calloc(pid_map_size, sizeof *pid_map);
+    timers     = calloc(slot_count, sizeof *timers);
+
+    if (!slots || !free_slots || !pid_map || !timers)
+    {
+        wlog(FATAL, "Failed to allocate connection table for %zu clients.", slot_count);
+        conn_table_shutdown();
+        return EXIT_FAILURE;
+    }
+
+    for (free_count = 0; free_count < slot_count; free_count++)
+        free_slots[free_count] = slot_count - free_count - 1;
+
+    conn_timeouts_update();
+    timer_wheel_init(&wheel, now_ms(), 10);
+
+    wlog(DEBUG, "Connection table ready for %zu clients.", slot_count);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_timeouts_update()
+{
+    check_interval = HEADER_TIMEOUT;
+    if ((unsigned long) SEND_TIMEOUT < check_interval)
+        check_interval = SEND_TIMEOUT;
+    if ((unsigned long) KEEPALIVE_TIMEOUT < check_interval)
+        check_interval = KEEPALIVE_TIMEOUT;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_table_shutdown()
+{
+    shm_free(slots, slot_count * sizeof *slots);
+    free(free_slots);
+    free(pid_map);
+    free(timers);
+
+    slots      = NULL;
+    free_slots = NULL;
+    pid_map    = NULL;
+    timers     = NULL;
+    slot_count = 0;
+    free_count = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+Admission conn_admission()
+{
+    if (free_count > 0 &&
+        (MAX_INFLIGHT == 0 || STAT_GET(inflight_bytes) < (unsigned long) MAX_INFLIGHT))
+        return ADM_ACCEPT;
+
+    return SHED_MODE ? ADM_SHED : ADM_PAUSE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int conn_claim()
+{
+    if (free_count == 0)
+        return -1;
+
+    int slot = free_slots[--free_count];
+    atomic_store_explicit(&slots[slot].inflight, 0, memory_order_relaxed);
+    atomic_store_explicit(&slots[slot].phase, PHASE_HEADER, memory_order_relaxed);
+    atomic_store_explicit(
+        &slots[slot].deadline, now_ms() + HEADER_TIMEOUT, memory_order_relaxed);
+    STAT_ADD(active, 1);
+    return slot;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_bind(int slot, pid_t pid)
+{
+    slots[slot].pid = pid;
+    pid_map_put(pid, slot);
+    uint64_t check    = now_ms() + check_interval;
+    uint64_t deadline = atomic_load_explicit(&slots[slot].deadline, memory_order_relaxed);
+    timer_arm(&wheel, &timers[slot], deadline < check ? deadline : check);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_release(int slot)
+{
+    // A child killed mid-transfer never got to account for what it didn't send
+    unsigned long left = atomic_exchange_explicit(&slots[slot].inflight, 0, memory_order_relaxed);
+    STAT_SUB(inflight_bytes, left);
+    STAT_SUB(active, 1);
+    timer_cancel(&wheel, &timers[slot]);
+
+    slots[slot].pid          = 0;
+    free_slots[free_count++] = slot;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_enter(int slot)
+{
+    self = slot;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int conn_reap()
+{
+    int   reaped = 0;
+    int   status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        int slot = pid_map_take(pid);
+        if (slot == -1)
+            continue;  // Not one of ours (e.g. a helper process)
+
+        if (WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL)  // SIGKILL is our timeout
+            wlog(WARNING, "Child %d killed by signal %d.", pid, WTERMSIG(status));
+
+        conn_release(slot);
+        reaped++;
+    }
+
+    if (pid == -1 && errno != ECHILD)
+        wlog(ERROR, "Failed to reap children: (%d) %s.", errno, strerror(errno));
+
+    if (reaped)
+        wlog(TRACE, "Reaped %d children, %zu still active.", reaped, conn_active());
+
+    return reaped;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int conn_expire()
+{
+    uint64_t now     = now_ms();
+    Timer*   expired = timer_wheel_advance(&wheel, now);
+    int      killed  = 0;
+
+    while (expired)
+    {
+        Timer* t    = expired;
+        int    slot = t - timers;
+        expired     = t->next;
+
+        uint64_t deadline = atomic_load_explicit(&slots[slot].deadline, memory_order_relaxed);
+        if (deadline > now)  // Made progress since the timer was armed
+        {
+            uint64_t check = now + check_interval;
+            timer_arm(&wheel, t, deadline < check ? deadline : check);
+            continue;
+        }
+
+        wlog(DEBUG,
+             "Connection of child %d timed out in phase %d.",
+             slots[slot].pid,
+             atomic_load_explicit(&slots[slot].phase, memory_order_relaxed));
+
+        // The slot is freed when the child is reaped
+        if (kill(slots[slot].pid, SIGKILL) == -1 && errno != ESRCH)
+            wlog(ERROR, "Failed to kill child %d: %s.", slots[slot].pid, strerror(errno));
+
+        killed++;
+    }
+
+    if (killed)
+    {
+        STAT_ADD(timed_out, killed);
+        wlog(INFO, "Closed %d timed out connections.", killed);
+    }
+
+    return killed;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int conn_timeout()
+{
+    return timer_wheel_timeout(&wheel, now_ms());
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_phase(ConnPhase phase)
+{
+    if (self == -1)
+        return;
+
+    int timeout = phase == PHASE_HEADER ? HEADER_TIMEOUT
+                : phase == PHASE_SEND   ? SEND_TIMEOUT
+                                        : KEEPALIVE_TIMEOUT;
+
+    atomic_store_explicit(&slots[self].phase, phase, memory_order_relaxed);
+    atomic_store_explicit(&slots[self].deadline, now_ms() + timeout, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_progress()
+{
+    if (self == -1 || atomic_load_explicit(&slots[self].phase, memory_order_relaxed) != PHASE_SEND)
+        return;
+
+    atomic_store_explicit(&slots[self].deadline, now_ms() + SEND_TIMEOUT, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t conn_drain(int force)
+{
+    int killed = 0;
+
+    for (size_t i = 0; i < slot_count; i++)
+    {
+        pid_t pid = slots[i].pid;
+        if (pid == 0)
+            continue;
+
+        // Nothing in flight between two requests: close it now, like its timeout would
+        if (force || atomic_load_explicit(&slots[i].phase, memory_order_relaxed) == PHASE_IDLE)
+        {
+            if (kill(pid, SIGKILL) == 0)
+                killed++;
+        }
+        else if (!drain_asked && kill(pid, SIGTERM) == -1 && errno != ESRCH)
+            wlog(ERROR, "Failed to signal child %d: %s.", pid, strerror(errno));
+    }
+
+    drain_asked = 1;
+    if (killed)
+        wlog(DEBUG, "Closed %d %s connections.", killed, force ? "open" : "idle");
+
+    return conn_active();
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t conn_active()
+{
+    return slot_count - free_count;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void conn_inflight_add(long delta)
+{
+    if (self == -1)
+        return;
+
+    atomic_fetch_add_explicit(&slots[self].inflight, delta, memory_order_relaxed);
+    STAT_ADD(inflight_bytes, delta);
+}
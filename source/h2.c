@@ -0,0 +1,1534 @@
+#include "h2.h"
+#include "access_log.h"
+#include "arena.h"
+#include "capture.h"
+#include "config.h"
+#include "connections.h"
+#include "hpack.h"
+#include "listener.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "out_sched.h"
+#include "ratelimit.h"
+#include "server.h"
+#include "sig.h"
+#include "stats.h"
+#include "tls.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief The connection preface every client starts with. */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+/** @brief Length of the connection preface. */
+#define H2_PREFACE_LEN 24
+
+/** @brief Length of a frame header. */
+#define H2_FRAME_HEADER 9
+
+/** @brief Largest frame payload received and sent, the HTTP/2 default we never raise. */
+#define H2_FRAME_MAX 16384
+
+/** @brief Initial flow control window of the connection and of each stream. */
+#define H2_WINDOW 65535
+
+/** @brief Largest flow control window allowed. */
+#define H2_WINDOW_MAX 0x7fffffff
+
+/** @brief Largest header block (HEADERS and its CONTINUATIONs) accepted. */
+#define H2_BLOCK_MAX (64 * 1024)
+
+/** @brief Largest encoded response header block. */
+#define H2_HEADER_BLOCK (16 * 1024)
+
+/**
+ * @brief Body bytes a stream may have queued before its handler waits for them
+ * to be sent, which bounds the memory of a connection to this many per stream. */
+#define H2_STREAM_BUFFER (64 * 1024)
+
+/**
+ * @brief DATA frames are scheduled while fewer bytes than this wait to be sent.
+ * Kept small so the turn of a stream comes back quickly, but enough to keep
+ * the socket busy between two wakeups. */
+#define H2_OUTPUT_LOW (32 * 1024)
+
+/** @brief Frame types. */
+enum
+{
+    H2_DATA          = 0x0,
+    H2_HEADERS       = 0x1,
+    H2_PRIORITY      = 0x2,
+    H2_RST_STREAM    = 0x3,
+    H2_SETTINGS      = 0x4,
+    H2_PUSH_PROMISE  = 0x5,
+    H2_PING          = 0x6,
+    H2_GOAWAY        = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION  = 0x9,
+};
+
+/** @brief Frame flags. */
+enum
+{
+    H2_FLAG_END_STREAM  = 0x1,
+    H2_FLAG_ACK         = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED      = 0x8,
+    H2_FLAG_PRIORITY    = 0x20,
+};
+
+/** @brief Error codes, of RST_STREAM and GOAWAY frames. */
+enum
+{
+    H2_NO_ERROR           = 0x0,
+    H2_PROTOCOL_ERROR     = 0x1,
+    H2_INTERNAL_ERROR     = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED      = 0x5,
+    H2_FRAME_SIZE_ERROR   = 0x6,
+    H2_REFUSED_STREAM     = 0x7,
+    H2_COMPRESSION_ERROR  = 0x9,
+    H2_ENHANCE_YOUR_CALM  = 0xb,
+};
+
+/** @brief Settings. */
+enum
+{
+    H2_SETTINGS_ENABLE_PUSH            = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE         = 0x5,
+};
+
+/** @brief Where a stream is in its life. */
+typedef enum H2StateEnum
+{
+    H2S_FREE,     /**< Slot unused. */
+    H2S_RECV,     /**< Request header received, its body still arriving (and dropped). */
+    H2S_READY,    /**< Request complete, waiting for its turn to be handled. */
+    H2S_RUNNING,  /**< Request being handled. */
+    H2S_SENDING,  /**< Handled, what is left of the response is still being sent. */
+} H2State;
+
+struct H2StreamStruct
+{
+    /** @brief Stream identifier. */
+    uint32_t id;
+    /** @brief Current H2State. */
+    H2State state;
+    /** @brief Whether the request is a HEAD request, whose body is dropped. */
+    int head;
+    /** @brief Whether the request header didn't fit in HEADER_MAX. */
+    int too_large;
+    /** @brief Whether the response header was sent. */
+    int begun;
+    /** @brief Whether the whole body is queued: END_STREAM goes with its last byte. */
+    int ended;
+    /** @brief Whether END_STREAM or RST_STREAM was sent, nothing more goes out. */
+    int fin;
+    /** @brief Whether either side reset the stream, writes to it fail. */
+    int reset;
+    /** @brief Send window, negative if the client shrank it under what was sent. */
+    int64_t window;
+    /** @brief The request, rebuilt as an HTTP/1.1 header for handle_user_request(). */
+    char* req;
+    /** @brief Queued body bytes, sent from out_off to out_len. */
+    char* out;
+    /** @brief First queued byte not yet framed. */
+    size_t out_off;
+    /** @brief End of the queued bytes. */
+    size_t out_len;
+    /** @brief Allocated size of out. */
+    size_t out_size;
+    /** @brief File queued after the buffered bytes, -1 if none. */
+    int fd;
+    /** @brief Where the rest of the file starts. */
+    off_t file_off;
+    /** @brief Bytes of the file still to send. */
+    size_t file_left;
+    /** @brief Body bytes queued so far, what its DATA frames carry. */
+    size_t body_len;
+};
+
+/** @brief A request being rebuilt from the fields of its header block. */
+typedef struct H2RequestStruct
+{
+    /** @brief The :method pseudo-header. */
+    char method[16];
+    /** @brief The :path pseudo-header. */
+    char path[HEADER_MAX / 2];
+    /** @brief The :authority pseudo-header, sent on as Host. */
+    char authority[256];
+    /** @brief Regular header fields, as HTTP/1.1 header lines. */
+    char fields[HEADER_MAX];
+    /** @brief Length of fields. */
+    size_t fields_len;
+    /** @brief Whether a Host field was among them. */
+    int host;
+    /** @brief Whether a regular field was seen, pseudo-headers must come first. */
+    int regular;
+    /** @brief Whether the header is malformed, which resets the stream. */
+    int malformed;
+    /** @brief Whether the fields didn't fit. */
+    int too_large;
+} H2Request;
+
+/** @brief The HTTP/2 connection handled by this process. */
+static struct
+{
+    /** @brief Client socket. */
+    int socket;
+    /** @brief Whether the connection is done with: closed, failed or after an error. */
+    int closed;
+    /** @brief Whether it was closed because of a protocol error. */
+    int error;
+    /** @brief Whether GOAWAY was sent or received: no new streams are accepted. */
+    int goaway;
+    /** @brief Last stream accepted when GOAWAY was sent, later ones are ignored. */
+    uint32_t goaway_last;
+    /** @brief Highest stream identifier the client used. */
+    uint32_t last_stream;
+    /** @brief Requests handled, the first one was charged to the rate limit on accept. */
+    unsigned long served;
+    /** @brief Connection send window. */
+    int64_t window;
+    /** @brief Initial send window of new streams, set by the client. */
+    int64_t initial_window;
+    /** @brief Decoder of the client's header blocks. */
+    HpackDecoder decoder;
+    /** @brief Stream slots, HTTP2_STREAMS of them. */
+    H2Stream* streams;
+    /** @brief Slot whose turn to send comes next. */
+    size_t turn;
+    /** @brief Whether the connection preface was received. */
+    int preface;
+    /** @brief Bytes received and not yet processed, at most one frame plus a partial one. */
+    uint8_t in[HEADER_MAX + H2_FRAME_HEADER + H2_FRAME_MAX];
+    /** @brief Length of in. */
+    size_t in_len;
+    /** @brief Header block being gathered from HEADERS and CONTINUATION frames. */
+    uint8_t block[H2_BLOCK_MAX];
+    /** @brief Length of block. */
+    size_t block_len;
+    /** @brief Stream of the header block being gathered, 0 if none. */
+    uint32_t block_stream;
+    /** @brief Whether its HEADERS frame ended the stream. */
+    int block_end_stream;
+    /** @brief Frames waiting to be sent, from out_off to out_len. */
+    uint8_t* out;
+    /** @brief First byte not yet sent. */
+    size_t out_off;
+    /** @brief End of the frames. */
+    size_t out_len;
+    /** @brief Allocated size of out. */
+    size_t out_size;
+} h2;
+
+H2Stream* h2_current = NULL;
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t get32(const uint8_t* p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/**
+ * @brief Make room for len more bytes at the end of the output.
+ * @return Where to write them, or NULL if out of memory (the connection is closed). */
+static uint8_t* out_reserve(size_t len)
+{
+    if (h2.out_off == h2.out_len)
+        h2.out_off = h2.out_len = 0;
+
+    if (h2.out_len + len > h2.out_size && h2.out_off > 0)  // Sent bytes make room first
+    {
+        memmove(h2.out, h2.out + h2.out_off, h2.out_len - h2.out_off);
+        h2.out_len -= h2.out_off;
+        h2.out_off = 0;
+    }
+
+    if (h2.out_len + len > h2.out_size)
+    {
+        size_t   size = h2.out_len + len > 2 * h2.out_size ? h2.out_len + len : 2 * h2.out_size;
+        uint8_t* out  = realloc(h2.out, size);
+        if (!out)
+        {
+            wlog(ERROR, "Out of memory for HTTP/2 output.");
+            h2.closed = 1;
+            return NULL;
+        }
+        h2.out      = out;
+        h2.out_size = size;
+    }
+
+    uint8_t* p = h2.out + h2.out_len;
+    h2.out_len += len;
+    return p;
+}
+
+static void frame_header(uint8_t* p, size_t len, int type, int flags, uint32_t id)
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id);
+}
+
+/** @brief Queue a frame to be sent. */
+static void queue_frame(int type, int flags, uint32_t id, const void* payload, size_t len)
+{
+    uint8_t* p = out_reserve(H2_FRAME_HEADER + len);
+    if (!p)
+        return;
+
+    frame_header(p, len, type, flags, id);
+    if (len > 0)
+        memcpy(p + H2_FRAME_HEADER, payload, len);
+}
+
+static void queue_rst(uint32_t id, uint32_t code)
+{
+    uint8_t payload[4];
+    put32(payload, code);
+    queue_frame(H2_RST_STREAM, 0, id, payload, sizeof payload);
+}
+
+static void queue_window_update(uint32_t id, uint32_t increment)
+{
+    uint8_t payload[4];
+    put32(payload, increment);
+    queue_frame(H2_WINDOW_UPDATE, 0, id, payload, sizeof payload);
+}
+
+static void queue_goaway(uint32_t code)
+{
+    uint8_t payload[8];
+    put32(payload, h2.last_stream);
+    put32(payload + 4, code);
+    queue_frame(H2_GOAWAY, 0, 0, payload, sizeof payload);
+
+    h2.goaway      = 1;
+    h2.goaway_last = h2.last_stream;
+}
+
+/** @brief Close the connection over a protocol error, telling the client why. */
+static void connection_error(uint32_t code, const char* what)
+{
+    wlog(WARNING, "HTTP/2 connection error: %s.", what);
+
+    if (!h2.closed)
+        queue_goaway(code);
+    h2.closed = 1;
+    h2.error  = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static H2Stream* stream_find(uint32_t id)
+{
+    for (int i = 0; i < HTTP2_STREAMS; i++)
+        if (h2.streams[i].state != H2S_FREE && h2.streams[i].id == id)
+            return &h2.streams[i];
+
+    return NULL;
+}
+
+/** @brief Bytes of a stream still to send. */
+static size_t stream_pending(const H2Stream* s)
+{
+    return s->out_len - s->out_off + s->file_left;
+}
+
+/**
+ * @brief Done with a stream: release what it holds and free its slot.
+ * The slot of a stream being handled is only freed once its handler returns,
+ * so it isn't given to another stream while the handler still uses it. */
+static void stream_close(H2Stream* s)
+{
+    if (s->fd != -1)
+        close(s->fd);
+    free(s->out);
+
+    s->fd        = -1;
+    s->out       = NULL;
+    s->out_off   = s->out_len = s->out_size = 0;
+    s->file_left = 0;
+    s->fin       = 1;
+
+    if (s->state != H2S_RUNNING)  // The handler still reads the request
+    {
+        free(s->req);
+        s->req   = NULL;
+        s->state = H2S_FREE;
+    }
+}
+
+/** @brief Reset a stream, telling the client why. */
+static void stream_reset(H2Stream* s, uint32_t code)
+{
+    if (!s->fin)
+        queue_rst(s->id, code);
+
+    s->reset = 1;
+    stream_close(s);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Queue a DATA frame for a stream whose turn it is. */
+static void send_data(H2Stream* s)
+{
+    size_t len = stream_pending(s);
+    if (len > H2_FRAME_MAX)
+        len = H2_FRAME_MAX;
+    if (len > 0 && (int64_t) len > s->window)
+        len = s->window;
+    if (len > 0 && (int64_t) len > h2.window)
+        len = h2.window;
+
+    uint8_t* frame = out_reserve(H2_FRAME_HEADER + len);
+    if (!frame)
+        return;
+
+    // Buffered bytes go first, they were queued before the file
+    size_t buffered = s->out_len - s->out_off;
+    size_t copied   = len < buffered ? len : buffered;
+    if (copied > 0)
+        memcpy(frame + H2_FRAME_HEADER, s->out + s->out_off, copied);
+    s->out_off += copied;
+
+    if (s->out_off == s->out_len)
+        s->out_off = s->out_len = 0;
+
+    if (len > copied)
+    {
+        ssize_t n = pread(s->fd, frame + H2_FRAME_HEADER + copied, len - copied, s->file_off);
+        if (n != (ssize_t) (len - copied))
+        {
+            wlog(WARNING, "Failed to read file for stream %u, or it ended early.", s->id);
+            h2.out_len -= H2_FRAME_HEADER + len;
+            stream_reset(s, H2_INTERNAL_ERROR);
+            return;
+        }
+
+        s->file_off += n;
+        s->file_left -= n;
+        if (s->file_left == 0)
+        {
+            close(s->fd);
+            s->fd = -1;
+        }
+    }
+
+    s->window -= len;
+    h2.window -= len;
+
+    int end = s->ended && stream_pending(s) == 0;
+    frame_header(frame, len, H2_DATA, end ? H2_FLAG_END_STREAM : 0, s->id);
+
+    if (end)
+        stream_close(s);
+}
+
+/**
+ * @brief Fill the output with DATA frames, taking streams in turn.
+ * Each stream with something to send and room in its window gets one frame
+ * before any gets a second, so a large response shares the connection with
+ * the small ones started after it instead of holding them up. */
+static void schedule()
+{
+    while (!h2.closed && h2.out_len - h2.out_off < H2_OUTPUT_LOW)
+    {
+        H2Stream* next = NULL;
+
+        for (int i = 0; i < HTTP2_STREAMS && !next; i++)
+        {
+            size_t    slot = (h2.turn + i) % HTTP2_STREAMS;
+            H2Stream* s    = &h2.streams[slot];
+
+            if ((s->state != H2S_RUNNING && s->state != H2S_SENDING) || !s->begun || s->fin)
+                continue;
+
+            size_t pending = stream_pending(s);
+            if ((pending > 0 && s->window > 0 && h2.window > 0) || (pending == 0 && s->ended))
+            {
+                next    = s;
+                h2.turn = slot + 1;
+            }
+        }
+
+        if (!next)
+            return;
+
+        send_data(next);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Bytes left to send on the connection: the output, then what the streams queued. */
+static size_t pending_output()
+{
+    size_t pending = h2.out_len - h2.out_off;
+
+    for (int i = 0; i < HTTP2_STREAMS; i++)
+        if (h2.streams[i].state != H2S_FREE)
+            pending += stream_pending(&h2.streams[i]);
+
+    return pending;
+}
+
+/** @brief Send as much of the output as the socket takes without blocking. */
+static void write_output()
+{
+    while (h2.out_off < h2.out_len)
+    {
+        size_t  grant = sched_grant(h2.out_len - h2.out_off, pending_output());
+        ssize_t n = tls_send(h2.socket, h2.out + h2.out_off, grant, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                wlog(DEBUG, "Failed to send to client: (%d) %s.", errno, strerror(errno));
+                h2.closed = 1;
+            }
+            return;
+        }
+
+        h2.out_off += n;
+        conn_progress();
+        ratelimit_charge(n);
+        listener_sent(n);
+        sched_charge(n);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Apply settings sent by the client, in a SETTINGS frame or when upgrading.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on an invalid value (the
+ *         connection is closed). */
+static int apply_settings(const uint8_t* p, size_t len)
+{
+    for (size_t i = 0; i + 6 <= len; i += 6)
+    {
+        uint16_t id    = p[i] << 8 | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+
+        if (id == H2_SETTINGS_ENABLE_PUSH && value > 1)
+        {
+            connection_error(H2_PROTOCOL_ERROR, "invalid SETTINGS_ENABLE_PUSH");
+            return EXIT_FAILURE;
+        }
+
+        if (id == H2_SETTINGS_MAX_FRAME_SIZE && (value < H2_FRAME_MAX || value > 0xffffff))
+        {
+            connection_error(H2_PROTOCOL_ERROR, "invalid SETTINGS_MAX_FRAME_SIZE");
+            return EXIT_FAILURE;
+        }
+
+        if (id != H2_SETTINGS_INITIAL_WINDOW_SIZE)  // Our frames never exceed the default size
+            continue;
+
+        if (value > H2_WINDOW_MAX)
+        {
+            connection_error(H2_FLOW_CONTROL_ERROR, "invalid SETTINGS_INITIAL_WINDOW_SIZE");
+            return EXIT_FAILURE;
+        }
+
+        // Applies to the windows of open streams too, as a difference
+        int64_t delta = (int64_t) value - h2.initial_window;
+        for (int j = 0; j < HTTP2_STREAMS; j++)
+        {
+            H2Stream* s = &h2.streams[j];
+            if (s->state == H2S_FREE)
+                continue;
+
+            s->window += delta;
+            if (s->window > H2_WINDOW_MAX)
+            {
+                connection_error(H2_FLOW_CONTROL_ERROR, "stream window overflow");
+                return EXIT_FAILURE;
+            }
+        }
+        h2.initial_window = value;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Ignore a header field, of a block that must be decoded but isn't used. */
+static void discard_field(
+    void* ctx, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    (void) ctx, (void) name, (void) name_len, (void) value, (void) value_len;
+}
+
+/** @brief Copy a pseudo-header value, the request is malformed if it's repeated or too long. */
+static void copy_pseudo(H2Request* r, char* dest, size_t size, const char* value, size_t len)
+{
+    if (dest[0] != '\0' || len == 0 || len >= size)
+    {
+        r->malformed = 1;
+        return;
+    }
+
+    memcpy(dest, value, len);
+    dest[len] = '\0';
+}
+
+/** @brief Add a header field to the request being rebuilt. */
+static void collect_field(
+    void* ctx, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    H2Request* r = ctx;
+
+    // Anything that would end a line could smuggle headers into the rebuilt request
+    if (name_len == 0 || memchr(value, '\r', value_len) || memchr(value, '\n', value_len) ||
+        memchr(value, '\0', value_len))
+    {
+        r->malformed = 1;
+        return;
+    }
+
+    for (size_t i = name[0] == ':' ? 1 : 0; i < name_len; i++)
+        if (name[i] <= ' ' || name[i] == ':' || name[i] >= 0x7f
+            || (name[i] >= 'A' && name[i] <= 'Z'))
+        {
+            r->malformed = 1;  // HTTP/2 field names are lower case tokens
+            return;
+        }
+
+    if (name[0] == ':')
+    {
+        if (r->regular)
+            r->malformed = 1;
+        else if (name_len == 7 && memcmp(name, ":method", 7) == 0)
+            copy_pseudo(r, r->method, sizeof r->method, value, value_len);
+        else if (name_len == 5 && memcmp(name, ":path", 5) == 0)
+        {
+            for (size_t i = 0; i < value_len; i++)
+                if ((unsigned char) value[i] <= ' ' || value[i] == 0x7f)
+                {
+                    r->malformed = 1;  // Would split the request line we rebuild
+                    return;
+                }
+            copy_pseudo(r, r->path, sizeof r->path, value, value_len);
+        }
+        else if (name_len == 10 && memcmp(name, ":authority", 10) == 0)
+            copy_pseudo(r, r->authority, sizeof r->authority, value, value_len);
+        else if (name_len != 7 || memcmp(name, ":scheme", 7) != 0)
+            r->malformed = 1;
+        return;
+    }
+
+    r->regular = 1;
+
+    static const char* connection_specific[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL};
+    for (const char** c = connection_specific; *c; c++)
+        if (name_len == strlen(*c) && memcmp(name, *c, name_len) == 0)
+        {
+            r->malformed = 1;
+            return;
+        }
+
+    if (name_len == 2 && memcmp(name, "te", 2) == 0)  // Only "trailers", of no use to us
+    {
+        if (value_len != 8 || memcmp(value, "trailers", 8) != 0)
+            r->malformed = 1;
+        return;
+    }
+
+    if (name_len == 4 && memcmp(name, "host", 4) == 0)
+        r->host = 1;
+
+    if (r->fields_len + name_len + value_len + 4 >= sizeof r->fields)
+    {
+        r->too_large = 1;
+        return;
+    }
+
+    r->fields_len += snprintf(r->fields + r->fields_len,
+                              sizeof r->fields - r->fields_len,
+                              "%.*s: %.*s\r\n",
+                              (int) name_len,
+                              name,
+                              (int) value_len,
+                              value);
+}
+
+/**
+ * @brief Rebuild a request as the HTTP/1.1 header handle_user_request() reads.
+ * @return The header, or NULL if out of memory. */
+static char* request_text(const H2Request* r)
+{
+    size_t size = HEADER_MAX + sizeof r->path + sizeof r->authority + 64;
+    char*  req  = malloc(size);
+    if (!req)
+        return NULL;
+
+    int len = snprintf(req, size, "%s %s HTTP/1.1\r\n", r->method, r->path);
+    if (!r->host && r->authority[0] != '\0')
+        len += snprintf(req + len, size - len, "Host: %s\r\n", r->authority);
+    if (!r->too_large)
+        len += snprintf(req + len, size - len, "%.*s", (int) r->fields_len, r->fields);
+    snprintf(req + len, size - len, "\r\n");
+
+    return req;
+}
+
+/** @brief Open a stream for a request whose header block is complete. */
+static void stream_open(uint32_t id, const uint8_t* block, size_t len, int end_stream)
+{
+    H2Request r;
+    r.method[0] = r.path[0] = r.authority[0] = '\0';
+    r.fields_len = 0;
+    r.host = r.regular = r.malformed = r.too_large = 0;
+
+    if (hpack_decode(&h2.decoder, block, len, collect_field, &r))
+    {
+        connection_error(H2_COMPRESSION_ERROR, "malformed header block");
+        return;
+    }
+
+    h2.last_stream = id;
+    if (h2.goaway)  // The client will retry it on a new connection
+        return;
+
+    if (r.malformed || r.method[0] == '\0' || r.path[0] == '\0')
+    {
+        wlog(WARNING, "Malformed request on HTTP/2 stream %u.", id);
+        queue_rst(id, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    H2Stream* s = NULL;
+    for (int i = 0; i < HTTP2_STREAMS && !s; i++)
+        if (h2.streams[i].state == H2S_FREE)
+            s = &h2.streams[i];
+
+    if (!s)  // Over the limit we announced, possibly before the client got it
+    {
+        wlog(DEBUG, "No room for HTTP/2 stream %u, refusing it.", id);
+        queue_rst(id, H2_REFUSED_STREAM);
+        return;
+    }
+
+    memset(s, 0, sizeof *s);
+    s->id        = id;
+    s->fd        = -1;
+    s->window    = h2.initial_window;
+    s->head      = strcmp(r.method, "HEAD") == 0;
+    s->too_large = r.too_large;
+    s->req       = request_text(&r);
+    s->state     = end_stream ? H2S_READY : H2S_RECV;
+
+    if (!s->req)
+        stream_reset(s, H2_INTERNAL_ERROR);
+}
+
+/** @brief A header block is complete: open its stream, or take it as trailers. */
+static void header_block_done()
+{
+    uint32_t  id = h2.block_stream;
+    H2Stream* s  = stream_find(id);
+
+    h2.block_stream = 0;
+
+    if (id > h2.last_stream)
+    {
+        stream_open(id, h2.block, h2.block_len, h2.block_end_stream);
+        return;
+    }
+
+    // Trailers, or a block for a stream we already reset: decoded all the same
+    if (hpack_decode(&h2.decoder, h2.block, h2.block_len, discard_field, NULL))
+    {
+        connection_error(H2_COMPRESSION_ERROR, "malformed header block");
+        return;
+    }
+
+    if (s && s->state != H2S_RECV)
+        stream_reset(s, H2_STREAM_CLOSED);
+    else if (s && h2.block_end_stream)
+        s->state = H2S_READY;
+}
+
+/** @brief Add a header block fragment, until the block is complete. */
+static void header_fragment(const uint8_t* p, size_t len, int flags)
+{
+    if (h2.block_len + len > sizeof h2.block)
+    {
+        connection_error(H2_ENHANCE_YOUR_CALM, "header block too large");
+        return;
+    }
+
+    memcpy(h2.block + h2.block_len, p, len);
+    h2.block_len += len;
+
+    if (flags & H2_FLAG_END_HEADERS)
+        header_block_done();
+}
+
+/**
+ * @brief Strip the padding of a DATA or HEADERS frame.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the padding is invalid. */
+static int unpad(const uint8_t** p, size_t* len, int flags)
+{
+    if (!(flags & H2_FLAG_PADDED))
+        return EXIT_SUCCESS;
+
+    if (*len < 1 || **p >= *len)
+    {
+        connection_error(H2_PROTOCOL_ERROR, "invalid padding");
+        return EXIT_FAILURE;
+    }
+
+    *len -= 1 + **p;
+    (*p)++;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void on_data(uint32_t id, int flags, const uint8_t* p, size_t len)
+{
+    size_t    frame_len = len;  // Flow control counts the padding too
+    H2Stream* s         = stream_find(id);
+
+    if (id == 0 || id > h2.last_stream)
+    {
+        connection_error(H2_PROTOCOL_ERROR, "DATA on an idle stream");
+        return;
+    }
+
+    if (unpad(&p, &len, flags))
+        return;
+
+    if (frame_len > 0)  // Request bodies aren't read, so the window is given back right away
+        queue_window_update(0, frame_len);
+
+    if (!s)  // Reset by us, what was in flight is dropped
+        return;
+
+    if (s->state != H2S_RECV)
+    {
+        stream_reset(s, H2_STREAM_CLOSED);
+        return;
+    }
+
+    if (flags & H2_FLAG_END_STREAM)
+        s->state = H2S_READY;
+    else if (frame_len > 0)
+        queue_window_update(id, frame_len);
+}
+
+static void on_headers(uint32_t id, int flags, const uint8_t* p, size_t len)
+{
+    if (id == 0 || id % 2 == 0)
+    {
+        connection_error(H2_PROTOCOL_ERROR, "HEADERS on an invalid stream");
+        return;
+    }
+
+    if (unpad(&p, &len, flags))
+        return;
+
+    if (flags & H2_FLAG_PRIORITY)  // Priorities are ignored, streams take turns
+    {
+        if (len < 5)
+        {
+            connection_error(H2_PROTOCOL_ERROR, "HEADERS too short");
+            return;
+        }
+        p += 5;
+        len -= 5;
+    }
+
+    h2.block_len        = 0;
+    h2.block_stream     = id;
+    h2.block_end_stream = flags & H2_FLAG_END_STREAM;
+    header_fragment(p, len, flags);
+}
+
+static void on_window_update(uint32_t id, const uint8_t* p, size_t len)
+{
+    if (len != 4)
+    {
+        connection_error(H2_FRAME_SIZE_ERROR, "WINDOW_UPDATE of invalid size");
+        return;
+    }
+
+    uint32_t  increment = get32(p) & 0x7fffffff;
+    H2Stream* s         = id ? stream_find(id) : NULL;
+
+    if (id == 0)
+    {
+        h2.window += increment;
+        if (increment == 0 || h2.window > H2_WINDOW_MAX)
+            connection_error(increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR,
+                             "invalid connection WINDOW_UPDATE");
+        return;
+    }
+
+    if (!s || s->fin)
+        return;
+
+    s->window += increment;
+    if (increment == 0)
+        stream_reset(s, H2_PROTOCOL_ERROR);
+    else if (s->window > H2_WINDOW_MAX)
+        stream_reset(s, H2_FLOW_CONTROL_ERROR);
+}
+
+static void on_rst_stream(uint32_t id)
+{
+    H2Stream* s = stream_find(id);
+    if (!s)
+        return;
+
+    wlog(DEBUG, "Client reset stream %u.", id);
+    s->fin   = 1;  // Nothing more may be sent on it, not even RST_STREAM
+    s->reset = 1;
+    stream_close(s);
+}
+
+/** @brief Handle one frame from the client. */
+static void process_frame(int type, int flags, uint32_t id, const uint8_t* p, size_t len)
+{
+    if (h2.block_stream && (type != H2_CONTINUATION || id != h2.block_stream))
+    {
+        connection_error(H2_PROTOCOL_ERROR, "header block interrupted");
+        return;
+    }
+
+    switch (type)
+    {
+        case H2_DATA:
+            on_data(id, flags, p, len);
+            break;
+
+        case H2_HEADERS:
+            on_headers(id, flags, p, len);
+            break;
+
+        case H2_CONTINUATION:
+            if (!h2.block_stream)
+                connection_error(H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+            else
+                header_fragment(p, len, flags);
+            break;
+
+        case H2_RST_STREAM:
+            if (len != 4)
+                connection_error(H2_FRAME_SIZE_ERROR, "RST_STREAM of invalid size");
+            else if (id == 0 || id > h2.last_stream)
+                connection_error(H2_PROTOCOL_ERROR, "RST_STREAM on an idle stream");
+            else
+                on_rst_stream(id);
+            break;
+
+        case H2_SETTINGS:
+            if (id != 0)
+                connection_error(H2_PROTOCOL_ERROR, "SETTINGS on a stream");
+            else if ((flags & H2_FLAG_ACK) ? len != 0 : len % 6 != 0)
+                connection_error(H2_FRAME_SIZE_ERROR, "SETTINGS of invalid size");
+            else if (!(flags & H2_FLAG_ACK) && apply_settings(p, len) == EXIT_SUCCESS)
+                queue_frame(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            break;
+
+        case H2_PING:
+            if (id != 0 || len != 8)
+                connection_error(H2_PROTOCOL_ERROR, "invalid PING");
+            else if (!(flags & H2_FLAG_ACK))
+                queue_frame(H2_PING, H2_FLAG_ACK, 0, p, len);
+            break;
+
+        case H2_GOAWAY:
+            wlog(DEBUG, "Client is going away.");
+            h2.goaway = 1;  // Streams already open are still answered
+            if (!h2.goaway_last)
+                h2.goaway_last = h2.last_stream;
+            break;
+
+        case H2_WINDOW_UPDATE:
+            on_window_update(id, p, len);
+            break;
+
+        case H2_PUSH_PROMISE:
+            connection_error(H2_PROTOCOL_ERROR, "PUSH_PROMISE from a client");
+            break;
+
+        default:  // PRIORITY and unknown frame types are ignored
+            break;
+    }
+}
+
+/** @brief Handle the complete frames received so far. */
+static void process_input()
+{
+    size_t pos = 0;
+
+    if (!h2.preface)
+    {
+        size_t n = h2.in_len < H2_PREFACE_LEN ? h2.in_len : H2_PREFACE_LEN;
+        if (memcmp(h2.in, H2_PREFACE, n) != 0)
+        {
+            wlog(WARNING, "Invalid HTTP/2 connection preface.");
+            h2.closed = h2.error = 1;
+            return;
+        }
+
+        if (n < H2_PREFACE_LEN)
+            return;
+
+        h2.preface = 1;
+        pos        = H2_PREFACE_LEN;
+    }
+
+    while (!h2.closed && h2.in_len - pos >= H2_FRAME_HEADER)
+    {
+        const uint8_t* p   = h2.in + pos;
+        size_t         len = p[0] << 16 | p[1] << 8 | p[2];
+
+        if (len > H2_FRAME_MAX)
+        {
+            connection_error(H2_FRAME_SIZE_ERROR, "frame larger than SETTINGS_MAX_FRAME_SIZE");
+            break;
+        }
+
+        if (h2.in_len - pos < H2_FRAME_HEADER + len)
+            break;
+
+        process_frame(p[3], p[4], get32(p + 5) & 0x7fffffff, p + H2_FRAME_HEADER, len);
+        pos += H2_FRAME_HEADER + len;
+    }
+
+    memmove(h2.in, h2.in + pos, h2.in_len - pos);
+    h2.in_len -= pos;
+}
+
+/** @brief Read what the client sent and handle it. */
+static void read_input()
+{
+    ssize_t n = tls_recv(h2.socket, h2.in + h2.in_len, sizeof h2.in - h2.in_len, MSG_DONTWAIT);
+
+    if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    if (n <= 0)
+    {
+        if (n == -1)
+            wlog(DEBUG, "Failed to receive data: (%d) %s.", errno, strerror(errno));
+        h2.closed = 1;
+        return;
+    }
+
+    h2.in_len += n;
+    process_input();
+}
+
+/**
+ * @brief Schedule frames, then wait until the socket can be read or written and do so.
+ * @param wait Whether to block until something happens.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the connection is closed. */
+static int pump(int wait)
+{
+    schedule();
+
+    struct pollfd pfd     = {.fd     = h2.socket,
+                             .events = POLLIN | (h2.out_off < h2.out_len ? POLLOUT : 0)};
+    int           pending = tls_pending();  // Already decrypted, poll() can't see it
+
+    if (wait && !pending && (pfd.events & POLLOUT))  // Blocked on a full socket
+        sched_waiting();
+
+    int ready = poll(&pfd, 1, wait && !pending ? -1 : 0);  // Stuck clients are killed
+
+    if (ready == -1 && errno != EINTR)
+    {
+        wlog(ERROR, "Polling client socket failed: (%d) %s.", errno, strerror(errno));
+        h2.closed = 1;
+    }
+
+    if (ready > 0 && (pfd.revents & POLLOUT))
+        write_output();
+
+    if (pending || (ready > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR))))
+        read_input();
+
+    return h2.closed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Handle the request of a stream. */
+static void run_stream(H2Stream* s)
+{
+    h2_current      = s;
+    s->state        = H2S_RUNNING;
+    http_keep_alive = 1;  // Both only shape HTTP/1.1 framing, which streams don't use
+    http_chunked    = 1;
+    STAT_ADD(h2_streams, 1);
+
+    wlog(DEBUG, "Handling HTTP/2 stream %u.", s->id);
+
+    trace_mark(TRACE_FIRST_BYTE);  // Received along with the other streams
+    trace_mark(TRACE_PARSED);
+    if (s->req)
+    {
+        trace_request(s->req, strlen(s->req), 2);
+        capture_request(s->req, strlen(s->req), 2);
+    }
+
+    if (h2.served++ && ratelimit_request())  // The first request was charged on accept
+    {
+        wlog(DEBUG, "Client over its rate limit, answering stream with 429.");
+        send_error_page(h2.socket, "429 Too Many Requests", "429", "Slow down.");
+    }
+    else if (s->too_large)
+    {
+        wlog(WARNING, "Request header larger than %d bytes.", HEADER_MAX);
+        send_error_page(
+            h2.socket, "431 Request Header Fields Too Large", "431", "Request header too large.");
+    }
+    else
+    {
+        uint64_t start = now_us();
+
+        if (handle_user_request(h2.socket, s->req))
+            wlog(ERROR, "Failure during request handling.");
+
+        listener_request_done(start);
+    }
+
+    trace_queued(s->body_len);  // Sent after this, interleaved with the other streams
+    trace_end();
+    arena_reset();
+    h2_current = NULL;
+
+    if (!s->reset && !s->ended)  // The handler gave up without ending the response
+        stream_reset(s, H2_INTERNAL_ERROR);
+
+    s->state = H2S_SENDING;
+    free(s->req);
+    s->req = NULL;
+    if (s->fin)  // Sent or reset while it ran
+        stream_close(s);
+}
+
+/** @brief The stream to handle next: the oldest complete request. */
+static H2Stream* next_ready()
+{
+    H2Stream* next = NULL;
+
+    for (int i = 0; i < HTTP2_STREAMS; i++)
+    {
+        H2Stream* s = &h2.streams[i];
+        if (s->state == H2S_READY && (!next || s->id < next->id))
+            next = s;
+    }
+
+    return next;
+}
+
+/** @brief Whether any stream is open, or anything waits to be sent. */
+static int busy()
+{
+    for (int i = 0; i < HTTP2_STREAMS; i++)
+        if (h2.streams[i].state != H2S_FREE)
+            return 1;
+
+    return h2.out_off < h2.out_len;
+}
+
+/** @brief Apply the settings of an upgrade request, sent base64url encoded in HTTP2-Settings. */
+static void upgrade_settings(const char* req)
+{
+    size_t      len;
+    const char* value = http_header_value(req, "HTTP2-Settings", &len);
+    uint8_t     payload[256];
+    size_t      n    = 0;
+    uint32_t    bits = 0;
+    int         have = 0;
+
+    for (size_t i = 0; value && i < len && value[i] != '='; i++)
+    {
+        const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        const char* digit  = value[i] ? strchr(digits, value[i]) : NULL;
+
+        if (!digit)
+        {
+            wlog(WARNING, "Invalid HTTP2-Settings header, ignored.");
+            return;
+        }
+
+        bits = bits << 6 | (digit - digits);
+        have += 6;
+        if (have >= 8 && n < sizeof payload)
+        {
+            have -= 8;
+            payload[n++] = bits >> have;
+        }
+    }
+
+    apply_settings(payload, n - n % 6);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int h2_upgrade_requested(const char* req)
+{
+    size_t      len, ignored;
+    const char* upgrade = http_header_value(req, "Upgrade", &len);
+
+    if (!HTTP2 || !upgrade || tls_active() || !http_request_11(req) ||  // h2c is cleartext only
+        !http_header_value(req, "HTTP2-Settings", &ignored) ||
+        http_header_value(req, "Transfer-Encoding", &ignored))
+        return 0;
+
+    const char* length = http_header_value(req, "Content-Length", &ignored);
+    if (length && atol(length) > 0)
+        return 0;
+
+    for (size_t i = 0; i + 3 <= len; i++)  // "h2c" among the protocols offered
+    {
+        char before = i > 0 ? upgrade[i - 1] : ',';
+        char after  = i + 3 < len ? upgrade[i + 3] : ',';
+        if (strncasecmp(upgrade + i, "h2c", 3) == 0 && (before == ',' || before == ' ') &&
+            (after == ',' || after == ' '))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int h2_serve(int client_socket, const char* data, size_t len, size_t upgrade_len)
+{
+    memset(&h2, 0, sizeof h2);
+    h2.socket         = client_socket;
+    h2.window         = H2_WINDOW;
+    h2.initial_window = H2_WINDOW;
+    h2.streams        = calloc(HTTP2_STREAMS, sizeof *h2.streams);
+
+    if (!h2.streams || len - upgrade_len > sizeof h2.in)
+    {
+        wlog(ERROR, "Failed to set up HTTP/2 connection.");
+        free(h2.streams);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < HTTP2_STREAMS; i++)
+        h2.streams[i].fd = -1;
+
+    hpack_decoder_init(&h2.decoder);
+    STAT_ADD(h2_connections, 1);
+    wlog(INFO, "Serving HTTP/2 connection%s.", upgrade_len ? ", upgraded from HTTP/1.1" : "");
+
+    if (upgrade_len)  // The request that asked for it is answered on stream 1
+    {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                        "Connection: Upgrade\r\n"
+                                        "Upgrade: h2c\r\n\r\n";
+        uint8_t*          p           = out_reserve(sizeof switching - 1);
+        if (p)
+            memcpy(p, switching, sizeof switching - 1);
+
+        H2Stream* s = &h2.streams[0];
+        s->req      = strndup(data, upgrade_len);
+        s->id       = 1;
+        s->window   = h2.initial_window;
+        s->head     = strncmp(data, "HEAD ", 5) == 0;
+        s->state    = s->req ? H2S_READY : H2S_FREE;
+        h2.last_stream = 1;
+
+        if (s->req)
+            upgrade_settings(s->req);
+    }
+
+    uint8_t settings[6];  // Ours: how many streams the client may open at once
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, HTTP2_STREAMS);
+    queue_frame(H2_SETTINGS, 0, 0, settings, sizeof settings);
+
+    memcpy(h2.in, data + upgrade_len, len - upgrade_len);
+    h2.in_len = len - upgrade_len;
+    process_input();
+
+    int phase = -1;
+    while (!h2.closed)
+    {
+        if (shut_req && !h2.goaway)  // Streams already open are still answered
+            queue_goaway(H2_NO_ERROR);
+
+        // After an upgrade, stream 1 waits for the preface: the client reads
+        // what follows 101 as HTTP/2 only once it has switched itself
+        H2Stream* next = h2.preface ? next_ready() : NULL;
+        if (next)
+        {
+            run_stream(next);
+            pump(0);
+            continue;
+        }
+
+        int active = busy();
+        if (!active && h2.goaway)
+            break;
+
+        // Idle between requests, like a kept-alive HTTP/1.1 connection
+        if ((active ? PHASE_SEND : PHASE_IDLE) != phase)
+        {
+            phase = active ? PHASE_SEND : PHASE_IDLE;
+            if (!active)
+                access_log_flush();  // The timeout may close an idle connection
+            conn_phase((ConnPhase) phase);
+        }
+
+        pump(1);
+    }
+
+    if (h2.out_off < h2.out_len)  // GOAWAY after an error, if the socket takes it
+        tls_send(client_socket, h2.out + h2.out_off, h2.out_len - h2.out_off,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    for (int i = 0; i < HTTP2_STREAMS; i++)
+        stream_close(&h2.streams[i]);
+
+    free(h2.streams);
+    free(h2.out);
+    hpack_decoder_free(&h2.decoder);
+    wlog(INFO, "HTTP/2 connection closed.");
+
+    return h2.error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Whether a response header line is about this connection, not the response. */
+static int connection_specific(const char* name, size_t len)
+{
+    static const char* names[] = {"connection",
+                                  "keep-alive",
+                                  "proxy-connection",
+                                  "transfer-encoding",
+                                  "upgrade",
+                                  "content-length",  // Added from the framing given
+                                  NULL};
+
+    for (const char** n = names; *n; n++)
+        if (len == strlen(*n) && strncasecmp(name, *n, len) == 0)
+            return 1;
+
+    return 0;
+}
+
+int h2_stream_begin(
+    H2Stream* s, const char* head, size_t head_len, long long content_length, int end)
+{
+    if (s->reset || h2.closed)
+        return EXIT_FAILURE;
+
+    if (s->begun)
+    {
+        wlog(ERROR, "Response already started on stream %u.", s->id);
+        return EXIT_FAILURE;
+    }
+
+    const char* end_of_head = head + head_len;
+    const char* status      = memchr(head, ' ', head_len);
+    const char* line        = memchr(head, '\n', head_len);
+
+    uint8_t block[H2_HEADER_BLOCK];
+    size_t  n = status ? hpack_encode_status(block, sizeof block, atoi(status + 1)) : 0;
+
+    // Header lines, up to the blank line ending them
+    while (n && line && ++line < end_of_head && *line != '\r')
+    {
+        const char* eol   = memchr(line, '\r', end_of_head - line);
+        const char* colon = memchr(line, ':', (eol ? eol : end_of_head) - line);
+        if (!eol)
+            break;
+
+        if (colon && !connection_specific(line, colon - line))
+        {
+            const char* value = colon + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                value++;
+
+            size_t w = hpack_encode_header(
+                block + n, sizeof block - n, line, colon - line, value, eol - value);
+            n = w ? n + w : 0;
+        }
+
+        line = eol + 1;
+    }
+
+    if (n && content_length >= 0)
+    {
+        char length[24];
+        int  length_len = snprintf(length, sizeof length, "%lld", content_length);
+        size_t w = hpack_encode_header(
+            block + n, sizeof block - n, "content-length", 14, length, length_len);
+        n = w ? n + w : 0;
+    }
+
+    if (n == 0)
+    {
+        wlog(ERROR, "Response header does not fit in an HTTP/2 header block.");
+        return EXIT_FAILURE;
+    }
+
+    end = end || s->head;
+
+    // HEADERS, then CONTINUATIONs for what doesn't fit in a frame
+    for (size_t sent = 0; sent < n;)
+    {
+        size_t piece = n - sent < H2_FRAME_MAX ? n - sent : H2_FRAME_MAX;
+        int    flags = sent + piece == n ? H2_FLAG_END_HEADERS : 0;
+
+        if (sent == 0)
+            queue_frame(H2_HEADERS, flags | (end ? H2_FLAG_END_STREAM : 0), s->id, block, piece);
+        else
+            queue_frame(H2_CONTINUATION, flags, s->id, block + sent, piece);
+        sent += piece;
+    }
+
+    s->begun = 1;
+    if (end)  // Nothing follows, body writes are dropped
+        s->fin = s->ended = 1;
+
+    return h2.closed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Keep the connection going until a stream has at most limit bytes queued.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the stream was reset or
+ *         the connection failed. */
+static int stream_wait(H2Stream* s, size_t limit)
+{
+    while (!s->reset && stream_pending(s) > limit && pump(1) == EXIT_SUCCESS)
+        ;
+
+    return s->reset || h2.closed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int h2_stream_write(H2Stream* s, const void* data, size_t len)
+{
+    if (s->reset || h2.closed)
+        return EXIT_FAILURE;
+
+    if (s->fin)  // A response without a body, to HEAD
+        return EXIT_SUCCESS;
+
+    if (s->file_left > 0 && stream_wait(s, 0))  // These bytes come after the file
+        return EXIT_FAILURE;
+
+    if (s->out_len + len > s->out_size)
+    {
+        size_t size = s->out_len + len > 2 * s->out_size ? s->out_len + len : 2 * s->out_size;
+        char*  out  = realloc(s->out, size);
+        if (!out)
+        {
+            wlog(ERROR, "Out of memory for HTTP/2 stream output.");
+            return EXIT_FAILURE;
+        }
+        s->out      = out;
+        s->out_size = size;
+    }
+
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+    s->body_len += len;
+
+    return stream_wait(s, H2_STREAM_BUFFER);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int h2_stream_sendfile(H2Stream* s, int fd, off_t offset, size_t len)
+{
+    if (s->reset || h2.closed)
+        return EXIT_FAILURE;
+
+    if (s->fin)
+        return EXIT_SUCCESS;
+
+    if (s->file_left > 0 && stream_wait(s, 0))  // One file at a time
+        return EXIT_FAILURE;
+
+    s->fd = dup(fd);
+    if (s->fd == -1)
+    {
+        wlog(ERROR, "Failed to keep file for stream %u: (%d) %s.", s->id, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    s->file_off  = offset;
+    s->file_left = len;
+    s->body_len += len;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int h2_stream_flush(H2Stream* s)
+{
+    // Until the stream's bytes are out of our buffers, not just framed
+    while (!s->reset && (s->out_len > s->out_off || h2.out_off < h2.out_len) &&
+           pump(1) == EXIT_SUCCESS)
+        ;
+
+    return s->reset || h2.closed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int h2_stream_end(H2Stream* s)
+{
+    if (s->reset)
+        return EXIT_FAILURE;
+
+    s->ended = 1;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void h2_stream_abort(H2Stream* s)
+{
+    if (!s->reset)
+        stream_reset(s, H2_INTERNAL_ERROR);
+}
@@ -0,0 +1,494 @@
+#include "hpack.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Longest name or value decoded, longer ones are refused. */
+#define HPACK_STRING_MAX 8192
+
+/** @brief Longest Huffman code, in bits. */
+#define HUFFMAN_MAX_BITS 30
+
+/** @brief The HPACK static table (RFC 7541, Appendix A). Index 0 is unused. */
+static const struct
+{
+    const char* name;
+    const char* value;
+} static_table[] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/** @brief Number of static table entries, index 0 included. */
+#define STATIC_ENTRIES (sizeof static_table / sizeof static_table[0])
+
+/**
+ * @brief Length in bits of the Huffman code of each symbol (RFC 7541, Appendix B),
+ * 256 being EOS. The code is canonical, so the lengths are enough to rebuild it. */
+static const uint8_t huffman_bits[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/**
+ * @brief Canonical decoding tables, built from huffman_bits on first use.
+ * Codes of one length are consecutive, starting at first_code, and their
+ * symbols are listed in order in symbols, starting at first_symbol. */
+static struct
+{
+    int      ready;
+    uint32_t first_code[HUFFMAN_MAX_BITS + 1];
+    uint16_t first_symbol[HUFFMAN_MAX_BITS + 1];
+    uint16_t count[HUFFMAN_MAX_BITS + 1];
+    uint16_t symbols[257];
+} huffman;
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Build the canonical decoding tables. */
+static void huffman_setup()
+{
+    uint16_t n = 0;
+    for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++)
+    {
+        huffman.first_symbol[bits] = n;
+        for (int sym = 0; sym < 257; sym++)
+            if (huffman_bits[sym] == bits)
+                huffman.symbols[n++] = sym;
+        huffman.count[bits] = n - huffman.first_symbol[bits];
+    }
+
+    uint32_t code = 0;
+    for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++)
+    {
+        huffman.first_code[bits] = code;
+        code                     = (code + huffman.count[bits]) << 1;
+    }
+
+    huffman.ready = 1;
+}
+
+/**
+ * @brief Decode a Huffman coded string.
+ * @return Decoded length, or -1 if it is malformed or longer than size. */
+static long huffman_decode(const uint8_t* in, size_t len, char* out, size_t size)
+{
+    if (!huffman.ready)
+        huffman_setup();
+
+    uint32_t code    = 0;  // Bits of the symbol being read
+    int      bits    = 0;
+    size_t   written = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int bit = 7; bit >= 0; bit--)
+        {
+            code = code << 1 | ((in[i] >> bit) & 1);
+            bits++;
+
+            uint32_t rank = code - huffman.first_code[bits];
+            if (rank < huffman.count[bits])
+            {
+                uint16_t sym = huffman.symbols[huffman.first_symbol[bits] + rank];
+                if (sym == 256 || written == size)  // EOS may only appear as padding
+                    return -1;
+
+                out[written++] = (char) sym;
+                code           = 0;
+                bits           = 0;
+            }
+            else if (bits == HUFFMAN_MAX_BITS)
+                return -1;
+        }
+    }
+
+    // Padding: fewer than 8 bits, all ones (the start of EOS)
+    if (bits > 7 || code != (1u << bits) - 1)
+        return -1;
+
+    return written;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Read an integer with an N-bit prefix.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if it is truncated or too large. */
+static int read_int(const uint8_t** p, const uint8_t* end, int prefix, size_t* value)
+{
+    if (*p >= end)
+        return EXIT_FAILURE;
+
+    size_t max = (1u << prefix) - 1;
+    size_t v   = **p & max;
+    (*p)++;
+
+    for (int shift = 0; v >= max; shift += 7)
+    {
+        if (*p >= end || shift > 21)  // Nothing we accept needs more than 28 bits
+            return EXIT_FAILURE;
+
+        uint8_t b = *(*p)++;
+        v += (size_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+
+    *value = v;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Read a string literal, Huffman coded or not.
+ * @return Its length, or -1 if it is malformed or longer than size. */
+static long read_string(const uint8_t** p, const uint8_t* end, char* out, size_t size)
+{
+    if (*p >= end)
+        return -1;
+
+    int    coded = **p & 0x80;
+    size_t len;
+    if (read_int(p, end, 7, &len) || len > (size_t) (end - *p))
+        return -1;
+
+    const uint8_t* data = *p;
+    *p += len;
+
+    if (coded)
+        return huffman_decode(data, len, out, size);
+
+    if (len > size)
+        return -1;
+
+    memcpy(out, data, len);
+    return len;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Drop the oldest entry of the dynamic table. */
+static void table_evict(HpackDecoder* d)
+{
+    HpackEntry* e = &d->entries[(d->first + d->count - 1) % HPACK_MAX_ENTRIES];
+
+    d->size -= e->name_len + e->value_len + 32;
+    d->count--;
+    free(e->name);
+    e->name = NULL;
+}
+
+/** @brief Add a header field to the dynamic table, evicting old entries to make room. */
+static void table_add(
+    HpackDecoder* d, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    size_t entry_size = name_len + value_len + 32;
+    char*  copy       = entry_size <= d->limit ? malloc(name_len + value_len) : NULL;
+
+    if (copy)  // Copied first, the name may be one of the entries evicted
+    {
+        memcpy(copy, name, name_len);
+        memcpy(copy + name_len, value, value_len);
+    }
+
+    while (d->count > 0 && (d->size + entry_size > d->limit || !copy))
+        table_evict(d);
+
+    if (!copy)  // Larger than the table: it empties the table (or we're out of memory)
+        return;
+
+    d->first                       = (d->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    d->entries[d->first].name      = copy;
+    d->entries[d->first].name_len  = name_len;
+    d->entries[d->first].value_len = value_len;
+    d->size += entry_size;
+    d->count++;
+}
+
+/**
+ * @brief Look up a header field by index, in the static then the dynamic table.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if there's no such entry. */
+static int table_get(const HpackDecoder* d,
+                     size_t              index,
+                     const char**        name,
+                     size_t*             name_len,
+                     const char**        value,
+                     size_t*             value_len)
+{
+    if (index == 0)
+        return EXIT_FAILURE;
+
+    if (index < STATIC_ENTRIES)
+    {
+        *name      = static_table[index].name;
+        *name_len  = strlen(*name);
+        *value     = static_table[index].value;
+        *value_len = strlen(*value);
+        return EXIT_SUCCESS;
+    }
+
+    index -= STATIC_ENTRIES;
+    if (index >= d->count)
+        return EXIT_FAILURE;
+
+    const HpackEntry* e = &d->entries[(d->first + index) % HPACK_MAX_ENTRIES];
+    *name               = e->name;
+    *name_len           = e->name_len;
+    *value              = e->name + e->name_len;
+    *value_len          = e->value_len;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void hpack_decoder_init(HpackDecoder* d)
+{
+    memset(d, 0, sizeof *d);
+    d->limit = HPACK_TABLE_SIZE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void hpack_decoder_free(HpackDecoder* d)
+{
+    while (d->count > 0)
+        table_evict(d);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int hpack_decode(HpackDecoder* d, const uint8_t* block, size_t len, HpackHeaderFn emit, void* ctx)
+{
+    const uint8_t* p   = block;
+    const uint8_t* end = block + len;
+    char           name_buff[HPACK_STRING_MAX], value_buff[HPACK_STRING_MAX];
+
+    while (p < end)
+    {
+        const char* name;
+        const char* value;
+        size_t      name_len, value_len, index;
+
+        if (*p & 0x80)  // Indexed header field
+        {
+            if (read_int(&p, end, 7, &index) ||
+                table_get(d, index, &name, &name_len, &value, &value_len))
+                return EXIT_FAILURE;
+
+            emit(ctx, name, name_len, value, value_len);
+            continue;
+        }
+
+        if ((*p & 0xe0) == 0x20)  // Dynamic table size update
+        {
+            if (read_int(&p, end, 5, &index) || index > HPACK_TABLE_SIZE)
+                return EXIT_FAILURE;
+
+            d->limit = index;
+            while (d->size > d->limit)
+                table_evict(d);
+            continue;
+        }
+
+        // Literal, with incremental indexing (6-bit index) or without (4-bit, never indexed too)
+        int indexing = (*p & 0xc0) == 0x40;
+        if (read_int(&p, end, indexing ? 6 : 4, &index))
+            return EXIT_FAILURE;
+
+        if (index > 0)
+        {
+            if (table_get(d, index, &name, &name_len, &value, &value_len))
+                return EXIT_FAILURE;
+        }
+        else
+        {
+            long n = read_string(&p, end, name_buff, sizeof name_buff);
+            if (n < 0)
+                return EXIT_FAILURE;
+            name     = name_buff;
+            name_len = n;
+        }
+
+        long n = read_string(&p, end, value_buff, sizeof value_buff);
+        if (n < 0)
+            return EXIT_FAILURE;
+
+        emit(ctx, name, name_len, value_buff, n);
+        if (indexing)
+            table_add(d, name, name_len, value_buff, n);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Write an integer with an N-bit prefix, after the pattern bits of the first byte.
+ * @return Bytes written, 0 if they did not fit. */
+static size_t write_int(uint8_t* out, size_t size, uint8_t pattern, int prefix, size_t value)
+{
+    size_t max = (1u << prefix) - 1;
+    size_t len = 0;
+
+    if (size == 0)
+        return 0;
+
+    if (value < max)
+    {
+        out[len++] = pattern | value;
+        return len;
+    }
+
+    out[len++] = pattern | max;
+    for (value -= max; value >= 0x80; value >>= 7)
+    {
+        if (len == size)
+            return 0;
+        out[len++] = 0x80 | (value & 0x7f);
+    }
+
+    if (len == size)
+        return 0;
+    out[len++] = value;
+    return len;
+}
+
+/**
+ * @brief Write a string literal, not Huffman coded, lower-casing it if asked.
+ * @return Bytes written, 0 if they did not fit. */
+static size_t write_string(uint8_t* out, size_t size, const char* s, size_t len, int lower)
+{
+    size_t n = write_int(out, size, 0x00, 7, len);
+
+    if (n == 0 || n + len > size)
+        return 0;
+
+    for (size_t i = 0; i < len; i++)
+        out[n + i] = lower ? tolower((unsigned char) s[i]) : s[i];
+
+    return n + len;
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t hpack_encode_status(uint8_t* out, size_t size, int status)
+{
+    for (size_t i = 8; i <= 14; i++)  // :status entries
+        if (atoi(static_table[i].value) == status)
+            return write_int(out, size, 0x80, 7, i);
+
+    char digits[8];
+    snprintf(digits, sizeof digits, "%03u", (unsigned) status % 1000);
+
+    size_t n = write_int(out, size, 0x00, 4, 8);  // Literal, name ":status"
+    size_t v = n ? write_string(out + n, size - n, digits, 3, 0) : 0;
+    return v ? n + v : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t hpack_encode_header(uint8_t*    out,
+                           size_t      size,
+                           const char* name,
+                           size_t      name_len,
+                           const char* value,
+                           size_t      value_len)
+{
+    size_t index = 0;
+    for (size_t i = 15; i < STATIC_ENTRIES && index == 0; i++)  // Past the pseudo-headers
+        if (strlen(static_table[i].name) == name_len &&
+            strncasecmp(static_table[i].name, name, name_len) == 0)
+            index = i;
+
+    // Literal without indexing: we keep no encoder state, so the peer's table stays empty
+    size_t n = write_int(out, size, 0x00, 4, index);
+    if (n && index == 0)
+    {
+        size_t s = write_string(out + n, size - n, name, name_len, 1);
+        n        = s ? n + s : 0;
+    }
+
+    size_t v = n ? write_string(out + n, size - n, value, value_len, 0) : 0;
+    return v ? n + v : 0;
+}
@@ -0,0 +1,410 @@
+#include "html_rewrite.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Parser states. */
+typedef enum HtmlStateEnum
+{
+    HS_TEXT,        /**< Between tags. */
+    HS_TAG_OPEN,    /**< Just after '<'. */
+    HS_DECL,        /**< After "<!", looking for the "--" of a comment. */
+    HS_COMMENT,     /**< Inside "<!-- -->". */
+    HS_TAG_NAME,    /**< Reading the tag name. */
+    HS_TAG,         /**< Inside a tag, between attributes. */
+    HS_ATTR_NAME,   /**< Reading an attribute name. */
+    HS_AFTER_NAME,  /**< After an attribute name, maybe before '='. */
+    HS_BEFORE_VAL,  /**< After '=', before the value. */
+    HS_VALUE,       /**< Reading an attribute value. */
+    HS_RAW,         /**< Inside script or style, looking for the end tag. */
+} HtmlState;
+
+/** @brief How an attribute value is rewritten. */
+typedef enum HtmlValueKindEnum
+{
+    HV_NONE,    /**< Not a URL, passed on as it goes. */
+    HV_URL,     /**< A single URL (src, href). */
+    HV_SRCSET,  /**< A list of URLs with descriptors (srcset). */
+} HtmlValueKind;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Point a URL at the proxy if it points inside the upstream server.
+ * Absolute and protocol-relative URLs to the upstream host become root-relative,
+ * and the upstream path prefix is stripped from root-relative ones. Relative
+ * URLs, URLs to other hosts and root-relative URLs outside the prefix work as
+ * they are (or not at all through the proxy) and are left alone.
+ * @return Length written to out, never more than len. */
+static size_t rewrite_url(const HtmlRewriter* rw, const char* url, size_t len, char* out)
+{
+    const char* path     = NULL;  // Path on the upstream server the URL points at
+    size_t      path_len = 0;
+    size_t      skip     = 0;
+
+    if (len >= 7 && strncasecmp(url, "http://", 7) == 0)
+        skip = 7;
+    else if (len >= 8 && strncasecmp(url, "https://", 8) == 0)
+        skip = 8;
+    else if (len >= 2 && url[0] == '/' && url[1] == '/')
+        skip = 2;
+
+    if (skip)
+    {
+        size_t authority_len = 0;
+        while (skip + authority_len < len && !strchr("/?#", url[skip + authority_len]))
+            authority_len++;
+
+        if (authority_len == strlen(rw->host) &&
+            strncasecmp(url + skip, rw->host, authority_len) == 0)
+        {
+            path     = url + skip + authority_len;
+            path_len = len - skip - authority_len;
+        }
+    }
+    else if (len > 0 && url[0] == '/')
+    {
+        path     = url;
+        path_len = len;
+    }
+
+    size_t prefix_len = strlen(rw->prefix);
+    if (path && prefix_len > 0)
+    {
+        if (path_len >= prefix_len && strncmp(path, rw->prefix, prefix_len) == 0 &&
+            (path_len == prefix_len || strchr("/?#", path[prefix_len])))
+        {
+            path += prefix_len;
+            path_len -= prefix_len;
+        }
+        else
+            path = NULL;  // Outside what we proxy
+    }
+
+    if (!path)
+    {
+        memcpy(out, url, len);
+        return len;
+    }
+
+    size_t written = 0;
+    if (path_len == 0 || path[0] != '/')  // "http://host?q" and "/prefix?q" both mean "/?q"
+        out[written++] = '/';
+
+    memcpy(out + written, path, path_len);
+    return written + path_len;
+}
+
+/**
+ * @brief Rewrite every URL of a srcset value ("a.png 1x, b.png 2x").
+ * @return Length written to out, never more than len. */
+static size_t rewrite_srcset(const HtmlRewriter* rw, const char* value, size_t len, char* out)
+{
+    size_t i = 0, written = 0;
+
+    while (i < len)
+    {
+        // Separators before the URL
+        while (i < len && (isspace((unsigned char) value[i]) || value[i] == ','))
+            out[written++] = value[i++];
+
+        size_t start = i;
+        while (i < len && !isspace((unsigned char) value[i]))
+            i++;
+
+        size_t end = i;  // Trailing commas separate candidates, they're not part of the URL
+        while (end > start && value[end - 1] == ',')
+            end--;
+
+        written += rewrite_url(rw, value + start, end - start, out + written);
+        memcpy(out + written, value + end, i - end);
+        written += i - end;
+
+        // Descriptor ("2x", "100w") up to the next candidate
+        while (i < len && value[i] != ',')
+            out[written++] = value[i++];
+    }
+
+    return written;
+}
+
+/** @brief Write out the held back attribute value, rewritten. */
+static size_t flush_value(HtmlRewriter* rw, char* out)
+{
+    size_t written;
+
+    if (rw->kind == HV_SRCSET)
+        written = rewrite_srcset(rw, rw->value, rw->value_len, out);
+    else if (rw->value_len > 0 && rw->value[0] != '#')  // Fragments stay on the page
+        written = rewrite_url(rw, rw->value, rw->value_len, out);
+    else
+    {
+        memcpy(out, rw->value, rw->value_len);
+        written = rw->value_len;
+    }
+
+    rw->value_len = 0;
+    return written;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Remember a character of a tag or attribute name, lower case. */
+static void name_push(HtmlRewriter* rw, char c)
+{
+    if (rw->name_len < sizeof rw->name - 1)
+        rw->name[rw->name_len++] = (char) tolower((unsigned char) c);
+    rw->name[rw->name_len] = '\0';
+}
+
+static void name_start(HtmlRewriter* rw, char c)
+{
+    rw->name_len = 0;
+    name_push(rw, c);
+}
+
+/** @brief The tag just ended with '>'. */
+static void tag_end(HtmlRewriter* rw)
+{
+    rw->state = rw->raw_end && !rw->closing ? HS_RAW : HS_TEXT;
+    rw->match = 0;
+    if (rw->state == HS_TEXT)
+        rw->raw_end = NULL;
+}
+
+/** @brief The tag name is complete. */
+static void tag_named(HtmlRewriter* rw)
+{
+    rw->raw_end = NULL;
+    if (strcmp(rw->name, "script") == 0)
+        rw->raw_end = "</script";
+    else if (strcmp(rw->name, "style") == 0)
+        rw->raw_end = "</style";
+}
+
+/** @brief An attribute value starts: decide whether to hold it back. */
+static void value_start(HtmlRewriter* rw, char quote)
+{
+    rw->state     = HS_VALUE;
+    rw->quote     = quote;
+    rw->value_len = 0;
+    rw->kind      = HV_NONE;
+
+    if (strcmp(rw->name, "src") == 0 || strcmp(rw->name, "href") == 0)
+        rw->kind = HV_URL;
+    else if (strcmp(rw->name, "srcset") == 0)
+        rw->kind = HV_SRCSET;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void html_rewrite_init(HtmlRewriter* rw, const char* host, const char* prefix)
+{
+    memset(rw, 0, sizeof *rw);
+    rw->state  = HS_TEXT;
+    rw->host   = host;
+    rw->prefix = prefix;
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t html_rewrite(HtmlRewriter* rw, const char* in, size_t len, char* out)
+{
+    size_t written = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        // Most of a page is text or script: copy up to the next '<' in one go
+        if (rw->state == HS_TEXT || (rw->state == HS_RAW && rw->match == 0))
+        {
+            const char* lt   = memchr(in + i, '<', len - i);
+            size_t      skip = (lt ? (size_t) (lt - in) : len) - i;
+            memcpy(out + written, in + i, skip);
+            written += skip;
+            i += skip;
+            if (i == len)
+                break;
+        }
+
+        char c = in[i];
+
+        if (rw->state == HS_VALUE)
+        {
+            int end = rw->quote ? c == rw->quote : isspace((unsigned char) c) || c == '>';
+
+            if (!end && rw->kind != HV_NONE)
+            {
+                if (rw->value_len < sizeof rw->value)
+                {
+                    rw->value[rw->value_len++] = c;
+                    continue;
+                }
+
+                // Too long to be a URL we care about: give it back and stop holding
+                memcpy(out + written, rw->value, rw->value_len);
+                written += rw->value_len;
+                rw->value_len = 0;
+                rw->kind      = HV_NONE;
+            }
+
+            if (end)
+            {
+                if (rw->kind != HV_NONE)
+                    written += flush_value(rw, out + written);
+
+                if (c == '>')
+                    tag_end(rw);
+                else
+                    rw->state = HS_TAG;
+            }
+
+            out[written++] = c;
+            continue;
+        }
+
+        out[written++] = c;
+
+        switch (rw->state)
+        {
+            case HS_TEXT:
+                if (c == '<')
+                    rw->state = HS_TAG_OPEN;
+                break;
+
+            case HS_TAG_OPEN:
+                rw->closing = c == '/';
+                if (c == '!')
+                {
+                    rw->state = HS_DECL;
+                    rw->match = 0;
+                }
+                else if (c == '/')
+                {
+                    rw->state    = HS_TAG_NAME;
+                    rw->name_len = 0;
+                }
+                else if (isalpha((unsigned char) c))
+                {
+                    rw->state = HS_TAG_NAME;
+                    name_start(rw, c);
+                }
+                else
+                    rw->state = c == '<' ? HS_TAG_OPEN : HS_TEXT;  // "a < b"
+                break;
+
+            case HS_DECL:
+                if (c == '-' && ++rw->match == 2)
+                {
+                    rw->state = HS_COMMENT;
+                    rw->match = 0;
+                }
+                else if (c != '-')  // <!DOCTYPE ...>
+                    rw->state = c == '>' ? HS_TEXT : HS_TAG;
+                break;
+
+            case HS_COMMENT:
+                if (c == '-')
+                    rw->match++;
+                else if (c == '>' && rw->match >= 2)
+                    rw->state = HS_TEXT;
+                else
+                    rw->match = 0;
+                break;
+
+            case HS_TAG_NAME:
+                if (isalnum((unsigned char) c) || c == '-')
+                    name_push(rw, c);
+                else
+                {
+                    tag_named(rw);
+                    if (c == '>')
+                        tag_end(rw);
+                    else
+                        rw->state = HS_TAG;
+                }
+                break;
+
+            case HS_TAG:
+                if (c == '>')
+                    tag_end(rw);
+                else if (!isspace((unsigned char) c) && c != '/')
+                {
+                    rw->state = HS_ATTR_NAME;
+                    name_start(rw, c);
+                }
+                break;
+
+            case HS_ATTR_NAME:
+                if (c == '=')
+                    rw->state = HS_BEFORE_VAL;
+                else if (c == '>')
+                    tag_end(rw);
+                else if (isspace((unsigned char) c))
+                    rw->state = HS_AFTER_NAME;
+                else if (c == '/')
+                    rw->state = HS_TAG;
+                else
+                    name_push(rw, c);
+                break;
+
+            case HS_AFTER_NAME:
+                if (c == '=')
+                    rw->state = HS_BEFORE_VAL;
+                else if (c == '>')
+                    tag_end(rw);
+                else if (!isspace((unsigned char) c) && c != '/')
+                {
+                    rw->state = HS_ATTR_NAME;
+                    name_start(rw, c);
+                }
+                break;
+
+            case HS_BEFORE_VAL:
+                if (c == '"' || c == '\'')
+                    value_start(rw, c);
+                else if (c == '>')
+                    tag_end(rw);
+                else if (!isspace((unsigned char) c))
+                {
+                    written--;  // Unquoted: this is the first character of the value
+                    value_start(rw, 0);
+                    i--;
+                }
+                break;
+
+            case HS_RAW:
+                if (tolower((unsigned char) c) == rw->raw_end[rw->match])
+                {
+                    if (rw->raw_end[++rw->match] == '\0')  // End tag, read it as a tag
+                    {
+                        rw->state   = HS_TAG;
+                        rw->closing = 1;
+                    }
+                }
+                else
+                    rw->match = c == '<' ? 1 : 0;
+                break;
+        }
+    }
+
+    return written;
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t html_rewrite_finish(HtmlRewriter* rw, char* out)
+{
+    size_t written = 0;
+
+    if (rw->state == HS_VALUE && rw->kind != HV_NONE)  // Truncated document, give it back as is
+    {
+        memcpy(out, rw->value, rw->value_len);
+        written = rw->value_len;
+    }
+
+    html_rewrite_init(rw, rw->host, rw->prefix);
+    return written;
+}
@@ -0,0 +1,599 @@
+#include "listener.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "shm.h"
+#include "upgrade.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief A listener spec, parsed. */
+typedef struct ListenSpecStruct
+{
+    /** @brief Address to bind to. */
+    struct sockaddr_storage addr;
+    /** @brief Length of addr, abstract Unix names are not null terminated. */
+    socklen_t addr_len;
+    /** @brief "tls" option. */
+    int tls;
+    /** @brief "v6only" option: don't accept IPv4 clients on an IPv6 socket. */
+    int v6only;
+    /** @brief "mode" option, -1 to leave the socket file's permissions alone. */
+    int mode;
+    /** @brief "name" option, empty for the bound address. */
+    char name[128];
+} ListenSpec;
+
+/** @brief The open listeners. */
+static Listener listeners[LISTENERS_MAX];
+
+/** @brief Number of open listeners. */
+static size_t count = 0;
+
+/** @brief Counters of each listener, in shared memory. */
+static ListenerStats* counters = NULL;
+
+/** @brief Counters of the listener this child's connection came from. */
+static ListenerStats* self = NULL;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Set an optional integer option on a listening socket.
+ * Failures are logged but not fatal, the server works without any of them.
+ * @param fd The socket.
+ * @param level Protocol level of the option.
+ * @param name The option.
+ * @param value Value to set, 0 leaves the kernel default.
+ * @param label Name of the option, for logging. */
+static void set_listener_option(int fd, int level, int name, int value, const char* label)
+{
+    if (value == 0)
+        return;
+
+    wlog(INFO, "Setting socket option %s to %d...", label, value);
+    if (setsockopt(fd, level, name, &value, sizeof value) == -1)
+        wlog(ERROR, "Failed to set socket option %s. %d %s.", label, errno, strerror(errno));
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Parse the address of a listener spec.
+ * @param address "PORT", "HOST:PORT", "[IPV6]:PORT", "unix:PATH" or "unix:@NAME".
+ * @param[out] spec Where to store the address.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (logged). */
+static int parse_address(const char* address, ListenSpec* spec)
+{
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un* sun  = (struct sockaddr_un*) &spec->addr;
+        const char*         path = address + 5;
+        size_t              len  = strlen(path);
+
+        if (len == 0 || len >= sizeof sun->sun_path)
+        {
+            wlog(FATAL, "Unix socket path empty or too long: %s.", address);
+            return EXIT_FAILURE;
+        }
+
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, path, len);
+
+        if (path[0] == '@')  // Abstract namespace: no file, gone with the socket
+            sun->sun_path[0] = '\0';
+
+        spec->addr_len = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+        return EXIT_SUCCESS;
+    }
+
+    char        host[128] = "::";  // A port alone is dual-stack
+    const char* port      = address;
+    const char* colon     = strrchr(address, ':');
+
+    if (address[0] == '[')
+    {
+        const char* end = strchr(address, ']');
+        if (!end || end[1] != ':' || (size_t) (end - address) > sizeof host)
+        {
+            wlog(FATAL, "Invalid IPv6 listener address: %s.", address);
+            return EXIT_FAILURE;
+        }
+
+        snprintf(host, sizeof host, "%.*s", (int) (end - address - 1), address + 1);
+        port = end + 2;
+    }
+    else if (colon)
+    {
+        if ((size_t) (colon - address) >= sizeof host)
+        {
+            wlog(FATAL, "Listener host name too long: %s.", address);
+            return EXIT_FAILURE;
+        }
+
+        snprintf(host, sizeof host, "%.*s", (int) (colon - address), address);
+        port = colon + 1;
+    }
+
+    struct addrinfo  hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE | AI_NUMERICSERV};
+    struct addrinfo* sai;  // Linked list with >= 1 results
+    int              err = getaddrinfo(host, port, &hints, &sai);
+
+    if (err != 0)
+    {
+        wlog(FATAL, "Failed to get address info of %s. %d %s.", address, err, gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    memcpy(&spec->addr, sai->ai_addr, sai->ai_addrlen);  // The first one is the preferred one
+    spec->addr_len = sai->ai_addrlen;
+    freeaddrinfo(sai);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parse a listener spec: an address, then options separated by commas.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (logged). */
+static int parse_spec(const char* text, ListenSpec* spec)
+{
+    char  copy[512];
+    char* save;
+
+    memset(spec, 0, sizeof *spec);
+    spec->mode = -1;
+    snprintf(copy, sizeof copy, "%s", text);
+
+    char* address = strtok_r(copy, ",", &save);
+    if (!address || parse_address(address, spec))
+    {
+        wlog(FATAL, "Invalid listener: \"%s\".", text);
+        return EXIT_FAILURE;
+    }
+
+    for (char* option = strtok_r(NULL, ",", &save); option; option = strtok_r(NULL, ",", &save))
+    {
+        char* end;
+
+        if (strcmp(option, "tls") == 0)
+            spec->tls = 1;
+        else if (strcmp(option, "v6only") == 0)
+            spec->v6only = 1;
+        else if (strncmp(option, "mode=", 5) == 0)
+        {
+            spec->mode = strtol(option + 5, &end, 8);
+            if (*end != '\0' || end == option + 5 || spec->mode < 0 || spec->mode > 07777)
+            {
+                wlog(FATAL, "Invalid socket file mode in listener \"%s\".", text);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strncmp(option, "name=", 5) == 0)
+            snprintf(spec->name, sizeof spec->name, "%s", option + 5);
+        else
+        {
+            wlog(FATAL, "Unknown option \"%s\" in listener \"%s\".", option, text);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (spec->tls && TLS_CERT[0] == '\0')
+    {
+        wlog(FATAL, "Listener \"%s\" needs a TLS certificate (--tls-cert).", text);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Name a listener after the address it is bound to. */
+static void name_listener(Listener* l, const struct sockaddr_storage* addr, socklen_t len)
+{
+    char ip[INET6_ADDRSTRLEN] = "?";
+
+    if (addr->ss_family == AF_UNIX)
+    {
+        const struct sockaddr_un* sun  = (const struct sockaddr_un*) addr;
+        size_t                    path = len - offsetof(struct sockaddr_un, sun_path);
+
+        if (sun->sun_path[0] == '\0')  // Abstract, shown with @ like ss and netstat do
+            snprintf(l->name, sizeof l->name, "unix:@%.*s", (int) path - 1, sun->sun_path + 1);
+        else
+            snprintf(l->name, sizeof l->name, "unix:%s", sun->sun_path);
+    }
+    else if (addr->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*) addr;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof ip);
+        snprintf(l->name, sizeof l->name, "[%s]:%d", ip, ntohs(sin6->sin6_port));
+    }
+    else
+    {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*) addr;
+        inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof ip);
+        snprintf(l->name, sizeof l->name, "%s:%d", ip, ntohs(sin->sin_port));
+    }
+}
+
+/**
+ * @brief Name a listening socket, from its spec or the address it is bound to.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (logged). */
+static int label_listener(const ListenSpec* spec, Listener* l)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len = sizeof addr;
+
+    if (getsockname(l->fd, (struct sockaddr*) &addr, &addr_len) == -1)
+    {
+        wlog(FATAL, "Failed to get socket name. %d %s.", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (spec->name[0] != '\0')
+        snprintf(l->name, sizeof l->name, "%s", spec->name);
+    else
+        name_listener(l, &addr, addr_len);
+
+    wlog(INFO, "Server listening on %s%s.", l->name, l->tls ? " (TLS)" : "");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Create a non-blocking listening socket.
+ * @param spec Where and how to listen.
+ * @param[out] l The listener.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (logged). */
+static int open_listener(const ListenSpec* spec, Listener* l)
+{
+    int family = spec->addr.ss_family;
+    int err;
+
+    memset(l, 0, sizeof *l);
+    l->family = family;
+    l->tls    = spec->tls;
+
+    wlog(INFO, "Creating server socket...");
+    l->fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);  // Only an upgrade hands them on
+
+    if (l->fd == -1)
+    {
+        wlog(FATAL, "Failed to create server socket. %d %s.", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    wlog(DEBUG, "Server socket created.");
+
+    if (family != AF_UNIX)
+    {
+        wlog(INFO, "Setting socket option %d (SO_REUSEADDR)...", SO_REUSEADDR);
+        err = setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
+
+        if (err == -1)
+            wlog(ERROR, "Failed to set socket option. %d %s.", errno, strerror(errno));
+
+        wlog(DEBUG, "Socket option successfully set.");
+    }
+
+    if (family == AF_INET6)  // Explicit, the system default varies (net.ipv6.bindv6only)
+    {
+        if (setsockopt(l->fd, IPPROTO_IPV6, IPV6_V6ONLY, &spec->v6only, sizeof spec->v6only))
+            wlog(ERROR, "Failed to set IPV6_V6ONLY. %d %s.", errno, strerror(errno));
+    }
+
+    // Buffer sizes must be set before listen() to take part in window scaling
+    set_listener_option(l->fd, SOL_SOCKET, SO_SNDBUF, SNDBUF, "SO_SNDBUF");
+    set_listener_option(l->fd, SOL_SOCKET, SO_RCVBUF, RCVBUF, "SO_RCVBUF");
+
+    if (family != AF_UNIX)
+    {
+        set_listener_option(l->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, DEFER_ACCEPT, "TCP_DEFER_ACCEPT");
+        set_listener_option(l->fd, IPPROTO_TCP, TCP_FASTOPEN, FASTOPEN, "TCP_FASTOPEN");
+    }
+
+    wlog(INFO, "Setting server socket to non-blocking...");
+    err = fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (err == -1)
+    {
+        wlog(FATAL, "Failed to set server socket to non-blocking. %s.", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    wlog(DEBUG, "Server socket successfully set to non-blocking.");
+
+    const struct sockaddr_un* sun  = (const struct sockaddr_un*) &spec->addr;
+    int                       file = family == AF_UNIX && sun->sun_path[0] != '\0';
+    struct stat               st;
+
+    // Left behind by a server that didn't shut down cleanly. Only sockets are
+    // removed, a typo in the path must not delete a regular file.
+    if (file && lstat(sun->sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        wlog(INFO, "Removing stale socket file %s...", sun->sun_path);
+        unlink(sun->sun_path);
+    }
+
+    wlog(INFO, "Binding server socket...");
+    err = bind(l->fd, (const struct sockaddr*) &spec->addr, spec->addr_len);
+
+    if (err == -1)
+    {
+        wlog(FATAL, "Failed to bind server socket. %d %s.", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    wlog(DEBUG, "Server socket bound.");
+
+    if (file)
+    {
+        snprintf(l->path, sizeof l->path, "%s", sun->sun_path);
+
+        if (spec->mode >= 0 && chmod(l->path, spec->mode) == -1)
+        {
+            wlog(FATAL, "Failed to set mode of %s. %d %s.", l->path, errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    else if (spec->mode >= 0)
+        wlog(WARNING, "Socket file mode ignored, the listener has no file.");
+
+    // Mark server socket as passive, ready to accept connections
+    wlog(INFO, "Marking server socket as passive (listen)...");
+    err = listen(l->fd, BACKLOG);
+
+    if (err == -1)
+    {
+        wlog(FATAL, "Failed to listen on server socket. %d %s.", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return label_listener(spec, l);
+}
+
+/**
+ * @brief Take over a listening socket handed down by the old server.
+ * Options set before listen() can't change anymore, the backlog still can.
+ * @param spec How it was opened.
+ * @param fd The inherited socket.
+ * @param[out] l The listener.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (logged). */
+static int adopt_listener(const ListenSpec* spec, int fd, Listener* l)
+{
+    int       listening = 0;
+    socklen_t len       = sizeof listening;
+
+    memset(l, 0, sizeof *l);
+    l->fd     = fd;
+    l->family = spec->addr.ss_family;
+    l->tls    = spec->tls;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening)
+    {
+        wlog(FATAL, "Inherited socket %d is not listening.", fd);
+        return EXIT_FAILURE;
+    }
+
+    wlog(INFO, "Using the listening socket %d of the old server...", fd);
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 || listen(fd, BACKLOG) == -1)
+    {
+        wlog(FATAL, "Failed to set up inherited socket. %d %s.", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    const struct sockaddr_un* sun = (const struct sockaddr_un*) &spec->addr;
+    if (l->family == AF_UNIX && sun->sun_path[0] != '\0')
+        snprintf(l->path, sizeof l->path, "%s", sun->sun_path);
+
+    return label_listener(spec, l);
+}
+
+/**
+ * @brief Parse a listener spec and open it.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (logged). */
+static int add_listener(const char* text)
+{
+    ListenSpec spec;
+
+    if (parse_spec(text, &spec))
+        return EXIT_FAILURE;
+
+    int fd = upgrade_inherit(text);  // Handed down by the old server, -1 for a new socket
+    if (fd != -1 ? adopt_listener(&spec, fd, &listeners[count])
+                 : open_listener(&spec, &listeners[count]))
+    {
+        if (listeners[count].fd > 0)
+            close(listeners[count].fd);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(listeners[count].spec, sizeof listeners[count].spec, "%s", text);
+    count++;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int listener_startup()
+{
+    counters = shm_alloc("listener statistics", LISTENERS_MAX * sizeof *counters);
+    if (!counters)
+        return EXIT_FAILURE;
+
+    char spec[32];
+
+    if (SERVER_PORT >= 0)  // IPv4 only, as it always was
+    {
+        snprintf(spec, sizeof spec, "0.0.0.0:%d", SERVER_PORT);
+        if (add_listener(spec))
+            return EXIT_FAILURE;
+    }
+
+    if (TLS_PORT > 0)
+    {
+        snprintf(spec, sizeof spec, "0.0.0.0:%d,tls", TLS_PORT);
+        if (add_listener(spec))
+            return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < LISTEN_COUNT; i++)
+        if (add_listener(LISTEN[i]))
+            return EXIT_FAILURE;
+
+    upgrade_inherit_done();
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void listener_shutdown()
+{
+    if (counters)
+    {
+        char buff[4096];
+        listener_stats_render(buff, sizeof buff);
+
+        for (char* line = strtok(buff, "\n"); line; line = strtok(NULL, "\n"))
+            wlog(INFO, "Stats: %s.", line);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (listeners[i].fd != -1 && close(listeners[i].fd) == -1)
+            wlog(WARNING, "Failed to close server socket: %d %s.", errno, strerror(errno));
+
+        if (listeners[i].path[0] != '\0' && !upgrade_inheriting() &&  // Still the old server's
+            unlink(listeners[i].path) == -1)
+            wlog(WARNING, "Failed to remove %s: %s.", listeners[i].path, strerror(errno));
+    }
+
+    count = 0;
+    shm_free(counters, LISTENERS_MAX * sizeof *counters);
+    counters = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void listener_close_all()
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (listeners[i].fd != -1 && close(listeners[i].fd))
+            wlog(WARNING, "[%d] Failed to close server socket.", getpid());
+
+        listeners[i].fd      = -1;    // Names stay, for the statistics
+        listeners[i].path[0] = '\0';  // Socket files belong to the main loop
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+void listener_stop()
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (listeners[i].path[0] != '\0' && unlink(listeners[i].path) == -1)
+            wlog(WARNING, "Failed to remove %s: %s.", listeners[i].path, strerror(errno));
+    }
+
+    listener_close_all();
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t listener_count()
+{
+    return count;
+}
+
+/* -------------------------------------------------------------------------- */
+
+const Listener* listener_get(size_t index)
+{
+    return &listeners[index];
+}
+
+/* -------------------------------------------------------------------------- */
+
+void listener_accepted(size_t index)
+{
+    atomic_fetch_add_explicit(&counters[index].accepted, 1, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void listener_enter(size_t index)
+{
+    self = &counters[index];
+}
+
+/* -------------------------------------------------------------------------- */
+
+void listener_request_done(uint64_t start_us)
+{
+    if (!self)
+        return;
+
+    atomic_fetch_add_explicit(&self->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&self->request_us, now_us() - start_us, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void listener_sent(size_t n)
+{
+    if (self)
+        atomic_fetch_add_explicit(&self->sent, n, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t listener_stats_render(char* buff, size_t buff_size)
+{
+    static const struct
+    {
+        const char* name;
+        size_t      offset;
+    } fields[] = {
+        {"listener_accepted", offsetof(ListenerStats, accepted)},
+        {"listener_requests", offsetof(ListenerStats, requests)},
+        {"listener_request_us", offsetof(ListenerStats, request_us)},
+        {"listener_sent_bytes", offsetof(ListenerStats, sent)},
+    };
+
+    size_t len = 0;
+    buff[0]    = '\0';
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t f = 0; f < sizeof fields / sizeof fields[0]; f++)
+        {
+            atomic_ulong* field = (atomic_ulong*) ((char*) &counters[i] + fields[f].offset);
+            int           n     = snprintf(buff + len,
+                                 buff_size - len,
+                                 "%s{listener=\"%s\"} %lu\n",
+                                 fields[f].name,
+                                 listeners[i].name,
+                                 atomic_load_explicit(field, memory_order_relaxed));
+
+            if (n < 0 || (size_t) n >= buff_size - len)
+                return len;
+            len += n;
+        }
+    }
+
+    return len;
+}
@@ -2,11 +2,19 @@
 #include "net_utils.h"
 #include "logging.h"
 #include "config.h"
+#include "shm.h"
+#include "stats.h"
 
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 /* -------------------------------------------------------------------------- */
 
@@ -15,11 +23,79 @@ static const char* log_strings[6] = {
     "[TRACE]", "[DEBUG]", "[INFO]", "[WARN]", "[ERROR]", "[FATAL]"};
 
 /**
- * @brief Local file stream where log messages are written.
- * This is the file stream that is opened when wlog_startup() is called.
- * It is used to store log messages in a file.
+ * @brief Log file descriptor where log messages are written.
+ * This is the file that is opened when wlog_startup() is called, in append
+ * mode. Each message is written with a single write(), so messages of
+ * different processes never interleave. -1 if not open.
  */
-static FILE* lfs;
+static int lfd = -1;
+
+/** @brief Most call sites followed by LOG_RATE, later ones are not limited. */
+#define LOG_SITES 128
+
+/** @brief Seconds the level stays raised after a slow write, see LOG_DEGRADE_US. */
+#define DEGRADE_SECONDS 10
+
+/** @brief Longest message, past this it is cut. Paths in messages have no length limit. */
+#define LOG_MESSAGE_MAX 2048
+
+/** @brief Logging state shared by every process. */
+typedef struct LogSharedStruct
+{
+    /**
+     * @brief Times the log file was rotated or reopened.
+     * Every process compares it with its own count before writing, and
+     * switches to the new file when it changed. */
+    atomic_uint generation;
+    /** @brief Lowest level written while writes are slow, 0 when they aren't. */
+    atomic_int degraded;
+    /** @brief When the level goes back to LOG_LEVEL (now_ms()), unless writes are still slow. */
+    atomic_ulong degraded_until;
+} LogShared;
+
+/** @brief Messages of a call site, for LOG_RATE. Sites are told apart by their format string. */
+typedef struct LogSiteStruct
+{
+    /** @brief Format string of the site, NULL if the slot is free. */
+    const char* message;
+    /** @brief Level of its last message, for the summary. */
+    LogLevel level;
+    /** @brief Messages written in the current second. */
+    unsigned count;
+    /** @brief Start of the current second (now_ms()). */
+    uint64_t window_ms;
+    /** @brief Messages dropped since the last summary. */
+    unsigned long suppressed;
+    /** @brief When the first of them was dropped (now_ms()). */
+    uint64_t suppressed_ms;
+} LogSite;
+
+/** @brief Shared logging state. NULL until the log file is open. */
+static LogShared* shared = NULL;
+
+/** @brief Call sites of this process, in a hash table keyed by format string address. */
+static LogSite sites[LOG_SITES];
+
+/** @brief Average time this process takes to write a message, in microseconds. */
+static uint64_t write_us = 0;
+
+/** @brief Value of shared->generation when this process last opened the log file. */
+static unsigned seen_generation = 0;
+
+/** @brief When the current log file was started (now_ms()), for LOG_ROTATE. */
+static uint64_t opened_ms = 0;
+
+/** @brief Size of the log file once started, it's not rotated by age if it didn't grow. */
+static off_t opened_size = 0;
+
+/** @brief When wlog_maintain() last looked at the size of the log file (now_ms()). */
+static uint64_t checked_ms = 0;
+
+/** @brief Size of the log file then. While it grows, the size limit is checked every second. */
+static off_t checked_size = 0;
+
+/** @brief Whether it grew since the check before. */
+static int growing = 0;
 
 /**
  * @brief Log status.
@@ -39,9 +115,9 @@ int wlog_startup()
         return EXIT_FAILURE;
     }
 
-    lfs = fopen(LOG_FILE_NAME, "a");  // Open log_event file stream
+    lfd = open(LOG_FILE_NAME, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);  // Open log file
 
-    if (lfs == NULL)
+    if (lfd == -1)
     {
         ls = LS_FAILURE;
         wlog(ERROR, "Error encountered during logging startup: %s\n", strerror(errno));
@@ -49,8 +125,11 @@ int wlog_startup()
         return EXIT_FAILURE;
     }
 
-    ls = LS_SUCCESSFUL;
+    ls        = LS_SUCCESSFUL;
+    opened_ms = now_ms();
     wlog(INFO, "Log file stream opened.");
+
+    shared = shm_alloc("logging state", sizeof *shared);  // NULL: never rotated nor degraded
     return EXIT_SUCCESS;
 };
 
@@ -58,10 +137,13 @@ int wlog_startup()
 
 int wlog_shutdown()
 {
-    if (lfs)
+    if (lfd != -1)
     {
         wlog(INFO, "Closing log file stream.");
-        fclose(lfs);
+        close(lfd);
+        lfd = -1;
+        shm_free(shared, sizeof *shared);
+        shared = NULL;
         return EXIT_SUCCESS;
     }
 
@@ -71,6 +153,297 @@ int wlog_shutdown()
 
 /* -------------------------------------------------------------------------- */
 
+/**
+ * @brief Open LOG_FILE_NAME again, in place of the current log file.
+ * dup2() swaps the file behind lfd in one step, a message is written either
+ * to the old file or to the new one.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure (lfd is unchanged). */
+static int reopen()
+{
+    int fd = open(LOG_FILE_NAME, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return EXIT_FAILURE;
+
+    int ret = dup2(fd, lfd) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Switch to the log file opened by the main process after a rotation.
+ * If it can't be opened, messages keep going to the old file. */
+static void follow()
+{
+    seen_generation = atomic_load_explicit(&shared->generation, memory_order_acquire);
+    reopen();
+}
+
+/**
+ * @brief Make every process switch to a new LOG_FILE_NAME, once it exists. */
+static void publish()
+{
+    opened_ms       = now_ms();
+    seen_generation = atomic_fetch_add_explicit(&shared->generation, 1, memory_order_release) + 1;
+    STAT_ADD(log_rotations, 1);
+}
+
+/**
+ * @brief Compress a rotated log file with gzip, in a child process.
+ * The child waits a bit first, so the other processes can finish their last
+ * message to it. It's not tracked: conn_reap() ignores it when it exits.
+ * @param path The rotated log file. */
+static void compress(const char* path)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        wlog(WARNING, "Failed to compress %s: %s.", path, strerror(errno));
+        return;
+    }
+
+    if (pid == 0)  // Listeners and connections are close-on-exec, gzip doesn't keep them
+    {
+        execlp("sh", "sh", "-c", "sleep 2; exec gzip -f -- \"$0\"", path, (char*) NULL);
+        _exit(127);
+    }
+}
+
+/**
+ * @brief Rename the log file to LOG_FILE_NAME.YYYYmmdd-HHMMSS and start a new one. */
+static void rotate()
+{
+    char       path[PATH_MAX];
+    time_t     t  = time(NULL);
+    struct tm* tm = localtime(&t);
+    int        n  = snprintf(path, sizeof path, "%s.", LOG_FILE_NAME);
+    n += strftime(path + n, sizeof path - n, "%Y%m%d-%H%M%S", tm);
+
+    // Several rotations in a second get a suffix, an existing file is never replaced
+    for (int i = 1; access(path, F_OK) == 0 && i < 100; i++)
+        snprintf(path + n, sizeof path - n, ".%d", i);
+
+    if (rename(LOG_FILE_NAME, path) == -1)
+    {
+        wlog(ERROR, "Failed to rotate the log file to %s: %s.", path, strerror(errno));
+        opened_ms = now_ms();  // Try again in LOG_ROTATE
+        return;
+    }
+
+    if (reopen())  // Messages still go to the renamed file, nothing is lost
+    {
+        wlog(ERROR, "Failed to open a new log file: %s.", strerror(errno));
+        return;
+    }
+
+    publish();
+    wlog(INFO, "Log rotated to %s.", path);
+
+    struct stat st;
+    opened_size = fstat(lfd, &st) == 0 ? st.st_size : 0;
+
+    if (LOG_COMPRESS)
+        compress(path);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Find the slot of a call site, claiming a free one if it's new.
+ * @param message Format string of the site.
+ * @return The slot, NULL if the table is full. */
+static LogSite* site_get(const char* message)
+{
+    size_t h = ((uintptr_t) message >> 3) % LOG_SITES;
+    for (size_t i = 0; i < LOG_SITES; i++, h = (h + 1) % LOG_SITES)
+    {
+        if (sites[h].message == message)
+            return &sites[h];
+
+        if (!sites[h].message)
+        {
+            sites[h].message = message;
+            return &sites[h];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Log how many messages of a site were dropped, if any.
+ * @param site The call site.
+ * @param now Current time (now_ms()). */
+static void site_summary(LogSite* site, uint64_t now)
+{
+    unsigned long n = site->suppressed;
+    if (n == 0)
+        return;
+
+    site->suppressed = 0;
+    wlog(site->level,
+         "Message \"%s\" repeated %lu times in the last %lu s.",
+         site->message,
+         n,
+         (unsigned long) (now - site->suppressed_ms) / 1000 + 1);
+}
+
+/**
+ * @brief Count a message against LOG_RATE, summarizing the dropped ones first.
+ * @param lvl Level of the message.
+ * @param message Format string of the message.
+ * @return 1 if it can be written, 0 if it's dropped. */
+static int site_admit(LogLevel lvl, const char* message)
+{
+    LogSite* site = site_get(message);
+    if (!site)
+        return 1;
+
+    uint64_t now = now_ms();
+    if (now - site->window_ms >= 1000)
+    {
+        site->window_ms = now;
+        site->count     = 0;
+    }
+
+    site->level = lvl;
+    if (site->count >= (unsigned) LOG_RATE)
+    {
+        if (site->suppressed++ == 0)
+            site->suppressed_ms = now;
+        STAT_ADD(log_suppressed, 1);
+        return 0;
+    }
+
+    site->count++;
+    site_summary(site, now);
+    return 1;
+}
+
+/**
+ * @brief Raise the level of every process if writing messages got slow.
+ * @param us Time this message took to write, in microseconds. */
+static void degrade_check(uint64_t us)
+{
+    write_us += ((int64_t) us - (int64_t) write_us) / 8;  // Moving average
+    if (write_us <= (uint64_t) LOG_DEGRADE_US)
+        return;
+
+    atomic_store_explicit(&shared->degraded_until, now_ms() + DEGRADE_SECONDS * 1000,
+                          memory_order_relaxed);
+    if (atomic_exchange_explicit(&shared->degraded, WARNING, memory_order_relaxed) == 0)
+    {
+        STAT_ADD(log_degraded, 1);
+        wlog(WARNING,
+             "Log writes take %lu us, dropping messages below WARNING for %d s.",
+             (unsigned long) write_us,
+             DEGRADE_SECONDS);
+    }
+}
+
+/**
+ * @brief Whether a message is dropped because writes are slow.
+ * @param lvl Level of the message.
+ * @return 1 if it's dropped, else 0. */
+static int degraded(LogLevel lvl)
+{
+    int level = atomic_load_explicit(&shared->degraded, memory_order_relaxed);
+    return level != 0 && (int) lvl < level &&
+           now_ms() < atomic_load_explicit(&shared->degraded_until, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void wlog_maintain()
+{
+    if (lfd == -1 || !shared)
+        return;
+
+    uint64_t now = now_ms();
+    if (now - checked_ms < 1000)  // Once per second at most
+        return;
+    checked_ms = now;
+
+    for (size_t i = 0; LOG_RATE > 0 && i < LOG_SITES; i++)  // Sites that went quiet
+        if (sites[i].suppressed && now - sites[i].window_ms >= 1000)
+            site_summary(&sites[i], now);
+
+    if (atomic_load_explicit(&shared->degraded, memory_order_relaxed) &&
+        now >= atomic_load_explicit(&shared->degraded_until, memory_order_relaxed))
+    {
+        atomic_store_explicit(&shared->degraded, 0, memory_order_relaxed);
+        wlog(WARNING, "Log writes are fast again, back to level %d.", LOG_LEVEL);
+    }
+
+    if (LOG_MAX_MB == 0 && LOG_ROTATE == 0)
+        return;
+
+    struct stat st;
+    if (fstat(lfd, &st) == -1)
+        return;
+
+    growing      = st.st_size != checked_size;
+    checked_size = st.st_size;
+
+    if ((LOG_ROTATE > 0 && now - opened_ms >= (uint64_t) LOG_ROTATE * 1000 &&
+         st.st_size > opened_size) ||
+        (LOG_MAX_MB > 0 && st.st_size >= (off_t) LOG_MAX_MB << 20))
+        rotate();
+}
+
+/* -------------------------------------------------------------------------- */
+
+int wlog_timeout()
+{
+    if (lfd == -1 || !shared)
+        return -1;
+
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; LOG_RATE > 0 && i < LOG_SITES; i++)  // Summaries to write
+        if (sites[i].suppressed && sites[i].window_ms + 1000 < next)
+            next = sites[i].window_ms + 1000;
+
+    if (atomic_load_explicit(&shared->degraded, memory_order_relaxed))
+    {
+        uint64_t until = atomic_load_explicit(&shared->degraded_until, memory_order_relaxed);
+        next           = until < next ? until : next;
+    }
+
+    if ((LOG_MAX_MB > 0 || LOG_ROTATE > 0) && growing && checked_ms + 1000 < next)
+        next = checked_ms + 1000;  // Children may be writing
+
+    if (LOG_ROTATE > 0 && checked_size > opened_size &&
+        opened_ms + (uint64_t) LOG_ROTATE * 1000 < next)
+        next = opened_ms + (uint64_t) LOG_ROTATE * 1000;
+
+    if (next == UINT64_MAX)
+        return -1;
+
+    if (next < checked_ms + 1000)  // wlog_maintain() looks once per second at most
+        next = checked_ms + 1000;
+
+    uint64_t now = now_ms();
+    return next <= now ? 0 : next - now > INT_MAX ? INT_MAX : (int) (next - now);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void wlog_reopen()
+{
+    if (lfd == -1 || !shared)
+        return;
+
+    if (reopen())
+    {
+        wlog(ERROR, "Failed to reopen the log file: %s.", strerror(errno));
+        return;
+    }
+
+    publish();
+    wlog(INFO, "Log file reopened.");
+}
+
+/* -------------------------------------------------------------------------- */
+
 int wlog(LogLevel lvl, char message[], ...)
 {
     if (ls == LS_UNINITIALIZED)  // User has forgotten to call wlog_startup()
@@ -85,13 +458,19 @@ int wlog(LogLevel lvl, char message[], ...)
     if (lvl < LOG_LEVEL)  // Should this message even be printed?
         return EXIT_SUCCESS;
 
+    if (shared && lvl < FATAL && degraded(lvl))  // Writes are slow, only the important ones
+        return EXIT_SUCCESS;
+
+    if (LOG_RATE > 0 && lvl < FATAL && !site_admit(lvl, message))  // Dropped, counted
+        return EXIT_SUCCESS;
+
     if (message[0] == '\0' || message[0] == '\n')  // Check if message is empty.
     {
         wlog(INFO, "Empty log message, what the sigma?");
         return EXIT_FAILURE;
     }
 
-    char log_message[BUFFER_SIZE];               // Create mutable copy of message
+    char log_message[LOG_MESSAGE_MAX];           // Create mutable copy of message
     strncpy(log_message, message, sizeof log_message - 1);
     log_message[sizeof log_message - 1] = '\0';  // Ensure null termination
 
@@ -111,14 +490,20 @@ int wlog(LogLevel lvl, char message[], ...)
 
     /* ---------------------------------------------------------------------- */
 
-    fprintf(stderr, "%s %s %s", log_time, ll, log_message);
+    char line[sizeof log_message + 32];
+    int  len = snprintf(line, sizeof line, "%s %s %s", log_time, ll, log_message);
+    if (len < 0 || (size_t) len >= sizeof line)
+        len = sizeof line - 1;
+
+    uint64_t start = LOG_DEGRADE_US > 0 ? now_us() : 0;
+    fputs(line, stderr);
 
     if (ls <= LS_FAILURE)  // Logging to file has failed or has not been initialized
     {
         return EXIT_FAILURE;
     }
 
-    if (!lfs)
+    if (lfd == -1)
     {
         fprintf(stderr, "Log file stream broken. Logging to file is now disabled.");
         ls = LS_STREAMBROKEN;
@@ -127,8 +512,14 @@ int wlog(LogLevel lvl, char message[], ...)
 
     /* ---------------------------------------------------------------------- */
 
-    fprintf(lfs, "%s %s %s", log_time, ll, log_message);
-    fflush(lfs);
+    if (shared &&
+        atomic_load_explicit(&shared->generation, memory_order_acquire) != seen_generation)
+        follow();  // Rotated or reopened by the main process
 
-    return EXIT_SUCCESS;
+    int ret = write(lfd, line, len) == len ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (start && shared)
+        degrade_check(now_us() - start);
+
+    return ret;
 }
@@ -4,6 +4,7 @@
 #include "server.h"
 #include "server.h"
 #include "sig.h"
+#include "upgrade.h"
 
 #include <stdlib.h>
 
@@ -13,6 +14,8 @@
 // TODO remove necessity of having a favicon file if none is found (maybe have a default one?)
 int main(int argc, char const* argv[])
 {
+    upgrade_startup(argv);  // Before anything can fork, the environment may hand down sockets
+
     if (config_server(argc, argv) == EXIT_FAILURE)
         return EXIT_FAILURE;
 
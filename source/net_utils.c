@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <strings.h>
 
 /* -------------------------------------------------------------------------- */
 
@@ -19,6 +20,9 @@ static time_t clt;
  * localtime() function with the clt variable. */
 static struct tm* ct;
 
+int http_keep_alive = 0;
+int http_chunked    = 0;
+
 /* -------------------------------------------------------------------------- */
 
 const char* get_mime_type(const char path[])
@@ -77,6 +81,18 @@ void build_html_header(char*       header,
                        const char* status,
                        const char* content_type,
                        size_t      content_length)
+{
+    build_response_header(header, header_size, status, content_type, content_length, NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void build_response_header(char*       header,
+                           size_t      header_size,
+                           const char* status,
+                           const char* content_type,
+                           size_t      content_length,
+                           const char* extra_headers)
 {
     wlog(TRACE, "Building HTML header. (%s, %s, %lu)", status, content_type, content_length);
     snprintf(header,
@@ -84,11 +100,179 @@ void build_html_header(char*       header,
              "HTTP/1.1 %s\r\n"
              "Content-Type: %s\r\n"
              "Content-Length: %zu\r\n"
-             "Connection: close\r\n"
+             "Connection: %s\r\n"
+             "%s"
              "\r\n",
              status,
              content_type,
-             content_length);
+             content_length,
+             http_keep_alive ? "keep-alive" : "close",
+             extra_headers ? extra_headers : "");
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t render_error_body(char* buff, size_t buff_size, const char* title, const char* message)
+{
+    int len =
+        snprintf(buff, buff_size, "<html><body><h1>%s</h1><p>%s</p></body></html>", title, message);
+
+    if (len < 0 || (size_t) len >= buff_size)
+        return 0;
+
+    return len;
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t render_error_page(char*       buff,
+                         size_t      buff_size,
+                         const char* status,
+                         const char* title,
+                         const char* message,
+                         const char* extra_headers)
+{
+    char   body[512];
+    size_t body_len = render_error_body(body, sizeof body, title, message);
+
+    if (body_len == 0)
+        return 0;
+
+    build_response_header(buff, buff_size, status, "text/html", body_len, extra_headers);
+    size_t header_len = strlen(buff);
+
+    if (header_len + body_len >= buff_size)
+        return 0;
+
+    memcpy(buff + header_len, body, body_len + 1);
+    return header_len + body_len;
+}
+
+/* -------------------------------------------------------------------------- */
+
+const char* http_header_value(const char* head, const char* name, size_t* len)
+{
+    size_t name_len = strlen(name);
+
+    for (const char* line = strstr(head, "\r\n"); line; line = strstr(line, "\r\n"))
+    {
+        line += 2;  // Skip the request/status line, then every header line
+        if (strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+            continue;
+
+        const char* value = line + name_len + 1;
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        const char* end = strstr(value, "\r\n");
+        *len            = end ? (size_t) (end - value) : strlen(value);
+        return value;
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int http_request_11(const char* req)
+{
+    const char* line_end = strstr(req, "\r\n");
+    return line_end && line_end - req >= 8 && strncmp(line_end - 8, "HTTP/1.1", 8) == 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int http_wants_keep_alive(const char* req)
+{
+    size_t len;
+
+    if (!strstr(req, "\r\n"))
+        return 0;
+
+    const char* body_len = http_header_value(req, "Content-Length", &len);
+    if (body_len && !(len == 1 && body_len[0] == '0'))
+        return 0;  // We don't read bodies, they would be taken for the next request
+
+    if (http_header_value(req, "Transfer-Encoding", &len))
+        return 0;
+
+    const char* connection = http_header_value(req, "Connection", &len);
+
+    if (connection && len >= 5 && strncasecmp(connection, "close", 5) == 0)
+        return 0;
+
+    if (connection && len >= 10 && strncasecmp(connection, "keep-alive", 10) == 0)
+        return 1;
+
+    return http_request_11(req);
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* -------------------------------------------------------------------------- */
+
+uint64_t bucket_pack(int32_t tokens, uint32_t time)
+{
+    return ((uint64_t) (uint32_t) tokens << 32) | time;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int64_t bucket_take(atomic_uint_fast64_t* bucket,
+                    int64_t               rate,
+                    int64_t               burst,
+                    int64_t               cost,
+                    int                   allow_debt)
+{
+    uint32_t now = (uint32_t) now_ms();
+    uint64_t old = atomic_load_explicit(bucket, memory_order_relaxed);
+
+    for (;;)
+    {
+        int64_t  tokens  = (int32_t) (old >> 32);
+        uint32_t last    = (uint32_t) old;
+        uint32_t elapsed = now - last;  // Wraps correctly
+
+        // Tokens come on a fixed schedule, floor(t * rate / 1000) of them by time t:
+        // crediting the difference since the last refill loses no fraction of one
+        // and counts none twice, so the rate is exact even when called every ms
+        if ((int32_t) elapsed > 0)  // Another process may have refilled after we read now
+        {
+            tokens += now > last ? (int64_t) now * rate / 1000 - (int64_t) last * rate / 1000
+                                 : (int64_t) elapsed * rate / 1000;  // The clock wrapped
+            last = now;
+        }
+
+        if (tokens > burst)
+            tokens = burst;
+
+        int64_t left = tokens - cost;
+        if (left < 0 && !allow_debt)
+            left = tokens;  // Refused, keep the refill
+
+        if (left < INT32_MIN)
+            left = INT32_MIN;
+
+        if (atomic_compare_exchange_weak_explicit(
+                bucket, &old, bucket_pack(left, last), memory_order_relaxed, memory_order_relaxed))
+            return tokens - cost;
+    }
 }
 
 /* -------------------------------------------------------------------------- */
@@ -176,12 +360,15 @@ void human_readable_size(long bytes, char buffer[], size_t buff_len)
 
 /* -------------------------------------------------------------------------- */
 
-void log_transfer_data(long read, long sent, long unsigned transfers)
+void log_transfer_data(LogLevel lvl, long read, long sent, long unsigned transfers)
 {
+    if (lvl < LOG_LEVEL)  // Skip formatting the sizes
+        return;
+
     char read_str[32], sent_str[32];
     human_readable_size(read, read_str, sizeof read_str);
     human_readable_size(sent, sent_str, sizeof sent_str);
-    wlog(INFO, "%lu transfers done. %s sent. Total read: %s.", transfers, sent_str, read_str);
+    wlog(lvl, "%lu transfers done. %s sent. Total read: %s.", transfers, sent_str, read_str);
 
     return;
 }
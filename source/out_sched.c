@@ -0,0 +1,235 @@
+#include "out_sched.h"
+#include "config.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "shm.h"
+#include "stats.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Time between two looks at the shared state while waiting, in microseconds. */
+#define SCHED_TICK_US 1000
+
+/** @brief Longest single wait for bandwidth, in microseconds. */
+#define SCHED_WAIT_MAX_US 100000
+
+/** @brief Responses with at most this many quanta left are short. */
+#define SCHED_SHORT_QUANTA 4
+
+/** @brief How long a short response waiting holds long ones back, in microseconds. */
+#define SCHED_SHORT_HOLD_US (5 * SCHED_TICK_US)
+
+/** @brief Most ticks a long response holds back in a row, so it is never starved. */
+#define SCHED_YIELD_TICKS 5
+
+/** @brief Smallest per-connection bucket, so slow caps still send whole packets. */
+#define SCHED_CONN_BURST_MIN 4096
+
+/** @brief State shared by every child, each field a single atomic word. */
+typedef struct SchedStateStruct
+{
+    /** @brief Bandwidth bucket of all connections (see bucket_pack()), when BANDWIDTH is set. */
+    atomic_uint_fast64_t bucket;
+    /** @brief Current round. A connection gets a new quantum when it sees the round change. */
+    atomic_ulong round;
+    /** @brief Until when (now_us()) a short response is waiting, long ones hold back meanwhile. */
+    atomic_ulong short_until;
+} SchedState;
+
+/** @brief The shared state, in shared memory. NULL in processes that don't schedule. */
+static SchedState* state = NULL;
+
+/** @brief Last round this connection got a quantum in. New connections get one right away. */
+static unsigned long round_seen = ULONG_MAX;
+
+/** @brief Bytes this connection may still send in the current round. */
+static size_t deficit = 0;
+
+/** @brief Whether the response being sent was short at its last grant. */
+static int current_short = 0;
+
+/** @brief Bandwidth bucket of this connection, when BANDWIDTH_CONN is set. */
+static atomic_uint_fast64_t conn_bucket;
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Burst of the shared bucket: at least a quantum, so a round can always start. */
+static int64_t global_burst()
+{
+    return BANDWIDTH / 20 > SCHED_QUANTUM ? BANDWIDTH / 20 : SCHED_QUANTUM;
+}
+
+/** @brief Burst of a connection's bucket. */
+static int64_t conn_burst()
+{
+    return BANDWIDTH_CONN / 20 > SCHED_CONN_BURST_MIN ? BANDWIDTH_CONN / 20 : SCHED_CONN_BURST_MIN;
+}
+
+/** @brief Time until a bucket at tokens gets back above zero at rate, within the wait bounds. */
+static uint64_t refill_wait(int64_t tokens, int64_t rate)
+{
+    uint64_t us = (uint64_t) (1 - tokens) * 1000000 / rate;
+    return us < SCHED_TICK_US ? SCHED_TICK_US : us > SCHED_WAIT_MAX_US ? SCHED_WAIT_MAX_US : us;
+}
+
+static void sched_sleep(uint64_t us)
+{
+    struct timespec ts = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    nanosleep(&ts, NULL);  // Woken early by a signal: we just look again
+}
+
+/* -------------------------------------------------------------------------- */
+
+int sched_startup()
+{
+    state = shm_alloc("output scheduler", sizeof *state);
+    if (!state)
+        return EXIT_FAILURE;
+
+    atomic_store_explicit(
+        &state->bucket, bucket_pack(global_burst(), (uint32_t) now_ms()), memory_order_relaxed);
+
+    wlog(INFO,
+         "Scheduling output in quanta of %d bytes, capped at %d bytes/s (%d per connection).",
+         SCHED_QUANTUM,
+         BANDWIDTH,
+         BANDWIDTH_CONN);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void sched_shutdown()
+{
+    shm_free(state, sizeof *state);
+    state = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void sched_conn_start()
+{
+    // A zero time would be "in the future" for half of the clock's lap, and never refill
+    atomic_store_explicit(
+        &conn_bucket, bucket_pack(conn_burst(), (uint32_t) now_ms()), memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t sched_grant(size_t want, size_t remaining)
+{
+    if (!state || want == 0)
+        return want;
+
+    current_short = remaining <= (size_t) SCHED_QUANTUM * SCHED_SHORT_QUANTA;
+
+    uint64_t start   = 0;  // When we started waiting, 0 if we didn't
+    int      yielded = 0;  // Ticks spent holding back for short responses
+
+    for (;;)
+    {
+        unsigned long round     = atomic_load_explicit(&state->round, memory_order_relaxed);
+        uint64_t      now       = now_us();
+        uint64_t      wait      = 0;
+        int64_t       room      = INT64_MAX;  // Bandwidth left, of all connections and of ours
+        int64_t       conn_room = INT64_MAX;
+
+        if (BANDWIDTH)
+            room = bucket_take(&state->bucket, BANDWIDTH, global_burst(), 0, 0);
+
+        if (BANDWIDTH_CONN)
+            conn_room = bucket_take(&conn_bucket, BANDWIDTH_CONN, conn_burst(), 0, 0);
+
+        if (!BANDWIDTH)  // No rounds without a bandwidth to measure them against
+            deficit = want;
+        else if (round != round_seen)  // A new round: a quantum, or all of a short response
+        {
+            round_seen = round;
+            deficit    = (size_t) SCHED_QUANTUM;
+            if (current_short && remaining > deficit)
+                deficit = remaining;
+        }
+
+        if (deficit == 0)
+        {
+            // Turn used. Once a quantum of bandwidth is left unused, everyone else
+            // used theirs (or has nothing to send): start the next round
+            if (room >= SCHED_QUANTUM)
+            {
+                atomic_compare_exchange_strong_explicit(
+                    &state->round, &round, round + 1, memory_order_relaxed, memory_order_relaxed);
+                continue;
+            }
+            wait = SCHED_TICK_US;
+        }
+        else if (!current_short && yielded < SCHED_YIELD_TICKS &&
+                 now < atomic_load_explicit(&state->short_until, memory_order_relaxed))
+        {
+            yielded++;
+            wait = SCHED_TICK_US;
+        }
+        else if (room <= 0)
+        {
+            if (current_short)
+                atomic_store_explicit(
+                    &state->short_until, now + SCHED_SHORT_HOLD_US, memory_order_relaxed);
+            wait = refill_wait(room, BANDWIDTH);
+        }
+        else if (conn_room <= 0)
+            wait = refill_wait(conn_room, BANDWIDTH_CONN);
+        else
+        {
+            size_t grant = want < deficit ? want : deficit;
+            if ((int64_t) grant > room)
+                grant = room;
+            if ((int64_t) grant > conn_room)
+                grant = conn_room;
+
+            if (start)
+            {
+                STAT_ADD(sched_waits, 1);
+                STAT_ADD(sched_wait_us, now - start);
+            }
+
+            if (yielded)
+                STAT_ADD(sched_yields, 1);
+
+            return grant;
+        }
+
+        if (!start)
+            start = now;
+        sched_sleep(wait);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+void sched_charge(size_t n)
+{
+    if (!state)
+        return;
+
+    deficit -= n < deficit ? n : deficit;
+
+    if (BANDWIDTH)
+        bucket_take(&state->bucket, BANDWIDTH, global_burst(), n, 1);
+
+    if (BANDWIDTH_CONN)
+        bucket_take(&conn_bucket, BANDWIDTH_CONN, conn_burst(), n, 1);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void sched_waiting()
+{
+    if (state && current_short)
+        atomic_store_explicit(&state->short_until, now_us() + SCHED_SHORT_HOLD_US,
+                              memory_order_relaxed);
+}
@@ -0,0 +1,591 @@
+#include "path_index.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Slot has never been used. */
+#define PI_EMPTY 0
+/** @brief Slot holds an entry. */
+#define PI_USED 1
+/** @brief Slot held an entry that was removed (tombstone). */
+#define PI_DELETED 2
+/** @brief Flag set on entries that are directories. */
+#define PI_DIR 4
+/** @brief Flag set on symlinked directories: not indexed below, looked up on the filesystem. */
+#define PI_LINK 8
+
+/** @brief Events we care about on every watched directory. */
+#define PI_WATCH_MASK \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB)
+
+/**
+ * @brief A single entry of the index.
+ * Kept at 24 bytes: names live in a separate arena and are referenced by
+ * offset, and the modification time is stored in seconds as 32 bits. */
+typedef struct IndexEntryStruct
+{
+    /** @brief FNV-1a hash of the relative path. */
+    uint32_t hash;
+    /** @brief Offset of the relative path in the names arena. */
+    uint32_t name;
+    /** @brief Length of the relative path. */
+    uint16_t len;
+    /** @brief Slot state (PI_EMPTY, PI_USED, PI_DELETED) plus PI_DIR and PI_LINK. */
+    uint16_t flags;
+    /** @brief Modification time, in seconds since Epoch. */
+    uint32_t mtime;
+    /** @brief Size of the entry in bytes. */
+    uint64_t size;
+} IndexEntry;
+
+/**
+ * @brief Hash table of entries, indexed by hash modulo capacity.
+ * Collisions are resolved by linear probing. */
+static IndexEntry* table;
+
+/** @brief Number of slots in the table. Always a power of two. */
+static size_t capacity;
+
+/** @brief Number of slots holding an entry. */
+static size_t used;
+
+/** @brief Number of tombstone slots. */
+static size_t tombstones;
+
+/**
+ * @brief Names arena.
+ * Relative paths of all entries, stored back to back without terminators. */
+static char* names;
+
+/** @brief Bytes used in the names arena. */
+static size_t names_len;
+
+/** @brief Bytes allocated for the names arena. */
+static size_t names_cap;
+
+/** @brief Bytes in the names arena that belong to removed entries. */
+static size_t names_garbage;
+
+/**
+ * @brief Relative path of each watched directory, indexed by watch descriptor.
+ * Watch descriptors are small increasing integers, so a flat array works. */
+static char** watches;
+
+/** @brief Number of slots in the watches array. */
+static size_t watches_cap;
+
+/** @brief Inotify file descriptor, -1 when not watching. */
+static int ifd = -1;
+
+/** @brief Non-zero when the index is built and lookups are authoritative. */
+static int ready = 0;
+
+/** @brief Length of ROOT_DIR without trailing slashes. */
+static size_t root_len;
+
+/* -------------------------------------------------------------------------- */
+
+static uint32_t pi_hash(const char* s, size_t len)
+{
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Find the slot of a relative path.
+ * @return The slot holding the path, or NULL if it's not in the table. */
+static IndexEntry* pi_find(const char* rel, size_t len, uint32_t hash)
+{
+    size_t mask = capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        IndexEntry* e = &table[i];
+        if ((e->flags & 3) == PI_EMPTY)
+            return NULL;
+        if ((e->flags & 3) == PI_USED && e->hash == hash && e->len == len &&
+            memcmp(names + e->name, rel, len) == 0)
+            return e;
+    }
+}
+
+static int pi_resize(size_t new_capacity)
+{
+    IndexEntry* old     = table;
+    size_t      old_cap = capacity;
+
+    table = calloc(new_capacity, sizeof *table);
+    if (!table)
+    {
+        table = old;
+        return EXIT_FAILURE;
+    }
+
+    capacity   = new_capacity;
+    tombstones = 0;
+
+    for (size_t i = 0; i < old_cap; i++)
+    {
+        if ((old[i].flags & 3) != PI_USED)
+            continue;
+
+        size_t j = old[i].hash & (capacity - 1);
+        while (table[j].flags != PI_EMPTY)
+            j = (j + 1) & (capacity - 1);
+        table[j] = old[i];
+    }
+
+    free(old);
+    return EXIT_SUCCESS;
+}
+
+static int pi_insert(const char* rel, size_t len, const struct stat* st, int link)
+{
+    if (len > UINT16_MAX)
+        return EXIT_FAILURE;
+
+    if ((used + tombstones + 1) * 10 > capacity * 7)  // Keep load factor under 70%
+    {
+        size_t new_capacity = (used + 1) * 10 > capacity * 5 ? capacity * 2 : capacity;
+        if (pi_resize(new_capacity))
+            return EXIT_FAILURE;
+    }
+
+    uint32_t    hash = pi_hash(rel, len);
+    IndexEntry* e    = pi_find(rel, len, hash);
+
+    if (!e)
+    {
+        if (!names || names_len + len > names_cap)
+        {
+            size_t new_cap = names_cap ? names_cap * 2 : 4096;
+            while (new_cap < names_len + len)
+                new_cap *= 2;
+            if (new_cap > UINT32_MAX)
+                return EXIT_FAILURE;
+
+            char* grown = realloc(names, new_cap);
+            if (!grown)
+                return EXIT_FAILURE;
+            names     = grown;
+            names_cap = new_cap;
+        }
+
+        size_t i = hash & (capacity - 1);
+        while ((table[i].flags & 3) == PI_USED)
+            i = (i + 1) & (capacity - 1);
+
+        if ((table[i].flags & 3) == PI_DELETED)
+            tombstones--;
+
+        e       = &table[i];
+        e->hash = hash;
+        e->name = names_len;
+        e->len  = len;
+        memcpy(names + names_len, rel, len);
+        names_len += len;
+        used++;
+    }
+
+    e->flags = PI_USED | (S_ISDIR(st->st_mode) ? PI_DIR : 0) | (link ? PI_LINK : 0);
+    e->size  = st->st_size;
+    e->mtime = st->st_mtime;
+    return EXIT_SUCCESS;
+}
+
+static void pi_remove_entry(IndexEntry* e)
+{
+    e->flags = PI_DELETED;
+    names_garbage += e->len;
+    used--;
+    tombstones++;
+}
+
+static void pi_remove(const char* rel, size_t len, int subtree)
+{
+    IndexEntry* e = pi_find(rel, len, pi_hash(rel, len));
+    if (e)
+        pi_remove_entry(e);
+
+    if (!subtree)
+        return;
+
+    // A directory moved out of the tree keeps its watches, drop them
+    for (size_t wd = 0; wd < watches_cap; wd++)
+    {
+        const char* w = watches[wd];
+        if (w && strncmp(w, rel, len) == 0 && (w[len] == '\0' || w[len] == '/'))
+        {
+            inotify_rm_watch(ifd, wd);
+            free(watches[wd]);
+            watches[wd] = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < capacity; i++)  // Removing a directory is rare, scan is fine
+    {
+        e = &table[i];
+        if ((e->flags & 3) == PI_USED && e->len > len && names[e->name + len] == '/' &&
+            memcmp(names + e->name, rel, len) == 0)
+            pi_remove_entry(e);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int pi_watch(const char* full, const char* rel)
+{
+    int wd = inotify_add_watch(ifd, full, PI_WATCH_MASK | IN_ONLYDIR);
+    if (wd == -1)
+    {
+        wlog(WARNING, "Failed to watch %s: (%d) %s.", full, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if ((size_t) wd >= watches_cap)
+    {
+        size_t new_cap = watches_cap ? watches_cap * 2 : 64;
+        while (new_cap <= (size_t) wd)
+            new_cap *= 2;
+
+        char** grown = realloc(watches, new_cap * sizeof *watches);
+        if (!grown)
+            return EXIT_FAILURE;
+        memset(grown + watches_cap, 0, (new_cap - watches_cap) * sizeof *watches);
+        watches     = grown;
+        watches_cap = new_cap;
+    }
+
+    free(watches[wd]);
+    watches[wd] = strdup(rel);
+    return watches[wd] ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Index a directory and everything below it.
+ * The watch is added before reading the directory so entries created while
+ * scanning are not missed.
+ * @param rel Path of the directory relative to ROOT_DIR ("" for the root). */
+static int pi_scan(const char* rel)
+{
+    char full[PATH_MAX];
+    snprintf(full, sizeof full, "%.*s%s%s", (int) root_len, ROOT_DIR, *rel ? "/" : "", rel);
+
+    if (ifd != -1 && pi_watch(full, rel))
+        return EXIT_FAILURE;
+
+    DIR* dir = opendir(full);
+    if (!dir)
+    {
+        wlog(WARNING, "Failed to open directory %s: (%d) %s.", full, errno, strerror(errno));
+        return EXIT_SUCCESS;  // Vanished or unreadable, fopen() would fail anyway
+    }
+
+    int            status = EXIT_SUCCESS;
+    struct dirent* de;
+    while (status == EXIT_SUCCESS && (de = readdir(dir)))
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        char child[PATH_MAX];
+        int  len = snprintf(child, sizeof child, "%s%s%s", rel, *rel ? "/" : "", de->d_name);
+        if (len < 0 || (size_t) len >= sizeof child)
+            continue;
+
+        struct stat st, lst;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) == -1 ||
+            fstatat(dirfd(dir), de->d_name, &lst, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;  // Dangling symlink or already gone
+
+        // Don't follow symlinked directories, they could loop: below them, lookups stat()
+        int link = S_ISDIR(st.st_mode) && S_ISLNK(lst.st_mode);
+        if (pi_insert(child, len, &st, link))
+        {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode) && !link)
+            status = pi_scan(child);
+    }
+
+    closedir(dir);
+    return status;
+}
+
+/**
+ * @brief Check whether a path is below a symlinked directory, which isn't indexed.
+ * @param rel Path relative to ROOT_DIR.
+ * @param len Its length. */
+static int pi_linked(const char* rel, size_t len)
+{
+    for (size_t i = 1; i < len; i++)
+    {
+        if (rel[i] != '/')
+            continue;
+
+        IndexEntry* e = pi_find(rel, i, pi_hash(rel, i));
+        if (!e)
+            return 0;  // Its parent would be indexed
+        if (e->flags & PI_LINK)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void pi_free()
+{
+    free(table);
+    free(names);
+    for (size_t i = 0; i < watches_cap; i++)
+        free(watches[i]);
+    free(watches);
+
+    if (ifd != -1)
+        close(ifd);
+
+    table         = NULL;
+    names         = NULL;
+    watches       = NULL;
+    ifd           = -1;
+    capacity      = 0;
+    used          = 0;
+    tombstones    = 0;
+    names_len     = 0;
+    names_cap     = 0;
+    watches_cap   = 0;
+    names_garbage = 0;
+    ready         = 0;
+}
+
+static int pi_build()
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    root_len = strlen(ROOT_DIR);
+    while (root_len > 1 && ROOT_DIR[root_len - 1] == '/')
+        root_len--;
+
+    capacity = 1024;
+    table    = calloc(capacity, sizeof *table);
+    ifd      = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (!table || ifd == -1)
+    {
+        wlog(ERROR, "Failed to set up path index: (%d) %s.", errno, strerror(errno));
+        pi_free();
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    if (stat(ROOT_DIR, &st) == -1 || pi_insert("", 0, &st, 0) || pi_scan(""))
+    {
+        wlog(ERROR, "Failed to index %s. Path index disabled.", ROOT_DIR);
+        pi_free();
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    char mem_str[32];
+    human_readable_size(capacity * sizeof *table + names_cap, mem_str, sizeof mem_str);
+    wlog(INFO, "Indexed %zu entries of %s (%s) in %.2f ms.", used, ROOT_DIR, mem_str, ms);
+
+    ready = 1;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int path_index_startup()
+{
+    if (!PATH_INDEX)
+    {
+        wlog(DEBUG, "Path index disabled.");
+        return EXIT_SUCCESS;
+    }
+
+    wlog(INFO, "Building path index of %s...", ROOT_DIR);
+    return pi_build();
+}
+
+/* -------------------------------------------------------------------------- */
+
+void path_index_shutdown()
+{
+    pi_free();
+}
+
+/* -------------------------------------------------------------------------- */
+
+int path_index_ready()
+{
+    return ready;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int path_index_lookup(const char path[], PathInfo* info)
+{
+    if (strncmp(path, ROOT_DIR, root_len) != 0)
+        return EXIT_FAILURE;
+
+    const char* rel = path + root_len;
+    if (*rel != '\0' && *rel != '/')  // "database/x" is not inside "data"
+        return EXIT_FAILURE;
+
+    while (*rel == '/')
+        rel++;
+
+    size_t len = strlen(rel);
+    while (len > 0 && rel[len - 1] == '/')
+        len--;
+
+    IndexEntry* e = pi_find(rel, len, pi_hash(rel, len));
+    if (!e && pi_linked(rel, len))  // Not indexed, the filesystem knows
+    {
+        struct stat st;
+        if (stat(path, &st) == -1)
+            return EXIT_FAILURE;
+
+        if (info)
+        {
+            info->is_dir = S_ISDIR(st.st_mode);
+            info->size   = st.st_size;
+            info->mtime  = st.st_mtime;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (!e)
+        return EXIT_FAILURE;
+
+    if (info)
+    {
+        info->is_dir = (e->flags & PI_DIR) != 0;
+        info->size   = e->size;
+        info->mtime  = e->mtime;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int path_index_fd()
+{
+    return ifd;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int path_index_update()
+{
+    if (!ready)
+        return EXIT_FAILURE;
+
+    char buff[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        ssize_t len = read(ifd, buff, sizeof buff);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;  // EAGAIN, nothing left to read
+
+        for (char* p = buff; p < buff + len;)
+        {
+            struct inotify_event* ev = (struct inotify_event*) p;
+            p += sizeof *ev + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                wlog(WARNING, "Path index event queue overflowed. Rebuilding index...");
+                pi_free();
+                return pi_build();
+            }
+
+            if (ev->wd < 0 || (size_t) ev->wd >= watches_cap || !watches[ev->wd])
+                continue;
+
+            if (ev->mask & IN_IGNORED)  // Watch removed, directory is gone
+            {
+                free(watches[ev->wd]);
+                watches[ev->wd] = NULL;
+                continue;
+            }
+
+            if (ev->len == 0)
+                continue;
+
+            const char* dir = watches[ev->wd];
+            char        rel[PATH_MAX];
+            int n = snprintf(rel, sizeof rel, "%s%s%s", dir, *dir ? "/" : "", ev->name);
+            if (n < 0 || (size_t) n >= sizeof rel)
+                continue;
+
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                wlog(TRACE, "Path index: removed %s.", rel);
+                pi_remove(rel, n, ev->mask & IN_ISDIR);
+                continue;
+            }
+
+            char full[PATH_MAX];
+            n = snprintf(full, sizeof full, "%.*s/%s", (int) root_len, ROOT_DIR, rel);
+            if (n < 0 || (size_t) n >= sizeof full)
+                continue;
+            n = strlen(rel);
+
+            struct stat st, lst;
+            if (stat(full, &st) == -1 || lstat(full, &lst) == -1)
+            {
+                pi_remove(rel, n, 1);
+                continue;
+            }
+
+            int link = S_ISDIR(st.st_mode) && S_ISLNK(lst.st_mode);
+            wlog(TRACE, "Path index: updated %s.", rel);
+            if (pi_insert(rel, n, &st, link) ||
+                (S_ISDIR(st.st_mode) && !link && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                 pi_scan(rel)))
+            {
+                wlog(ERROR, "Failed to update path index. Path index disabled.");
+                pi_free();
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // Removed names are never reclaimed in place, rebuild once they pile up
+    if (names_garbage > 64 * 1024 && names_garbage > names_len / 2)
+    {
+        wlog(DEBUG, "Compacting path index...");
+        pi_free();
+        return pi_build();
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1089 @@
+#define _GNU_SOURCE  // strptime(), timegm()
+#include "proxy.h"
+#include "bufpool.h"
+#include "config.h"
+#include "connections.h"
+#include "h2.h"
+#include "html_rewrite.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "proxy_cache.h"
+#include "response.h"
+#include "server.h"
+#include "stats.h"
+#include "upstream.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Most bytes rewritten at a time, for HTML pages. */
+#define PROXY_CHUNK (16 * 1024)
+
+/** @brief Seconds a background refresh may take before it is killed. */
+#define PROXY_REFRESH_TIMEOUT 30
+
+/** @brief State of a chunked transfer coding decoder. */
+typedef enum ChunkStateEnum
+{
+    CH_SIZE,      /**< Reading the hexadecimal chunk size. */
+    CH_EXT,       /**< Skipping chunk extensions until the end of the line. */
+    CH_DATA,      /**< Reading chunk data. */
+    CH_DATA_END,  /**< Expecting the "\r\n" after chunk data. */
+    CH_TRAILER,   /**< Skipping trailer lines after the last chunk. */
+    CH_DONE,      /**< Body complete. */
+    CH_ERROR,     /**< Malformed body. */
+} ChunkState;
+
+/** @brief Incremental decoder for chunked upstream bodies. */
+typedef struct ChunkDecoderStruct
+{
+    /** @brief A ChunkState. */
+    int state;
+    /** @brief Data bytes left in the current chunk, or the chunk size being read. */
+    uint64_t left;
+    /** @brief Length of the current trailer line. */
+    size_t line_len;
+} ChunkDecoder;
+
+/** @brief How the end of an upstream body is found. */
+typedef enum BodyFramingEnum
+{
+    BODY_NONE,     /**< No body (HEAD, 204, 304). */
+    BODY_LENGTH,   /**< Content-Length bytes. */
+    BODY_CHUNKED,  /**< Chunked transfer coding. */
+    BODY_CLOSE,    /**< Until the upstream closes the connection. */
+} BodyFraming;
+
+/** @brief Headers that only concern a single connection and are never forwarded. */
+static const char* hop_by_hop[] = {"Connection",
+                                   "Keep-Alive",
+                                   "Proxy-Connection",
+                                   "TE",
+                                   "Trailer",
+                                   "Transfer-Encoding",
+                                   "Upgrade",
+                                   "Content-Length",
+                                   NULL};
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_startup()
+{
+    if (!proxy_enabled())
+        return EXIT_SUCCESS;
+
+    if (upstream_startup() || proxy_cache_startup())
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_shutdown()
+{
+    proxy_cache_shutdown();
+    upstream_shutdown();
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_maintain()
+{
+    upstream_maintain();
+}
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_timeout()
+{
+    return upstream_timeout();
+}
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_enabled()
+{
+    return PROXY_UPSTREAM[0] != '\0';
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Whether a header line is one of the given names. */
+static int header_is(const char* line, const char* names[])
+{
+    for (int i = 0; names[i]; i++)
+    {
+        size_t len = strlen(names[i]);
+        if (strncasecmp(line, names[i], len) == 0 && line[len] == ':')
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Copy the header lines of a raw header, minus the excluded ones.
+ * The request or status line is not copied.
+ * @return Bytes written, or 0 if they did not fit. */
+static size_t copy_headers(char* dst, size_t size, const char* head, const char* excluded[])
+{
+    size_t      len  = 0;
+    const char* line = strstr(head, "\r\n");
+
+    while (line && line[2] != '\r' && line[2] != '\0')
+    {
+        line += 2;
+        const char* end = strstr(line, "\r\n");
+        size_t      n   = end ? (size_t) (end - line) + 2 : strlen(line);
+
+        if (!header_is(line, excluded))
+        {
+            if (len + n >= size)
+                return 0;
+            memcpy(dst + len, line, n);
+            len += n;
+        }
+
+        line = end;
+    }
+
+    dst[len] = '\0';
+    return len;
+}
+
+/** @brief Whether a comma separated header value contains a token. */
+static int has_token(const char* value, size_t len, const char* token)
+{
+    size_t token_len = strlen(token);
+
+    for (size_t i = 0; i + token_len <= len; i++)
+    {
+        if (strncasecmp(value + i, token, token_len) != 0)
+            continue;
+
+        char before = i > 0 ? value[i - 1] : ',';
+        char after  = i + token_len < len ? value[i + token_len] : ',';
+        if ((before == ',' || before == ' ') && (after == ',' || after == ' ' || after == '='))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Value of a numeric Cache-Control directive (max-age=N).
+ * @return The value, or -1 if the directive is absent. */
+static long cc_seconds(const char* value, size_t len, const char* directive)
+{
+    size_t dir_len = strlen(directive);
+
+    for (size_t i = 0; i + dir_len < len; i++)
+    {
+        if (strncasecmp(value + i, directive, dir_len) != 0 || value[i + dir_len] != '=')
+            continue;
+        if (i > 0 && value[i - 1] != ',' && value[i - 1] != ' ')
+            continue;
+
+        const char* num = value + i + dir_len + 1;
+        if (*num == '"')
+            num++;
+        return strtol(num, NULL, 10);
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Parse a Content-Length value, digits only (RFC 9110, section 8.6).
+ * @return The length, or -1 if it is negative, not a number or does not fit. */
+static long long content_length_value(const char* value, size_t len)
+{
+    long long length = 0;
+
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
+    if (len == 0)
+        return -1;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (value[i] < '0' || value[i] > '9' || length > (LLONG_MAX - (value[i] - '0')) / 10)
+            return -1;
+        length = length * 10 + (value[i] - '0');
+    }
+
+    return length;
+}
+
+/**
+ * @brief Parse an HTTP date (IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT").
+ * @return The date, or 0 if it is missing or invalid. */
+static time_t http_date(const char* value, size_t len)
+{
+    char      date[64];
+    struct tm tm;
+
+    if (!value || len >= sizeof date)
+        return 0;
+
+    memcpy(date, value, len);
+    date[len] = '\0';
+    memset(&tm, 0, sizeof tm);
+
+    if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return 0;
+
+    return timegm(&tm);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Decide how long a response may be cached.
+ * Follows Cache-Control (s-maxage, max-age, no-store, private, no-cache) and
+ * Expires. Responses without explicit freshness information are not cached.
+ * How long it may be served stale comes from stale-while-revalidate and
+ * stale-if-error (RFC 5861), PROXY_STALE by default, none if must-revalidate.
+ * @param[in] head The response header, null terminated.
+ * @param[in] status The response status code.
+ * @param[out] times Freshness of the response.
+ * @return Non-zero if the response can be stored. */
+static int response_freshness(const char* head, int status, CacheTimes* times)
+{
+    switch (status)  // Cacheable by default, as long as they say for how long
+    {
+        case 200: case 203: case 300: case 301: case 404: case 410: break;
+        default: return 0;
+    }
+
+    size_t      len;
+    const char* value;
+
+    if (http_header_value(head, "Set-Cookie", &len))
+        return 0;
+
+    // Requests are always sent with "Accept-Encoding: identity", that's the only variation
+    value = http_header_value(head, "Vary", &len);
+    if (value && !(len == 15 && strncasecmp(value, "Accept-Encoding", 15) == 0))
+        return 0;
+
+    time_t now  = time(NULL);
+    time_t date = http_date(http_header_value(head, "Date", &len), len);
+    long   age  = 0;
+
+    value = http_header_value(head, "Age", &len);
+    if (value)
+        age = strtol(value, NULL, 10);
+
+    times->stored = now - (age > 0 ? age : 0);
+
+    long lifetime         = -1;
+    long stale_revalidate = PROXY_STALE;
+    long stale_error      = PROXY_STALE;
+    value                 = http_header_value(head, "Cache-Control", &len);
+    if (value)
+    {
+        if (has_token(value, len, "no-store") || has_token(value, len, "private") ||
+            has_token(value, len, "no-cache"))
+            return 0;
+
+        lifetime = cc_seconds(value, len, "s-maxage");
+        if (lifetime < 0)
+            lifetime = cc_seconds(value, len, "max-age");
+
+        if (has_token(value, len, "must-revalidate") || has_token(value, len, "proxy-revalidate"))
+            stale_revalidate = stale_error = 0;
+
+        long seconds = cc_seconds(value, len, "stale-while-revalidate");
+        if (seconds >= 0)
+            stale_revalidate = seconds;
+
+        seconds = cc_seconds(value, len, "stale-if-error");
+        if (seconds >= 0)
+            stale_error = seconds;
+    }
+
+    if (lifetime < 0)
+    {
+        value = http_header_value(head, "Expires", &len);
+        if (!value)
+            return 0;
+
+        time_t expiry = http_date(value, len);  // Invalid dates mean "already expired"
+        lifetime      = expiry - (date ? date : now);
+    }
+
+    times->expires     = times->stored + lifetime;
+    times->stale_until = times->expires + stale_revalidate;
+    times->error_until = times->expires + stale_error;
+    return lifetime > 0;
+}
+
+/**
+ * @brief Conditional request headers to revalidate a stored response with
+ * (If-None-Match from its ETag, If-Modified-Since from its Last-Modified).
+ * @return Length written to buff, 0 if the response has no validator. */
+static size_t cache_validators(const CacheHit* stale, char* buff, size_t size)
+{
+    char     head[HEADER_MAX + 1];
+    CacheHit cursor = *stale;  // Reading moves the cursor, the caller's stays at the start
+    size_t   got    = 0;
+
+    if (stale->header_len > HEADER_MAX)
+        return 0;
+
+    while (got < stale->header_len)
+    {
+        ssize_t n = proxy_cache_read(&cursor, head + got, stale->header_len - got);
+        if (n <= 0)
+            return 0;
+        got += n;
+    }
+    head[got] = '\0';
+
+    size_t      len, out = 0;
+    const char* etag     = http_header_value(head, "ETag", &len);
+    if (etag && len < size / 2 - 32)
+        out += snprintf(buff + out, size - out, "If-None-Match: %.*s\r\n", (int) len, etag);
+
+    const char* modified = http_header_value(head, "Last-Modified", &len);
+    if (modified && len < size / 2 - 32)
+        out += snprintf(buff + out, size - out, "If-Modified-Since: %.*s\r\n", (int) len, modified);
+
+    return out;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Decode a piece of a chunked body in place.
+ * @param d The decoder.
+ * @param buff The raw bytes, replaced by the decoded data.
+ * @param len Number of raw bytes.
+ * @return Number of decoded bytes at the start of buff. */
+static size_t chunk_decode(ChunkDecoder* d, char* buff, size_t len)
+{
+    size_t out = 0;
+
+    for (size_t i = 0; i < len && d->state != CH_DONE && d->state != CH_ERROR; i++)
+    {
+        char c = buff[i];
+
+        switch (d->state)
+        {
+            case CH_SIZE:
+                if (c >= '0' && c <= '9')
+                    d->left = d->left * 16 + (c - '0');
+                else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                    d->left = d->left * 16 + ((c | 0x20) - 'a' + 10);
+                else if (c == '\n')
+                    d->state = d->left ? CH_DATA : CH_TRAILER;
+                else
+                    d->state = CH_EXT;  // ';' extensions, or the '\r' of the line end
+
+                if (d->left > ((uint64_t) 1 << 48))
+                    d->state = CH_ERROR;
+                break;
+
+            case CH_EXT:
+                if (c == '\n')
+                    d->state = d->left ? CH_DATA : CH_TRAILER;
+                break;
+
+            case CH_DATA:
+            {
+                size_t n = len - i;
+                if (n > d->left)
+                    n = d->left;
+
+                memmove(buff + out, buff + i, n);
+                out += n;
+                i += n - 1;
+                d->left -= n;
+
+                if (d->left == 0)
+                    d->state = CH_DATA_END;
+                break;
+            }
+
+            case CH_DATA_END:
+                if (c == '\n')
+                    d->state = CH_SIZE;
+                else if (c != '\r')
+                    d->state = CH_ERROR;
+                break;
+
+            case CH_TRAILER:
+                if (c == '\n')
+                {
+                    if (d->line_len == 0)
+                        d->state = CH_DONE;
+                    d->line_len = 0;
+                }
+                else if (c != '\r')
+                    d->line_len++;
+                break;
+        }
+    }
+
+    return out;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Pass body bytes on to the cache and the client.
+ * @param failed Whether sending to the client already failed; then only the
+ *               cache gets them.
+ * @return Whether sending to the client has failed. */
+static int forward_data(
+    Response* res, CacheWriter* writer, const char* data, size_t len, int failed)
+{
+    if (len == 0)
+        return failed;
+
+    proxy_cache_append(writer, data, len);
+
+    return failed || response_write(res, data, len);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Answer a request from a fresh cache entry.
+ * @return EXIT_SUCCESS on success, 2 if the entry was evicted before anything
+ *         was sent (the request can still be forwarded), EXIT_FAILURE if the
+ *         response could not be completed. */
+static int send_cached(int client_socket, CacheHit* hit, int head_only)
+{
+    char    head[HEADER_MAX + 64];
+    ssize_t n = 0;
+
+    if (hit->header_len > HEADER_MAX)
+        return 2;
+
+    for (size_t got = 0; got < hit->header_len; got += n)
+    {
+        n = proxy_cache_read(hit, head + got, hit->header_len - got);
+        if (n <= 0)
+            return 2;
+    }
+
+    size_t   body_len = hit->size - hit->header_len;
+    long     age      = (long) (time(NULL) - hit->times.stored);
+    int      len      = snprintf(
+        head + hit->header_len, sizeof head - hit->header_len, "Age: %ld\r\n", age > 0 ? age : 0);
+    Response res;
+
+    if (response_begin_head(&res, client_socket, head, hit->header_len + len, body_len, head_only))
+        return EXIT_FAILURE;
+
+    if (head_only)
+        return response_end(&res);
+
+    if (hit->fd != -1)  // Spilled to disk: let the kernel copy it
+    {
+        response_sendfile(&res, hit->fd, hit->header_len, body_len);
+        return response_end(&res);
+    }
+
+    // Read in a buffer sized for the body, a single copy when it fits
+    size_t size;
+    char*  buff = bufpool_get(body_len, &size);
+    if (!buff)
+    {
+        response_abort(&res);
+        return EXIT_FAILURE;
+    }
+
+    while ((n = proxy_cache_read(hit, buff, size)) > 0)
+        if (response_write(&res, buff, n))
+            break;
+
+    bufpool_put(buff);
+
+    if (n > 0)  // The client went away
+        return EXIT_FAILURE;
+
+    if (n < 0)  // Evicted halfway, can't recover
+    {
+        response_abort(&res);
+        return EXIT_FAILURE;
+    }
+
+    return response_end(&res);
+}
+
+/**
+ * @brief Answer a request from a cache entry another process is still filling,
+ * streaming its bytes as they arrive.
+ * The length isn't known yet, so the body is chunked (or delimited by closing
+ * the connection for HTTP/1.0 clients).
+ * @return EXIT_SUCCESS on success, 2 if the entry was dropped before anything
+ *         was sent (the request can still be forwarded), EXIT_FAILURE if the
+ *         response could not be completed. */
+static int send_following(int client_socket, CacheHit* hit)
+{
+    char    head[HEADER_MAX + 64];
+    ssize_t n = 0;
+
+    if (proxy_cache_wait_header(hit) || hit->header_len > HEADER_MAX)
+        return 2;
+
+    for (size_t got = 0; got < hit->header_len; got += n)
+    {
+        n = proxy_cache_follow(hit, head + got, hit->header_len - got);
+        if (n <= 0)
+            return 2;
+    }
+
+    long     age = (long) (time(NULL) - hit->times.stored);
+    int      len = snprintf(
+        head + hit->header_len, sizeof head - hit->header_len, "Age: %ld\r\n", age > 0 ? age : 0);
+    Response res;
+
+    if (response_begin_head(&res, client_socket, head, hit->header_len + len, RESPONSE_CHUNKED, 0))
+        return EXIT_FAILURE;
+
+    // Each piece is all the fetch has so far, send it before waiting for more
+    size_t size;
+    char*  buff = bufpool_get(BUFPOOL_MEDIUM, &size);
+    if (!buff)
+    {
+        response_abort(&res);
+        return EXIT_FAILURE;
+    }
+
+    while ((n = proxy_cache_follow(hit, buff, size)) > 0)
+        if (response_write(&res, buff, n) || response_flush(&res))
+            break;
+
+    bufpool_put(buff);
+
+    if (n > 0)  // The client went away
+        return EXIT_FAILURE;
+
+    if (n < 0)  // The fetch failed halfway, can't recover
+    {
+        response_abort(&res);
+        return EXIT_FAILURE;
+    }
+
+    return response_end(&res);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Send the request to the upstream server and read the response header.
+ * A pooled connection may have been closed by the upstream while idle; in
+ * that case the request is retried once on a new connection.
+ * @param[out] conn The upstream connection used.
+ * @param[in] request The request to send.
+ * @param[in] request_len Its length.
+ * @param[out] head Where to store the response header and the body bytes read with it.
+ * @param[out] have Number of bytes stored in head.
+ * @return Length of the response header, or 0 on failure. */
+static size_t upstream_exchange(UpstreamConn* conn,
+                                const char*   request,
+                                size_t        request_len,
+                                char*         head,
+                                size_t*       have)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (upstream_acquire(conn, attempt > 0))
+            return 0;
+
+        int reused = conn->slot != -1;
+        *have      = 0;
+        head[0]    = '\0';
+
+        ssize_t n = send(conn->fd, request, request_len, MSG_NOSIGNAL);
+
+        char* end = NULL;
+        while (n > 0 && !(end = strstr(head, "\r\n\r\n")) && *have < HEADER_MAX)
+        {
+            n = recv(conn->fd, head + *have, HEADER_MAX - *have, 0);
+            if (n > 0)
+            {
+                *have += n;
+                head[*have] = '\0';
+            }
+        }
+
+        if (end)
+            return end + 4 - head;
+
+        upstream_release(conn, 0);
+
+        if (!reused || *have > 0)  // Only a stale pooled connection is worth a retry
+        {
+            wlog(WARNING, "Failed to get a response header from upstream.");
+            return 0;
+        }
+
+        wlog(DEBUG, "Pooled upstream connection was closed, retrying on a new one.");
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Answer a request the upstream failed to: with the expired copy we have
+ * if it may be served on errors (stale-if-error), with a 502 otherwise.
+ * @return EXIT_SUCCESS if the stale copy was sent, EXIT_FAILURE otherwise. */
+static int upstream_failed(int client_socket, CacheHit* stale, int head_only, const char* message)
+{
+    if (client_socket == -1)  // Background refresh, nobody to answer
+        return EXIT_FAILURE;
+
+    if (stale && time(NULL) < stale->times.error_until)
+    {
+        int result = send_cached(client_socket, stale, head_only);
+        if (result != 2)
+        {
+            wlog(DEBUG, "Upstream failed, served a stale copy instead.");
+            STAT_ADD(cache_stale, 1);
+            if (result)
+                http_keep_alive = 0;
+            return result;
+        }
+    }
+
+    http_keep_alive = 0;
+    send_error_page(client_socket, "502 Bad Gateway", "502", message);
+    return EXIT_FAILURE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Forward a request upstream and stream the response back.
+ * @param client_socket The client, -1 to only refresh the cache.
+ * @param writer The cache entry reserved for the response by the lookup, or
+ *               one not storing. Always finished (committed or aborted).
+ * @param stale An expired copy of the response, or NULL. It is revalidated
+ *              rather than downloaded again when it has validators, and
+ *              served if the upstream fails within its stale-if-error time.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error. */
+static int proxy_forward(int          client_socket,
+                         const char*  req,
+                         const char*  method,
+                         const char*  target,
+                         int          head_only,
+                         CacheWriter* writer,
+                         CacheHit*    stale)
+{
+    static const char* not_forwarded[] = {"Host",
+                                          "Connection",
+                                          "Keep-Alive",
+                                          "Proxy-Connection",
+                                          "TE",
+                                          "Trailer",
+                                          "Transfer-Encoding",
+                                          "Upgrade",
+                                          "HTTP2-Settings",
+                                          "Accept-Encoding",
+                                          NULL};
+
+    // Conditions of the client's own are passed on as is, its 304 isn't ours to use
+    size_t len;
+    char   validators[512];
+    size_t validators_len = 0;
+    if (stale && !http_header_value(req, "If-None-Match", &len) &&
+        !http_header_value(req, "If-Modified-Since", &len))
+        validators_len = cache_validators(stale, validators, sizeof validators);
+
+    char   request[HEADER_MAX + 1024];
+    size_t request_len = snprintf(request,
+                                  sizeof request,
+                                  "%s %s%s HTTP/1.1\r\nHost: %s\r\n%.*s",
+                                  method,
+                                  upstream_prefix(),
+                                  target,
+                                  upstream_host(),
+                                  (int) validators_len,
+                                  validators);
+    size_t headers_len =
+        copy_headers(request + request_len, sizeof request - request_len - 64, req, not_forwarded);
+    request_len += headers_len;
+    request_len += snprintf(request + request_len,
+                            sizeof request - request_len,
+                            "Accept-Encoding: identity\r\nConnection: keep-alive\r\n\r\n");
+
+    UpstreamConn conn;
+    char         head[HEADER_MAX + 1];
+    size_t       have;
+    size_t       head_len = upstream_exchange(&conn, request, request_len, head, &have);
+
+    if (head_len == 0)
+    {
+        proxy_cache_abort(writer);
+        STAT_ADD(upstream_errors, 1);
+        return upstream_failed(
+            client_socket, stale, head_only, "The upstream server did not answer.");
+    }
+
+    char saved    = head[head_len];
+    head[head_len] = '\0';  // Body bytes may follow, put back below
+
+    int status = 0, minor = 0;
+    if (sscanf(head, "HTTP/1.%d %d", &minor, &status) != 2 || status < 200)
+    {
+        upstream_release(&conn, 0);
+        proxy_cache_abort(writer);
+        STAT_ADD(upstream_errors, 1);
+        return upstream_failed(client_socket, stale, head_only, "Invalid upstream response.");
+    }
+
+    if (stale && (status == 500 || status == 502 || status == 503 || status == 504) &&
+        time(NULL) < stale->times.error_until)
+    {
+        upstream_release(&conn, 0);
+        proxy_cache_abort(writer);
+        return upstream_failed(client_socket, stale, head_only, "Upstream server error.");
+    }
+
+    // How does the upstream end the body, and will it keep the connection?
+    const char* connection     = http_header_value(head, "Connection", &len);
+    int         upstream_close = connection ? has_token(connection, len, "close")
+                                            : minor == 0;
+    if (minor == 0 && connection && has_token(connection, len, "keep-alive"))
+        upstream_close = 0;
+
+    if (status == 304 && validators_len > 0)  // Our copy is still good, no body to read
+    {
+        upstream_release(&conn, !upstream_close);
+        proxy_cache_abort(writer);
+
+        // The 304 may leave the freshness headers out, then the old lifetime starts over
+        CacheTimes times;
+        if (!response_freshness(head, 200, &times))
+        {
+            time_t shift = time(NULL) - stale->times.stored;
+            times        = stale->times;
+            times.stored += shift;
+            times.expires += shift;
+            times.stale_until += shift;
+            times.error_until += shift;
+        }
+
+        if (proxy_cache_refresh(stale, &times) == EXIT_SUCCESS)
+        {
+            wlog(DEBUG, "Revalidated %s with the upstream.", target);
+            STAT_ADD(cache_revalidations, 1);
+            stale->times = times;
+
+            if (client_socket == -1)
+                return EXIT_SUCCESS;
+
+            int result = send_cached(client_socket, stale, head_only);
+            if (result != 2)
+            {
+                if (result)
+                    http_keep_alive = 0;
+                return result;
+            }
+        }
+
+        // Evicted meanwhile, ask again for the whole thing
+        return proxy_forward(client_socket, req, method, target, head_only, writer, NULL);
+    }
+
+    const char* te             = http_header_value(head, "Transfer-Encoding", &len);
+    const char* content_length = http_header_value(head, "Content-Length", &len);
+    long long   body_left      = content_length ? content_length_value(content_length, len) : -1;
+    BodyFraming framing        = te ? BODY_CHUNKED : content_length ? BODY_LENGTH : BODY_CLOSE;
+
+    if (framing == BODY_LENGTH && body_left < 0)  // Nothing tells where the body ends
+    {
+        wlog(WARNING, "Invalid Content-Length from the upstream for %s.", target);
+        upstream_release(&conn, 0);
+        proxy_cache_abort(writer);
+        STAT_ADD(upstream_errors, 1);
+        return upstream_failed(client_socket, stale, head_only, "Invalid upstream response.");
+    }
+
+    if (head_only || status == 204 || status == 304)
+        framing = BODY_NONE;
+
+    // Links in HTML pages are pointed at us on the way, which changes their length
+    const char* type    = http_header_value(head, "Content-Type", &len);
+    int         is_html = type && len >= 9 && strncasecmp(type, "text/html", 9) == 0;
+    int         rewrite = PROXY_REWRITE && is_html && framing != BODY_NONE;
+    if (http_header_value(head, "Content-Encoding", &len))
+        rewrite = 0;  // Compressed anyway, in spite of our Accept-Encoding
+
+    // Status line and end-to-end headers: sent to the client and stored in the cache
+    const char* reason     = strchr(head, ' ');
+    int         reason_len = (int) strcspn(reason, "\r\n");
+    char        out[HEADER_MAX + 256];
+    size_t      stored_len = snprintf(out, sizeof out, "HTTP/1.1%.*s\r\n", reason_len, reason);
+    stored_len += copy_headers(out + stored_len, sizeof out - stored_len, head, hop_by_hop);
+
+    // Known lengths are passed on, unless the body is rewritten; the rest is chunked
+    long long out_length = RESPONSE_CHUNKED;
+    if (head_only)
+        out_length = content_length ? body_left : RESPONSE_NO_BODY;
+    else if (framing == BODY_NONE)
+        out_length = RESPONSE_NO_BODY;
+    else if (framing == BODY_LENGTH && !rewrite)
+        out_length = body_left;
+
+    // Store GET responses that say they can be, unless the request was personal
+    CacheTimes times;
+    long long  body_len = framing == BODY_NONE ? 0 : framing == BODY_LENGTH ? body_left : -1;
+
+    if (!head_only && !http_header_value(req, "Authorization", &len) &&
+        response_freshness(head, status, &times))
+    {
+        if (writer->entry == -1)  // Not reserved by the lookup, which was skipped
+            proxy_cache_begin(writer, target);
+        proxy_cache_header(writer, out, stored_len, rewrite ? -1 : body_len, status, &times);
+    }
+    else
+        proxy_cache_abort(writer);  // Requests following it fetch it themselves
+
+    head[head_len] = saved;
+
+    Response res;
+    int      failed = client_socket == -1 ||
+                 response_begin_head(&res, client_socket, out, stored_len, out_length, head_only);
+
+    // Stream the body, starting with what came in along with the header. The rest is
+    // read in a buffer sized for it: the whole body if its length is known and fits
+    ChunkDecoder decoder  = {.state = CH_SIZE};
+    size_t       want     = framing == BODY_LENGTH ? (size_t) body_left : BUFPOOL_MEDIUM;
+    size_t       size     = 0;
+    char*        buff     = framing == BODY_NONE ? NULL : bufpool_get(want, &size);
+    char*        data     = head + head_len;
+    size_t       pending  = have - head_len;
+    int          complete = framing == BODY_NONE;
+    HtmlRewriter rewriter;
+    char         rewritten[PROXY_CHUNK + HTML_URL_MAX];
+
+    if (rewrite && size > PROXY_CHUNK)
+        size = PROXY_CHUNK;  // What rewritten has room for
+
+    if (rewrite)
+        html_rewrite_init(&rewriter, upstream_host(), upstream_prefix());
+
+    // If our client goes away, finish the fetch anyway for the cache and its followers
+    while (!complete && buff && (!failed || writer->entry != -1))
+    {
+        if (pending == 0)
+        {
+            // Small reads are gathered in the response until the upstream makes us wait
+            ssize_t n = recv(conn.fd, buff, size, MSG_DONTWAIT);
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                failed = failed || response_flush(&res);
+                n      = recv(conn.fd, buff, size, 0);
+            }
+
+            if (n <= 0)
+            {
+                complete = framing == BODY_CLOSE && n == 0;
+                if (!complete)
+                    wlog(WARNING, "Upstream response ended early.");
+                break;
+            }
+
+            data    = buff;
+            pending = n;
+            if (failed)
+                conn_progress();  // Keep our deadline away while only storing
+        }
+
+        size_t data_len = pending;
+        if (framing == BODY_CHUNKED)
+        {
+            data_len = chunk_decode(&decoder, data, pending);
+            complete = decoder.state == CH_DONE;
+            if (decoder.state == CH_ERROR)
+            {
+                wlog(WARNING, "Malformed chunked response from upstream.");
+                break;
+            }
+        }
+        else if (framing == BODY_LENGTH)
+        {
+            if ((long long) data_len > body_left)
+                data_len = body_left;  // Anything past the length is not ours
+            body_left -= data_len;
+            complete = body_left == 0;
+        }
+
+        pending = 0;
+        if (rewrite)
+        {
+            data_len = html_rewrite(&rewriter, data, data_len, rewritten);
+            failed   = forward_data(&res, writer, rewritten, data_len, failed);
+        }
+        else
+            failed = forward_data(&res, writer, data, data_len, failed);
+    }
+
+    bufpool_put(buff);
+
+    if (complete && rewrite)
+    {
+        size_t data_len = html_rewrite_finish(&rewriter, rewritten);
+        failed          = forward_data(&res, writer, rewritten, data_len, failed);
+    }
+
+    if (!failed && complete)
+        failed = response_end(&res);
+    else if (!failed)
+        response_abort(&res);  // The client gets what we have, cut short
+
+    upstream_release(&conn, complete && !upstream_close && framing != BODY_CLOSE);
+
+    if (complete)
+        proxy_cache_commit(writer);
+    else
+        proxy_cache_abort(writer);
+
+    if (failed || !complete)
+    {
+        http_keep_alive = 0;  // The client can't tell where this response ends
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Refresh a stale cache entry in the background, after it was served.
+ * The work is done by a detached grandchild, so neither this client nor the
+ * next request on its connection waits for the upstream. Only one refresh per
+ * entry runs at a time: the reservation fails if one is already filling it.
+ * @param client_socket The client socket, closed in the grandchild.
+ * @param target The request target. */
+static void proxy_refresh(int client_socket, const char* target)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        wlog(WARNING, "Failed to fork for a cache refresh: (%d) %s.", errno, strerror(errno));
+        return;
+    }
+
+    if (pid > 0)
+    {
+        waitpid(pid, NULL, 0);  // Only the intermediate, it exits right away
+        return;
+    }
+
+    if (fork() != 0)  // The grandchild is adopted by init, nobody has to wait for it
+        _exit(EXIT_SUCCESS);
+
+    close(client_socket);
+    conn_enter(-1);                // Our progress is not the client's
+    h2_current = NULL;             // Nor is its stream
+    alarm(PROXY_REFRESH_TIMEOUT);  // Not tracked by the main loop, so bound it ourselves
+
+    // Look it up again for a read cursor at the start, and in case it was refreshed meanwhile
+    CacheHit    stale = {.fd = -1};
+    CacheWriter writer;
+    CacheLookup found = proxy_cache_lookup(target, &stale, NULL);
+
+    if ((found == CACHE_STALE || found == CACHE_EXPIRED) &&
+        proxy_cache_begin(&writer, target) == EXIT_SUCCESS)
+    {
+        char req[CACHE_KEY_MAX + 32];
+        snprintf(req, sizeof req, "GET %s HTTP/1.1\r\n\r\n", target);
+        proxy_forward(-1, req, "GET", target, 0, &writer, &stale);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_handle(int client_socket, const char* req, const char* method, const char* target)
+{
+    int head_only = strcmp(method, "HEAD") == 0;
+
+    if (!head_only && strcmp(method, "GET") != 0)
+    {
+        http_keep_alive = 0;
+        send_error_page(
+            client_socket, "501 Not Implemented", "501", "Only GET and HEAD are proxied.");
+        return EXIT_FAILURE;
+    }
+
+    // The client can ask us to skip the cache, the response is still stored
+    size_t      len;
+    const char* cc         = http_header_value(req, "Cache-Control", &len);
+    int         revalidate =
+        cc && (has_token(cc, len, "no-cache") || cc_seconds(cc, len, "max-age") == 0);
+    const char* pragma     = http_header_value(req, "Pragma", &len);
+    if (pragma && has_token(pragma, len, "no-cache"))
+        revalidate = 1;
+
+    // Reserve the entry on a miss if we'll be able to store the response
+    int         storable = !head_only && !http_header_value(req, "Authorization", &len);
+    CacheHit    hit      = {.fd = -1};
+    CacheWriter writer   = {.entry = -1, .fd = -1};
+    CacheLookup found =
+        revalidate ? CACHE_MISS : proxy_cache_lookup(target, &hit, storable ? &writer : NULL);
+    int result = 2;
+
+    if (found == CACHE_FRESH || found == CACHE_STALE)
+    {
+        result = send_cached(client_socket, &hit, head_only);
+        if (result != 2 && found == CACHE_STALE)
+        {
+            wlog(DEBUG, "Served %s stale, refreshing it.", target);
+            STAT_ADD(cache_stale, 1);
+            proxy_refresh(client_socket, target);
+        }
+        else if (result != 2)
+        {
+            wlog(DEBUG, "Served %s from cache.", target);
+            STAT_ADD(cache_hits, 1);
+        }
+    }
+    else if (found == CACHE_FILLING && !head_only)
+    {
+        result = send_following(client_socket, &hit);
+        if (result != 2)
+        {
+            wlog(DEBUG, "Served %s along with the request fetching it.", target);
+            STAT_ADD(cache_coalesced, 1);
+        }
+    }
+
+    if (result != 2)
+    {
+        proxy_cache_done(&hit);
+        if (result)
+            http_keep_alive = 0;
+        return result;
+    }
+
+    STAT_ADD(cache_misses, 1);
+    wlog(DEBUG, "Forwarding %s %s upstream.", method, target);
+
+    CacheHit* stale = found == CACHE_EXPIRED ? &hit : NULL;
+    result          = proxy_forward(client_socket, req, method, target, head_only, &writer, stale);
+    proxy_cache_done(&hit);
+    return result;
+}
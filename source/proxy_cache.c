@@ -0,0 +1,1014 @@
+#include "proxy_cache.h"
+#include "config.h"
+#include "logging.h"
+#include "shm.h"
+#include "stats.h"
+#include "upgrade.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Size of a cache block. Responses are stored as chains of blocks. */
+#define CACHE_BLOCK_SIZE (16 * 1024)
+
+/** @brief How long a follower sleeps before checking that the filling process is alive. */
+#define CACHE_WAIT_MS 200
+
+/** @brief State of a cache entry. */
+typedef enum CacheEntryStateEnum
+{
+    CE_FREE,     /**< Unused, in the free entry list. */
+    CE_FILLING,  /**< Being stored by its owner, only visible to followers. */
+    CE_READY,    /**< Complete, visible to lookups and in the LRU list. */
+} CacheEntryState;
+
+/**
+ * @brief A stored response.
+ * Every field but the atomic ones is protected by the cache lock. The blocks
+ * and spill file of an entry are only written by its owner while it is
+ * filling, and never change once it is ready, so they are read without the
+ * lock. */
+typedef struct CacheEntryStruct
+{
+    /** @brief Cache key (request target). */
+    char key[CACHE_KEY_MAX];
+    /** @brief Hash of the key. */
+    uint64_t hash;
+    /** @brief Bumped whenever the entry is freed, so lock-free readers notice. */
+    atomic_uint gen;
+    /** @brief A CacheEntryState. Written under the lock, read by followers without it. */
+    atomic_int state;
+    /** @brief Process storing the entry while filling. */
+    pid_t owner;
+    /** @brief Next entry in the same hash bucket, or in the free entry list. */
+    int chain;
+    /** @brief Neighbours in the LRU list. */
+    int lru_prev, lru_next;
+    /** @brief First and last block of the entry, -1 if none. */
+    int first_block, last_block;
+    /** @brief Bytes stored so far (header and body). */
+    atomic_size_t size;
+    /** @brief Bumped whenever a follower has something new to look at; a futex word. */
+    atomic_uint progress;
+    /** @brief Followers sleeping on progress, so the owner only wakes them when needed. */
+    atomic_int waiters;
+    /** @brief Length of the stored header. */
+    size_t header_len;
+    /** @brief HTTP status code. */
+    int status;
+    /** @brief Whether the entry lives in a spill file instead of blocks. Read by followers. */
+    atomic_int on_disk;
+    /** @brief Freshness of the response. */
+    CacheTimes times;
+} CacheEntry;
+
+/** @brief Shared cache state, at the start of the shared region. */
+typedef struct CacheStruct
+{
+    /** @brief Protects the entry table, the free lists and the LRU list. */
+    pthread_mutex_t lock;
+    /** @brief Free entry list, linked through chain. */
+    int free_entry;
+    /** @brief Free block list, linked through block_next. */
+    int free_block;
+    /** @brief Most and least recently used ready entries. */
+    int lru_head, lru_tail;
+    /** @brief Bytes held in spill files. */
+    size_t disk_bytes;
+} Cache;
+
+/** @brief The shared region, NULL when the cache is disabled. */
+static Cache* cache = NULL;
+
+/** @brief Size of the shared region. */
+static size_t region_size = 0;
+
+/** @brief Hash buckets, each the first entry of a chain or -1. */
+static int* buckets = NULL;
+
+/** @brief Number of buckets, a power of two. */
+static size_t bucket_count = 0;
+
+/** @brief Entry table. */
+static CacheEntry* entries = NULL;
+
+/** @brief Number of entries. */
+static int entry_count = 0;
+
+/** @brief Next block of each block, -1 at the end of a chain. */
+static int* block_next = NULL;
+
+/** @brief Block data. */
+static char* blocks = NULL;
+
+/** @brief Number of blocks. */
+static int block_count = 0;
+
+/** @brief Largest response kept in memory, bigger ones are spilled or dropped. */
+static size_t object_max = 0;
+
+/** @brief The main server process, in spill file names: an upgraded server has its own files. */
+static pid_t server_pid = 0;
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t cache_hash(const char* key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (; *key; key++)
+        hash = (hash ^ (unsigned char) *key) * 0x100000001b3ULL;
+    return hash;
+}
+
+static void cache_lock()
+{
+    // Robust: a child killed while holding the lock doesn't wedge everyone else
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD)
+    {
+        wlog(WARNING, "Recovering cache lock from a dead process.");
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+static void cache_unlock()
+{
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void cache_file_name(char* buff, size_t size, int e, unsigned gen)
+{
+    snprintf(buff, size, "%s/cache-%d-%d-%u", PROXY_CACHE_DIR, (int) server_pid, e, gen);
+}
+
+/** @brief Tell the followers of an entry that it changed. */
+static void cache_notify(CacheEntry* entry)
+{
+    atomic_fetch_add(&entry->progress, 1);
+    if (atomic_load(&entry->waiters) > 0)
+        syscall(SYS_futex, &entry->progress, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void lru_unlink(int e)
+{
+    CacheEntry* entry = &entries[e];
+
+    if (entry->lru_prev != -1)
+        entries[entry->lru_prev].lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if (entry->lru_next != -1)
+        entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+}
+
+static void lru_push(int e)
+{
+    entries[e].lru_prev = -1;
+    entries[e].lru_next = cache->lru_head;
+
+    if (cache->lru_head != -1)
+        entries[cache->lru_head].lru_prev = e;
+    else
+        cache->lru_tail = e;
+
+    cache->lru_head = e;
+}
+
+/** @brief Give back the blocks of an entry. Lock held. */
+static void cache_free_blocks(CacheEntry* entry)
+{
+    if (entry->first_block != -1)
+    {
+        block_next[entry->last_block] = cache->free_block;
+        cache->free_block             = entry->first_block;
+    }
+
+    entry->first_block = -1;
+    entry->last_block  = -1;
+}
+
+/** @brief Remove an entry from everything and put it in the free list. Lock held. */
+static void cache_free_entry(int e)
+{
+    CacheEntry* entry = &entries[e];
+    unsigned    gen   = atomic_fetch_add_explicit(&entry->gen, 1, memory_order_release);
+
+    if (entry->state == CE_READY)
+        lru_unlink(e);
+
+    for (int* link = &buckets[entry->hash & (bucket_count - 1)]; *link != -1;
+         link      = &entries[*link].chain)
+    {
+        if (*link == e)
+        {
+            *link = entry->chain;
+            break;
+        }
+    }
+
+    if (entry->on_disk)
+    {
+        char name[512];
+        cache_file_name(name, sizeof name, e, gen);
+        unlink(name);
+
+        if (entry->state == CE_READY)
+            cache->disk_bytes -= atomic_load_explicit(&entry->size, memory_order_relaxed);
+    }
+
+    cache_free_blocks(entry);
+    entry->state      = CE_FREE;
+    entry->on_disk    = 0;
+    entry->header_len = 0;
+    entry->chain      = cache->free_entry;
+    atomic_store_explicit(&entry->size, 0, memory_order_relaxed);
+    cache->free_entry = e;
+    cache_notify(entry);
+}
+
+/**
+ * @brief Free entries left filling by processes that died. Lock held.
+ * Only needed when the cache runs out of space, so a full scan is fine.
+ * @return Number of entries freed. */
+static int cache_reclaim_orphans()
+{
+    int freed = 0;
+
+    for (int e = 0; e < entry_count; e++)
+    {
+        if (entries[e].state == CE_FILLING && kill(entries[e].owner, 0) == -1 && errno == ESRCH)
+        {
+            cache_free_entry(e);
+            freed++;
+        }
+    }
+
+    return freed;
+}
+
+/**
+ * @brief Evict the least recently used ready entry matching a condition. Lock held.
+ * @param memory Only consider entries held in memory (blocks).
+ * @param disk Only consider entries held in spill files.
+ * @return EXIT_SUCCESS if an entry was evicted, EXIT_FAILURE otherwise. */
+static int cache_evict(int memory, int disk)
+{
+    for (int e = cache->lru_tail; e != -1; e = entries[e].lru_prev)
+    {
+        if ((memory && entries[e].on_disk) || (disk && !entries[e].on_disk))
+            continue;
+
+        cache_free_entry(e);
+        STAT_ADD(cache_evictions, 1);
+        return EXIT_SUCCESS;
+    }
+
+    return EXIT_FAILURE;
+}
+
+/** @brief Take a free block, evicting if needed. Lock held. @return The block, or -1. */
+static int cache_alloc_block()
+{
+    while (cache->free_block == -1)
+        if (cache_evict(1, 0) && cache_reclaim_orphans() == 0)
+            return -1;
+
+    int block         = cache->free_block;
+    cache->free_block = block_next[block];
+    block_next[block] = -1;
+    return block;
+}
+
+/** @brief Take a free entry, evicting if needed. Lock held. @return The entry, or -1. */
+static int cache_alloc_entry()
+{
+    while (cache->free_entry == -1)
+        if (cache_evict(0, 0) && cache_reclaim_orphans() == 0)
+            return -1;
+
+    int e             = cache->free_entry;
+    cache->free_entry = entries[e].chain;
+    return e;
+}
+
+/**
+ * @brief Find the entry of a key in a given state. Lock held.
+ * Drops entries left filling by dead processes on the way.
+ * @return The entry, or -1. */
+static int cache_find(const char* key, uint64_t hash, int state)
+{
+    int next;
+
+    for (int e = buckets[hash & (bucket_count - 1)]; e != -1; e = next)
+    {
+        CacheEntry* entry = &entries[e];
+        next              = entry->chain;
+
+        if (entry->hash != hash || strcmp(entry->key, key) != 0)
+            continue;
+
+        if (entry->state == CE_FILLING && kill(entry->owner, 0) == -1 && errno == ESRCH)
+            cache_free_entry(e);
+        else if (entry->state == state)
+            return e;
+    }
+
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Remove spill files left by a previous run. */
+static void cache_clean_dir()
+{
+    DIR* dir = opendir(PROXY_CACHE_DIR);
+    if (!dir)
+        return;
+
+    struct dirent* ent;
+    while ((ent = readdir(dir)))
+    {
+        if (strncmp(ent->d_name, "cache-", 6) == 0)
+            unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+
+    closedir(dir);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_cache_startup()
+{
+    if (PROXY_UPSTREAM[0] == '\0' || PROXY_CACHE_MB == 0)
+        return EXIT_SUCCESS;
+
+    server_pid  = getpid();
+    block_count = (int) ((size_t) PROXY_CACHE_MB * 1024 * 1024 / CACHE_BLOCK_SIZE);
+    entry_count = block_count * 2 < 64 ? 64 : block_count * 2;  // Leave room for spilled entries
+    object_max  = (size_t) block_count * CACHE_BLOCK_SIZE / 8;
+
+    bucket_count = 64;
+    while (bucket_count < (size_t) entry_count)
+        bucket_count *= 2;
+
+    size_t buckets_off = sizeof(Cache);
+    size_t entries_off = buckets_off + bucket_count * sizeof *buckets;
+    entries_off        = (entries_off + 63) & ~(size_t) 63;
+    size_t next_off    = entries_off + entry_count * sizeof *entries;
+    size_t blocks_off  = next_off + block_count * sizeof *block_next;
+    blocks_off         = (blocks_off + 4095) & ~(size_t) 4095;
+    region_size        = blocks_off + (size_t) block_count * CACHE_BLOCK_SIZE;
+
+    char* region = shm_alloc("proxy cache", region_size);
+    if (!region)
+        return EXIT_FAILURE;
+
+    cache      = (Cache*) region;
+    buckets    = (int*) (region + buckets_off);
+    entries    = (CacheEntry*) (region + entries_off);
+    block_next = (int*) (region + next_off);
+    blocks     = region + blocks_off;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int err = pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (err)
+    {
+        wlog(FATAL, "Failed to create the cache lock: %s.", strerror(err));
+        proxy_cache_shutdown();
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < bucket_count; i++)
+        buckets[i] = -1;
+
+    for (int e = 0; e < entry_count; e++)
+    {
+        entries[e].chain       = e + 1 < entry_count ? e + 1 : -1;
+        entries[e].first_block = -1;
+        entries[e].last_block  = -1;
+    }
+
+    for (int b = 0; b < block_count; b++)
+        block_next[b] = b + 1 < block_count ? b + 1 : -1;
+
+    cache->free_entry = 0;
+    cache->free_block = block_count > 0 ? 0 : -1;
+    cache->lru_head   = -1;
+    cache->lru_tail   = -1;
+
+    if (PROXY_CACHE_DIR[0] != '\0')
+    {
+        if (mkdir(PROXY_CACHE_DIR, 0700) == -1 && errno != EEXIST)
+        {
+            wlog(FATAL,
+                 "Failed to create cache directory %s: %s.",
+                 PROXY_CACHE_DIR,
+                 strerror(errno));
+            proxy_cache_shutdown();
+            return EXIT_FAILURE;
+        }
+
+        if (!upgrade_inheriting())  // The old server's children are still reading theirs
+            cache_clean_dir();
+    }
+
+    wlog(INFO,
+         "Proxy cache ready: %d MB in memory (%d blocks, %d entries), %s.",
+         PROXY_CACHE_MB,
+         block_count,
+         entry_count,
+         PROXY_CACHE_DIR[0] != '\0' ? "spilling large responses to disk" : "no disk spill");
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_cache_shutdown()
+{
+    if (cache)
+        pthread_mutex_destroy(&cache->lock);
+
+    if (cache && PROXY_CACHE_DIR[0] != '\0')
+        cache_clean_dir();
+
+    shm_free(cache, region_size);
+    cache   = NULL;
+    buckets = NULL;
+    entries = NULL;
+    blocks  = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Point a hit at a ready entry. Lock held.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if its spill file is gone. */
+static int cache_hit_ready(int e, CacheHit* hit)
+{
+    CacheEntry* entry = &entries[e];
+    hit->entry        = e;
+    hit->gen          = atomic_load_explicit(&entry->gen, memory_order_relaxed);
+    hit->status       = entry->status;
+    hit->header_len   = entry->header_len;
+    hit->size         = atomic_load_explicit(&entry->size, memory_order_relaxed);
+    hit->times        = entry->times;
+    hit->block        = entry->first_block;
+    hit->prev_block   = -1;
+    hit->pos          = 0;
+    hit->filling      = 0;
+
+    if (entry->on_disk)
+    {
+        char name[512];
+        cache_file_name(name, sizeof name, e, hit->gen);
+        hit->fd = open(name, O_RDONLY | O_CLOEXEC);
+
+        if (hit->fd == -1)  // Removed behind our back, forget about it
+        {
+            wlog(WARNING, "Cache spill file %s vanished: %s.", name, strerror(errno));
+            cache_free_entry(e);
+            return EXIT_FAILURE;
+        }
+    }
+
+    lru_unlink(e);
+    lru_push(e);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Take a free entry for a key and mark it filling by this process. Lock held.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if no entry is available. */
+static int cache_reserve(CacheWriter* w, const char* key, uint64_t hash)
+{
+    int e = cache_alloc_entry();
+    if (e == -1)
+        return EXIT_FAILURE;
+
+    CacheEntry* entry = &entries[e];
+    strcpy(entry->key, key);
+    entry->hash        = hash;
+    entry->state       = CE_FILLING;
+    entry->owner       = getpid();
+    entry->first_block = -1;
+    entry->last_block  = -1;
+    entry->on_disk     = 0;
+    entry->header_len  = 0;
+    atomic_store_explicit(&entry->size, 0, memory_order_relaxed);
+
+    int* bucket  = &buckets[hash & (bucket_count - 1)];
+    entry->chain = *bucket;
+    *bucket      = e;
+
+    w->entry = e;
+    w->gen   = atomic_load_explicit(&entry->gen, memory_order_relaxed);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+CacheLookup proxy_cache_lookup(const char* key, CacheHit* hit, CacheWriter* w)
+{
+    hit->fd = -1;
+    if (w)
+    {
+        w->entry = -1;
+        w->fd    = -1;
+    }
+
+    if (!cache)
+        return CACHE_MISS;
+
+    uint64_t    hash  = cache_hash(key);
+    CacheLookup found = CACHE_MISS;
+
+    cache_lock();
+
+    int e = cache_find(key, hash, CE_READY);
+    if (e != -1 && cache_hit_ready(e, hit) == EXIT_SUCCESS)
+    {
+        time_t now = time(NULL);
+        found      = now < hit->times.expires     ? CACHE_FRESH
+                   : now < hit->times.stale_until ? CACHE_STALE
+                                                  : CACHE_EXPIRED;
+    }
+
+    // Stale responses are served while being refreshed, even if someone's on it
+    if (found != CACHE_FRESH && found != CACHE_STALE)
+    {
+        int filling = cache_find(key, hash, CE_FILLING);
+
+        if (filling != -1)  // Someone is fetching it already, wait for them instead
+        {
+            proxy_cache_done(hit);
+            hit->entry      = filling;
+            hit->gen        = atomic_load_explicit(&entries[filling].gen, memory_order_relaxed);
+            hit->header_len = 0;
+            hit->size       = 0;
+            hit->block      = -1;
+            hit->prev_block = -1;
+            hit->pos        = 0;
+            hit->filling    = 1;
+            found           = CACHE_FILLING;
+        }
+        else if (w && strlen(key) < CACHE_KEY_MAX)
+            cache_reserve(w, key, hash);
+    }
+
+    cache_unlock();
+    return found;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Copy bytes at the read cursor, at most up to the end of its block.
+ * @return Bytes copied, 0 if the entry was spilled to disk while copying (read
+ *         again from the file), -1 if it was freed. */
+static ssize_t cache_copy(CacheHit* hit, char* buff, size_t len)
+{
+    if (hit->fd != -1)  // Spill files are never rewritten, no need to check the generation
+    {
+        ssize_t n = pread(hit->fd, buff, len, hit->pos);
+        if (n <= 0)
+            return -1;
+        hit->pos += n;
+        return n;
+    }
+
+    size_t offset = hit->pos % CACHE_BLOCK_SIZE;
+    if (len > CACHE_BLOCK_SIZE - offset)
+        len = CACHE_BLOCK_SIZE - offset;
+
+    int block = hit->block;
+    memcpy(buff, blocks + (size_t) block * CACHE_BLOCK_SIZE + offset, len);
+    int next = block_next[block];
+
+    // Seqlock: if the entry was freed while we copied, the copy may be garbage
+    atomic_thread_fence(memory_order_acquire);
+    CacheEntry* entry = &entries[hit->entry];
+    if (atomic_load_explicit(&entry->gen, memory_order_relaxed) != hit->gen)
+        return -1;
+
+    // Same if the owner moved it to disk and gave its blocks back
+    if (hit->filling && atomic_load_explicit(&entry->on_disk, memory_order_relaxed))
+        return 0;
+
+    hit->pos += len;
+    if (hit->pos % CACHE_BLOCK_SIZE == 0)
+    {
+        hit->prev_block = block;
+        hit->block      = next;  // -1 while following if the next block isn't there yet
+    }
+
+    return len;
+}
+
+/* -------------------------------------------------------------------------- */
+
+ssize_t proxy_cache_read(CacheHit* hit, char* buff, size_t len)
+{
+    if (hit->pos >= hit->size)
+        return 0;
+
+    if (len > hit->size - hit->pos)
+        len = hit->size - hit->pos;
+
+    return cache_copy(hit, buff, len);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Sleep until an entry's progress counter moves past a value.
+ * Wakes up regularly to check on the owner: if it died, the entry is dropped.
+ * @return EXIT_SUCCESS when there may be progress, EXIT_FAILURE if the entry is gone. */
+static int cache_wait(CacheHit* hit, unsigned seen)
+{
+    CacheEntry*     entry   = &entries[hit->entry];
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = CACHE_WAIT_MS * 1000000L};
+
+    atomic_fetch_add(&entry->waiters, 1);
+    long ret = syscall(SYS_futex, &entry->progress, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    atomic_fetch_sub(&entry->waiters, 1);
+
+    if (ret == -1 && errno == ETIMEDOUT)
+    {
+        cache_lock();
+        if (atomic_load(&entry->gen) == hit->gen && entry->state == CE_FILLING &&
+            kill(entry->owner, 0) == -1 && errno == ESRCH)
+            cache_free_entry(hit->entry);
+        cache_unlock();
+    }
+
+    return atomic_load(&entry->gen) == hit->gen ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_cache_wait_header(CacheHit* hit)
+{
+    CacheEntry* entry = &entries[hit->entry];
+
+    for (;;)
+    {
+        unsigned seen = atomic_load(&entry->progress);
+
+        cache_lock();
+        int alive = atomic_load(&entry->gen) == hit->gen;
+        if (alive && entry->header_len > 0)
+        {
+            hit->status     = entry->status;
+            hit->header_len = entry->header_len;
+            hit->times      = entry->times;
+        }
+        cache_unlock();
+
+        if (!alive)
+            return EXIT_FAILURE;
+        if (hit->header_len > 0)
+            return EXIT_SUCCESS;
+        if (cache_wait(hit, seen))
+            return EXIT_FAILURE;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+ssize_t proxy_cache_follow(CacheHit* hit, char* buff, size_t len)
+{
+    CacheEntry* entry = &entries[hit->entry];
+
+    for (;;)
+    {
+        // Read in this order: a ready entry's size is final
+        unsigned seen    = atomic_load(&entry->progress);
+        int      ready   = atomic_load(&entry->state) == CE_READY;
+        size_t   size    = atomic_load_explicit(&entry->size, memory_order_acquire);
+        int      on_disk = atomic_load(&entry->on_disk);
+
+        if (atomic_load(&entry->gen) != hit->gen)
+            return -1;
+
+        if (hit->pos < size)
+        {
+            if (on_disk && hit->fd == -1)
+            {
+                char name[512];
+                cache_file_name(name, sizeof name, hit->entry, hit->gen);
+                hit->fd = open(name, O_RDONLY | O_CLOEXEC);
+                if (hit->fd == -1)
+                    return -1;
+            }
+
+            if (hit->fd == -1 && hit->block == -1)  // Linked before size was published
+                hit->block =
+                    hit->prev_block == -1 ? entry->first_block : block_next[hit->prev_block];
+
+            ssize_t n = 0;  // No block: given back by a spill, go again with the file
+            if (hit->fd != -1 || hit->block != -1)
+                n = cache_copy(hit, buff, len < size - hit->pos ? len : size - hit->pos);
+
+            if (n != 0)
+                return n;
+            continue;
+        }
+
+        if (ready)
+        {
+            hit->size    = size;
+            hit->filling = 0;
+            return 0;
+        }
+
+        if (cache_wait(hit, seen))
+            return -1;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_cache_refresh(const CacheHit* hit, const CacheTimes* times)
+{
+    CacheEntry* entry = &entries[hit->entry];
+
+    cache_lock();
+    int valid = atomic_load(&entry->gen) == hit->gen && entry->state == CE_READY;
+    if (valid)
+        entry->times = *times;
+    cache_unlock();
+
+    return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_cache_done(CacheHit* hit)
+{
+    if (hit->fd != -1)
+        close(hit->fd);
+    hit->fd = -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int proxy_cache_begin(CacheWriter* w, const char* key)
+{
+    w->entry = -1;
+    w->fd    = -1;
+
+    if (!cache || strlen(key) >= CACHE_KEY_MAX)
+        return EXIT_FAILURE;
+
+    uint64_t hash = cache_hash(key);
+
+    cache_lock();
+
+    int failed = cache_find(key, hash, CE_FILLING) != -1  // Someone else is already on it
+              || cache_reserve(w, key, hash);
+
+    cache_unlock();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Move an entry that outgrew memory to a spill file.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+static int cache_spill(CacheWriter* w)
+{
+    CacheEntry* entry = &entries[w->entry];
+    char        name[512];
+    cache_file_name(name, sizeof name, w->entry, w->gen);
+
+    w->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (w->fd == -1)
+    {
+        wlog(WARNING, "Failed to create cache spill file %s: %s.", name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // Only we write this entry, its blocks can be read without the lock
+    size_t left = atomic_load_explicit(&entry->size, memory_order_relaxed);
+    for (int b = entry->first_block; b != -1 && left > 0; b = block_next[b])
+    {
+        size_t n = left < CACHE_BLOCK_SIZE ? left : CACHE_BLOCK_SIZE;
+        if (write(w->fd, blocks + (size_t) b * CACHE_BLOCK_SIZE, n) != (ssize_t) n)
+        {
+            wlog(WARNING, "Failed to write cache spill file %s: %s.", name, strerror(errno));
+            close(w->fd);
+            unlink(name);
+            w->fd = -1;
+            return EXIT_FAILURE;
+        }
+        left -= n;
+    }
+
+    // Followers must see the flag before the blocks can be reused
+    cache_lock();
+    entry->on_disk = 1;
+    cache_free_blocks(entry);
+    cache_unlock();
+    cache_notify(entry);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_cache_append(CacheWriter* w, const void* data, size_t len)
+{
+    if (w->entry == -1)
+        return;
+
+    CacheEntry* entry = &entries[w->entry];
+    size_t      size  = atomic_load_explicit(&entry->size, memory_order_relaxed);
+
+    if (w->fd == -1 && size + len > object_max)
+    {
+        if (PROXY_CACHE_DIR[0] == '\0' || cache_spill(w))
+        {
+            wlog(DEBUG, "Response for %s too large to cache.", entry->key);
+            proxy_cache_abort(w);
+            return;
+        }
+    }
+
+    if (w->fd != -1)
+    {
+        if (size + len > (size_t) PROXY_DISK_MB * 1024 * 1024 ||
+            write(w->fd, data, len) != (ssize_t) len)
+        {
+            proxy_cache_abort(w);
+            return;
+        }
+
+        atomic_store_explicit(&entry->size, size + len, memory_order_release);
+        cache_notify(entry);
+        return;
+    }
+
+    const char* src = data;
+    while (len > 0)
+    {
+        size_t offset = size % CACHE_BLOCK_SIZE;
+
+        if (offset == 0)  // Last block full (or none yet)
+        {
+            cache_lock();
+            int block = cache_alloc_block();
+            if (block != -1)
+            {
+                if (entry->last_block != -1)
+                    block_next[entry->last_block] = block;
+                else
+                    entry->first_block = block;
+                entry->last_block = block;
+            }
+            cache_unlock();
+
+            if (block == -1)
+            {
+                wlog(DEBUG, "Cache full, not storing %s.", entry->key);
+                proxy_cache_abort(w);
+                return;
+            }
+        }
+
+        size_t n = CACHE_BLOCK_SIZE - offset;
+        if (n > len)
+            n = len;
+
+        memcpy(blocks + (size_t) entry->last_block * CACHE_BLOCK_SIZE + offset, src, n);
+        src += n;
+        len -= n;
+        size += n;
+        atomic_store_explicit(&entry->size, size, memory_order_release);
+    }
+
+    cache_notify(entry);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_cache_header(CacheWriter*      w,
+                        const char*       header,
+                        size_t            header_len,
+                        long long         body_len,
+                        int               status,
+                        const CacheTimes* times)
+{
+    if (w->entry == -1)
+        return;
+
+    CacheEntry* entry = &entries[w->entry];
+    size_t      total = header_len + (body_len > 0 ? (size_t) body_len : 0);
+
+    if (total > object_max &&
+        (PROXY_CACHE_DIR[0] == '\0' || total > (size_t) PROXY_DISK_MB * 1024 * 1024))
+    {
+        wlog(DEBUG, "Response for %s too large to cache.", entry->key);
+        proxy_cache_abort(w);
+        return;
+    }
+
+    proxy_cache_append(w, header, header_len);
+    if (w->entry == -1)
+        return;
+
+    cache_lock();
+    entry->status     = status;
+    entry->header_len = header_len;
+    entry->times      = *times;
+    cache_unlock();
+    cache_notify(entry);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_cache_commit(CacheWriter* w)
+{
+    if (w->entry == -1)
+        return;
+
+    int         e     = w->entry;
+    CacheEntry* entry = &entries[e];
+    size_t      size  = atomic_load_explicit(&entry->size, memory_order_relaxed);
+
+    if (w->fd != -1)
+    {
+        close(w->fd);
+        w->fd = -1;
+    }
+
+    cache_lock();
+
+    if (entry->on_disk)
+    {
+        while (cache->disk_bytes + size > (size_t) PROXY_DISK_MB * 1024 * 1024)
+        {
+            if (cache_evict(0, 1))
+            {
+                cache_unlock();
+                proxy_cache_abort(w);
+                return;
+            }
+        }
+        cache->disk_bytes += size;
+    }
+
+    int old = cache_find(entry->key, entry->hash, CE_READY);
+    if (old != -1)
+        cache_free_entry(old);
+
+    entry->state = CE_READY;
+    lru_push(e);
+
+    cache_unlock();
+    cache_notify(entry);
+
+    STAT_ADD(cache_stores, 1);
+    w->entry = -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void proxy_cache_abort(CacheWriter* w)
+{
+    if (w->entry == -1)
+        return;
+
+    if (w->fd != -1)
+        close(w->fd);
+
+    cache_lock();
+    cache_free_entry(w->entry);
+    cache_unlock();
+
+    w->entry = -1;
+    w->fd    = -1;
+}
@@ -0,0 +1,227 @@
+#include "ratelimit.h"
+#include "config.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "shm.h"
+#include "stats.h"
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief log2 of the number of sets in the table. */
+#define RL_SET_BITS 11
+/** @brief Number of sets in the table. */
+#define RL_SETS (1 << RL_SET_BITS)
+/** @brief Entries per set. A client can only live in the set its key hashes to. */
+#define RL_WAYS 8
+
+/** @brief Request tokens are counted in thousandths, so refills can be fractional. */
+#define RL_MILLI 1000
+
+/**
+ * @brief A client's entry.
+ * Every field is a single atomic word so the main loop and the children can
+ * update entries concurrently without locks, buckets included (see bucket_pack()). */
+typedef struct RateEntryStruct
+{
+    /** @brief Client key (see rl_key()), 0 if the entry is free. */
+    atomic_uint_fast64_t key;
+    /** @brief Request bucket, in thousandths of a request. */
+    atomic_uint_fast64_t requests;
+    /** @brief Byte bucket. Children charge it after sending, so it can go into debt. */
+    atomic_uint_fast64_t bytes;
+    /** @brief Clock reference bit, set on every use, cleared by the eviction sweep. */
+    atomic_uchar referenced;
+} RateEntry;
+
+/** @brief A set of entries, with its own clock hand. */
+typedef struct RateSetStruct
+{
+    RateEntry    ways[RL_WAYS];
+    atomic_uint  hand;
+} RateSet;
+
+/** @brief The table, in shared memory. NULL when rate limiting is disabled. */
+static RateSet* table = NULL;
+
+/** @brief Entry of the connection handled by this process, NULL if none. */
+static RateEntry* current = NULL;
+
+/** @brief Key of the connection handled by this process. */
+static uint64_t current_key = 0;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Build the table key of a peer address.
+ * IPv4 clients are keyed by address. IPv6 clients are keyed by their /64,
+ * since a single host usually owns a whole /64 and could rotate through it.
+ * @return The key, or 0 if the address can't be limited. */
+static uint64_t rl_key(const struct sockaddr_storage* addr)
+{
+    if (addr->ss_family == AF_INET)
+    {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*) addr;
+        return (1ULL << 63) | ntohl(sin->sin_addr.s_addr);
+    }
+
+    if (addr->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*) addr;
+        uint64_t                   prefix;
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))  // IPv4 client on a dual-stack listener
+        {
+            uint32_t v4;
+            memcpy(&v4, sin6->sin6_addr.s6_addr + 12, sizeof v4);
+            return (1ULL << 63) | ntohl(v4);
+        }
+
+        memcpy(&prefix, sin6->sin6_addr.s6_addr, sizeof prefix);
+        return (prefix & ~(1ULL << 63)) | 1;  // Never 0, never clashes with IPv4 keys
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the entry of a key, creating it if needed.
+ * A new client takes a free way of its set, or evicts the first way the
+ * set's clock hand finds unreferenced. */
+static RateEntry* rl_entry(uint64_t key)
+{
+    uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+    RateSet* set  = &table[hash >> (64 - RL_SET_BITS)];
+
+    for (int i = 0; i < RL_WAYS; i++)
+    {
+        RateEntry* e = &set->ways[i];
+        if (atomic_load_explicit(&e->key, memory_order_acquire) == key)
+        {
+            atomic_store_explicit(&e->referenced, 1, memory_order_relaxed);
+            return e;
+        }
+    }
+
+    // Clock sweep: at most two laps, the first one may only clear reference bits
+    for (int i = 0; i < RL_WAYS * 2; i++)
+    {
+        unsigned   hand = atomic_fetch_add_explicit(&set->hand, 1, memory_order_relaxed);
+        RateEntry* e    = &set->ways[hand % RL_WAYS];
+
+        if (atomic_exchange_explicit(&e->referenced, 0, memory_order_relaxed) && i < RL_WAYS)
+            continue;  // Used since the last sweep, give it another chance
+
+        uint64_t old = atomic_load_explicit(&e->key, memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(
+                &e->key, &old, key, memory_order_acq_rel, memory_order_relaxed))
+            continue;  // Someone else took it first
+
+        uint32_t now = (uint32_t) now_ms();
+        atomic_store_explicit(
+            &e->requests, bucket_pack(RATE_BURST * RL_MILLI, now), memory_order_relaxed);
+        atomic_store_explicit(&e->bytes, bucket_pack(RATE_LIMIT_BYTES, now), memory_order_relaxed);
+        atomic_store_explicit(&e->referenced, 1, memory_order_relaxed);
+
+        if (old)
+            STAT_ADD(rate_evictions, 1);
+        return e;
+    }
+
+    return NULL;  // Heavy contention on this set, let the client through
+}
+
+/* -------------------------------------------------------------------------- */
+
+int ratelimit_startup()
+{
+    if (RATE_LIMIT == 0 && RATE_LIMIT_BYTES == 0)
+    {
+        wlog(DEBUG, "Rate limiting disabled.");
+        return EXIT_SUCCESS;
+    }
+
+    table = shm_alloc("rate limiting table", RL_SETS * sizeof *table);
+    if (!table)
+        return EXIT_FAILURE;
+
+    wlog(INFO,
+         "Rate limiting clients to %d requests/s (burst %d) and %d bytes/s.",
+         RATE_LIMIT,
+         RATE_BURST,
+         RATE_LIMIT_BYTES);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void ratelimit_shutdown()
+{
+    shm_free(table, RL_SETS * sizeof *table);
+    table = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int ratelimit_admit(const struct sockaddr_storage* addr)
+{
+    current     = NULL;
+    current_key = 0;
+
+    if (!table)
+        return EXIT_SUCCESS;
+
+    uint64_t key = rl_key(addr);
+    if (key == 0)
+        return EXIT_SUCCESS;
+
+    RateEntry* e = rl_entry(key);
+    if (!e)
+        return EXIT_SUCCESS;
+
+    current     = e;
+    current_key = key;
+    return ratelimit_request();
+}
+
+/* -------------------------------------------------------------------------- */
+
+int ratelimit_request()
+{
+    // The entry may have been given to another client since, then we just stop limiting
+    if (!current || atomic_load_explicit(&current->key, memory_order_relaxed) != current_key)
+        return EXIT_SUCCESS;
+
+    if (RATE_LIMIT_BYTES &&
+        bucket_take(&current->bytes, RATE_LIMIT_BYTES, RATE_LIMIT_BYTES, 0, 0) < 0)
+    {
+        STAT_ADD(rate_limited, 1);
+        return EXIT_FAILURE;
+    }
+
+    if (RATE_LIMIT &&
+        bucket_take(
+            &current->requests, RATE_LIMIT * RL_MILLI, RATE_BURST * RL_MILLI, RL_MILLI, 0) < 0)
+    {
+        STAT_ADD(rate_limited, 1);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void ratelimit_charge(size_t bytes)
+{
+    if (!current || !RATE_LIMIT_BYTES ||
+        atomic_load_explicit(&current->key, memory_order_relaxed) != current_key)
+        return;
+
+    bucket_take(&current->bytes, RATE_LIMIT_BYTES, RATE_LIMIT_BYTES, bytes, 1);
+}
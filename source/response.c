@@ -0,0 +1,519 @@
+#include "response.h"
+#include "connections.h"
+#include "h2.h"
+#include "listener.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "out_sched.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "tls.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Room kept for the size line of the open chunk.
+ * The size is written zero-padded to this fixed width ("0000abcd\r\n"), which
+ * chunked allows, so the line fits right before the data with no gap. */
+#define CHUNK_LINE 10
+
+/** @brief Largest chunk sent, so its size fits in CHUNK_LINE. */
+#define CHUNK_MAX (1UL << 30)
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Hold the producer until the client's socket has room again. */
+static int wait_writable(Response* res)
+{
+    STAT_ADD(send_waits, 1);
+    sched_waiting();
+
+    struct pollfd pfd = {.fd = res->socket, .events = POLLOUT};
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR)  // A stuck client is killed on its deadline
+    {
+        wlog(DEBUG, "Failed to wait for client socket: (%d) %s.", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/** @brief Give up on the response: the client can't tell where it ends. */
+static int fail(Response* res)
+{
+    if (res->stream)  // The stream is reset, the connection goes on
+        h2_stream_abort(res->stream);
+
+    res->failed     = 1;
+    http_keep_alive = 0;
+    conn_inflight_add(-res->inflight);
+    res->inflight = 0;
+    return EXIT_FAILURE;
+}
+
+/** @brief Account for bytes that reached the socket. */
+static void account(Response* res, size_t n)
+{
+    long done = (long) n < res->inflight ? (long) n : res->inflight;
+
+    res->sent += n;
+    res->sends++;
+    res->inflight -= done;
+    conn_inflight_add(-done);
+    conn_progress();
+    ratelimit_charge(n);
+    listener_sent(n);
+    sched_charge(n);
+    trace_send(n);
+}
+
+/**
+ * @brief Bytes of the response left to send, for the scheduler.
+ * @param queued Bytes about to be sent, buffered body bytes included.
+ * @param unwritten Body bytes written after them, e.g. the rest of a file. */
+static size_t remaining(Response* res, size_t queued, size_t unwritten)
+{
+    if (res->length < 0)  // Unknown length: only what we have
+        return queued + unwritten;
+
+    return queued + unwritten + (size_t) (res->length - res->written);
+}
+
+/**
+ * @brief Send a list of buffers completely, waiting for room when the socket is full.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the client went away. */
+static int send_all(Response* res, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        size_t queued = 0;
+        for (int i = 0; i < count; i++)
+            queued += iov[i].iov_len;
+
+        // Only send what the scheduler grants: cut the list there for this call
+        size_t grant = sched_grant(queued, remaining(res, queued, 0));
+        int    used  = 0;
+        while (used < count && grant > iov[used].iov_len)
+            grant -= iov[used++].iov_len;
+
+        size_t cut = used < count ? iov[used].iov_len : 0;  // Length of the cut buffer
+        if (used < count)
+            iov[used++].iov_len = grant;
+
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = used};
+        ssize_t       n   = tls_sendmsg(res->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (cut)
+            iov[used - 1].iov_len = cut;
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(res) == EXIT_SUCCESS)
+                continue;
+
+            wlog(DEBUG, "Failed to send to client: (%d) %s.", errno, strerror(errno));
+            return fail(res);
+        }
+
+        account(res, n);
+
+        while (count > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0)
+        {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Send the buffer, followed by data that didn't fit in it.
+ * When chunked, the buffered body and data go out as one chunk, then after,
+ * which is sent as is (the last chunk, or the size line of a chunk sent
+ * from a file). Leaves the buffer empty, with room for the next size line.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the client went away. */
+static int flush_buffer(Response* res, const void* data, size_t len, const char* after)
+{
+    struct iovec iov[4];
+    int          count = 0;
+    size_t       end   = res->used;  // Bytes of the buffer to send
+
+    if (res->chunked)
+    {
+        size_t body = res->used - res->chunk + len;
+        if (body > 0)
+        {
+            char line[16];
+            snprintf(line, sizeof line, "%08x\r\n", (unsigned) body);
+            memcpy(res->buff + res->chunk - CHUNK_LINE, line, CHUNK_LINE);
+        }
+        else
+            end = res->chunk - CHUNK_LINE;  // Empty chunks would end the body
+
+        iov[count++] = (struct iovec) {.iov_base = res->buff, .iov_len = end};
+        iov[count++] = (struct iovec) {.iov_base = (void*) data, .iov_len = len};
+        iov[count++] = (struct iovec) {.iov_base = "\r\n", .iov_len = body > 0 ? 2 : 0};
+        iov[count++] = (struct iovec) {.iov_base = (void*) after, .iov_len = strlen(after)};
+        res->used = res->chunk = CHUNK_LINE;
+    }
+    else
+    {
+        iov[count++] = (struct iovec) {.iov_base = res->buff, .iov_len = end};
+        iov[count++] = (struct iovec) {.iov_base = (void*) data, .iov_len = len};
+        res->used    = 0;
+    }
+
+    // Skip empty buffers, and the call altogether if there's nothing to send
+    struct iovec* first = iov;
+    while (count > 0 && first->iov_len == 0)
+    {
+        first++;
+        count--;
+    }
+
+    return count > 0 ? send_all(res, first, count) : EXIT_SUCCESS;
+}
+
+/** @brief Check that len more body bytes are allowed by the declared length. */
+static int body_fits(Response* res, size_t len)
+{
+    long long limit = res->length == RESPONSE_NO_BODY ? 0 : res->length;
+
+    if (limit >= 0 && res->written + (long long) len > limit)
+    {
+        wlog(ERROR, "Response body larger than its declared length.");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Add the framing and Connection headers to the header in the buffer.
+ * @param head_len Length of the status line and header lines already in the buffer. */
+static int response_start(
+    Response* res, int client_socket, size_t head_len, long long content_length, int head_only)
+{
+    // HTTP/1.0 clients can't read chunks, they find the end when we close
+    if (content_length == RESPONSE_CHUNKED && !http_chunked && !head_only)
+        http_keep_alive = 0;
+
+    res->socket    = client_socket;
+    res->stream    = h2_current;
+    res->head_only = head_only;
+    res->failed    = 0;
+    res->length    = content_length;
+    res->written   = 0;
+    res->sent      = 0;
+    res->sends     = 0;
+    res->chunked   = content_length == RESPONSE_CHUNKED && http_chunked && !head_only
+                 && !res->stream;
+    res->inflight  = content_length > 0 && !head_only && !res->stream ? (long) content_length : 0;
+
+    if (strncmp(res->buff, "HTTP/", 5) == 0 && head_len > 9)  // "HTTP/1.1 200 OK"
+        trace_status(atoi(res->buff + 9));
+
+    int len;
+    if (content_length >= 0)
+        len = snprintf(res->buff + head_len,
+                       sizeof res->buff - head_len,
+                       "Content-Length: %lld\r\nConnection: %s\r\n\r\n",
+                       content_length,
+                       http_keep_alive ? "keep-alive" : "close");
+    else
+        len = snprintf(res->buff + head_len,
+                       sizeof res->buff - head_len,
+                       "%sConnection: %s\r\n\r\n",
+                       content_length == RESPONSE_CHUNKED && http_chunked
+                           ? "Transfer-Encoding: chunked\r\n"
+                           : "",
+                       http_keep_alive ? "keep-alive" : "close");
+
+    if (len < 0 || head_len + len + CHUNK_LINE > sizeof res->buff)
+    {
+        wlog(ERROR, "Response header does not fit in buffer.");
+        res->inflight = 0;
+        return fail(res);
+    }
+
+    if (res->stream)  // Sent as a HEADERS frame, the body goes to the stream as it is written
+    {
+        res->used = res->chunk = 0;
+        int end   = head_only || content_length == 0 || content_length == RESPONSE_NO_BODY;
+        return h2_stream_begin(res->stream, res->buff, head_len + len, content_length, end)
+                   ? fail(res)
+                   : EXIT_SUCCESS;
+    }
+
+    conn_inflight_add(res->inflight);  // Counts against MAX_INFLIGHT until sent
+
+    res->used = head_len + len;
+    if (res->chunked)  // Room for the size line of the first chunk
+        res->used += CHUNK_LINE;
+    res->chunk = res->used;
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int response_begin(Response*   res,
+                   int         client_socket,
+                   const char* status,
+                   const char* content_type,
+                   long long   content_length,
+                   const char* extra_headers)
+{
+    wlog(TRACE, "Beginning response. (%s, %s, %lld)", status, content_type, content_length);
+
+    int len = snprintf(res->buff,
+                       sizeof res->buff,
+                       "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s",
+                       status,
+                       content_type,
+                       extra_headers ? extra_headers : "");
+
+    if (len < 0 || (size_t) len >= sizeof res->buff)
+        len = sizeof res->buff;  // Refused by response_start()
+
+    return response_start(res, client_socket, len, content_length, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int response_begin_head(Response*   res,
+                        int         client_socket,
+                        const char* head,
+                        size_t      head_len,
+                        long long   content_length,
+                        int         head_only)
+{
+    if (head_len > sizeof res->buff)
+        head_len = sizeof res->buff;  // Refused by response_start()
+    else
+        memcpy(res->buff, head, head_len);
+
+    return response_start(res, client_socket, head_len, content_length, head_only);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int response_write(Response* res, const void* data, size_t len)
+{
+    if (res->failed)
+        return EXIT_FAILURE;
+
+    if (res->head_only || len == 0)
+        return EXIT_SUCCESS;
+
+    if (!body_fits(res, len))
+        return fail(res);
+
+    res->written += len;
+
+    if (res->stream)
+        return h2_stream_write(res->stream, data, len) ? fail(res) : EXIT_SUCCESS;
+
+    const char* bytes = data;
+    while (res->used + len > sizeof res->buff)  // Send it along with the buffer
+    {
+        size_t piece = len < CHUNK_MAX ? len : CHUNK_MAX;
+        if (flush_buffer(res, bytes, piece, ""))
+            return EXIT_FAILURE;
+
+        bytes += piece;
+        len -= piece;
+    }
+
+    memcpy(res->buff + res->used, bytes, len);
+    res->used += len;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int response_printf(Response* res, const char* format, ...)
+{
+    if (res->failed)
+        return EXIT_FAILURE;
+
+    va_list args, retry;
+    va_start(args, format);
+    va_copy(retry, args);
+
+    size_t room = sizeof res->buff - res->used;
+    int    len  = vsnprintf(res->buff + res->used, room, format, args);
+
+    if (len >= 0 && (size_t) len >= room && flush_buffer(res, NULL, 0, "") == EXIT_SUCCESS)
+    {
+        room = sizeof res->buff - res->used;  // Made room, try again
+        len  = vsnprintf(res->buff + res->used, room, format, retry);
+    }
+
+    va_end(retry);
+    va_end(args);
+
+    if (res->failed)
+        return EXIT_FAILURE;
+
+    if (len < 0 || (size_t) len >= room)
+    {
+        wlog(ERROR, "Formatted response text does not fit in buffer.");
+        return fail(res);
+    }
+
+    if (res->head_only)  // Formatted in place, but not kept
+        return EXIT_SUCCESS;
+
+    if (!body_fits(res, len))
+        return fail(res);
+
+    res->written += len;
+
+    if (res->stream)  // Formatted in the buffer, queued on the stream from there
+        return h2_stream_write(res->stream, res->buff, len) ? fail(res) : EXIT_SUCCESS;
+
+    res->used += len;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int response_sendfile(Response* res, int fd, off_t offset, size_t len)
+{
+    if (res->failed)
+        return EXIT_FAILURE;
+
+    if (res->head_only || len == 0)
+        return EXIT_SUCCESS;
+
+    if (!body_fits(res, len))
+        return fail(res);
+
+    res->written += len;
+
+    if (res->stream)
+        return h2_stream_sendfile(res->stream, fd, offset, len) ? fail(res) : EXIT_SUCCESS;
+
+    // Chunked: close the buffered chunk and open one for the file's bytes
+    char line[32] = "";
+    if (res->chunked)
+        snprintf(line, sizeof line, "%zx\r\n", len);
+
+    if (flush_buffer(res, NULL, 0, line))
+        return EXIT_FAILURE;
+
+    off_t end = offset + len;
+    while (offset < end)
+    {
+        size_t  grant = sched_grant(end - offset, remaining(res, 0, end - offset));
+        ssize_t n     = tls_sendfile(res->socket, fd, &offset, grant);
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (wait_writable(res))
+                return fail(res);
+            continue;
+        }
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n == 0)  // Truncated since we looked at its size, errno tells nothing
+        {
+            wlog(WARNING, "File ended %lld bytes short of what was to be sent.",
+                 (long long) (end - offset));
+            return fail(res);
+        }
+
+        if (n < 0)
+        {
+            wlog(DEBUG, "Failed to send file to client: (%d) %s.", errno, strerror(errno));
+            return fail(res);
+        }
+
+        account(res, n);
+    }
+
+    if (res->chunked)  // The chunk's closing line goes out with the next one
+    {
+        memcpy(res->buff, "\r\n", 2);
+        res->used = res->chunk = 2 + CHUNK_LINE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int response_flush(Response* res)
+{
+    if (res->failed)
+        return EXIT_FAILURE;
+
+    if (res->stream)
+        return h2_stream_flush(res->stream) ? fail(res) : EXIT_SUCCESS;
+
+    return flush_buffer(res, NULL, 0, "");
+}
+
+/* -------------------------------------------------------------------------- */
+
+int response_end(Response* res)
+{
+    if (res->failed)
+        return EXIT_FAILURE;
+
+    if (!res->head_only && res->length >= 0 && res->written != res->length)
+    {
+        wlog(WARNING, "Response body shorter than its Content-Length.");
+        if (!res->stream)
+            flush_buffer(res, NULL, 0, "");
+        return fail(res);
+    }
+
+    if (res->stream)  // The stream ends once what is queued on it is sent
+        return h2_stream_end(res->stream) ? fail(res) : EXIT_SUCCESS;
+
+    if (flush_buffer(res, NULL, 0, res->chunked ? "0\r\n\r\n" : ""))
+        return EXIT_FAILURE;
+
+    conn_inflight_add(-res->inflight);  // Only if something was off, but never leak it
+    res->inflight = 0;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void response_abort(Response* res)
+{
+    if (res->failed)
+        return;
+
+    if (!res->stream)
+        flush_buffer(res, NULL, 0, "");  // What the client gets before the close is still useful
+    fail(res);
+}
@@ -1,8 +1,26 @@
+#define _GNU_SOURCE  // accept4()
 #include "server.h"
 #include "logging.h"
 #include "net_utils.h"
 #include "config.h"
 #include "sig.h"
+#include "path_index.h"
+#include "connections.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "out_sched.h"
+#include "proxy.h"
+#include "response.h"
+#include "h2.h"
+#include "tls.h"
+#include "listener.h"
+#include "trace.h"
+#include "access_log.h"
+#include "capture.h"
+#include "warmup.h"
+#include "upgrade.h"
+#include "arena.h"
+#include "bufpool.h"
 
 #include <netdb.h>
 #include <stdio.h>
@@ -14,6 +32,10 @@
 #include <unistd.h>
 #include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
 /* -------------------------------------------------------------------------- */
 
 /**
@@ -23,24 +45,10 @@
  * attempts if the server has not been initialized. */
 static ServerStatus sst = SST_UNINITIALIZED;
 
-/**
- * @brief Global error code.
- * Stores the last error code when a function returns an error. */
-static int err = 0;
-
-/**
- * @brief Server socket.
- * File descriptor of the server socket. */
-static int ssfd = 0;
-
 /**
  * @brief Client socket.
  * File descriptor of the client socket. */
 static int csfd = 0;
-/**
- * @brief Server address info.
- * Linked list with >= 1 results from the getaddrinfo() function. */
-static struct addrinfo* sai;
 
 /**
  * @brief Client socket address.
@@ -58,6 +66,52 @@ static socklen_t csa_size = sizeof csa;
  * the root directory. */
 static const char* landing = "index.html";
 
+/**
+ * @brief Deepest directory level shown in the directory listing.
+ * Symbolic links to directories are not followed, this only bounds very deep trees. */
+#define LISTING_DEPTH 16
+
+/**
+ * @brief Most connections accepted per poll() wakeup.
+ * Bounds how long a burst of connections can keep the main loop from reaping
+ * children and expiring deadlines. */
+#define ACCEPT_BATCH 64
+
+/**
+ * @brief Milliseconds between checks for idle connections while draining.
+ * Only then does the main loop wake up without a deadline or an event. */
+#define DRAIN_CHECK_MS 100
+
+/**
+ * @brief Pre-rendered 404 Not Found response.
+ * Built once in server_start() so requests for paths missing from the path
+ * index can be answered with a single send(). */
+static char page_404[1024];
+
+/**
+ * @brief Length of the pre-rendered 404 response. */
+static size_t page_404_len = 0;
+
+/**
+ * @brief Pre-rendered 503 Service Unavailable response.
+ * Sent by the main loop itself, without forking, to connections shed while
+ * overloaded. */
+static char page_503[1024];
+
+/**
+ * @brief Length of the pre-rendered 503 response. */
+static size_t page_503_len = 0;
+
+/**
+ * @brief Pre-rendered 429 Too Many Requests response.
+ * Sent to clients over their rate limit, by the main loop without forking
+ * or by the child on a kept-alive connection. */
+static char page_429[1024];
+
+/**
+ * @brief Length of the pre-rendered 429 response. */
+static size_t page_429_len = 0;
+
 /* -------------------------------------------------------------------------- */
 
 int server_start()
@@ -82,96 +136,249 @@ int server_start()
         return EXIT_FAILURE;
     };
 
-    struct addrinfo hints;            // Struct with data to guide getaddrinfo()
-    memset(&hints, 0, sizeof hints);  // Clear structure
-    hints.ai_family   = AF_INET;      // IPv4
-    hints.ai_socktype = SOCK_STREAM;  // TDP
-    hints.ai_flags    = AI_PASSIVE;   // Local address
-
-    wlog(INFO, "Getting local address info...");
-
-    char port_string[6];  // Getaddrinfo requires port as a string.
-    snprintf(port_string, sizeof port_string, "%d", SERVER_PORT);
-    err = getaddrinfo(NULL, port_string, &hints, &sai);
-
-    if (err != 0)
+    if (stats_startup() || conn_table_startup() || ratelimit_startup() || sched_startup() ||
+        access_log_startup() || trace_startup() || capture_startup() || proxy_startup() ||
+        arena_startup())
     {
-        wlog(FATAL, "Failed to get address info. Error %d %s.", err, gai_strerror(err));
+        wlog(FATAL, "Failed to set up shared server state.");
         sst = SST_FAILURE;
         return EXIT_FAILURE;
     }
 
-    wlog(DEBUG, "Get address operation successful.");
-
-    wlog(INFO, "Creating server socket...");
-    ssfd = socket(sai->ai_family, sai->ai_socktype, sai->ai_protocol);
+    page_404_len = render_error_page(
+        page_404, sizeof page_404, "404 Not Found", "404", "Sorry, not found!", NULL);
+
+    char retry_after[32];
+    snprintf(retry_after, sizeof retry_after, "Retry-After: %d\r\n", RETRY_AFTER);
+    page_503_len = render_error_page(page_503,
+                                     sizeof page_503,
+                                     "503 Service Unavailable",
+                                     "503",
+                                     "Server is overloaded, try again later.",
+                                     retry_after);
+    page_429_len = render_error_page(page_429,
+                                     sizeof page_429,
+                                     "429 Too Many Requests",
+                                     "429",
+                                     "Slow down.",
+                                     "Retry-After: 1\r\n");
+
+    if (warmup_run())  // Serving cold
+        wlog(WARNING, "Warm-up failed, serving without it.");
+
+    if (path_index_startup())  // Lookups fall back to the filesystem
+        wlog(WARNING, "Path index unavailable, serving without it.");
+
+    if (tls_startup())
+    {
+        wlog(FATAL, "TLS setup failed.");
+        sst = SST_FAILURE;
+        return EXIT_FAILURE;
+    }
 
-    if (ssfd == -1)
+    if (listener_startup())
     {
-        wlog(FATAL, "Failed to create server socket. %d %s.", errno, strerror(errno));
+        wlog(FATAL, "Failed to open the listening sockets.");
         sst = SST_FAILURE;
         return EXIT_FAILURE;
     }
 
-    wlog(DEBUG, "Server socket created.");
+    sst = SST_RUNNING;
+    return EXIT_SUCCESS;
+}
 
-    wlog(INFO, "Setting socket option %d (SO_REUSEADDR)...", SO_REUSEADDR);
-    err = setsockopt(ssfd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
+/* -------------------------------------------------------------------------- */
 
-    if (err == -1)
-        wlog(ERROR, "Failed to set socket option. %d %s.", errno, strerror(errno));
+/**
+ * @brief Answer a connection with a pre-rendered page and close it.
+ * Runs in the main loop, so it must never block: the page is small enough to
+ * fit in the send buffer of a fresh socket.
+ * @param client_socket The socket of the refused connection.
+ * @param page The pre-rendered response, NULL to close without one (TLS
+ *             clients, which would take it for a broken handshake).
+ * @param page_len The length of the response. */
+static void send_and_close(int client_socket, const char* page, size_t page_len)
+{
+    if (page && send(client_socket, page, page_len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+        wlog(DEBUG, "Failed to send refusal page: (%d) %s.", errno, strerror(errno));
 
-    wlog(DEBUG, "Socket option successfully set.");
+    // Closing with unread data resets the connection, which could discard the 503
+    char discard[512];
+    shutdown(client_socket, SHUT_WR);
+    while (recv(client_socket, discard, sizeof discard, MSG_DONTWAIT) > 0)
+        ;
 
-    wlog(INFO, "Setting server socket to non-blocking...");
-    err = fcntl(ssfd, F_SETFL, fcntl(ssfd, F_GETFL, 0) | O_NONBLOCK);
+    close(client_socket);
+}
+
+/* -------------------------------------------------------------------------- */
 
-    if (err == -1)
+/**
+ * @brief Log the address of a newly accepted peer.
+ * @param addr The peer address.
+ * @param l The listener it connected to. */
+static void log_peer(const struct sockaddr_storage* addr, const Listener* l)
+{
+    if (addr->ss_family == AF_UNIX)  // Peers of Unix sockets rarely have a name
     {
-        wlog(FATAL, "Failed to set server socket to non-blocking. %s.", strerror(errno));
-        sst = SST_FAILURE;
-        return EXIT_FAILURE;
+        wlog(access_log_level(), "Accepted connection on %s.", l->name);
+        return;
     }
 
-    wlog(DEBUG, "Server socket successfully set to non-blocking.");
+    char        ipstr[INET6_ADDRSTRLEN];
+    int         port     = 0;
+    const char* inet_err = NULL;
 
-    wlog(INFO, "Binding server socket with port on local machine...");
-    err = bind(ssfd, sai->ai_addr, sai->ai_addrlen);
+    if (addr->ss_family == AF_INET)  // IPv4
+    {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*) addr;
+        port                          = ntohs(sin->sin_port);
+        inet_err = inet_ntop(addr->ss_family, &sin->sin_addr, ipstr, sizeof ipstr);
+    }
+    else if (addr->ss_family == AF_INET6)  // IPv6
+    {
+        const struct sockaddr_in6* sin = (const struct sockaddr_in6*) addr;
+        port                           = ntohs(sin->sin6_port);
+        inet_err = inet_ntop(addr->ss_family, &sin->sin6_addr, ipstr, sizeof ipstr);
+    }
 
-    if (err == -1)
+    if (inet_err == NULL || port == 0)
     {
-        wlog(FATAL, "Failed to bind server socket. %d %s.", errno, strerror(errno));
-        sst = SST_FAILURE;
-        return EXIT_FAILURE;
+        wlog(WARNING, "Failed to determine peer's address.");
+        return;
     }
 
-    wlog(DEBUG, "Server socket bound.");
+    wlog(access_log_level(), "Accepted connection from %s:%d on %s.", ipstr, port, l->name);
+}
+
+/* -------------------------------------------------------------------------- */
 
-    // Mark server socket as passive, ready to accept connections
-    wlog(INFO, "Marking server socket as passive (listen)...");
-    err = listen(ssfd, BACKLOG);
+/**
+ * @brief Prepare an accepted socket for its child.
+ * Sockets are accepted non-blocking so the main loop never stalls on them,
+ * but children handle their connection with blocking calls.
+ * @param client_socket The accepted socket.
+ * @param family Address family of its listener. */
+static void client_socket_setup(int client_socket, int family)
+{
+    if (fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) & ~O_NONBLOCK) == -1)
+        wlog(WARNING, "Failed to set client socket to blocking. %s.", strerror(errno));
 
-    if (err == -1)
-    {
-        wlog(FATAL, "Failed to listen on server socket. %d %s.", errno, strerror(errno));
-        sst = SST_FAILURE;
-        return EXIT_FAILURE;
-    }
+    if (NODELAY && family != AF_UNIX
+        && setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int)))
+        wlog(WARNING, "Failed to set TCP_NODELAY. %s.", strerror(errno));
+}
 
-    struct sockaddr_in addr;
-    socklen_t          addr_len = sizeof addr;
+/* -------------------------------------------------------------------------- */
 
-    if (getsockname(ssfd, (struct sockaddr*) &addr, &addr_len) == -1)
+/**
+ * @brief Accept every connection waiting in the listener queue.
+ * Drains the queue until it is empty (EAGAIN) instead of going back to poll()
+ * after each connection. Stops early when overloaded, leaving the rest
+ * queued, or after ACCEPT_BATCH connections so deadlines are still checked
+ * during long bursts.
+ * @param index Index of the listener with pending connections. */
+static void accept_connections(size_t index)
+{
+    const Listener* l = listener_get(index);
+
+    for (int batch = 0; batch < ACCEPT_BATCH && !shut_req; batch++)
     {
-        wlog(FATAL, "Failed to get socket name. %d %s.", errno, strerror(errno));
-        sst = SST_FAILURE;
-        return EXIT_FAILURE;
+        if (conn_admission() == ADM_PAUSE)  // Picked up by the main loop
+            return;
+
+        csa_size = sizeof csa;
+        csfd     = accept4(
+            l->fd, (struct sockaddr*) &csa, &csa_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (csfd == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)  // Queue drained
+                return;
+
+            if (errno == EINTR || errno == ECONNABORTED)  // Client gave up while queued
+                continue;
+
+            wlog(ERROR, "Failed to accept connection. (%d) %s.", errno, strerror(errno));
+            return;  // E.g. out of fds, poll() will tell us when to try again
+        }
+
+        STAT_ADD(accepted, 1);
+        listener_accepted(index);
+        trace_accept();
+        access_log_peer(&csa);
+        wlog(access_log_level(), "Request accepted. Connected to socket.");
+
+        if (ratelimit_admit(&csa))
+        {
+            wlog(DEBUG, "Client over its rate limit, refusing connection with 429.");
+            send_and_close(csfd, l->tls ? NULL : page_429, page_429_len);
+            continue;
+        }
+
+        if (conn_admission() == ADM_SHED)
+        {
+            wlog(DEBUG, "Overloaded, shedding connection with 503.");
+            STAT_ADD(shed_503, 1);
+            send_and_close(csfd, l->tls ? NULL : page_503, page_503_len);
+            continue;
+        }
+
+        if (LOG_LEVEL <= access_log_level())  // Only format the peer address if logged
+            log_peer(&csa, l);
+
+        int slot = conn_claim();  // Admission said there's room, so this can't fail
+
+        wlog(TRACE, "Forking...");
+
+        // Fork to handle client in a separate process
+        // fork() returns PID of child process to parent and 0 to the child itself.
+        pid_t pid = fork();
+
+        if (pid == -1)
+        {
+            wlog(ERROR, "Failed to fork proccess: (%d) %s.", errno, strerror(errno));
+            conn_release(slot);
+            close(csfd);
+            continue;
+        }
+
+        if (pid == 0)  // We are in a child process
+        {
+            conn_enter(slot);
+            listener_enter(index);
+            sched_conn_start();
+            client_socket_setup(csfd, l->family);
+
+            int tls = l->tls;
+            listener_close_all();  // Close unused server sockets
+
+            if (tls && tls_accept(csfd))
+                wlog(DEBUG, "[%d] No TLS session, closing.", getpid());
+            else if (server_client_handler(csfd))
+                wlog(WARNING, "[%d] Failure during client handling.", getpid());
+
+            tls_close();
+            access_log_flush();
+
+            if (close(csfd))  // Done
+                wlog(WARNING, "[%d] Failed to close client socket.", getpid());
+
+            exit(EXIT_SUCCESS);  // Kill child
+        }
+
+        conn_bind(slot, pid);
+        close(csfd);  // Parent process closes the client socket
     }
+}
 
-    sst = SST_RUNNING;
-    wlog(INFO, "Server listening on port %d.", ntohs(addr.sin_port));
+/* -------------------------------------------------------------------------- */
 
-    return EXIT_SUCCESS;
+/**
+ * @brief The earlier of two poll() timeouts.
+ * @return The shorter one, -1 (no timeout) only if both are. */
+static int earliest(int a, int b)
+{
+    return a < 0 ? b : b < 0 ? a : a < b ? a : b;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -190,123 +397,166 @@ int server_run()
     if (sst == SST_NONINITFAILURE)
         return EXIT_FAILURE;
 
-    struct pollfd polled;  // We will only monitor 1 socket
-    int           event_count = 0;
+    enum
+    {
+        POLL_INDEX,      // Changes in the served tree
+        POLL_WAKE,       // Signals, through the self-pipe
+        POLL_UPGRADE,    // The new server of an upgrade is ready, or gone
+        POLL_LISTENERS,  // Then the listeners, incoming connections
+    };
+
+    struct pollfd polled[POLL_LISTENERS + LISTENERS_MAX];
+    nfds_t        polled_count = POLL_LISTENERS + listener_count();
+    int           event_count  = 0;
+    int           paused       = 0;  // Are we leaving new connections in the kernel queue?
+    uint64_t      drain_until  = 0;  // Once draining: no more accepts, exit when idle or by then
+    int           forced       = 0;  // Past the drain deadline, the children were killed
 
-    polled.fd     = ssfd;    // Server
-    polled.events = POLLIN;  // Poll incoming connections
+    for (nfds_t i = 0; i < polled_count; i++)
+        polled[i].events = POLLIN;
+
+    upgrade_ready();  // If started by an upgrade, the old server can stop accepting
 
     wlog(TRACE, "Entering main loop...");
-    while (!shut_req)
+    for (;;)
     {
-        wlog(TRACE, "Polling with 1.5s timeout...");
-        event_count = poll(&polled, 1, 1500);  // 1.5 second timeout
-        if (event_count < 0)
+        if (child_req)  // Free the slots of exited children before deciding on admission
         {
-            if (errno == EINTR)  // Interrupted by a signal
+            child_req = 0;
+            conn_reap();
+        }
+
+        if (shut_req)  // SIGINT or SIGTERM, a second one doesn't wait for the connections
+        {
+            shut_req = 0;
+            wlog(INFO, "Shutdown requested after receiving signal %d.", (int) shut_signal);
+            if (drain_until)
+                drain_until = now_ms();  // Stop waiting
+            else
             {
-                if (shut_req)    // Do we need to exit?
-                {
-                    wlog(INFO, "Shutdown requested during polling.");
-                    break;
-                }
-
-                wlog(FATAL, "EINTR detected, but shutdown request = %d.", shut_req);
-                wlog(INFO, "This should not happen. Manually requesting shutdown.");
-                shut_req = 1;
-                break;  // This should NOT happen
+                listener_stop();  // New clients are refused now, not left waiting in the queue
+                drain_until = now_ms() + DRAIN_TIMEOUT;
+                if (conn_active())
+                    wlog(INFO, "Draining %zu connections before exiting.", conn_active());
             }
-
-            wlog(ERROR, "Polling failed: (%d) %s.", errno, strerror(errno));
-            continue;
         }
 
-        if (event_count == 0)
+        if (reopen_req)  // SIGUSR1, the log file was moved
         {
-            wlog(TRACE, "Continue polling...");
-            continue;
+            reopen_req = 0;
+            wlog_reopen();
         }
 
-        if (polled.revents & POLLIN)
+        if (reload_req)  // SIGHUP, the config file changed
         {
-            wlog(TRACE, "POLLIN event received.");
-
-            csfd = accept(ssfd, (struct sockaddr*) &csa, &csa_size);
-            if (csfd == -1)
-            {
-                wlog(ERROR, "Failed to accept connection. (%d) %s.", errno, strerror(errno));
-                continue;
-            }
+            reload_req = 0;
+            if (config_reload() == EXIT_SUCCESS)
+                conn_timeouts_update();
+        }
 
-            wlog(INFO, "Request accepted. Connected to socket.");
+        if (upgrade_req)  // SIGUSR2, a new binary was installed
+        {
+            upgrade_req = 0;
+            if (drain_until)
+                wlog(WARNING, "Already draining, ignoring SIGUSR2.");
+            else
+                upgrade_start();
+        }
 
-            char        ipstr[INET6_ADDRSTRLEN];
-            int         port     = 0;
-            const char* inet_err = NULL;
+        if (!drain_until && upgrade_check() == UPGRADE_READY)  // The new server accepts from now on
+        {
+            listener_close_all();  // Its queued connections are the new server's
+            drain_until = now_ms() + DRAIN_TIMEOUT;
+            wlog(INFO, "Draining %zu connections before exiting.", conn_active());
+        }
 
-            if (csa.ss_family == AF_INET)  // IPv4
-            {
-                struct sockaddr_in* sin = (struct sockaddr_in*) &csa;
-                port                    = ntohs(sin->sin_port);
-                inet_err = inet_ntop(csa.ss_family, &sin->sin_addr, ipstr, sizeof ipstr);
-            }
-            else if (csa.ss_family == AF_INET6)  // IPv6
+        if (drain_until)
+        {
+            if (!forced && now_ms() >= drain_until && conn_active())
             {
-                struct sockaddr_in6* sin = (struct sockaddr_in6*) &csa;
-                port                     = ntohs(sin->sin6_port);
-                inet_err = inet_ntop(csa.ss_family, &sin->sin6_addr, ipstr, sizeof ipstr);
+                wlog(WARNING, "Drain deadline reached, closing %zu connections.", conn_active());
+                forced = 1;
             }
 
-            if (inet_err == NULL)
+            if (conn_drain(forced) == 0)
             {
-                wlog(ERROR, "Failed to determine peer's IP address.");
-                close(csfd);
-                continue;
+                wlog(INFO, "All connections drained, exiting.");
+                break;
             }
+        }
 
-            if (port == 0)
+        conn_expire();     // Kill children stuck past their deadline, reaped on SIGCHLD
+        proxy_maintain();  // Keep the upstream connection pool open
+        tls_maintain();    // Rotate the session ticket key
+        wlog_maintain();   // Rotate the log file
+
+        // Already accepted connections come first: stop polling the listener while overloaded
+        if (conn_admission() == ADM_PAUSE)
+        {
+            if (!paused)
             {
-                wlog(ERROR, "Failed to determine peer's port number.");
-                close(csfd);
-                continue;
+                wlog(WARNING,
+                     "Overloaded (%zu active, %lu bytes in flight). Pausing accept.",
+                     conn_active(),
+                     STAT_GET(inflight_bytes));
+                STAT_ADD(accept_pauses, 1);
+                paused = 1;
             }
+        }
+        else if (paused)
+        {
+            wlog(INFO, "Load back under watermarks. Resuming accept.");
+            paused = 0;
+        }
 
-            wlog(INFO, "Accepted connection from %s:%d", ipstr, port);
-
-            wlog(TRACE, "Forking...");
+        polled[POLL_INDEX].fd   = path_index_fd();  // Negative when there is no index
+        polled[POLL_WAKE].fd    = sigh_wake_fd();
+        polled[POLL_UPGRADE].fd = upgrade_fd();
+        for (size_t i = 0; i < listener_count(); i++)  // Negative fds are ignored
+            polled[POLL_LISTENERS + i].fd = paused || drain_until ? -1 : listener_get(i)->fd;
 
-            // Fork to handle client in a separate process
-            // fork() returns PID of child process to parent and 0 to the child itself.
-            pid_t pid = fork();
+        // Sleep until the next deadline of anything: with none, until an event or a signal
+        int timeout = earliest(conn_timeout(), wlog_timeout());
+        timeout     = earliest(timeout, earliest(proxy_timeout(), tls_timeout()));
+        if (drain_until)  // Children going idle are closed, they don't signal it
+            timeout = earliest(timeout, forced ? -1 : DRAIN_CHECK_MS);
 
-            if (pid == -1)
+        wlog(TRACE, "Polling with %dms timeout...", timeout);
+        event_count = poll(polled, polled_count, timeout);
+        if (event_count < 0)
+        {
+            if (errno == EINTR)  // The flags are checked at the top of the loop
             {
-                wlog(ERROR, "Failed to fork proccess: (%d) %s.", errno, strerror(errno));
-                close(csfd);
+                wlog(TRACE, "Polling interrupted by a signal.");
                 continue;
             }
 
-            if (pid == 0)         // We are in a child process
-            {
-                if (close(ssfd))  // Close unused server socket
-                    wlog(WARNING, "[%d] Failed to close server socket.", getpid());
-
-                if (server_client_handler(csfd))
-                    wlog(WARNING, "[%d] Failure during client handling.", getpid());
+            wlog(ERROR, "Polling failed: (%d) %s.", errno, strerror(errno));
+            continue;
+        }
 
-                if (close(csfd))  // Done
-                    wlog(WARNING, "[%d] Failed to close client socket.", getpid());
+        if (event_count == 0)
+        {
+            wlog(TRACE, "Continue polling...");
+            continue;
+        }
 
-                exit(EXIT_SUCCESS);  // Kill child
-            }
+        if (polled[POLL_WAKE].revents & POLLIN)
+            sigh_woken();
 
-            close(csfd);  // Parent process closes the client socket
+        if (polled[POLL_INDEX].revents & POLLIN)
+        {
+            wlog(TRACE, "Path index change received.");
+            path_index_update();
         }
 
-        if (shut_req)
+        for (size_t i = 0; i < listener_count() && !shut_req; i++)
         {
-            wlog(INFO, "Shutdown requested after handling events.");
-            break;  // Exit the loop if shutdown is requested
+            if (polled[POLL_LISTENERS + i].revents & POLLIN)
+            {
+                wlog(TRACE, "POLLIN event received on %s.", listener_get(i)->name);
+                accept_connections(i);
+            }
         }
     }
 
@@ -318,27 +568,117 @@ int server_run()
 
 int server_client_handler(int client_socket)
 {
-    char buff[BUFFER_SIZE];                                      // Buffer
-    int  rec_bytes = recv(client_socket, buff, sizeof buff, 0);  // Bytes received
+    char   buff[HEADER_MAX + 1];  // Request header, plus any pipelined bytes after it
+    size_t have   = 0;            // Bytes in buff
+    int    status = EXIT_SUCCESS;
 
-    if (rec_bytes < 0)
+    for (int served = 0; !shut_req; served++)
     {
-        wlog(ERROR, "Failed to receive data: (%d) %s.", errno, strerror(errno));
-        return EXIT_FAILURE;
-    }
+        // A kept-alive connection is idle until the next request starts arriving,
+        // and may be closed by its timeout meanwhile: write what it logged first
+        if (served && have == 0)
+            access_log_flush();
+        conn_phase(served && have == 0 ? PHASE_IDLE : PHASE_HEADER);
+
+        char* end;
+        buff[have] = '\0';
+        while (!(end = strstr(buff, "\r\n\r\n")))
+        {
+            if (have == HEADER_MAX)
+            {
+                wlog(WARNING, "Request header larger than %d bytes.", HEADER_MAX);
+                http_keep_alive = 0;
+                send_error_page(client_socket,
+                                "431 Request Header Fields Too Large",
+                                "431",
+                                "Request header too large.");
+                return EXIT_FAILURE;
+            }
 
-    buff[rec_bytes] = '\0';
-    char rec_str[32];
-    human_readable_size(rec_bytes, rec_str, sizeof rec_str);
-    wlog(INFO, "Received %s.", rec_str);
+            int rec_bytes = tls_recv(client_socket, buff + have, HEADER_MAX - have, 0);
 
-    if (handle_user_request(client_socket, buff))
-    {
-        wlog(ERROR, "Failure during request handling.");
-        return EXIT_FAILURE;
+            if (rec_bytes < 0)
+            {
+                wlog(ERROR, "Failed to receive data: (%d) %s.", errno, strerror(errno));
+                return EXIT_FAILURE;
+            }
+
+            if (rec_bytes == 0)  // Client closed the connection
+            {
+                if (have > 0)
+                    wlog(WARNING, "Connection closed in the middle of a request header.");
+                return status;
+            }
+
+            if (have == 0 && served)  // Next request started, header deadline starts now
+                conn_phase(PHASE_HEADER);
+
+            trace_recv();
+
+            have += rec_bytes;
+            buff[have] = '\0';
+        }
+
+        size_t head_len = end + 4 - buff;
+
+        // Prior knowledge: the connection starts with the HTTP/2 preface, not a request
+        if (HTTP2 && !served && strncmp(buff, H2_PREFACE_START, strlen(H2_PREFACE_START)) == 0)
+            return h2_serve(client_socket, buff, have, 0);
+
+        trace_mark(TRACE_FIRST_BYTE);  // Pipelined requests were received with the previous one
+        trace_mark(TRACE_PARSED);
+        trace_request(buff, head_len, 1);
+        capture_request(buff, head_len, 1);
+
+        char next = buff[head_len];
+        buff[head_len]  = '\0';  // Terminate the header, pipelined bytes may follow
+
+        if (LOG_LEVEL <= access_log_level())
+        {
+            char rec_str[32];
+            human_readable_size(head_len, rec_str, sizeof rec_str);
+            wlog(access_log_level(), "Received %s.", rec_str);
+        }
+
+        if (served && ratelimit_request())  // The first request was charged on accept
+        {
+            wlog(DEBUG, "Client over its rate limit, answering with 429.");
+            tls_send(client_socket, page_429, page_429_len, 0);
+            trace_status(429);
+            trace_end();
+            break;
+        }
+
+        http_keep_alive = http_wants_keep_alive(buff);
+        http_chunked    = http_request_11(buff);
+
+        if (h2_upgrade_requested(buff))  // Answered on stream 1 once switched
+        {
+            buff[head_len] = next;
+            return h2_serve(client_socket, buff, have, head_len);
+        }
+
+        uint64_t start = now_us();
+
+        if (handle_user_request(client_socket, buff))
+        {
+            wlog(ERROR, "Failure during request handling.");
+            status = EXIT_FAILURE;
+        }
+
+        listener_request_done(start);
+        trace_end();
+        arena_reset();
+
+        if (!http_keep_alive)
+            break;
+
+        buff[head_len] = next;  // Keep pipelined bytes for the next request
+        memmove(buff, buff + head_len, have - head_len);
+        have -= head_len;
     }
 
-    return EXIT_SUCCESS;
+    return status;
     // Client socked is closed in server_run() after forking.
 }
 
@@ -353,8 +693,7 @@ int server_shutdown()
     }
 
     wlog(INFO, "Shutting down with '%s' value...", sst != SST_RUNNING ? "FAILURE" : "SUCCESS");
-    if (ssfd && close(ssfd) == -1)
-        wlog(WARNING, "Failed to close server socket: %d %s.", errno, strerror(errno));
+    listener_shutdown();
 
     if (csfd && close(csfd) == -1)
         wlog(WARNING, "Failed to close client socket: %d %s.", errno, strerror(errno));
@@ -362,7 +701,18 @@ int server_shutdown()
     // Note: && is a short-circuiting AND, it means that the second condition will not be checked
     // (and that there will be no attempt to close the sockets) if the first one fails.
 
-    freeaddrinfo(sai);  // Can this fail? It has no return value
+    path_index_shutdown();
+    tls_shutdown();
+    proxy_shutdown();
+    sched_shutdown();
+    trace_shutdown();
+    access_log_shutdown();
+    capture_shutdown();
+    ratelimit_shutdown();
+    conn_table_shutdown();
+    arena_shutdown();
+    bufpool_shutdown();
+    stats_shutdown();
 
     if (wlog_shutdown())
         fprintf(stderr, "Error during logging shutdown.\n");
@@ -382,18 +732,47 @@ int server_shutdown()
 
 int handle_user_request(int client_socket, char* req)
 {
-    // ex.: GET /index.html -> method = "GET", path = "/index.html"
-    char method[8], path[256];
-    // fprintf(stderr, "Request: %s.\n", req);
-    sscanf(req, "%s %s", method, path);
+    // ex.: GET /index.html -> method = "GET", target = "/index.html"
+    char   method[8];
+    size_t method_len = strcspn(req, " \r\n");
+    char*  at         = req + method_len;
+    size_t target_len = *at == ' ' ? strcspn(at + 1, " \r\n") : 0;
 
-    wlog(INFO, "Request with method \"%s\" and path \"%s\"...", method, path);
+    if (method_len == 0 || method_len >= sizeof method || target_len == 0)
+    {
+        wlog(WARNING, "Malformed request line.");
+        http_keep_alive = 0;
+        send_error_page(client_socket, "400 Bad Request", "400", "Bad request.");
+        return EXIT_FAILURE;
+    }
+
+    memcpy(method, req, method_len);
+    method[method_len] = '\0';
+
+    // Strings of the request live in the arena until server_client_handler() resets it
+    char* target = arena_strndup(at + 1, target_len);  // Forwarded as received in proxy mode
+    char* path   = arena_alloc(target_len + 1);
+    if (!target || !path)
+    {
+        send_error_page(client_socket, "500 Internal Server Error", "500", "Out of memory.");
+        return EXIT_FAILURE;
+    }
+
+    conn_phase(PHASE_SEND);
+
+    wlog(access_log_level(), "Request with method \"%s\" and path \"%s\"...", method, target);
+
+    // The decoded path is never longer than the target
+    url_decode(path, target_len + 1, target, target_len);
+
+    if (STATS_PATH[0] != '\0' && strcmp(path, STATS_PATH) == 0)
+    {
+        wlog(DEBUG, "Statistics request.");
+        return send_stats(client_socket);
+    }
 
-    // We need to decode the URL
-    // We don't need to store the decoded path in another string since the decoded output is
-    // guaranteed to be exactly the same length as the original path (or less) so we can overwrite
-    // the original path.
-    url_decode(path, sizeof path, path, sizeof path);
+    if (proxy_enabled())
+        return proxy_handle(client_socket, req, method, target);
 
     if (strstr(path, "..") || strstr(path, "//"))
     {
@@ -403,36 +782,55 @@ int handle_user_request(int client_socket, char* req)
         return EXIT_FAILURE;
     }
 
-    wlog(TRACE, "path: %s, len: %d, sizeof: %d.", path, strlen(path), sizeof path);
+    wlog(TRACE, "path: %s, len: %zu.", path, strlen(path));
 
     if (strlen(path) == 1)
     {
         wlog(DEBUG, "Root request.");
-        snprintf(path, sizeof path, "%s/%s", ROOT_DIR, landing);  // Página "padrão"
+        path = arena_printf("%s/%s", ROOT_DIR, landing);  // Página "padrão"
     }
-
-    if (strcmp(path, "/favicon.ico") == 0)
+    else if (strcmp(path, "/favicon.ico") == 0)
     {
         wlog(DEBUG, "Favicon request.");
-        snprintf(path, sizeof path, "%s/%s", ROOT_DIR, FAVICON_FILE);  // Favicon
+        path = arena_printf("%s/%s", ROOT_DIR, FAVICON_FILE);  // Favicon
     }
+    else if (path[0] == '/')  // This is probably be the case regardless, but we should check
+        path = arena_printf("%s%s", ROOT_DIR, path);
 
-    if (path[0] == '/')  // This is probably be the case regardless, but we should check
+    char* index_path = arena_printf("%s/index.html", ROOT_DIR);
+    if (!path || !index_path)
     {
-        char temp[sizeof path];
-        snprintf(temp, sizeof temp, "%s%s", ROOT_DIR, path);
-        strcpy(path, temp);
-        path[sizeof path - 1] = '\0';  // Só pra garantir
+        send_error_page(client_socket, "500 Internal Server Error", "500", "Out of memory.");
+        return EXIT_FAILURE;
     }
 
     wlog(DEBUG, "Changed path to \"%s\".", path);
-    char index_path[256];
-    snprintf(index_path, sizeof index_path, "%s/index.html", ROOT_DIR);
     if (strcmp(path, index_path) == 0)
     {
         return serve_data_tree(client_socket);
     }
 
+    PathInfo info;
+    if (path_index_ready() && (path_index_lookup(path, &info) || info.is_dir))
+    {
+        wlog(access_log_level(), "Path not in index. Sending 404 page to user...");
+        if (h2_current)  // The pre-rendered page is HTTP/1.1 text
+            return send_error_page(client_socket, "404 Not Found", "404", "Sorry, not found!");
+
+        http_keep_alive = 0;  // The pre-rendered page says "Connection: close"
+        trace_status(404);
+        ssize_t sent = tls_send(client_socket, page_404, page_404_len, 0);
+        if (sent == -1)
+            wlog(ERROR, "Failed to send 404 page.");
+        else  // Counted like the responses that go through response.c
+        {
+            ratelimit_charge(sent);
+            listener_sent(sent);
+            trace_send(sent);
+        }
+        return EXIT_SUCCESS;
+    }
+
     return send_file(client_socket, path);
 }
 
@@ -443,10 +841,9 @@ int send_file(int client_socket, const char path[])
     const char* content_type = get_mime_type(path);
     wlog(DEBUG, "Determined content-type to be %s.", content_type);
 
-    wlog(INFO, "Opening file at %s and creating stream...", path);
+    wlog(access_log_level(), "Opening file at %s and creating stream...", path);
     FILE* file = fopen(path, "rb");
 
-    char header[512];
     if (!file)
     {
         wlog(WARNING, "Failed to open file. Sending 404 page to user.");
@@ -454,99 +851,219 @@ int send_file(int client_socket, const char path[])
         return EXIT_FAILURE;
     }
 
+    trace_mark(TRACE_OPENED);
+
     wlog(TRACE, "Seeking size of file...");
     fseek(file, 0, SEEK_END);          // Move file pointer to end of file
     long int file_size = ftell(file);  // Count # of number of bytes
     fseek(file, 0, SEEK_SET);          // Move file pointer back to beginning
     wlog(TRACE, "Size of file is %ld.", file_size);
 
-    build_html_header(header, sizeof(header), "200 OK", content_type, file_size);
+    Response res;
+    response_begin(&res, client_socket, "200 OK", content_type, file_size, NULL);
+
+    // Straight from the file: nothing is copied through our buffers, and an
+    // HTTP/2 stream can keep sending it while the next requests are handled
+    wlog(access_log_level(), "Sending file...");
+    response_sendfile(&res, fileno(file), 0, file_size);
 
-    wlog(INFO, "Sending header to user...");
-    ssize_t sent = send(client_socket, header, strlen(header), 0);
-    ssize_t read;
-    wlog(INFO, "%d bytes sent.", sent);
+    response_end(&res);
+    log_transfer_data(access_log_level(), file_size, res.sent, res.sends);
 
-    char   buffer[BUFFER_SIZE];
-    size_t bytes_read;
+    wlog(access_log_level(), "Done sending file.");
 
-    wlog(INFO, "Reading file with buffer of length %d...", BUFFER_SIZE);
+    if (fclose(file) != 0)
+    {
+        wlog(WARNING, "Failed to close file: %d %s.", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
 
-    unsigned long transfers = 0;
-    sent                    = 0;
-    read                    = 0;
+    wlog(access_log_level(), "File closed.");
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
 
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+int send_error_page(int client_socket, const char* code, const char* title, const char* message)
+{
+    char     body[512];
+    size_t   body_len = render_error_body(body, sizeof body, title, message);
+    Response res;
+
+    if (body_len == 0)
     {
-        sent += send(client_socket, buffer, bytes_read, 0);
-        read += bytes_read;
-        transfers++;
+        wlog(ERROR, "Error %s page does not fit in buffer.", code);
+        return EXIT_FAILURE;
     }
 
-    log_transfer_data(read, sent, transfers);
+    wlog(TRACE, "Sending error %s page to user...", code);
+    response_begin(&res, client_socket, code, "text/html", body_len, NULL);
+    response_write(&res, body, body_len);
+    if (response_end(&res))
+        wlog(ERROR, "Failed to send %s error page.", code);
+    wlog(TRACE, "%zu bytes sent.", res.sent);
 
-    wlog(INFO, "Done reading file.");
+    return EXIT_SUCCESS;
+}
 
-    if (fclose(file) != 0)
+/* -------------------------------------------------------------------------- */
+
+int send_stats(int client_socket)
+{
+    char     body[8192];
+    size_t   body_len = stats_render(body, sizeof body);
+    Response res;
+
+    body_len += listener_stats_render(body + body_len, sizeof body - body_len);
+
+    response_begin(&res, client_socket, "200 OK", "text/plain", body_len, NULL);
+    response_write(&res, body, body_len);
+
+    if (response_end(&res))
     {
-        wlog(WARNING, "Failed to close file: %d %s.", errno, strerror(errno));
+        wlog(ERROR, "Failed to send statistics: (%d) %s.", errno, strerror(errno));
         return EXIT_FAILURE;
     }
 
-    wlog(INFO, "File closed.");
     return EXIT_SUCCESS;
 }
 
 /* -------------------------------------------------------------------------- */
 
-int send_error_page(int client_socket, const char* code, const char* title, const char* message)
+/**
+ * @brief Percent-encode a file name for use in a URL.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if it did not fit. */
+static int url_encode(const char* name, char* out, size_t size)
 {
-    char    header[512], body[512];
-    ssize_t sent;
+    size_t len = 0;
 
-    // Build the error page body
-    snprintf(body, sizeof(body), "<html><body><h1>%s</h1><p>%s</p></body></html>", title, message);
+    for (const unsigned char* c = (const unsigned char*) name; *c; c++)
+    {
+        if (len + 4 > size)
+            return EXIT_FAILURE;
 
-    // Build the error page header
-    build_html_header(header, sizeof(header), code, "text/html", strlen(body));
+        if (isalnum(*c) || strchr("-._~", *c))
+            out[len++] = *c;
+        else
+            len += snprintf(out + len, size - len, "%%%02X", *c);
+    }
 
-    wlog(TRACE, "Sending error %s header to user...", code);
-    sent = send(client_socket, header, strlen(header), 0);
-    if (sent == -1)
-        wlog(ERROR, "Failed to send %s error header.", code);
-    wlog(TRACE, "%d bytes sent.", sent);
+    out[len] = '\0';
+    return EXIT_SUCCESS;
+}
 
-    wlog(TRACE, "Sending error %s body to user...", code);
-    sent = send(client_socket, body, strlen(body), 0);
-    if (sent == -1)
-        wlog(ERROR, "Failed to send %s error body.", code);
-    wlog(TRACE, "%d bytes sent.", sent);
+/**
+ * @brief Escape a file name for use in HTML text.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if it did not fit. */
+static int html_escape(const char* name, char* out, size_t size)
+{
+    size_t len = 0;
 
+    for (const char* c = name; *c; c++)
+    {
+        const char* entity = *c == '&'   ? "&amp;"
+                             : *c == '<' ? "&lt;"
+                             : *c == '>' ? "&gt;"
+                             : *c == '"' ? "&quot;"
+                                         : NULL;
+        size_t      n      = entity ? strlen(entity) : 1;
+
+        if (len + n + 1 > size)
+            return EXIT_FAILURE;
+
+        memcpy(out + len, entity ? entity : c, n);
+        len += n;
+    }
+
+    out[len] = '\0';
     return EXIT_SUCCESS;
 }
 
+/** @brief Leave ".", ".." and hidden files out of the listing, like tree does. */
+static int listing_filter(const struct dirent* entry)
+{
+    return entry->d_name[0] != '.';
+}
+
+/**
+ * @brief Write the listing of a directory and its subdirectories as nested lists.
+ * @param res The response to write to.
+ * @param dir The directory on disk.
+ * @param url The URL the directory is served at, without a trailing slash.
+ * @param depth Nesting level, listing stops at LISTING_DEPTH.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the client went away. */
+static int list_directory(Response* res, const char* dir, const char* url, int depth)
+{
+    struct dirent** entries;
+    int             count = scandir(dir, &entries, listing_filter, alphasort);
+
+    if (count == -1)
+    {
+        wlog(WARNING, "Failed to list directory %s. %s.", dir, strerror(errno));
+        return EXIT_SUCCESS;  // Shown empty
+    }
+
+    int failed = response_printf(res, "<ul>\n");
+
+    for (int i = 0; i < count; i++)
+    {
+        const char* name = entries[i]->d_name;
+        char        path[512], link[1024], encoded[768], text[1536];
+        struct stat st;
+
+        int fits = url_encode(name, encoded, sizeof encoded) == EXIT_SUCCESS &&
+                   html_escape(name, text, sizeof text) == EXIT_SUCCESS &&
+                   (size_t) snprintf(path, sizeof path, "%s/%s", dir, name) < sizeof path &&
+                   (size_t) snprintf(link, sizeof link, "%s/%s", url, encoded) < sizeof link;
+        int is_dir = fits && lstat(path, &st) == 0 && S_ISDIR(st.st_mode);  // Links not followed
+
+        if (fits && !failed)
+        {
+            const char* slash = is_dir ? "/" : "";
+            failed = response_printf(res, "<li><a href=\"%s%s\">%s%s</a>", link, slash, text, slash);
+
+            if (!failed && is_dir && depth < LISTING_DEPTH)
+                failed = list_directory(res, path, link, depth + 1);
+
+            failed = failed || response_printf(res, "</li>\n");
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+    return failed || response_printf(res, "</ul>\n");
+}
+
 /* -------------------------------------------------------------------------- */
 
 int serve_data_tree(int client_socket)
 {
-    char command[80];
-    // Use tree for now, until/if we make our own tree view
-    snprintf(command,
-             sizeof(command),
-             "cd %s && tree -H . --noreport --charset utf-8 . > %s",
-             ROOT_DIR,
-             landing);
-
-    if (system(command) != 0)
-    {
-        wlog(ERROR, "Failed to execute tree command in data/%s.", landing);
-        send_error_page(client_socket,
-                        "500 Internal Server Error",
-                        "Internal Server Error",
-                        "Failed to execute tree command.");
+    Response res;
+
+    // Streamed as the directories are read, the length isn't known until the end
+    response_begin(
+        &res, client_socket, "200 OK", "text/html; charset=utf-8", RESPONSE_CHUNKED, NULL);
+    response_printf(&res,
+                    "<!DOCTYPE html>\n"
+                    "<html>\n"
+                    "<head>\n"
+                    " <meta charset=\"utf-8\">\n"
+                    " <title>Directory Tree</title>\n"
+                    " <style>body { font-family: monospace, sans-serif; }</style>\n"
+                    "</head>\n"
+                    "<body>\n"
+                    "<h1>Directory Tree</h1>\n"
+                    "<a href=\"/\">.</a>\n");
+
+    list_directory(&res, ROOT_DIR, "", 1);
+    response_printf(&res, "</body>\n</html>\n");
+
+    if (response_end(&res))
+    {
+        wlog(WARNING, "Failed to send the directory listing.");
         return EXIT_FAILURE;
     }
-    char path[256];
-    snprintf(path, sizeof path, "%s/%s", ROOT_DIR, landing);
-    return send_file(client_socket, path);
+
+    return EXIT_SUCCESS;
 }
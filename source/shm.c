@@ -0,0 +1,34 @@
+#include "shm.h"
+#include "logging.h"
+#include "net_utils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* -------------------------------------------------------------------------- */
+
+void* shm_alloc(const char* name, size_t size)
+{
+    // Anonymous mappings are zero filled and survive fork() as shared pages
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (ptr == MAP_FAILED)
+    {
+        wlog(ERROR, "Failed to map shared %s region: (%d) %s.", name, errno, strerror(errno));
+        return NULL;
+    }
+
+    char size_str[32];
+    human_readable_size(size, size_str, sizeof size_str);
+    wlog(DEBUG, "Mapped shared %s region (%s).", name, size_str);
+    return ptr;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void shm_free(void* ptr, size_t size)
+{
+    if (ptr)
+        munmap(ptr, size);
+}
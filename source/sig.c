@@ -1,23 +1,88 @@
 #include "sig.h"
 #include "logging.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
 static struct sigaction sa;
-volatile sig_atomic_t   shut_req = 0;
+volatile sig_atomic_t   shut_req    = 0;
+volatile sig_atomic_t   shut_signal = 0;
+volatile sig_atomic_t   child_req   = 0;
+volatile sig_atomic_t   reopen_req  = 0;
+volatile sig_atomic_t   reload_req  = 0;
+volatile sig_atomic_t   upgrade_req = 0;
+
+/** @brief Self-pipe: the handlers write a byte to wake_fds[1], the main loop polls wake_fds[0]. */
+static int wake_fds[2] = {-1, -1};
+
+/** @brief The main process, the only one the pipe wakes up. */
+static pid_t main_pid = 0;
+
+/**
+ * @brief Wake the main loop up from a signal handler.
+ * Only async-signal-safe calls: a full pipe already has a wake-up pending. */
+static void wake()
+{
+    int saved = errno;
+
+    if (wake_fds[1] != -1 && getpid() == main_pid)  // Children inherit the handlers
+        (void) !write(wake_fds[1], "", 1);
+
+    errno = saved;
+}
 
 void sigh(int signal)
 {
-    wlog(INFO, "Shutdown requested after receiving signal %d.", signal);
-    shut_req = 1;
+    shut_signal = signal;
+    shut_req    = 1;  // Logged by the main loop, wlog() isn't async-signal-safe
+    wake();
+}
+
+void sigh_child(int signal)
+{
+    (void) signal;
+    child_req = 1;  // Reaped by the main loop, no logging from here
+    wake();
+}
+
+void sigh_reopen(int signal)
+{
+    (void) signal;
+    reopen_req = 1;  // Reopened by the main loop
+    wake();
+}
 
-    wlog(TRACE, "Shutdown_request is now %d", shut_req);
-    return;
+void sigh_reload(int signal)
+{
+    (void) signal;
+    reload_req = 1;  // Reloaded by the main loop
+    wake();
+}
+
+void sigh_upgrade(int signal)
+{
+    (void) signal;
+    upgrade_req = 1;  // New binary started by the main loop
+    wake();
 }
 
 int sigh_startup()
 {
     wlog(INFO, "Setting up signal handling...");
+    if (pipe(wake_fds) == -1)
+    {
+        wlog(FATAL, "Failed to create the wake-up pipe: (%d) %s.", errno, strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++)  // Never blocks the handlers, nor the main loop draining it
+    {
+        fcntl(wake_fds[i], F_SETFL, fcntl(wake_fds[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(wake_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    main_pid = getpid();
     sigemptyset(&sa.sa_mask);
     sa.sa_handler = sigh;
     sa.sa_flags   = SA_RESTART;
@@ -34,6 +99,54 @@ int sigh_startup()
         return -1;
     }
 
+    struct sigaction sc;
+    sigemptyset(&sc.sa_mask);
+    sc.sa_handler = sigh_child;
+    sc.sa_flags   = SA_RESTART | SA_NOCLDSTOP;
+
+    if (sigaction(SIGCHLD, &sc, NULL) == -1)  // Child stopped or terminated
+    {
+        wlog(FATAL, "Failed to set SIGCHLD: (%d) %s.", errno, strerror(errno));
+        return -1;
+    }
+
+    sc.sa_handler = sigh_reopen;
+    sc.sa_flags   = SA_RESTART;
+
+    if (sigaction(SIGUSR1, &sc, NULL) == -1)  // Log file moved by another program
+    {
+        wlog(FATAL, "Failed to set SIGUSR1: (%d) %s.", errno, strerror(errno));
+        return -1;
+    }
+
+    sc.sa_handler = sigh_reload;
+
+    if (sigaction(SIGHUP, &sc, NULL) == -1)  // Config file changed
+    {
+        wlog(FATAL, "Failed to set SIGHUP: (%d) %s.", errno, strerror(errno));
+        return -1;
+    }
+
+    sc.sa_handler = sigh_upgrade;
+
+    if (sigaction(SIGUSR2, &sc, NULL) == -1)  // New binary installed
+    {
+        wlog(FATAL, "Failed to set SIGUSR2: (%d) %s.", errno, strerror(errno));
+        return -1;
+    }
+
     wlog(TRACE, "Signal handling startup complete.");
     return 0;
 }
+
+int sigh_wake_fd()
+{
+    return wake_fds[0];
+}
+
+void sigh_woken()
+{
+    char buff[64];
+    while (read(wake_fds[0], buff, sizeof buff) > 0)
+        ;
+}
@@ -0,0 +1,115 @@
+#include "stats.h"
+#include "logging.h"
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+
+ServerStats* stats = NULL;
+
+/**
+ * @brief Exported name of each statistics field.
+ * Adding a counter to ServerStats only requires a line here to export it. */
+static const struct
+{
+    const char* name;
+    size_t      offset;
+} fields[] = {
+    {"connections_accepted", offsetof(ServerStats, accepted)},
+    {"connections_active", offsetof(ServerStats, active)},
+    {"inflight_bytes", offsetof(ServerStats, inflight_bytes)},
+    {"shed_503", offsetof(ServerStats, shed_503)},
+    {"accept_pauses", offsetof(ServerStats, accept_pauses)},
+    {"timed_out", offsetof(ServerStats, timed_out)},
+    {"rate_limited", offsetof(ServerStats, rate_limited)},
+    {"rate_evictions", offsetof(ServerStats, rate_evictions)},
+    {"cache_hits", offsetof(ServerStats, cache_hits)},
+    {"cache_misses", offsetof(ServerStats, cache_misses)},
+    {"cache_stores", offsetof(ServerStats, cache_stores)},
+    {"cache_evictions", offsetof(ServerStats, cache_evictions)},
+    {"cache_coalesced", offsetof(ServerStats, cache_coalesced)},
+    {"cache_stale", offsetof(ServerStats, cache_stale)},
+    {"cache_revalidations", offsetof(ServerStats, cache_revalidations)},
+    {"send_waits", offsetof(ServerStats, send_waits)},
+    {"h2_connections", offsetof(ServerStats, h2_connections)},
+    {"h2_streams", offsetof(ServerStats, h2_streams)},
+    {"tls_handshakes", offsetof(ServerStats, tls_handshakes)},
+    {"tls_resumed", offsetof(ServerStats, tls_resumed)},
+    {"tls_failed", offsetof(ServerStats, tls_failed)},
+    {"tls_ktls", offsetof(ServerStats, tls_ktls)},
+    {"tls_handshake_us", offsetof(ServerStats, tls_handshake_us)},
+    {"tls_handshake_cpu_us", offsetof(ServerStats, tls_handshake_cpu_us)},
+    {"upstream_connects", offsetof(ServerStats, upstream_connects)},
+    {"upstream_reuses", offsetof(ServerStats, upstream_reuses)},
+    {"upstream_errors", offsetof(ServerStats, upstream_errors)},
+    {"sched_waits", offsetof(ServerStats, sched_waits)},
+    {"sched_wait_us", offsetof(ServerStats, sched_wait_us)},
+    {"sched_yields", offsetof(ServerStats, sched_yields)},
+    {"slow_requests", offsetof(ServerStats, slow_requests)},
+    {"traced_requests", offsetof(ServerStats, traced_requests)},
+    {"access_records", offsetof(ServerStats, access_records)},
+    {"access_writes", offsetof(ServerStats, access_writes)},
+    {"captured_requests", offsetof(ServerStats, captured_requests)},
+    {"log_rotations", offsetof(ServerStats, log_rotations)},
+    {"log_suppressed", offsetof(ServerStats, log_suppressed)},
+    {"log_degraded", offsetof(ServerStats, log_degraded)},
+    {"arena_requests", offsetof(ServerStats, arena_requests)},
+    {"arena_bytes", offsetof(ServerStats, arena_bytes)},
+    {"arena_peak", offsetof(ServerStats, arena_peak)},
+    {"arena_overflows", offsetof(ServerStats, arena_overflows)},
+    {"buffer_gets", offsetof(ServerStats, buffer_gets)},
+    {"buffer_allocs", offsetof(ServerStats, buffer_allocs)},
+    {"buffer_peak", offsetof(ServerStats, buffer_peak)},
+};
+
+/* -------------------------------------------------------------------------- */
+
+int stats_startup()
+{
+    stats = shm_alloc("statistics", sizeof *stats);
+    return stats ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void stats_shutdown()
+{
+    if (!stats)
+        return;
+
+    char buff[4096];
+    stats_render(buff, sizeof buff);
+
+    for (char* line = strtok(buff, "\n"); line; line = strtok(NULL, "\n"))
+        wlog(INFO, "Stats: %s.", line);
+
+    shm_free(stats, sizeof *stats);
+    stats = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+size_t stats_render(char* buff, size_t buff_size)
+{
+    size_t len = 0;
+    buff[0]    = '\0';
+
+    for (size_t i = 0; i < sizeof fields / sizeof fields[0]; i++)
+    {
+        atomic_ulong* field = (atomic_ulong*) ((char*) stats + fields[i].offset);
+        int           n     = snprintf(buff + len,
+                             buff_size - len,
+                             "%s %lu\n",
+                             fields[i].name,
+                             atomic_load_explicit(field, memory_order_relaxed));
+
+        if (n < 0 || (size_t) n >= buff_size - len)
+            break;
+        len += n;
+    }
+
+    return len;
+}
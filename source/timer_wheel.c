@@ -0,0 +1,180 @@
+#include "timer_wheel.h"
+
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Furthest tick (relative to now) the wheel can hold. */
+#define TW_RANGE ((uint64_t) 1 << (TW_BITS * TW_LEVELS))
+
+/** @brief Slot index of a tick at a given level. */
+#define TW_INDEX(tick, level) (((tick) >> (TW_BITS * (level))) & (TW_SLOTS - 1))
+
+/* -------------------------------------------------------------------------- */
+
+static void tw_link(Timer** head, Timer* t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head    = t;
+}
+
+static void tw_unlink(Timer* t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next  = NULL;
+    t->pprev = NULL;
+}
+
+/** @brief Put an unlinked timer in the slot matching its expiry. */
+static void tw_insert(TimerWheel* w, Timer* t)
+{
+    if (t->expires <= w->now)  // Already due, fire on the next tick
+        t->expires = w->now + 1;
+
+    uint64_t delta = t->expires - w->now;
+    if (delta >= TW_RANGE)
+        t->expires = w->now + TW_RANGE - 1;
+
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= ((uint64_t) 1 << (TW_BITS * (level + 1))))
+        level++;
+
+    tw_link(&w->slots[level][TW_INDEX(t->expires, level)], t);
+}
+
+/** @brief Move the timers of a higher level slot down to where they belong now. */
+static void tw_cascade(TimerWheel* w, int level, unsigned index)
+{
+    Timer* t               = w->slots[level][index];
+    w->slots[level][index] = NULL;
+
+    while (t)
+    {
+        Timer* next = t->next;
+        tw_insert(w, t);
+        t = next;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+void timer_wheel_init(TimerWheel* w, uint64_t now_ms, unsigned tick_ms)
+{
+    memset(w, 0, sizeof *w);
+    w->tick_ms = tick_ms ? tick_ms : 1;
+    w->now     = now_ms / w->tick_ms;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void timer_arm(TimerWheel* w, Timer* t, uint64_t expires_ms)
+{
+    if (t->pprev)
+        tw_unlink(t);
+    else
+        w->count++;
+
+    t->expires = (expires_ms + w->tick_ms - 1) / w->tick_ms;  // Never fire early
+    tw_insert(w, t);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void timer_cancel(TimerWheel* w, Timer* t)
+{
+    if (!t->pprev)
+        return;
+
+    tw_unlink(t);
+    w->count--;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int timer_armed(const Timer* t)
+{
+    return t->pprev != NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+Timer* timer_wheel_advance(TimerWheel* w, uint64_t now_ms)
+{
+    uint64_t target  = now_ms / w->tick_ms;
+    Timer*   expired = NULL;
+
+    if (w->count == 0)  // Nothing to fire, jump straight to the present
+    {
+        w->now = target > w->now ? target : w->now;
+        return NULL;
+    }
+
+    while (w->now < target)
+    {
+        w->now++;
+
+        // Entering a new lap of a level: bring down the timers of the next level's slot
+        for (int level = 1; level < TW_LEVELS && TW_INDEX(w->now, level - 1) == 0; level++)
+            tw_cascade(w, level, TW_INDEX(w->now, level));
+
+        Timer** slot = &w->slots[0][TW_INDEX(w->now, 0)];
+        while (*slot)
+        {
+            Timer* t = *slot;
+            tw_unlink(t);
+            w->count--;
+            t->next = expired;
+            expired = t;
+        }
+
+        if (w->count == 0)
+        {
+            w->now = target;
+            break;
+        }
+    }
+
+    return expired;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int timer_wheel_timeout(const TimerWheel* w, uint64_t now_ms)
+{
+    if (w->count == 0)
+        return -1;
+
+    uint64_t next = 0;
+
+    // Every level: a slot of a higher one may have to cascade before the next level 0 tick
+    for (int level = 0; level < TW_LEVELS; level++)
+    {
+        uint64_t lap = w->now >> (TW_BITS * level);
+        for (uint64_t k = 1; k <= TW_SLOTS; k++)
+        {
+            if (w->slots[level][(lap + k) & (TW_SLOTS - 1)])
+            {
+                // Level 0 slots fire on their tick, higher ones cascade when their lap starts
+                uint64_t tick = (lap + k) << (TW_BITS * level);
+                if (next == 0 || tick < next)
+                    next = tick;
+                break;
+            }
+        }
+    }
+
+    if (next == 0)
+        return 0;
+
+    uint64_t due_ms = next * w->tick_ms;
+    if (due_ms <= now_ms)
+        return 0;
+
+    uint64_t wait = due_ms - now_ms;
+    return wait > 0x7fffffff ? 0x7fffffff : (int) wait;
+}
@@ -0,0 +1,527 @@
+#include "tls.h"
+#include "bufpool.h"
+#include "config.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Most plaintext in a TLS record, what user space encrypts at a time. */
+#define TLS_RECORD 16384
+
+/** @brief A session ticket key, to encrypt tickets (AES-256-CBC) and sign them (HMAC-SHA256). */
+typedef struct TicketKeyStruct
+{
+    /** @brief Sent in the clear with each ticket, to find the key again. */
+    unsigned char name[16];
+    /** @brief Encryption key. */
+    unsigned char aes[32];
+    /** @brief Signing key. */
+    unsigned char hmac[32];
+} TicketKey;
+
+/** @brief Context shared by all connections. NULL when TLS is disabled. */
+static SSL_CTX* ctx = NULL;
+
+/**
+ * @brief Ticket keys, the current one first, then the previous one.
+ * Kept in the main loop's memory, children get a copy when forked: tickets
+ * don't need any state shared at runtime, unlike a session cache. */
+static TicketKey keys[2];
+
+/** @brief Number of keys in use. */
+static int key_count = 0;
+
+/** @brief When the ticket key is rotated next, in milliseconds. */
+static uint64_t rotate_at = 0;
+
+/** @brief Session of this process' connection. NULL unless it is TLS. */
+static SSL* ssl = NULL;
+
+/** @brief Whether the kernel encrypts what is sent on the connection. */
+static int ktls_send = 0;
+
+/** @brief Plaintext gathered for one record. */
+static unsigned char staging[TLS_RECORD];
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Log the oldest OpenSSL error, or none if the error queue is empty. */
+static void log_ssl_error(LogLevel level, const char* what)
+{
+    unsigned long e = ERR_get_error();
+    wlog(level, "%s. %s.", what, e ? ERR_error_string(e, NULL) : "No OpenSSL error");
+    ERR_clear_error();
+}
+
+/** @brief Make a new ticket key the current one, keeping the previous one. */
+static int rotate_ticket_key()
+{
+    TicketKey key;
+
+    if (RAND_bytes(key.name, sizeof key.name) <= 0 || RAND_bytes(key.aes, sizeof key.aes) <= 0 ||
+        RAND_bytes(key.hmac, sizeof key.hmac) <= 0)
+    {
+        log_ssl_error(ERROR, "Failed to generate a session ticket key");
+        return EXIT_FAILURE;
+    }
+
+    keys[1]   = keys[0];
+    keys[0]   = key;
+    key_count = key_count < 2 ? key_count + 1 : 2;
+    rotate_at = now_ms() + (uint64_t) TLS_TICKET_ROTATE * 1000;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Encrypt a new session ticket, or find the key of one presented for resumption.
+ * @return 1 on success, 2 to accept the ticket and issue a new one (it used
+ *         the previous key), 0 for an unknown key (full handshake), -1 on error. */
+static int ticket_key_cb(SSL*            s,
+                         unsigned char   name[16],
+                         unsigned char*  iv,
+                         EVP_CIPHER_CTX* cipher,
+                         EVP_MAC_CTX*    mac,
+                         int             enc)
+{
+    (void) s;
+    const TicketKey* key = NULL;
+
+    if (enc)
+    {
+        key = &keys[0];
+        memcpy(name, key->name, sizeof key->name);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0 ||
+            !EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv))
+            return -1;
+    }
+    else
+    {
+        for (int i = 0; i < key_count && !key; i++)
+            if (memcmp(name, keys[i].name, sizeof keys[i].name) == 0)
+                key = &keys[i];
+
+        if (!key)  // Older than the previous rotation
+            return 0;
+
+        if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv))
+            return -1;
+    }
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void*) key->hmac, sizeof key->hmac),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+
+    if (!EVP_MAC_CTX_set_params(mac, params))
+        return -1;
+
+    return key == &keys[0] ? 1 : 2;
+}
+
+/** @brief Pick h2 when the client offers it and HTTP/2 is enabled, HTTP/1.1 otherwise. */
+static int alpn_select(SSL*                  s,
+                       const unsigned char** out,
+                       unsigned char*        out_len,
+                       const unsigned char*  in,
+                       unsigned int          in_len,
+                       void*                 arg)
+{
+    (void) s;
+    (void) arg;
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";  // In order of preference
+    const unsigned char*       ours        = HTTP2 ? protocols : protocols + 3;
+    unsigned int               ours_len    = sizeof protocols - 1 - (ours - protocols);
+    unsigned char*             selected;
+
+    if (SSL_select_next_proto(&selected, out_len, ours, ours_len, in, in_len) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;  // Nothing in common, go on without ALPN
+
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int tls_startup()
+{
+    if (TLS_CERT[0] == '\0')  // No certificate, so no TLS listener either
+        return EXIT_SUCCESS;
+
+    wlog(INFO, "Setting up TLS with certificate %s...", TLS_CERT);
+    const char* key_file = TLS_KEY[0] != '\0' ? TLS_KEY : TLS_CERT;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        log_ssl_error(FATAL, "Failed to create TLS context");
+        return EXIT_FAILURE;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, TLS_CERT) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        log_ssl_error(FATAL, "Failed to load TLS certificate and key");
+        return EXIT_FAILURE;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx,
+                        SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION |
+                            (KTLS ? SSL_OP_ENABLE_KTLS : 0));
+
+    // A failed write is retried with the same bytes, possibly from a reallocated buffer
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Children exit with their connection, so a session cache would never be
+    // hit: sessions are resumed with tickets only, one per handshake
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_timeout(ctx, TLS_TICKET_ROTATE);  // Tickets outlive their key by up to a rotation
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+
+    return rotate_ticket_key();
+}
+
+/* -------------------------------------------------------------------------- */
+
+void tls_shutdown()
+{
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    OPENSSL_cleanse(keys, sizeof keys);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void tls_maintain()
+{
+    if (!ctx || now_ms() < rotate_at)
+        return;
+
+    if (rotate_ticket_key() == EXIT_SUCCESS)
+        wlog(INFO, "Session ticket key rotated.");
+    else
+        rotate_at = now_ms() + 1000;  // Try again in a second, not on every iteration
+}
+
+/* -------------------------------------------------------------------------- */
+
+int tls_timeout()
+{
+    if (!ctx)
+        return -1;
+
+    uint64_t now = now_ms();
+    return rotate_at <= now ? 0 : rotate_at - now > INT_MAX ? INT_MAX : (int) (rotate_at - now);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Wait until the socket is ready for what OpenSSL asked. */
+static int wait_socket(int socket, short events)
+{
+    struct pollfd pfd = {.fd = socket, .events = events};
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR)  // A stuck client is killed on its deadline
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Handle a failed OpenSSL call on the connection.
+ * @param socket The client socket.
+ * @param ret What the call returned.
+ * @param flags MSG_DONTWAIT to fail with EAGAIN instead of waiting.
+ * @return EXIT_SUCCESS to retry the call, EXIT_FAILURE with errno set. */
+static int ssl_failed(int socket, int ret, int flags)
+{
+    int e = SSL_get_error(ssl, ret);
+
+    if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE)
+    {
+        if (flags & MSG_DONTWAIT)
+        {
+            errno = EAGAIN;
+            return EXIT_FAILURE;
+        }
+
+        return wait_socket(socket, e == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT);
+    }
+
+    if (e == SSL_ERROR_SYSCALL && errno != 0)  // From the socket, errno says it all
+    {
+        ERR_clear_error();
+        return EXIT_FAILURE;
+    }
+
+    log_ssl_error(DEBUG, "TLS connection failed");
+    errno = ECONNRESET;
+    return EXIT_FAILURE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Microseconds from start to now on a clock. */
+static unsigned long elapsed_us(clockid_t clock, const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int tls_accept(int client_socket)
+{
+    struct timespec wall, cpu;  // Children are single-threaded: process time is handshake time
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+    signal(SIGPIPE, SIG_IGN);  // OpenSSL writes with write(), there's no MSG_NOSIGNAL
+
+    if (fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) | O_NONBLOCK) == -1)
+    {
+        wlog(ERROR, "Failed to set client socket to non-blocking. %s.", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    ssl = SSL_new(ctx);
+    if (!ssl || SSL_set_fd(ssl, client_socket) != 1)
+    {
+        log_ssl_error(ERROR, "Failed to create TLS session");
+        SSL_free(ssl);
+        ssl = NULL;
+        return EXIT_FAILURE;
+    }
+
+    int ret;
+    errno = 0;
+    while ((ret = SSL_accept(ssl)) != 1)
+    {
+        if (ssl_failed(client_socket, ret, 0))
+        {
+            wlog(WARNING, "TLS handshake failed: (%d) %s.", errno, strerror(errno));
+            STAT_ADD(tls_failed, 1);
+            SSL_free(ssl);
+            ssl = NULL;
+            return EXIT_FAILURE;
+        }
+        errno = 0;
+    }
+
+    unsigned long wall_us = elapsed_us(CLOCK_MONOTONIC, &wall);
+    unsigned long cpu_us  = elapsed_us(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    int           resumed = SSL_session_reused(ssl);
+    ktls_send             = BIO_get_ktls_send(SSL_get_wbio(ssl));
+
+    STAT_ADD(tls_handshakes, 1);
+    STAT_ADD(tls_resumed, resumed ? 1 : 0);
+    STAT_ADD(tls_ktls, ktls_send ? 1 : 0);
+    STAT_ADD(tls_handshake_us, wall_us);
+    STAT_ADD(tls_handshake_cpu_us, cpu_us);
+
+    wlog(DEBUG,
+         "TLS handshake done in %lu us (%lu us CPU): %s, %s%s, kTLS send %s, receive %s.",
+         wall_us,
+         cpu_us,
+         SSL_get_version(ssl),
+         SSL_get_cipher_name(ssl),
+         resumed ? ", resumed" : "",
+         ktls_send ? "on" : "off",
+         BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void tls_close()
+{
+    if (!ssl)
+        return;
+
+    SSL_shutdown(ssl);  // Best effort, the socket is closed right after
+    SSL_free(ssl);
+    ssl = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int tls_active()
+{
+    return ssl != NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int tls_pending()
+{
+    return ssl && SSL_pending(ssl) > 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+ssize_t tls_recv(int socket, void* buff, size_t len, int flags)
+{
+    if (!ssl)
+        return recv(socket, buff, len, flags);
+
+    for (;;)  // Also through OpenSSL with kTLS, it handles non-data records
+    {
+        errno = 0;
+        int n = SSL_read(ssl, buff, len > INT_MAX ? INT_MAX : (int) len);
+
+        if (n > 0)
+            return n;
+
+        if (SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN)  // Closed, with or without alert
+            return 0;
+
+        if (ssl_failed(socket, n, flags))
+            return -1;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Encrypt and send bytes in user space. */
+static ssize_t ssl_write(int socket, const void* buff, size_t len, int flags)
+{
+    for (;;)
+    {
+        errno = 0;
+        int n = SSL_write(ssl, buff, len > INT_MAX ? INT_MAX : (int) len);
+
+        if (n > 0)
+            return n;
+
+        if (ssl_failed(socket, n, flags))
+            return -1;
+    }
+}
+
+ssize_t tls_send(int socket, const void* buff, size_t len, int flags)
+{
+    if (ssl && !ktls_send)
+        return ssl_write(socket, buff, len, flags);
+
+    ssize_t n = send(socket, buff, len, flags);
+
+    // TLS sockets are non-blocking, wait like a blocking send() would
+    while (ssl && n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+           !(flags & MSG_DONTWAIT) && wait_socket(socket, POLLOUT) == EXIT_SUCCESS)
+        n = send(socket, buff, len, flags);
+
+    return n;
+}
+
+/* -------------------------------------------------------------------------- */
+
+ssize_t tls_sendmsg(int socket, const struct msghdr* msg, int flags)
+{
+    if (!ssl || ktls_send)
+        return sendmsg(socket, msg, flags);
+
+    const struct iovec* iov = msg->msg_iov;
+    if (msg->msg_iovlen == 1 || iov[0].iov_len >= sizeof staging)  // Nothing to gather
+        return ssl_write(socket, iov[0].iov_base, iov[0].iov_len, flags);
+
+    // Small pieces (chunk lines, headers) would each take a record of their own
+    size_t len = 0;
+    for (size_t i = 0; i < msg->msg_iovlen && len < sizeof staging; i++)
+    {
+        size_t n = iov[i].iov_len < sizeof staging - len ? iov[i].iov_len : sizeof staging - len;
+        if (n > 0)  // Empty ones may have no base
+            memcpy(staging + len, iov[i].iov_base, n);
+        len += n;
+    }
+
+    return ssl_write(socket, staging, len, flags);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Room left in the send buffer of a socket, to read that much of a file at once.
+ * @return The room in bytes, at least a record: a retry must offer the bytes OpenSSL
+ *         already took for one. */
+static size_t send_room(int socket)
+{
+    int       size, queued;
+    socklen_t len = sizeof size;
+
+    if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, &len) == -1 ||
+        ioctl(socket, SIOCOUTQ, &queued) == -1 || size - queued < TLS_RECORD)
+        return TLS_RECORD;
+
+    return size - queued;
+}
+
+ssize_t tls_sendfile(int socket, int fd, off_t* offset, size_t count)
+{
+    if (!ssl || ktls_send)
+        return sendfile(socket, fd, offset, count);
+
+    size_t want = send_room(socket);
+    size_t size;
+    char*  buff = bufpool_get(want < count ? want : count, &size);
+    if (!buff)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Not past the room: what doesn't go out now would be read again
+    if (size > want)
+        size = want;
+
+    // A retry after EAGAIN reads the same bytes again, as OpenSSL requires
+    ssize_t got  = pread(fd, buff, count < size ? count : size, *offset);
+    ssize_t sent = 0;
+
+    while (sent < got)  // A record per write
+    {
+        ssize_t n = ssl_write(socket, buff + sent, got - sent, MSG_DONTWAIT);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+
+    int err = errno;
+    bufpool_put(buff);
+    errno = err;
+
+    if (got <= 0)
+        return got;
+
+    if (sent == 0)  // Nothing went out: the error of the write
+        return -1;
+
+    *offset += sent;
+    return sent;
+}
@@ -0,0 +1,312 @@
+#include "trace.h"
+#include "access_log.h"
+#include "config.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "shm.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+_Static_assert(sizeof(TraceRecord) == 128, "trace records are 128 bytes");
+
+/** @brief Whether requests are traced: for the slow log, the trace file or the access log. */
+static int enabled = 0;
+
+/** @brief Slow log, -1 if SLOW_MS is 0. Opened for appending, shared by every child. */
+static int slow_fd = -1;
+
+/** @brief Trace file, -1 if TRACE_FILE is empty. Opened for appending, shared by every child. */
+static int trace_fd = -1;
+
+/** @brief Requests finished by every process, in shared memory: one in TRACE_SAMPLE is traced. */
+static atomic_ulong* finished = NULL;
+
+/** @brief When this process' connection was accepted, 0 once its first request started. */
+static uint64_t accept_us = 0;
+
+/** @brief The request handled by this process. */
+static struct
+{
+    /** @brief When it started (now_us()), 0 if no request is in progress. */
+    uint64_t start;
+    /** @brief When it reached each phase, 0 if it didn't. */
+    uint64_t phase[TRACE_PHASES];
+    /** @brief Its send and receive calls, bytes and the rest of the record. */
+    TraceRecord record;
+} cur;
+
+/** @brief Names of the phases in the slow log. */
+static const char* const phase_names[TRACE_PHASES] = {
+    "accept", "first_byte", "parsed", "opened", "headers", "last_byte"};
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Open a file shared by the children, appended to with single write() calls. */
+static int open_log(const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        wlog(ERROR, "Failed to open %s: %s.", path, strerror(errno));
+    return fd;
+}
+
+/** @brief Append to a shared file in one call, so lines of different children don't mix. */
+static void append(int fd, const void* data, size_t len)
+{
+    if (write(fd, data, len) != (ssize_t) len)
+        wlog(WARNING, "Failed to write request trace: %s.", strerror(errno));
+}
+
+/** @brief Offset of a phase from the start of the request, TRACE_NONE if it wasn't reached. */
+static uint32_t phase_offset(TracePhase phase)
+{
+    if (!cur.phase[phase])
+        return TRACE_NONE;
+
+    uint64_t us = cur.phase[phase] - cur.start;
+    return us < TRACE_NONE ? (uint32_t) us : TRACE_NONE - 1;
+}
+
+/** @brief Write the slow log line of the current request. */
+static void log_slow(const TraceRecord* r, uint64_t total)
+{
+    char line[512];
+    char date[32];
+    get_current_time(date, sizeof date);
+
+    int len = snprintf(line,
+                       sizeof line,
+                       "%s %.*s %u total=%.3fms",
+                       date,
+                       (int) sizeof r->request,
+                       r->request[0] ? r->request : "-",
+                       r->status,
+                       total / 1000.0);
+
+    for (int i = 0; i < TRACE_PHASES && len > 0 && (size_t) len < sizeof line; i++)
+        len += r->phase_us[i] == TRACE_NONE
+                   ? snprintf(line + len, sizeof line - len, " %s=-", phase_names[i])
+                   : snprintf(line + len,
+                              sizeof line - len,
+                              " %s=%.3fms",
+                              phase_names[i],
+                              r->phase_us[i] / 1000.0);
+
+    if (len > 0 && (size_t) len < sizeof line)
+        len += snprintf(line + len,
+                        sizeof line - len,
+                        " recvs=%u sends=%u in=%llu out=%llu\n",
+                        r->recvs,
+                        r->sends,
+                        (unsigned long long) r->bytes_in,
+                        (unsigned long long) r->bytes_out);
+
+    if (len < 0 || (size_t) len >= sizeof line)
+        len = sizeof line - 1;
+    line[len - 1] = '\n';  // Keep the line whole even if truncated
+
+    append(slow_fd, line, len);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int trace_startup()
+{
+    enabled = SLOW_MS > 0 || TRACE_FILE[0] != '\0' || access_log_enabled();
+    if (SLOW_MS == 0 && TRACE_FILE[0] == '\0')
+    {
+        wlog(DEBUG, "Request tracing disabled.");
+        return EXIT_SUCCESS;
+    }
+
+    if (SLOW_MS > 0 && (slow_fd = open_log(SLOW_LOG)) == -1)
+        return EXIT_FAILURE;
+
+    if (TRACE_FILE[0] == '\0')
+    {
+        wlog(INFO, "Logging requests slower than %d ms to %s.", SLOW_MS, SLOW_LOG);
+        return EXIT_SUCCESS;
+    }
+
+    finished = shm_alloc("trace sampling counter", sizeof *finished);
+    if (!finished || (trace_fd = open_log(TRACE_FILE)) == -1)
+        return EXIT_FAILURE;
+
+    struct stat st;
+    if (fstat(trace_fd, &st) == 0 && st.st_size == 0)  // New file, starts with its header
+    {
+        TraceFileHeader header = {.endian = 0x01020304, .record_size = sizeof(TraceRecord)};
+        memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+        append(trace_fd, &header, sizeof header);
+    }
+
+    wlog(INFO,
+         "Tracing one in %d requests to %s, logging requests slower than %d ms.",
+         TRACE_SAMPLE,
+         TRACE_FILE,
+         SLOW_MS);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_shutdown()
+{
+    if (slow_fd != -1)
+        close(slow_fd);
+
+    if (trace_fd != -1)
+        close(trace_fd);
+
+    shm_free(finished, sizeof *finished);
+    enabled  = 0;
+    slow_fd  = -1;
+    trace_fd = -1;
+    finished = NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_accept()
+{
+    if (enabled)
+        accept_us = now_us();
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_mark(TracePhase phase)
+{
+    if (!enabled || (cur.start == 0 && phase != TRACE_FIRST_BYTE))
+        return;
+
+    uint64_t now = now_us();
+
+    if (cur.start == 0)  // A new request
+    {
+        cur.start = accept_us ? accept_us : now;
+        if (accept_us)
+            cur.phase[TRACE_ACCEPT] = accept_us;
+        accept_us = 0;
+    }
+
+    if (!cur.phase[phase])
+        cur.phase[phase] = now;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_request(const char* req, size_t len, int protocol)
+{
+    if (cur.start == 0)
+        return;
+
+    const char* eol = memchr(req, '\r', len);
+    size_t      n   = eol ? (size_t) (eol - req) : len;
+
+    // "GET /path HTTP/1.1": keep the method and path
+    const char* version = n > 9 ? req + n - 9 : NULL;
+    if (version && strncmp(version, " HTTP/", 6) == 0)
+        n -= 9;
+
+    access_log_request(req, n);
+
+    if (n > sizeof cur.record.request)
+        n = sizeof cur.record.request;
+
+    memcpy(cur.record.request, req, n);
+    cur.record.bytes_in = len;
+    cur.record.protocol = protocol;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_status(int status)
+{
+    if (cur.start != 0 && !cur.record.status)
+        cur.record.status = status;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_recv()
+{
+    trace_mark(TRACE_FIRST_BYTE);
+
+    if (cur.start != 0)
+        cur.record.recvs++;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_send(size_t n)
+{
+    if (cur.start == 0)
+        return;
+
+    uint64_t now = now_us();
+    if (!cur.phase[TRACE_HEADERS])
+        cur.phase[TRACE_HEADERS] = now;
+    cur.phase[TRACE_LAST_BYTE] = now;
+
+    cur.record.sends++;
+    cur.record.bytes_out += n;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_queued(size_t n)
+{
+    if (cur.start != 0)
+        cur.record.bytes_out += n;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void trace_end()
+{
+    if (cur.start == 0)
+        return;
+
+    uint64_t now = now_us();
+    if (!cur.phase[TRACE_LAST_BYTE])  // Nothing sent by us: done once handled (HTTP/2)
+        cur.phase[TRACE_LAST_BYTE] = now;
+
+    TraceRecord* r     = &cur.record;
+    uint64_t     total = cur.phase[TRACE_LAST_BYTE] - cur.start;
+
+    for (int i = 0; i < TRACE_PHASES; i++)
+        r->phase_us[i] = phase_offset(i);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->time_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - (now - cur.start);
+
+    if (slow_fd != -1 && total >= (uint64_t) SLOW_MS * 1000)
+    {
+        STAT_ADD(slow_requests, 1);
+        log_slow(r, total);
+    }
+
+    if (trace_fd != -1 &&
+        atomic_fetch_add_explicit(finished, 1, memory_order_relaxed) % TRACE_SAMPLE == 0)
+    {
+        STAT_ADD(traced_requests, 1);
+        append(trace_fd, r, sizeof *r);
+    }
+
+    access_log_write(r);
+
+    memset(&cur, 0, sizeof cur);
+}
@@ -0,0 +1,253 @@
+#include "upgrade.h"
+#include "listener.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief A listening socket inherited from the old server. */
+typedef struct InheritedStruct
+{
+    /** @brief The socket, -1 once taken or closed. */
+    int fd;
+    /** @brief Spec of the listener it was opened for. */
+    char spec[512];
+} Inherited;
+
+/** @brief Command line of the server, argv[0] is started again. */
+static char const** command = NULL;
+
+/** @brief Where the last upgrade stands. */
+static UpgradeState state = UPGRADE_NONE;
+
+/** @brief The new server, while it starts. */
+static pid_t child = -1;
+
+/** @brief Read end of the readiness pipe, while the new server starts. */
+static int ready_fd = -1;
+
+/** @brief Write end of the readiness pipe, in a new server until it is ready. */
+static int notify_fd = -1;
+
+/** @brief Sockets inherited from the old server. */
+static Inherited inherited[LISTENERS_MAX];
+
+/** @brief Number of inherited sockets. */
+static size_t inherited_count = 0;
+
+/* -------------------------------------------------------------------------- */
+
+void upgrade_startup(char const* argv[])
+{
+    command = argv;
+
+    // Taken out of the environment, so helper processes and later upgrades don't see them
+    const char* ready = getenv(UPGRADE_ENV_READY);
+    if (ready)
+    {
+        notify_fd = atoi(ready);
+        fcntl(notify_fd, F_SETFD, FD_CLOEXEC);  // Not for the children
+        unsetenv(UPGRADE_ENV_READY);
+    }
+
+    const char* list = getenv(UPGRADE_ENV_LISTENERS);
+    if (!list)
+        return;
+
+    for (const char* line = list; *line && inherited_count < LISTENERS_MAX;)
+    {
+        char*       end;
+        const char* eol = strchr(line, '\n');
+        size_t      len = eol ? (size_t) (eol - line) : strlen(line);
+        long        fd  = strtol(line, &end, 10);
+
+        if (end != line && *end == ' ' && fd >= 0 && (size_t) (end + 1 - line) < len)
+        {
+            Inherited* in = &inherited[inherited_count++];
+            in->fd        = (int) fd;
+            snprintf(in->spec, sizeof in->spec, "%.*s", (int) (len - (end + 1 - line)), end + 1);
+        }
+
+        line += len + (eol != NULL);
+    }
+
+    unsetenv(UPGRADE_ENV_LISTENERS);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int upgrade_start()
+{
+    if (state != UPGRADE_NONE)
+    {
+        wlog(WARNING, "Upgrade already in progress, ignoring SIGUSR2.");
+        return EXIT_FAILURE;
+    }
+
+    char   listeners[LISTENERS_MAX * 528];
+    size_t len = 0;
+
+    listeners[0] = '\0';
+    for (size_t i = 0; i < listener_count(); i++)
+    {
+        const Listener* l = listener_get(i);
+        int             n = snprintf(listeners + len,
+                         sizeof listeners - len,
+                         "%s%d %s",
+                         len ? "\n" : "",
+                         l->fd,
+                         l->spec);
+        if (n < 0 || (size_t) n >= sizeof listeners - len)
+        {
+            wlog(ERROR, "Too many listeners to hand down, not upgrading.");
+            return EXIT_FAILURE;
+        }
+        len += n;
+    }
+
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        wlog(ERROR, "Failed to create the upgrade pipe: %s.", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);  // Single-threaded: nothing forks in between
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);  // Only the new server keeps it
+
+    wlog(INFO, "Upgrading: starting %s with %zu listeners...", command[0], listener_count());
+
+    child = fork();
+    if (child == -1)
+    {
+        wlog(ERROR, "Failed to fork the new server: %s.", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return EXIT_FAILURE;
+    }
+
+    if (child == 0)  // The listeners and the write end are close-on-exec everywhere else
+    {
+        char fd[16];
+        snprintf(fd, sizeof fd, "%d", fds[1]);
+
+        for (size_t i = 0; i < listener_count(); i++)
+            if (fcntl(listener_get(i)->fd, F_SETFD, 0) == -1)
+                _exit(EXIT_FAILURE);
+
+        if (fcntl(fds[1], F_SETFD, 0) == -1 || setenv(UPGRADE_ENV_READY, fd, 1) == -1 ||
+            setenv(UPGRADE_ENV_LISTENERS, listeners, 1) == -1)
+            _exit(EXIT_FAILURE);
+
+        execvp(command[0], (char* const*) command);
+        wlog(FATAL, "Failed to start %s: %s.", command[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    close(fds[1]);  // EOF once the new server is ready or gone
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    ready_fd = fds[0];
+    state    = UPGRADE_PENDING;
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+UpgradeState upgrade_check()
+{
+    if (state != UPGRADE_PENDING)
+        return state;
+
+    char    byte;
+    ssize_t n = read(ready_fd, &byte, 1);
+
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return state;  // Still starting
+
+    close(ready_fd);
+    ready_fd = -1;
+
+    if (n == 1)
+    {
+        wlog(INFO, "New server %d ready, handing over the listeners.", (int) child);
+        state = UPGRADE_READY;
+    }
+    else
+    {
+        wlog(ERROR, "New server %d failed to start, still serving.", (int) child);
+        state = UPGRADE_NONE;  // Reaped like the other children, SIGUSR2 can try again
+    }
+
+    return state;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int upgrade_fd()
+{
+    return ready_fd;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int upgrade_inherit(const char* spec)
+{
+    for (size_t i = 0; i < inherited_count; i++)
+    {
+        if (inherited[i].fd != -1 && strcmp(inherited[i].spec, spec) == 0)
+        {
+            int fd          = inherited[i].fd;
+            inherited[i].fd = -1;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void upgrade_inherit_done()
+{
+    for (size_t i = 0; i < inherited_count; i++)
+    {
+        if (inherited[i].fd == -1)
+            continue;
+
+        wlog(INFO, "Closing inherited listener \"%s\", no longer configured.", inherited[i].spec);
+        close(inherited[i].fd);
+        inherited[i].fd = -1;
+    }
+
+    inherited_count = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int upgrade_inheriting()
+{
+    return notify_fd != -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void upgrade_ready()
+{
+    if (notify_fd == -1)
+        return;
+
+    if (write(notify_fd, "", 1) != 1)
+        wlog(ERROR, "Failed to tell the old server to hand over: %s.", strerror(errno));
+    else
+        wlog(INFO, "Told the old server to hand over.");
+
+    close(notify_fd);
+    notify_fd = -1;
+}
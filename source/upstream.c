@@ -0,0 +1,456 @@
+#include "upstream.h"
+#include "config.h"
+#include "logging.h"
+#include "net_utils.h"
+#include "shm.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief State of a pool slot. */
+typedef enum UpstreamStateEnum
+{
+    US_DEAD,        /**< No connection, to be (re)opened by the main loop. */
+    US_CONNECTING,  /**< Opened by the main loop, not established yet. */
+    US_IDLE,        /**< Established and free to borrow. */
+    US_BUSY,        /**< Borrowed by a child (or checked by the main loop). */
+} UpstreamState;
+
+/** @brief A pool slot, in shared memory. */
+typedef struct UpstreamSlotStruct
+{
+    /** @brief An UpstreamState. Moved from IDLE to BUSY with a compare-and-swap. */
+    atomic_int state;
+    /** @brief Generation of the connection, bumped every time the slot is reopened. */
+    atomic_uint gen;
+    /** @brief Process that borrowed the slot. */
+    atomic_int owner;
+} UpstreamSlot;
+
+/** @brief The pool, in shared memory. NULL when proxy mode is disabled. */
+static UpstreamSlot* pool = NULL;
+
+/** @brief Number of slots in the pool. */
+static int pool_size = 0;
+
+/**
+ * @brief Socket of each slot, as seen by this process.
+ * Process-local on purpose: a child inherits the sockets (and this array)
+ * the main loop had when it forked, so a slot is only usable by a child if
+ * its generation still matches local_gen. */
+static int* local_fd = NULL;
+
+/** @brief Generation of each slot's socket in local_fd. */
+static unsigned* local_gen = NULL;
+
+/** @brief When the main loop may try to reopen each slot, in milliseconds. */
+static uint64_t* retry_at = NULL;
+
+/** @brief Resolved upstream address. */
+static struct sockaddr_storage upstream_addr;
+
+/** @brief Length of upstream_addr. */
+static socklen_t upstream_addr_len = 0;
+
+/** @brief Host header value. */
+static char host[256] = "";
+
+/** @brief Path prefix, without a trailing slash. */
+static char prefix[256] = "";
+
+/** @brief Milliseconds to wait before reopening a connection that failed. */
+#define UPSTREAM_RETRY_MS 1000
+
+/** @brief Milliseconds between checks of the open connections, for hangups and connects. */
+#define UPSTREAM_CHECK_MS 1000
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Split PROXY_UPSTREAM into host, port and path prefix.
+ * Accepts "http://host[:port][/prefix]", with or without the scheme. IPv6
+ * addresses go in brackets.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure. */
+static int upstream_parse(char* name, size_t name_size, char* port, size_t port_size)
+{
+    const char* url = PROXY_UPSTREAM;
+
+    if (strncmp(url, "http://", 7) == 0)
+        url += 7;
+    else if (strstr(url, "://"))
+    {
+        wlog(FATAL, "Unsupported upstream scheme in %s, only http:// is supported.", url);
+        return EXIT_FAILURE;
+    }
+
+    size_t authority_len = strcspn(url, "/");
+    if (authority_len == 0 || authority_len >= sizeof host)
+    {
+        wlog(FATAL, "Invalid upstream address: %s.", PROXY_UPSTREAM);
+        return EXIT_FAILURE;
+    }
+
+    memcpy(host, url, authority_len);
+    host[authority_len] = '\0';
+
+    snprintf(prefix, sizeof prefix, "%s", url + authority_len);
+    size_t prefix_len = strlen(prefix);
+    while (prefix_len > 0 && prefix[prefix_len - 1] == '/')
+        prefix[--prefix_len] = '\0';
+
+    const char* name_start = host;
+    const char* name_end;
+    const char* port_start = NULL;
+
+    if (host[0] == '[')  // [IPv6]:port
+    {
+        name_start = host + 1;
+        name_end   = strchr(name_start, ']');
+        if (!name_end)
+        {
+            wlog(FATAL, "Invalid upstream address: %s.", PROXY_UPSTREAM);
+            return EXIT_FAILURE;
+        }
+        if (name_end[1] == ':')
+            port_start = name_end + 2;
+    }
+    else
+    {
+        name_end = strchr(host, ':');
+        if (name_end)
+            port_start = name_end + 1;
+        else
+            name_end = host + strlen(host);
+    }
+
+    snprintf(name, name_size, "%.*s", (int) (name_end - name_start), name_start);
+    snprintf(port, port_size, "%s", port_start && *port_start ? port_start : "80");
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Open a socket to the upstream server.
+ * Failures are logged by the caller: the main loop retries quietly.
+ * @param nonblocking Don't wait for the connection to be established.
+ * @return The socket, or -1 on failure. */
+static int upstream_connect(int nonblocking)
+{
+    int fd = socket(upstream_addr.ss_family,
+                    SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0),
+                    0);
+    if (fd == -1)
+        return -1;
+
+    if (connect(fd, (struct sockaddr*) &upstream_addr, upstream_addr_len) == -1 &&
+        !(nonblocking && errno == EINPROGRESS))
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int upstream_startup()
+{
+    if (PROXY_UPSTREAM[0] == '\0')
+        return EXIT_SUCCESS;
+
+    char name[256], port[16];
+    if (upstream_parse(name, sizeof name, port, sizeof port))
+        return EXIT_FAILURE;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(name, port, &hints, &res);
+    if (err != 0)
+    {
+        wlog(FATAL, "Failed to resolve upstream %s: %s.", name, gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    memcpy(&upstream_addr, res->ai_addr, res->ai_addrlen);
+    upstream_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    pool_size = PROXY_POOL;
+    if (pool_size > 0)
+    {
+        pool      = shm_alloc("upstream pool", pool_size * sizeof *pool);
+        local_fd  = malloc(pool_size * sizeof *local_fd);
+        local_gen = calloc(pool_size, sizeof *local_gen);
+        retry_at  = calloc(pool_size, sizeof *retry_at);
+
+        if (!pool || !local_fd || !local_gen || !retry_at)
+        {
+            wlog(FATAL, "Failed to allocate upstream pool of %d connections.", pool_size);
+            upstream_shutdown();
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < pool_size; i++)
+            local_fd[i] = -1;
+    }
+
+    wlog(INFO,
+         "Proxying to http://%s%s with a pool of %d connections.",
+         host,
+         prefix,
+         pool_size);
+    upstream_maintain();  // Start connecting right away
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void upstream_shutdown()
+{
+    for (int i = 0; local_fd && i < pool_size; i++)
+        if (local_fd[i] != -1)
+            close(local_fd[i]);
+
+    shm_free(pool, pool_size * sizeof *pool);
+    free(local_fd);
+    free(local_gen);
+    free(retry_at);
+
+    pool      = NULL;
+    local_fd  = NULL;
+    local_gen = NULL;
+    retry_at  = NULL;
+    pool_size = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Close the connection of a slot the main loop owns and schedule a reopen. */
+static void upstream_close_slot(int i, uint64_t now, uint64_t delay)
+{
+    if (local_fd[i] != -1)
+        close(local_fd[i]);
+
+    local_fd[i] = -1;
+    retry_at[i] = now + delay;
+    atomic_store_explicit(&pool[i].state, US_DEAD, memory_order_release);
+}
+
+/* -------------------------------------------------------------------------- */
+
+void upstream_maintain()
+{
+    if (!pool)
+        return;
+
+    uint64_t      now = now_ms();
+    struct pollfd polled[pool_size];
+    int           polled_count = 0;
+
+    for (int i = 0; i < pool_size; i++)
+    {
+        int state = atomic_load_explicit(&pool[i].state, memory_order_acquire);
+
+        if (state == US_BUSY)  // Borrower killed before giving it back?
+        {
+            pid_t owner = atomic_load_explicit(&pool[i].owner, memory_order_relaxed);
+            if (owner != getpid() && kill(owner, 0) == -1 && errno == ESRCH)
+            {
+                wlog(DEBUG, "Reclaiming upstream connection %d from dead child %d.", i, owner);
+                upstream_close_slot(i, now, 0);
+                state = US_DEAD;
+            }
+        }
+
+        if (state == US_DEAD && now >= retry_at[i])
+        {
+            if (local_fd[i] != -1)  // Given back unusable by a child
+                upstream_close_slot(i, now, 0);
+
+            local_fd[i] = upstream_connect(1);
+            if (local_fd[i] == -1)
+            {
+                wlog(DEBUG, "Failed to connect to upstream %s: %s.", host, strerror(errno));
+                retry_at[i] = now + UPSTREAM_RETRY_MS;
+                continue;
+            }
+
+            local_gen[i] = atomic_fetch_add_explicit(&pool[i].gen, 1, memory_order_relaxed) + 1;
+            atomic_store_explicit(&pool[i].state, US_CONNECTING, memory_order_release);
+            state = US_CONNECTING;
+        }
+
+        if (state == US_CONNECTING)
+            polled[polled_count++] = (struct pollfd) {.fd = local_fd[i], .events = POLLOUT};
+
+        // An idle connection has nothing to say: if it's readable, the upstream hung up
+        if (state == US_IDLE)
+            polled[polled_count++] = (struct pollfd) {.fd = local_fd[i], .events = POLLIN};
+    }
+
+    if (polled_count == 0 || poll(polled, polled_count, 0) <= 0)
+        return;
+
+    for (int i = 0, p = 0; i < pool_size && p < polled_count; i++)
+    {
+        if (local_fd[i] != polled[p].fd)
+            continue;
+
+        short revents = polled[p++].revents;
+        if (revents == 0)
+            continue;
+
+        int state = atomic_load_explicit(&pool[i].state, memory_order_acquire);
+
+        if (state == US_CONNECTING)
+        {
+            int       error = 0;
+            socklen_t len   = sizeof error;
+            getsockopt(local_fd[i], SOL_SOCKET, SO_ERROR, &error, &len);
+
+            if (error)
+            {
+                wlog(DEBUG, "Failed to connect to upstream %s: %s.", host, strerror(error));
+                upstream_close_slot(i, now, UPSTREAM_RETRY_MS);
+                continue;
+            }
+
+            // Children use blocking calls on it, and the flag is shared with them
+            fcntl(local_fd[i], F_SETFL, fcntl(local_fd[i], F_GETFL, 0) & ~O_NONBLOCK);
+            STAT_ADD(upstream_connects, 1);
+            atomic_store_explicit(&pool[i].state, US_IDLE, memory_order_release);
+            wlog(TRACE, "Upstream connection %d established.", i);
+            continue;
+        }
+
+        int expected = US_IDLE;
+        if (state == US_IDLE && atomic_compare_exchange_strong_explicit(&pool[i].state,
+                                                                        &expected,
+                                                                        US_BUSY,
+                                                                        memory_order_acquire,
+                                                                        memory_order_relaxed))
+        {
+            wlog(DEBUG, "Upstream closed idle connection %d.", i);
+            upstream_close_slot(i, now, 0);
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+int upstream_timeout()
+{
+    if (!pool)
+        return -1;
+
+    uint64_t now     = now_ms();
+    int      timeout = UPSTREAM_CHECK_MS;  // Nothing tells the main loop an idle one hung up
+
+    for (int i = 0; i < pool_size; i++)
+    {
+        if (atomic_load_explicit(&pool[i].state, memory_order_relaxed) != US_DEAD)
+            continue;
+
+        if (retry_at[i] <= now)
+            return 0;
+
+        if (retry_at[i] - now < (uint64_t) timeout)
+            timeout = (int) (retry_at[i] - now);
+    }
+
+    return timeout;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int upstream_acquire(UpstreamConn* conn, int fresh)
+{
+    pid_t self = getpid();
+
+    for (int i = 0; !fresh && i < pool_size; i++)
+    {
+        // Only slots opened before we were forked are usable here
+        if (atomic_load_explicit(&pool[i].gen, memory_order_relaxed) != local_gen[i])
+            continue;
+
+        int expected = US_IDLE;
+        if (!atomic_compare_exchange_strong_explicit(
+                &pool[i].state, &expected, US_BUSY, memory_order_acquire, memory_order_relaxed))
+            continue;
+
+        if (atomic_load_explicit(&pool[i].gen, memory_order_relaxed) != local_gen[i])
+        {
+            // Reopened between our checks, it's not our socket: put it back
+            atomic_store_explicit(&pool[i].state, US_IDLE, memory_order_release);
+            continue;
+        }
+
+        atomic_store_explicit(&pool[i].owner, self, memory_order_relaxed);
+        conn->fd   = local_fd[i];
+        conn->slot = i;
+        STAT_ADD(upstream_reuses, 1);
+        return EXIT_SUCCESS;
+    }
+
+    conn->slot = -1;
+    conn->fd   = upstream_connect(0);
+
+    if (conn->fd == -1)
+    {
+        wlog(WARNING, "Failed to connect to upstream %s: (%d) %s.", host, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    STAT_ADD(upstream_connects, 1);
+    return EXIT_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+
+void upstream_release(UpstreamConn* conn, int reusable)
+{
+    if (conn->slot == -1)
+    {
+        if (conn->fd != -1)
+            close(conn->fd);
+    }
+    else  // The main loop closes its own copy of dead connections and reopens them
+        atomic_store_explicit(
+            &pool[conn->slot].state, reusable ? US_IDLE : US_DEAD, memory_order_release);
+
+    conn->fd   = -1;
+    conn->slot = -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+const char* upstream_host()
+{
+    return host;
+}
+
+/* -------------------------------------------------------------------------- */
+
+const char* upstream_prefix()
+{
+    return prefix;
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE  // readahead()
+#include "warmup.h"
+#include "config.h"
+#include "logging.h"
+#include "net_utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Most warm-up threads. */
+#define WARMUP_THREADS_MAX 64
+
+/** @brief Something for a warm-up thread to do. */
+typedef struct WarmupJobStruct
+{
+    /** @brief Directory to walk, or file to read ahead, with ROOT_DIR in front. */
+    char* path;
+    /** @brief Non-zero to read the file ahead, 0 to walk the directory. */
+    int preload;
+} WarmupJob;
+
+/** @brief Jobs and threads of the warm-up. */
+static struct
+{
+    /** @brief Protects everything but the counters. */
+    pthread_mutex_t lock;
+    /** @brief Signaled when a job is queued, and when the last one is done. */
+    pthread_cond_t changed;
+    /** @brief Queued jobs, as a stack: the walk goes depth first. */
+    WarmupJob* jobs;
+    /** @brief Queued job count. */
+    size_t count;
+    /** @brief Slots allocated in jobs. */
+    size_t cap;
+    /** @brief Jobs being run. */
+    size_t busy;
+    /** @brief Set at the deadline: threads stop taking jobs, and walking. */
+    atomic_int stop;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+/** @brief Directories walked. */
+static atomic_ulong dirs;
+/** @brief Entries found in them. */
+static atomic_ulong entries;
+/** @brief Files read ahead. */
+static atomic_ulong preloaded;
+/** @brief Bytes read ahead. */
+static atomic_ulong preloaded_bytes;
+/** @brief Directories and files that couldn't be opened: threads don't call wlog(). */
+static atomic_ulong failed;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Queue a job. Takes the lock.
+ * @param path Directory or file, with ROOT_DIR in front. Copied.
+ * @param preload Non-zero for a file to read ahead. */
+static void job_push(const char* path, int preload)
+{
+    char* copy = strdup(path);
+    if (!copy)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.count == pool.cap)
+    {
+        size_t     cap  = pool.cap ? pool.cap * 2 : 64;
+        WarmupJob* jobs = realloc(pool.jobs, cap * sizeof *jobs);
+        if (!jobs)
+        {
+            pthread_mutex_unlock(&pool.lock);
+            free(copy);
+            return;  // That part of the tree stays cold
+        }
+        pool.jobs = jobs;
+        pool.cap  = cap;
+    }
+
+    pool.jobs[pool.count++] = (WarmupJob) {.path = copy, .preload = preload};
+    pthread_cond_signal(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Stat every entry of a directory, queueing its subdirectories.
+ * @param path The directory. */
+static void walk(const char* path)
+{
+    DIR* dir = opendir(path);
+    if (!dir)
+    {
+        atomic_fetch_add_explicit(&failed, 1, memory_order_relaxed);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&dirs, 1, memory_order_relaxed);
+
+    struct dirent* de;
+    while ((de = readdir(dir)) && !pool.stop)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) == -1)  // What a lookup would do
+            continue;
+
+        atomic_fetch_add_explicit(&entries, 1, memory_order_relaxed);
+
+        // Don't follow symlinked directories, they could loop
+        struct stat lst;
+        char        sub[PATH_MAX];
+        if (S_ISDIR(st.st_mode) &&
+            fstatat(dirfd(dir), de->d_name, &lst, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISDIR(lst.st_mode) &&
+            snprintf(sub, sizeof sub, "%s/%s", path, de->d_name) < (int) sizeof sub)
+            job_push(sub, 0);
+    }
+
+    closedir(dir);
+}
+
+/**
+ * @brief Read a file ahead into the page cache.
+ * @param path The file. */
+static void preload(const char* path)
+{
+    int         fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        readahead(fd, 0, st.st_size) == 0)  // Waits for the reads, the deadline covers them
+    {
+        atomic_fetch_add_explicit(&preloaded, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&preloaded_bytes, st.st_size, memory_order_relaxed);
+    }
+    else
+        atomic_fetch_add_explicit(&failed, 1, memory_order_relaxed);
+
+    if (fd != -1)
+        close(fd);
+}
+
+/**
+ * @brief Warm-up thread: run jobs until there are none left or the deadline.
+ * @param arg Unused.
+ * @return NULL. */
+static void* worker(void* arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        while (pool.count == 0 && pool.busy > 0 && !pool.stop)  // Others may queue more
+            pthread_cond_wait(&pool.changed, &pool.lock);
+
+        if (pool.stop || pool.count == 0)
+            break;
+
+        WarmupJob job = pool.jobs[--pool.count];
+        pool.busy++;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (job.preload)
+            preload(job.path);
+        else
+            walk(job.path);
+        free(job.path);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0 && pool.count == 0)  // All done, wake the others and warmup_run()
+            pthread_cond_broadcast(&pool.changed);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/**
+ * @brief Queue the files listed in WARMUP_PRELOAD.
+ * One path per line, relative to ROOT_DIR, with or without a leading slash.
+ * Empty lines and lines starting with '#' are skipped. */
+static void queue_preload_list()
+{
+    FILE* f = fopen(WARMUP_PRELOAD, "r");
+    if (!f)
+    {
+        wlog(WARNING, "Can't open preload list %s: %s.", WARMUP_PRELOAD, strerror(errno));
+        return;
+    }
+
+    char line[PATH_MAX];
+    char path[PATH_MAX];
+    while (fgets(line, sizeof line, f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char* name            = line[0] == '/' ? line + 1 : line;
+
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        if (snprintf(path, sizeof path, "%s/%s", ROOT_DIR, name) < (int) sizeof path)
+            job_push(path, 1);
+    }
+
+    fclose(f);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int warmup_run()
+{
+    if (WARMUP_THREADS == 0)
+    {
+        wlog(DEBUG, "Warm-up disabled.");
+        return EXIT_SUCCESS;
+    }
+
+    uint64_t  start = now_ms();
+    pthread_t threads[WARMUP_THREADS_MAX];
+    int       started = 0;
+
+    // Jobs are a stack: the hot files are read ahead first, before the deadline can hit
+    job_push(ROOT_DIR, 0);
+    if (strcmp(WARMUP_PRELOAD, "") != 0)
+        queue_preload_list();
+
+    for (; started < WARMUP_THREADS && started < WARMUP_THREADS_MAX; started++)
+        if (pthread_create(&threads[started], NULL, worker, NULL) != 0)
+            break;
+
+    if (started == 0)
+    {
+        wlog(ERROR, "Failed to start the warm-up threads.");
+        pool.stop = 1;  // Nothing to join, the queue is freed below
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);  // The clock of pthread_cond_timedwait()
+    deadline.tv_sec += WARMUP_DEADLINE / 1000;
+    deadline.tv_nsec += (long) (WARMUP_DEADLINE % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int timed_out = 0;
+    pthread_mutex_lock(&pool.lock);
+    while ((pool.count > 0 || pool.busy > 0) && !pool.stop && !timed_out)
+        timed_out = pthread_cond_timedwait(&pool.changed, &pool.lock, &deadline) == ETIMEDOUT;
+
+    size_t left = pool.count;
+    pool.stop   = 1;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < started; i++)  // Single-threaded again before the first fork()
+        pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < pool.count; i++)
+        free(pool.jobs[i].path);
+    free(pool.jobs);
+    pool.jobs  = NULL;
+    pool.count = pool.cap = 0;
+
+    if (timed_out)
+        wlog(WARNING, "Warm-up deadline reached, %zu directories or files left cold.", left);
+
+    if (atomic_load(&failed))
+        wlog(WARNING,
+             "Warm-up couldn't open %lu directories or preloaded files.",
+             atomic_load(&failed));
+
+    wlog(INFO,
+         "Warm-up done in %lu ms with %d threads: %lu directories, %lu entries, "
+         "%lu files (%lu bytes) read ahead.",
+         (unsigned long) (now_ms() - start),
+         started,
+         atomic_load(&dirs),
+         atomic_load(&entries),
+         atomic_load(&preloaded),
+         atomic_load(&preloaded_bytes));
+
+    return started ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,448 @@
+/* -------------------------------------------------------------------------- */
+/*                   Converter of the access log (--access-log)               */
+/* -------------------------------------------------------------------------- */
+
+#include "access_log.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Usage: access_read [-f text|json|csv | -a] FILE
+ * Prints one line per request: as text (the default), as JSON objects (one
+ * per line) or as CSV with a header row. With -a, prints aggregates instead:
+ * requests, bytes and statuses overall, percentiles of the request time, and
+ * the paths with the most requests.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Paths shown by -a. */
+#define TOP_PATHS 10
+
+typedef enum FormatEnum
+{
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV,
+    FORMAT_AGGREGATE
+} Format;
+
+/** @brief A path, and the requests for it when aggregating. */
+typedef struct PathStruct
+{
+    uint64_t id;  // 0 for free slots
+    char*    name;
+    size_t   requests;
+    uint64_t bytes_out;
+    uint64_t total_us;
+} Path;
+
+static const char* const method_names[ACCESS_METHODS] = ACCESS_METHOD_NAMES;
+
+/** @brief Open addressing table of the paths, its size a power of two. */
+static Path*  paths      = NULL;
+static size_t path_slots = 0;
+static size_t path_count = 0;
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Find a path's slot, free if it isn't in the table. */
+static Path* path_slot(uint64_t id)
+{
+    size_t i = id & (path_slots - 1);
+    while (paths[i].id && paths[i].id != id)
+        i = (i + 1) & (path_slots - 1);
+    return &paths[i];
+}
+
+/** @brief Find a path, adding it if needed. NULL if out of memory. */
+static Path* path_get(uint64_t id)
+{
+    if ((path_count + 1) * 2 > path_slots)  // Keep the table at most half full
+    {
+        Path*  old   = paths;
+        size_t slots = path_slots;
+        Path*  grown = calloc(slots ? slots * 2 : 1024, sizeof *paths);
+        if (!grown)
+            return NULL;
+
+        paths      = grown;
+        path_slots = slots ? slots * 2 : 1024;
+
+        for (size_t i = 0; i < slots; i++)
+            if (old[i].id)
+                *path_slot(old[i].id) = old[i];
+        free(old);
+    }
+
+    Path* p = path_slot(id);
+    if (!p->id)
+    {
+        p->id = id;
+        path_count++;
+    }
+    return p;
+}
+
+/** @brief Name of a path, its hash if no record named it. */
+static const char* path_name(uint64_t id)
+{
+    static char unknown[32];
+
+    if (id == 0)
+        return "-";
+
+    Path* p = path_slots ? path_slot(id) : NULL;
+    if (p && p->name)
+        return p->name;
+
+    snprintf(unknown, sizeof unknown, "#%016llx", (unsigned long long) id);
+    return unknown;
+}
+
+/** @brief Format a record's peer, without brackets or port. */
+static void format_addr(const AccessRecord* r, char* out, size_t len)
+{
+    static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    static const uint8_t none[16]   = {0};
+
+    if (memcmp(r->addr, none, 16) == 0)
+        snprintf(out, len, "unix");
+    else if (memcmp(r->addr, mapped, 12) == 0)
+        inet_ntop(AF_INET, r->addr + 12, out, len);
+    else
+        inet_ntop(AF_INET6, r->addr, out, len);
+}
+
+static uint32_t total_us(const AccessRecord* r)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < ACCESS_SPANS; i++)
+        total += r->span_us[i];
+    return total;
+}
+
+/** @brief Print a string as a JSON or CSV string, quoting and escaping it. */
+static void print_quoted(const char* s, int json)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+        if (*s == '"')
+            fputs(json ? "\\\"" : "\"\"", stdout);
+        else if (json && *s == '\\')
+            fputs("\\\\", stdout);
+        else if (json && (unsigned char) *s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void print_record(const AccessRecord* r, Format format)
+{
+    char      addr[INET6_ADDRSTRLEN];
+    char      date[32];
+    time_t    secs = r->time_us / 1000000;
+    struct tm tm;
+
+    format_addr(r, addr, sizeof addr);
+    localtime_r(&secs, &tm);
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", &tm);
+
+    const char* method = r->method < ACCESS_METHODS ? method_names[r->method] : "OTHER";
+    const char* path   = path_name(r->path_id);
+    unsigned    ms     = (unsigned) (r->time_us / 1000 % 1000);
+
+    if (format == FORMAT_TEXT)
+    {
+        printf("%s.%03u %s %u %s %s %u %u %llu %.3f",
+               date,
+               ms,
+               addr,
+               r->port,
+               method,
+               path,
+               r->status,
+               r->bytes_in,
+               (unsigned long long) r->bytes_out,
+               total_us(r) / 1000.0);
+        for (int i = 0; i < ACCESS_SPANS; i++)
+            printf(" %.3f", r->span_us[i] / 1000.0);
+        printf("\n");
+        return;
+    }
+
+    if (format == FORMAT_JSON)
+    {
+        printf("{\"time\":\"%s.%03u\",\"addr\":\"%s\",\"port\":%u,\"method\":\"%s\",\"path\":",
+               date,
+               ms,
+               addr,
+               r->port,
+               method);
+        print_quoted(path, 1);
+        printf(",\"status\":%u,\"bytes_in\":%u,\"bytes_out\":%llu,\"total_us\":%u,"
+               "\"wait_us\":%u,\"read_us\":%u,\"handle_us\":%u,\"send_us\":%u}\n",
+               r->status,
+               r->bytes_in,
+               (unsigned long long) r->bytes_out,
+               total_us(r),
+               r->span_us[ACCESS_WAIT],
+               r->span_us[ACCESS_READ],
+               r->span_us[ACCESS_HANDLE],
+               r->span_us[ACCESS_SEND]);
+        return;
+    }
+
+    printf("%s.%03u,%s,%u,%s,", date, ms, addr, r->port, method);
+    print_quoted(path, 0);
+    printf(",%u,%u,%llu,%u,%u,%u,%u,%u\n",
+           r->status,
+           r->bytes_in,
+           (unsigned long long) r->bytes_out,
+           total_us(r),
+           r->span_us[ACCESS_WAIT],
+           r->span_us[ACCESS_READ],
+           r->span_us[ACCESS_HANDLE],
+           r->span_us[ACCESS_SEND]);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_requests(const void* a, const void* b)
+{
+    const Path *x = a, *y = b;
+    return (x->requests < y->requests) - (x->requests > y->requests);
+}
+
+static void print_aggregates(const AccessRecord* const* records, size_t count)
+{
+    uint32_t* times = malloc((count ? count : 1) * sizeof *times);
+    if (!times)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return;
+    }
+
+    uint64_t bytes_in = 0, bytes_out = 0, first = UINT64_MAX, last = 0;
+    size_t   classes[6] = {0};  // By status / 100, 0 for no status
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const AccessRecord* r = records[i];
+        Path*               p = r->path_id ? path_get(r->path_id) : NULL;
+
+        times[i] = total_us(r);
+        if (p)
+        {
+            p->requests++;
+            p->bytes_out += r->bytes_out;
+            p->total_us += times[i];
+        }
+
+        bytes_in += r->bytes_in;
+        bytes_out += r->bytes_out;
+        classes[r->status / 100 < 6 ? r->status / 100 : 0]++;
+        first = r->time_us < first ? r->time_us : first;
+        last  = r->time_us > last ? r->time_us : last;
+    }
+
+    double seconds = count > 1 ? (last - first) / 1e6 : 0;
+    printf("requests     %zu", count);
+    if (seconds > 0)
+        printf(" (%.1f/s over %.1f s)", count / seconds, seconds);
+    printf("\nbytes in     %llu\nbytes out    %llu\n",
+           (unsigned long long) bytes_in,
+           (unsigned long long) bytes_out);
+    printf("statuses     1xx %zu, 2xx %zu, 3xx %zu, 4xx %zu, 5xx %zu, none %zu\n",
+           classes[1],
+           classes[2],
+           classes[3],
+           classes[4],
+           classes[5],
+           classes[0]);
+
+    if (count)
+    {
+        qsort(times, count, sizeof *times, compare_u32);
+        printf("time (ms)    p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+               times[(size_t) (0.5 * (count - 1) + 0.5)] / 1000.0,
+               times[(size_t) (0.9 * (count - 1) + 0.5)] / 1000.0,
+               times[(size_t) (0.99 * (count - 1) + 0.5)] / 1000.0,
+               times[count - 1] / 1000.0);
+    }
+    free(times);
+
+    Path* top = malloc((path_count ? path_count : 1) * sizeof *top);
+    if (!top)
+        return;
+
+    size_t n = 0;
+    for (size_t i = 0; i < path_slots; i++)
+        if (paths[i].id && paths[i].requests)
+            top[n++] = paths[i];
+    qsort(top, n, sizeof *top, compare_requests);
+
+    printf("\n%10s %14s %12s  %s\n", "requests", "bytes out", "mean (ms)", "path");
+    for (size_t i = 0; i < n && i < TOP_PATHS; i++)
+        printf("%10zu %14llu %12.3f  %s\n",
+               top[i].requests,
+               (unsigned long long) top[i].bytes_out,
+               top[i].total_us / 1000.0 / top[i].requests,
+               top[i].name ? top[i].name : path_name(top[i].id));
+    free(top);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main(int argc, char* argv[])
+{
+    Format      format = FORMAT_TEXT;
+    const char* path   = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-a") == 0)
+            format = FORMAT_AGGREGATE;
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            i++;
+            format = strcmp(argv[i], "json") == 0  ? FORMAT_JSON
+                   : strcmp(argv[i], "csv") == 0   ? FORMAT_CSV
+                   : strcmp(argv[i], "text") == 0  ? FORMAT_TEXT
+                                                   : -1;
+        }
+        else if (!path)
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+
+    if (!path || (int) format == -1)
+    {
+        fprintf(stderr, "Usage: %s [-f text|json|csv | -a] ACCESS_LOG\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    AccessFileHeader header;
+    if (fread(&header, sizeof header, 1, file) != 1 ||
+        memcmp(header.magic, ACCESS_MAGIC, sizeof header.magic) != 0)
+    {
+        fprintf(stderr, "%s is not an access log.\n", path);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    if (header.endian != 0x01020304 || header.record_size != ACCESS_RECORD_SIZE)
+    {
+        fprintf(stderr, "%s was written by a server of another byte order or version.\n", path);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    // Names may come after the records using them: read everything first
+    char*  data = NULL;
+    size_t size = 0;
+    size_t cap  = 0;
+    size_t got;
+
+    do
+    {
+        if (size == cap)
+        {
+            cap       = cap ? cap * 2 : 1 << 20;
+            char* tmp = realloc(data, cap);
+            if (!tmp)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                free(data);
+                fclose(file);
+                return EXIT_FAILURE;
+            }
+            data = tmp;
+        }
+        got = fread(data + size, 1, cap - size, file);
+        size += got;
+    } while (got > 0);
+    fclose(file);
+
+    AccessRecord** records = malloc((size / ACCESS_RECORD_SIZE + 1) * sizeof *records);
+    size_t         count   = 0;
+    if (!records)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        free(data);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t off = 0; off + ACCESS_RECORD_SIZE <= size;)
+    {
+        AccessRecord* r = (AccessRecord*) (data + off);
+        AccessPath*   p = (AccessPath*) (data + off);
+
+        if (r->kind == ACCESS_KIND_REQUEST)
+        {
+            records[count++] = r;
+            off += ACCESS_RECORD_SIZE;
+            continue;
+        }
+
+        if (p->kind != ACCESS_KIND_PATH)
+        {
+            fprintf(stderr, "Unknown record at offset %zu, stopping.\n", off + sizeof header);
+            break;
+        }
+
+        size_t len  = offsetof(AccessPath, name) + p->length;
+        size_t span = (len + ACCESS_RECORD_SIZE - 1) / ACCESS_RECORD_SIZE * ACCESS_RECORD_SIZE;
+        if (off + span > size)
+            break;
+
+        Path* entry = path_get(p->id);
+        if (entry && !entry->name && (entry->name = malloc(p->length + 1)))
+        {
+            memcpy(entry->name, p->name, p->length);
+            entry->name[p->length] = '\0';
+        }
+        off += span;
+    }
+
+    if (format == FORMAT_AGGREGATE)
+        print_aggregates((const AccessRecord* const*) records, count);
+    else
+    {
+        if (format == FORMAT_CSV)
+            printf("time,addr,port,method,path,status,bytes_in,bytes_out,total_us,"
+                   "wait_us,read_us,handle_us,send_us\n");
+        for (size_t i = 0; i < count; i++)
+            print_record(records[i], format);
+    }
+
+    for (size_t i = 0; i < path_slots; i++)
+        free(paths[i].name);
+    free(paths);
+    free(records);
+    free(data);
+    return EXIT_SUCCESS;
+}
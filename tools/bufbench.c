@@ -0,0 +1,330 @@
+/* -------------------------------------------------------------------------- */
+/*                     Throughput across I/O buffer sizes                     */
+/* -------------------------------------------------------------------------- */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Usage: bufbench [-m MEGABYTES] [-r ROUNDS] [FILE]
+ * Sends FILE (or MEGABYTES of generated data, 64 by default) over a loopback
+ * TCP connection the way the server copies bodies through user space: read a
+ * buffer with pread(), send() it, again. Once for each buffer size, then with
+ * the buffer sized by the room left in the socket's send buffer (what the
+ * server does for TLS without kTLS), then with sendfile() for comparison.
+ * Prints the best throughput of ROUNDS runs (3 by default) and the system
+ * calls it took per megabyte.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Buffer the receiving side reads through, large enough to never be the limit. */
+#define DRAIN_BUFFER (1024 * 1024)
+
+/** @brief Largest buffer tried, and read by the send buffer room strategy. */
+#define BUFFER_MAX (1024 * 1024)
+
+/** @brief Smallest read of the send buffer room strategy, a TLS record. */
+#define ROOM_MIN 16384
+
+/** @brief Fixed buffer sizes tried. */
+static const size_t sizes[] = {1024, 4096, 16384, 65536, 262144, 1048576};
+
+/** @brief How a run sends the file. */
+typedef enum ModeEnum
+{
+    MODE_FIXED,     // pread() and send() through a buffer of a given size
+    MODE_ROOM,      // The same, sized by the room in the send buffer
+    MODE_SENDFILE,  // sendfile()
+} Mode;
+
+/** @brief The receiving end of a run. */
+typedef struct DrainStruct
+{
+    int      fd;
+    size_t   received;
+    uint64_t done_us;  // When the sender's EOF arrived
+} Drain;
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** @brief Read until EOF, counting the bytes. */
+static void* drain(void* arg)
+{
+    Drain*  d    = arg;
+    char*   buff = malloc(DRAIN_BUFFER);
+    ssize_t n;
+
+    while (buff && (n = recv(d->fd, buff, DRAIN_BUFFER, 0)) > 0)
+        d->received += n;
+
+    d->done_us = monotonic_us();
+    free(buff);
+    return NULL;
+}
+
+/** @brief Connect a socket to the listener, and accept it. -1 on failure. */
+static int connect_pair(int listener, const struct sockaddr_in* addr, int* accepted)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    if (connect(fd, (const struct sockaddr*) addr, sizeof *addr) == -1 ||
+        (*accepted = accept(listener, NULL, NULL)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/** @brief Room left in the send buffer of a socket, at least ROOM_MIN. */
+static size_t send_room(int fd)
+{
+    int       size, queued;
+    socklen_t len = sizeof size;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == -1 ||
+        ioctl(fd, SIOCOUTQ, &queued) == -1 || size - queued < ROOM_MIN)
+        return ROOM_MIN;
+
+    return size - queued;
+}
+
+/** @brief Send all of len bytes. 0 on failure. */
+static int send_all(int fd, const char* buff, size_t len, unsigned long* calls)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, buff, len, MSG_NOSIGNAL);
+        (*calls)++;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buff += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Send the file over fd.
+ * @return The number of system calls, 0 on failure. */
+static unsigned long send_file(
+    int fd, int file, off_t file_size, Mode mode, size_t size, char* buff)
+{
+    unsigned long calls = 0;
+    off_t         off   = 0;
+
+    while (off < file_size)
+    {
+        ssize_t n;
+        if (mode == MODE_SENDFILE)
+        {
+            n = sendfile(fd, file, &off, file_size - off);
+            calls++;
+            if (n <= 0)
+                return 0;
+            continue;
+        }
+
+        size_t want = mode == MODE_ROOM ? send_room(fd) : size;
+        if (mode == MODE_ROOM)
+            calls += 2;  // getsockopt() and ioctl()
+        if (want > BUFFER_MAX)
+            want = BUFFER_MAX;
+
+        n = pread(file, buff, want, off);
+        calls++;
+        if (n <= 0 || !send_all(fd, buff, n, &calls))
+            return 0;
+        off += n;
+    }
+
+    return calls;
+}
+
+/**
+ * @brief Send the file rounds times, print the best run.
+ * @return 0 on failure. */
+static int bench(const char*               label,
+                 int                       listener,
+                 const struct sockaddr_in* addr,
+                 int                       file,
+                 off_t                     file_size,
+                 Mode                      mode,
+                 size_t                    size,
+                 char*                     buff,
+                 int                       rounds)
+{
+    double        best_mbs = 0;
+    unsigned long calls    = 0;
+
+    for (int r = 0; r < rounds; r++)
+    {
+        Drain     d = {.fd = -1};
+        pthread_t thread;
+        int       fd = connect_pair(listener, addr, &d.fd);
+
+        if (fd == -1 || pthread_create(&thread, NULL, drain, &d))
+        {
+            perror("connect");
+            return 0;
+        }
+
+        uint64_t      start = monotonic_us();
+        unsigned long n     = send_file(fd, file, file_size, mode, size, buff);
+        shutdown(fd, SHUT_WR);
+        pthread_join(thread, NULL);
+        close(fd);
+        close(d.fd);
+
+        if (!n || d.received != (size_t) file_size)
+        {
+            fprintf(stderr, "%s: run failed.\n", label);
+            return 0;
+        }
+
+        double mbs = file_size / 1048576.0 / ((d.done_us - start) / 1e6);
+        if (mbs > best_mbs)
+        {
+            best_mbs = mbs;
+            calls    = n;
+        }
+    }
+
+    printf("%-10s %10.1f %12.2f\n", label, best_mbs, calls / (file_size / 1048576.0));
+    return 1;
+}
+
+/** @brief Write megabytes of data to an unlinked temporary file. -1 on failure. */
+static int make_file(int megabytes, char* buff)
+{
+    char path[] = "/tmp/bufbench-XXXXXX";
+    int  fd     = mkstemp(path);
+    if (fd == -1)
+        return -1;
+    unlink(path);
+
+    for (size_t i = 0; i < BUFFER_MAX; i++)
+        buff[i] = (char) (i * 2654435761u >> 13);
+
+    for (int i = 0; i < megabytes; i++)
+    {
+        if (write(fd, buff, BUFFER_MAX) != BUFFER_MAX)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+int main(int argc, char* argv[])
+{
+    int megabytes = 64;
+    int rounds    = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:r:")) != -1)
+    {
+        if (opt == 'm')
+            megabytes = atoi(optarg);
+        else if (opt == 'r')
+            rounds = atoi(optarg);
+        else
+            rounds = 0;
+    }
+
+    if (argc - optind > 1 || megabytes < 1 || rounds < 1)
+    {
+        fprintf(stderr, "Usage: %s [-m MEGABYTES] [-r ROUNDS] [FILE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char* buff = malloc(BUFFER_MAX);
+    int   file = -1;
+
+    if (buff)
+        file = optind < argc ? open(argv[optind], O_RDONLY) : make_file(megabytes, buff);
+
+    struct stat st;
+    if (file == -1 || fstat(file, &st) == -1 || st.st_size == 0)
+    {
+        fprintf(stderr, "%s: %s.\n", optind < argc ? argv[optind] : "data", strerror(errno));
+        free(buff);
+        return EXIT_FAILURE;
+    }
+
+    // Loopback listener on a port of the kernel's choosing
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t          len  = sizeof addr;
+    int                listener;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener             = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (listener == -1 || bind(listener, (struct sockaddr*) &addr, sizeof addr) == -1 ||
+        listen(listener, 1) == -1 || getsockname(listener, (struct sockaddr*) &addr, &len) == -1)
+    {
+        perror("listen");
+        free(buff);
+        close(file);
+        return EXIT_FAILURE;
+    }
+
+    // Read once first, so every run gets it from the page cache
+    for (off_t off = 0; off < st.st_size;)
+    {
+        ssize_t n = pread(file, buff, BUFFER_MAX, off);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+
+    printf("sending %.1f MB, best of %d runs\n", st.st_size / 1048576.0, rounds);
+    printf("%-10s %10s %12s\n", "buffer", "MB/s", "syscalls/MB");
+
+    int ok = 1;
+    for (size_t i = 0; ok && i < sizeof sizes / sizeof *sizes; i++)
+    {
+        char label[16];
+        if (sizes[i] >= 1048576)
+            snprintf(label, sizeof label, "%zuM", sizes[i] / 1048576);
+        else
+            snprintf(label, sizeof label, "%zuK", sizes[i] / 1024);
+
+        ok = bench(label, listener, &addr, file, st.st_size, MODE_FIXED, sizes[i], buff, rounds);
+    }
+
+    ok = ok && bench("room", listener, &addr, file, st.st_size, MODE_ROOM, 0, buff, rounds);
+    ok = ok && bench("sendfile", listener, &addr, file, st.st_size, MODE_SENDFILE, 0, buff, rounds);
+
+    close(listener);
+    close(file);
+    free(buff);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,511 @@
+/* -------------------------------------------------------------------------- */
+/*                  Replay of captured traffic (--capture)                    */
+/* -------------------------------------------------------------------------- */
+
+#include "capture.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Usage: replay [-c CONNECTIONS] [-s SPEED | -m] HOST PORT CAPTURE_FILE
+ * Sends the captured requests to HOST:PORT over CONNECTIONS kept-alive
+ * connections (8 by default), each request when it arrived originally, SPEED
+ * times faster (-s 2 takes half the time), or as fast as the server answers
+ * (-m). Then prints the statuses and the distribution of the latencies.
+ *
+ * Latency is counted from when a request was due, so a server that falls
+ * behind is charged for the time requests waited for a free connection.
+ * Service time is counted from when it was sent.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Size of the buffer responses are read through. */
+#define READ_BUFFER 65536
+
+/** @brief A captured request, and how its replay went. */
+typedef struct RequestStruct
+{
+    uint64_t    time_us;  // Captured arrival time
+    const char* head;
+    size_t      len;
+    int         status;      // Response status, 0 on errors
+    uint64_t    latency_us;  // From when it was due to the end of its response
+    uint64_t    service_us;  // From when it was sent
+} Request;
+
+/** @brief A connection to the server, with what was read from it. */
+typedef struct ConnectionStruct
+{
+    int    fd;  // -1 if not connected
+    char   buff[READ_BUFFER + 1];  // Room for a null terminator
+    size_t start;  // Unconsumed bytes are buff[start, end)
+    size_t end;
+} Connection;
+
+static Request*         requests = NULL;
+static size_t           count    = 0;
+static atomic_size_t    next     = 0;  // Next request to send
+static atomic_size_t    retried  = 0;  // Requests sent again after failing on a reused connection
+static struct addrinfo* server   = NULL;
+static double           speed    = 1;  // 0 to send as fast as possible
+static uint64_t         start_us = 0;  // When the first request is due
+
+/* -------------------------------------------------------------------------- */
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t us)
+{
+    struct timespec ts = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int connect_server(Connection* c)
+{
+    c->start = c->end = 0;
+    c->fd             = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+    if (c->fd == -1)
+        return -1;
+
+    if (connect(c->fd, server->ai_addr, server->ai_addrlen) == -1)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    return 0;
+}
+
+static void disconnect(Connection* c)
+{
+    if (c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+}
+
+/** @brief Read more from the server, keeping what wasn't consumed. 0 on EOF or error. */
+static int fill(Connection* c)
+{
+    if (c->start > 0)
+    {
+        memmove(c->buff, c->buff + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+
+    if (c->end == READ_BUFFER)  // A line longer than the buffer
+        return 0;
+
+    ssize_t n = recv(c->fd, c->buff + c->end, READ_BUFFER - c->end, 0);
+    if (n <= 0)
+        return 0;
+
+    c->end += n;
+    return 1;
+}
+
+/** @brief Find the end of a line (or of the header with "\r\n\r\n"), reading until it arrives. */
+static char* read_until(Connection* c, const char* delim)
+{
+    for (;;)
+    {
+        c->buff[c->end] = '\0';
+        char* found = strstr(c->buff + c->start, delim);
+        if (found)
+            return found;
+        if (!fill(c))
+            return NULL;
+    }
+}
+
+/** @brief Consume n bytes of body. 0 if the connection ended first. */
+static int skip(Connection* c, uint64_t n)
+{
+    while (n > 0)
+    {
+        if (c->start == c->end && !fill(c))
+            return 0;
+
+        size_t have = c->end - c->start;
+        size_t used = n < have ? n : have;
+        c->start += used;
+        n -= used;
+    }
+    return 1;
+}
+
+/** @brief Value of a header field in a null-terminated header, NULL if absent. */
+static const char* header_value(const char* head, const char* name)
+{
+    size_t      len = strlen(name);
+    const char* p   = strstr(head, "\r\n");
+
+    while (p && p[2] != '\r')
+    {
+        p += 2;
+        if (strncasecmp(p, name, len) == 0 && p[len] == ':')
+            return p + len + 1 + strspn(p + len + 1, " \t");
+        p = strstr(p, "\r\n");
+    }
+    return NULL;
+}
+
+/**
+ * @brief Read a response, header and body.
+ * @param head_only Whether it answers a HEAD request, and has no body.
+ * @param keep Set to whether the connection may be used again.
+ * @return Its status, 0 if it couldn't be read. */
+static int read_response(Connection* c, int head_only, int* keep)
+{
+    char* end = read_until(c, "\r\n\r\n");
+    if (!end)
+        return 0;
+
+    char* head = c->buff + c->start;
+    end[2]     = '\0';  // Header fields are searched up to here
+    int status = strncmp(head, "HTTP/1.", 7) == 0 ? atoi(head + 9) : 0;
+
+    const char* length     = header_value(head, "Content-Length");
+    const char* encoding   = header_value(head, "Transfer-Encoding");
+    const char* connection = header_value(head, "Connection");
+    int         chunked    = encoding && strncasecmp(encoding, "chunked", 7) == 0;
+    uint64_t    body       = length ? strtoull(length, NULL, 10) : 0;
+
+    *keep = !(connection && strncasecmp(connection, "close", 5) == 0) && head[7] == '1';
+    c->start = end + 4 - c->buff;
+
+    if (head_only || status == 204 || status == 304 || (status >= 100 && status < 200))
+        return status;
+
+    if (chunked)
+    {
+        for (;;)
+        {
+            char* eol = read_until(c, "\r\n");
+            if (!eol)
+                return 0;
+
+            uint64_t size = strtoull(c->buff + c->start, NULL, 16);
+            c->start      = eol + 2 - c->buff;
+
+            if (size == 0)  // Last chunk, then the trailer
+            {
+                while ((eol = read_until(c, "\r\n")) && eol != c->buff + c->start)
+                    c->start = eol + 2 - c->buff;
+                if (!eol)
+                    return 0;
+                c->start += 2;
+                return status;
+            }
+
+            if (!skip(c, size + 2))
+                return 0;
+        }
+    }
+
+    if (length)
+        return skip(c, body) ? status : 0;
+
+    // Neither: the body ends with the connection
+    while (fill(c))
+        c->start = c->end;
+    *keep = 0;
+    return status;
+}
+
+/** @brief Send a request and read its response. The status, 0 on failure. */
+static int exchange(Connection* c, const Request* r, int* keep)
+{
+    if (c->fd == -1 && connect_server(c) == -1)
+        return 0;
+
+    for (size_t sent = 0; sent < r->len;)
+    {
+        ssize_t n = send(c->fd, r->head + sent, r->len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return 0;
+        sent += n;
+    }
+
+    return read_response(c, strncmp(r->head, "HEAD ", 5) == 0, keep);
+}
+
+static void* worker(void* arg)
+{
+    (void) arg;
+    Connection* c = malloc(sizeof *c);
+    if (!c)
+        return NULL;
+    c->fd = -1;
+
+    sleep_until(start_us);
+
+    size_t i;
+    while ((i = atomic_fetch_add(&next, 1)) < count)
+    {
+        Request* r   = &requests[i];
+        uint64_t due = start_us;
+
+        if (speed > 0)
+        {
+            due += (uint64_t) ((r->time_us - requests[0].time_us) / speed);
+            sleep_until(due);
+        }
+        else
+            due = monotonic_us();
+
+        uint64_t sent   = monotonic_us();
+        int      keep   = 0;
+        int      reused = c->fd != -1;
+
+        r->status = exchange(c, r, &keep);
+        if (!r->status && reused)  // The server may have closed it while idle: try a new one
+        {
+            atomic_fetch_add(&retried, 1);
+            disconnect(c);
+            r->status = exchange(c, r, &keep);
+        }
+
+        if (c->start != c->end)  // Bytes past the response: we'd be out of step
+            keep = 0;
+
+        uint64_t done = monotonic_us();
+        r->latency_us = done - due;
+        r->service_us = done - sent;
+
+        if (!r->status || !keep)
+            disconnect(c);
+    }
+
+    disconnect(c);
+    free(c);
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int compare_time(const void* a, const void* b)
+{
+    const Request *x = a, *y = b;
+    return (x->time_us > y->time_us) - (x->time_us < y->time_us);
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Print the distribution of n values, sorting them. */
+static void print_distribution(const char* name, uint64_t* values, size_t n)
+{
+    if (n == 0)
+        return;
+
+    qsort(values, n, sizeof *values, compare_u64);
+    printf("%-12s", name);
+
+    static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++)
+    {
+        size_t rank = (size_t) (percentiles[i] * (n - 1) + 0.5);
+        printf(" p%g %.3f,", percentiles[i] * 100, values[rank] / 1000.0);
+    }
+    printf(" max %.3f ms\n", values[n - 1] / 1000.0);
+}
+
+static void report(uint64_t elapsed_us)
+{
+    size_t    ok = 0, classes[6] = {0};
+    uint64_t* latency = malloc((count ? count : 1) * sizeof *latency);
+    uint64_t* service = malloc((count ? count : 1) * sizeof *service);
+    if (!latency || !service)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        free(latency);
+        free(service);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        classes[requests[i].status / 100 < 6 ? requests[i].status / 100 : 0]++;
+        if (requests[i].status)
+        {
+            latency[ok] = requests[i].latency_us;
+            service[ok] = requests[i].service_us;
+            ok++;
+        }
+    }
+
+    printf("requests     %zu in %.3f s (%.1f/s), %zu failed, %zu retried\n",
+           count,
+           elapsed_us / 1e6,
+           elapsed_us ? count * 1e6 / elapsed_us : 0,
+           classes[0],
+           (size_t) atomic_load(&retried));
+    printf("statuses     1xx %zu, 2xx %zu, 3xx %zu, 4xx %zu, 5xx %zu\n",
+           classes[1],
+           classes[2],
+           classes[3],
+           classes[4],
+           classes[5]);
+    print_distribution("latency", latency, ok);
+    print_distribution("service", service, ok);
+
+    free(latency);
+    free(service);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Read a capture file into memory, pointing requests into it. */
+static char* load(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    CaptureFileHeader header;
+    if (fread(&header, sizeof header, 1, file) != 1 ||
+        memcmp(header.magic, CAPTURE_MAGIC, sizeof header.magic) != 0 ||
+        header.endian != 0x01020304 || header.record_size != sizeof(CaptureRecord))
+    {
+        fprintf(stderr, "%s is not a capture file of this version and byte order.\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    char*  data = NULL;
+    size_t size = 0, cap = 0, got;
+    do
+    {
+        if (size == cap)
+        {
+            cap       = cap ? cap * 2 : 1 << 20;
+            char* tmp = realloc(data, cap);
+            if (!tmp)
+            {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = tmp;
+        }
+        got = fread(data + size, 1, cap - size, file);
+        size += got;
+    } while (got > 0);
+    fclose(file);
+
+    requests = malloc((size / sizeof(CaptureRecord) + 1) * sizeof *requests);
+    if (!requests)
+    {
+        free(data);
+        return NULL;
+    }
+
+    for (size_t off = 0; off + sizeof(CaptureRecord) <= size;)
+    {
+        CaptureRecord* r    = (CaptureRecord*) (data + off);
+        size_t         span = sizeof *r + (r->length + 7) / 8 * 8;
+        if (off + span > size)
+            break;
+
+        requests[count++] = (Request) {
+            .time_us = r->time_us, .head = data + off + sizeof *r, .len = r->length};
+        off += span;
+    }
+
+    qsort(requests, count, sizeof *requests, compare_time);  // Children append out of order
+    return data;
+}
+
+int main(int argc, char* argv[])
+{
+    int connections = 8;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:m")) != -1)
+    {
+        if (opt == 'c')
+            connections = atoi(optarg);
+        else if (opt == 's')
+            speed = atof(optarg);
+        else if (opt == 'm')
+            speed = 0;
+        else
+            connections = 0;
+    }
+
+    if (argc - optind != 3 || connections < 1 || speed < 0)
+    {
+        fprintf(stderr, "Usage: %s [-c CONNECTIONS] [-s SPEED | -m] HOST PORT CAPTURE_FILE\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    int             err   = getaddrinfo(argv[optind], argv[optind + 1], &hints, &server);
+    if (err)
+    {
+        fprintf(stderr, "%s: %s.\n", argv[optind], gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    char* data = load(argv[optind + 2]);
+    if (!data)
+    {
+        freeaddrinfo(server);
+        return EXIT_FAILURE;
+    }
+
+    if (count > 0)
+        printf("replaying %zu requests over %.3f s of capture on %d connections, %s\n",
+               count,
+               (requests[count - 1].time_us - requests[0].time_us) / 1e6,
+               connections,
+               speed > 0 ? "timed" : "as fast as possible");
+
+    pthread_t* threads = malloc(connections * sizeof *threads);
+    int        started = 0;
+
+    start_us = monotonic_us() + 10000;  // Once every worker is ready
+    for (; threads && started < connections; started++)
+        if (pthread_create(&threads[started], NULL, worker, NULL))
+            break;
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    report(monotonic_us() - start_us);
+
+    free(threads);
+    free(requests);
+    free(data);
+    freeaddrinfo(server);
+    return started ? EXIT_SUCCESS : EXIT_FAILURE;
+}
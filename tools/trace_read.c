@@ -0,0 +1,197 @@
+/* -------------------------------------------------------------------------- */
+/*                   Reader of the request traces (--trace-file)              */
+/* -------------------------------------------------------------------------- */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Usage: trace_read [-s] FILE
+ * Prints one line per traced request, with the time it took to reach each
+ * phase in milliseconds ("-" when it didn't). With -s, prints percentiles of
+ * the total time and of each phase instead.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/** @brief Column names of the phases, in TracePhase order. */
+static const char* const phase_names[TRACE_PHASES] = {
+    "accept", "first_byte", "parsed", "opened", "headers", "last_byte"};
+
+/** @brief Time from the start to the end of a request, in microseconds. */
+static uint32_t total_us(const TraceRecord* r)
+{
+    return r->phase_us[TRACE_LAST_BYTE] == TRACE_NONE ? 0 : r->phase_us[TRACE_LAST_BYTE];
+}
+
+static void print_record(const TraceRecord* r)
+{
+    time_t    secs = r->time_us / 1000000;
+    struct tm tm;
+    char      date[32];
+    localtime_r(&secs, &tm);
+    strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf("%s.%03u %-40.*s h%u %3u %10.3f",
+           date,
+           (unsigned) (r->time_us / 1000 % 1000),
+           (int) sizeof r->request,
+           r->request[0] ? r->request : "-",
+           r->protocol,
+           r->status,
+           total_us(r) / 1000.0);
+
+    for (int i = 0; i < TRACE_PHASES; i++)
+    {
+        if (r->phase_us[i] == TRACE_NONE)
+            printf(" %10s", "-");
+        else
+            printf(" %10.3f", r->phase_us[i] / 1000.0);
+    }
+
+    printf(" %6u %6u %8llu %12llu\n",
+           r->recvs,
+           r->sends,
+           (unsigned long long) r->bytes_in,
+           (unsigned long long) r->bytes_out);
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Print the percentiles of count values, sorting them. */
+static void print_percentiles(const char* name, uint32_t* values, size_t count)
+{
+    if (count == 0)
+    {
+        printf("%-12s %8s\n", name, "-");
+        return;
+    }
+
+    qsort(values, count, sizeof *values, compare_u32);
+    printf("%-12s %8zu", name, count);
+
+    static const double percentiles[] = {0.5, 0.9, 0.99, 1.0};
+    for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++)
+    {
+        size_t rank = (size_t) (percentiles[i] * (count - 1) + 0.5);
+        printf(" %10.3f", values[rank] / 1000.0);
+    }
+    printf("\n");
+}
+
+static void print_summary(const TraceRecord* records, size_t count)
+{
+    uint32_t* values = malloc((count ? count : 1) * sizeof *values);
+    if (!values)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return;
+    }
+
+    printf("%-12s %8s %10s %10s %10s %10s  (ms)\n", "phase", "requests", "p50", "p90", "p99",
+           "max");
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++)
+        if (records[i].phase_us[TRACE_LAST_BYTE] != TRACE_NONE)
+            values[n++] = total_us(&records[i]);
+    print_percentiles("total", values, n);
+
+    for (int p = 0; p < TRACE_PHASES; p++)
+    {
+        n = 0;
+        for (size_t i = 0; i < count; i++)
+            if (records[i].phase_us[p] != TRACE_NONE)
+                values[n++] = records[i].phase_us[p];
+        print_percentiles(phase_names[p], values, n);
+    }
+
+    free(values);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main(int argc, char* argv[])
+{
+    int         summary = argc == 3 && strcmp(argv[1], "-s") == 0;
+    const char* path    = argc == 2 ? argv[1] : argc == 3 && summary ? argv[2] : NULL;
+
+    if (!path)
+    {
+        fprintf(stderr, "Usage: %s [-s] TRACE_FILE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    TraceFileHeader header;
+    if (fread(&header, sizeof header, 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0)
+    {
+        fprintf(stderr, "%s is not a trace file.\n", path);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    if (header.endian != 0x01020304 || header.record_size != sizeof(TraceRecord))
+    {
+        fprintf(stderr, "%s was written by a server of another byte order or version.\n", path);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    if (!summary)
+    {
+        printf("%-23s %-40s %-2s %3s %10s", "time", "request", "v", "st", "total");
+        for (int i = 0; i < TRACE_PHASES; i++)
+            printf(" %10s", phase_names[i]);
+        printf(" %6s %6s %8s %12s\n", "recvs", "sends", "in", "out");
+    }
+
+    TraceRecord* records = NULL;
+    size_t       count   = 0;
+    size_t       size    = 0;
+    TraceRecord  r;
+
+    while (fread(&r, sizeof r, 1, file) == 1)
+    {
+        if (!summary)
+        {
+            print_record(&r);
+            continue;
+        }
+
+        if (count == size)
+        {
+            size             = size ? size * 2 : 1024;
+            TraceRecord* tmp = realloc(records, size * sizeof *records);
+            if (!tmp)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                break;
+            }
+            records = tmp;
+        }
+        records[count++] = r;
+    }
+
+    if (summary)
+        print_summary(records, count);
+
+    free(records);
+    fclose(file);
+    return EXIT_SUCCESS;
+}